@@ -0,0 +1,599 @@
+/* Benchmark and correctness check for the convolution engine. A synthetic
+   image is encoded to PNG in memory, then for every kernel, backend and
+   thread count the PNG is decoded, convolved and re-encoded, with each
+   stage timed separately. Every result is compared byte for byte against
+   the single-threaded 'convolve' reference. Before that, each zlib codec
+   decodes the PNG and encodes the test image, and its output is checked
+   by decoding it again.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "lodepng.h"
+#include "convolve-engine.h"
+#include "png-codec.h"
+
+#define ONE_BILLION (double)1000000000.0
+
+#define DEFAULT_ROWS 1024
+#define DEFAULT_COLUMNS 1024
+#define DEFAULT_THREADS "1,2,4"
+#define DEFAULT_KERNELS "sharpen,gaussian:9,gaussian:31"
+#define DEFAULT_TRIALS 3
+
+#define MAX_LIST 16				/* Most items in a -n, -k or -Z list */
+#define LIST_LEN 256			/* Longest -n, -k or -Z argument */
+
+typedef enum {
+  BACKEND_DIRECT,
+  BACKEND_FFT
+} backend_t;
+
+static char *backend_names[] = { "direct", "fft" };
+
+typedef struct {
+  int tid;
+  int num_threads;
+  backend_t backend;
+  kernel_t *kernel;
+  border_t *border;
+  image_t *output;
+  image_t *input;
+  unsigned int traits;			/* Of this thread's rows, once done */
+} thread_args_t;
+
+/* Best time for each stage over all trials of one variant. */
+typedef struct {
+  double decode;
+  double convolve;
+  double encode;
+} stage_times_t;
+
+double
+now(void)
+{
+  struct timespec current_time;
+  clock_gettime(CLOCK_REALTIME, &current_time);
+  return current_time.tv_sec + (current_time.tv_nsec / ONE_BILLION);
+}
+
+void
+check_thread_rtn(char *msge, int rtn) {
+  if (rtn) {
+    fprintf(stderr, "ERROR: %s (%d)\n", msge,rtn);
+    exit(1);
+  }
+}
+
+/* Fill 'image' with a repeatable test pattern: smooth gradients so the PNG
+   filters have something to predict, plus noise so the compressor can't
+   shrink it to nothing. Alpha is opaque, as in most photographs.
+ */
+void
+make_synthetic(image_t *image, int rows, int columns, unsigned int seed)
+{
+  init_image(image, rows, columns);
+  for (int r = 0;  r < rows;  r++) {
+	for (int c = 0;  c < columns;  c++) {
+	  pixel_t *pixel = image->pixels + IMG_BYTE(columns, r, c, 0);
+	  pixel[RED_OFFSET] = (c * 255 / columns + rand_r(&seed) % 24) & 0xFF;
+	  pixel[GREEN_OFFSET] = (r * 255 / rows + rand_r(&seed) % 24) & 0xFF;
+	  pixel[BLUE_OFFSET] = ((r + c) * 2 + rand_r(&seed) % 24) & 0xFF;
+	  pixel[ALPHA_OFFSET] = 0xFF;
+	}
+  }
+}
+
+/* Thread body: convolve this thread's contiguous band of rows with the
+   requested backend.
+ */
+void *
+bench_band(void *args_pointer)
+{
+  thread_args_t *args = (thread_args_t *) args_pointer;
+  int rows = args->input->rows;
+  int first_row = (long) rows * args->tid / args->num_threads;
+  int last_row = (long) rows * (args->tid + 1) / args->num_threads;
+
+  if (args->backend == BACKEND_FFT) {
+	args->traits = convolve_fft_rows(args->output, args->input, args->kernel, args->border,
+									 first_row, last_row);
+  } else {
+	args->traits = convolve_direct_rows(args->output, args->input, args->kernel, args->border,
+										first_row, last_row);
+  }
+  return NULL;
+}
+
+/* Convolve 'input' into 'output' (already initialized) with 'num_threads'
+   threads, setting its traits and returning the elapsed time.
+ */
+double
+time_convolve(image_t *output, image_t *input, kernel_t *kernel, border_t *border,
+			  backend_t backend, int num_threads)
+{
+  pthread_t threads[num_threads];
+  thread_args_t thread_args[num_threads];
+  double start = now();
+
+  for (int i = 0;  i < num_threads;  i++) {
+	thread_args[i].tid = i;
+	thread_args[i].num_threads = num_threads;
+	thread_args[i].backend = backend;
+	thread_args[i].kernel = kernel;
+	thread_args[i].border = border;
+	thread_args[i].output = output;
+	thread_args[i].input = input;
+	check_thread_rtn("create",
+					 pthread_create(&threads[i], NULL, bench_band, &thread_args[i]));
+  }
+  output->traits = PIXELS_ALL;
+  for (int i = 0;  i < num_threads;  i++) {
+	check_thread_rtn("join", pthread_join(threads[i], NULL));
+	output->traits &= thread_args[i].traits;
+  }
+  return now() - start;
+}
+
+/* Working memory for every decode; it sizes itself on the first one, so
+   the timed trials after that measure decoding without allocation.
+ */
+static arena_t decode_arena;
+
+/* Decode 'png' into an RGBA 'image' with 'decompress', unfiltering while
+   inflating on 'num_threads' threads.
+ */
+unsigned int
+decode_png(image_t *image, const unsigned char *png, size_t png_size,
+		   const LodePNGDecompressSettings *decompress, int num_threads)
+{
+  LodePNGDecompressSettings settings = *decompress;
+
+  settings.num_threads = num_threads;
+  image->traits = 0;
+  return decode_rgba(&image->pixels, &image->columns, &image->rows, png, png_size,
+					 &settings, &decode_arena);
+}
+
+/* Encode 'image' to PNG in memory with 'compress', splitting scanline
+   filtering and compression across 'num_threads' threads.
+ */
+unsigned int
+encode_png(unsigned char **png, size_t *png_size, image_t *image,
+		   const LodePNGCompressSettings *compress, int num_threads)
+{
+  LodePNGState state;
+
+  *png = NULL;
+  *png_size = 0;
+  lodepng_state_init(&state);
+  state.encoder.zlibsettings = *compress;
+  state.encoder.zlibsettings.num_threads = num_threads;
+  if (image->traits & PIXELS_KNOWN) {
+	use_color_type(&state, image->traits & PIXELS_OPAQUE, image->traits & PIXELS_GREY);
+  }
+  unsigned int error =
+	lodepng_encode(png, png_size, image->pixels, image->columns, image->rows, &state);
+  lodepng_state_cleanup(&state);
+  return error;
+}
+
+/* Count the pixels that differ between two images of the same size. */
+long
+count_mismatches(image_t *a, image_t *b)
+{
+  long pixels = (long) a->rows * a->columns;
+  long mismatches = 0;
+
+  for (long i = 0;  i < pixels;  i++) {
+	if (memcmp(a->pixels + i * BYTES_PER_PIXEL, b->pixels + i * BYTES_PER_PIXEL,
+			   BYTES_PER_PIXEL)) {
+	  mismatches++;
+	}
+  }
+  return mismatches;
+}
+
+/* Run 'trials' rounds of decode, convolve and encode for one variant,
+   keeping the best time of each stage. The output of the last round is
+   left in 'output' for checking. Returns nonzero if a codec call fails.
+ */
+int
+run_variant(stage_times_t *best, image_t *output, const unsigned char *png,
+			size_t png_size, kernel_t *kernel, border_t *border,
+			const LodePNGDecompressSettings *decompress,
+			const LodePNGCompressSettings *compress,
+			backend_t backend, int num_threads, int trials)
+{
+  best->decode = best->convolve = best->encode = -1;
+
+  for (int trial = 0;  trial < trials;  trial++) {
+	image_t input;
+	unsigned char *encoded;
+	size_t encoded_size;
+
+	double start = now();
+	unsigned int error = decode_png(&input, png, png_size, decompress, num_threads);
+	double decode = now() - start;
+	if (error) {
+	  fprintf(stderr, "decode error %u: %s\n", error, lodepng_error_text(error));
+	  return 1;
+	}
+
+	if (trial > 0) {
+	  free_image(output);
+	}
+	init_image(output, input.rows, input.columns);
+	double convolve = time_convolve(output, &input, kernel, border, backend, num_threads);
+
+	start = now();
+	error = encode_png(&encoded, &encoded_size, output, compress, num_threads);
+	double encode = now() - start;
+	free(encoded);
+	free_image(&input);
+	if (error) {
+	  fprintf(stderr, "encode error %u: %s\n", error, lodepng_error_text(error));
+	  return 1;
+	}
+
+	if (best->decode < 0 || decode < best->decode) {
+	  best->decode = decode;
+	}
+	if (best->convolve < 0 || convolve < best->convolve) {
+	  best->convolve = convolve;
+	}
+	if (best->encode < 0 || encode < best->encode) {
+	  best->encode = encode;
+	}
+  }
+  return 0;
+}
+
+/* Time one codec: decode 'png' and encode 'source' on 'num_threads'
+   threads 'trials' times, keeping the best times and the encoded size.
+   Both the decoded image and a second decoding of the new PNG must equal
+   'source'. Returns nonzero on a codec error or a mismatch.
+ */
+int
+run_codec(stage_times_t *best, size_t *encoded_size, image_t *source,
+		  const unsigned char *png, size_t png_size, codec_t *codec,
+		  const LodePNGCompressSettings *base, int level, int num_threads, int trials)
+{
+  LodePNGDecompressSettings decompress;
+  LodePNGCompressSettings compress = *base;
+  lodepng_decompress_settings_init(&decompress);
+  use_codec(codec, level, &decompress, &compress);
+  best->decode = best->convolve = best->encode = -1;
+
+  for (int trial = 0;  trial < trials;  trial++) {
+	image_t decoded;
+	image_t check;
+	unsigned char *encoded;
+
+	double start = now();
+	unsigned int error = decode_png(&decoded, png, png_size, &decompress, num_threads);
+	double decode = now() - start;
+	if (error) {
+	  fprintf(stderr, "%s: decode error %u: %s\n", codec->name, error, lodepng_error_text(error));
+	  return 1;
+	}
+	long mismatches = count_mismatches(&decoded, source);
+	free_image(&decoded);
+
+	start = now();
+	error = encode_png(&encoded, encoded_size, source, &compress, num_threads);
+	double encode = now() - start;
+	if (error) {
+	  fprintf(stderr, "%s: encode error %u: %s\n", codec->name, error, lodepng_error_text(error));
+	  return 1;
+	}
+	error = decode_png(&check, encoded, *encoded_size, &lodepng_default_decompress_settings, 1);
+	free(encoded);
+	if (error || mismatches || count_mismatches(&check, source)) {
+	  if (!error) {
+		free_image(&check);
+	  }
+	  return 1;
+	}
+	free_image(&check);
+
+	if (best->decode < 0 || decode < best->decode) {
+	  best->decode = decode;
+	}
+	if (best->encode < 0 || encode < best->encode) {
+	  best->encode = encode;
+	}
+  }
+  return 0;
+}
+
+/* Split a comma-separated list in place. Returns the number of items, or
+   -1 if there are more than 'max'.
+ */
+int
+split_list(char *list, char **items, int max)
+{
+  int count = 0;
+
+  for (char *item = strtok(list, ",");  item;  item = strtok(NULL, ",")) {
+	if (count == max) {
+	  return -1;
+	}
+	items[count++] = item;
+  }
+  return count;
+}
+
+/* Print an optional message, usage information, and exit in error.
+ */
+void
+usage(char *prog_name, char *msge)
+{
+  if (msge && strlen(msge)) {
+	fprintf(stderr, "\n%s\n\n", msge);
+  }
+
+  fprintf(stderr, "usage: %s [flags]\n", prog_name);
+  fprintf(stderr, "  -h                print help\n");
+  fprintf(stderr, "  -r <rows>         synthetic image height (default %d)\n", DEFAULT_ROWS);
+  fprintf(stderr, "  -c <columns>      synthetic image width (default %d)\n", DEFAULT_COLUMNS);
+  fprintf(stderr, "  -s <seed>         seed for the synthetic image (default 1)\n");
+  fprintf(stderr, "  -n <counts>       comma-separated thread counts (default %s)\n",
+		  DEFAULT_THREADS);
+  fprintf(stderr, "  -k <kernels>      comma-separated kernels, each <name> or <name>:<size>\n");
+  fprintf(stderr, "                    (default %s), from:\n", DEFAULT_KERNELS);
+  print_kernels(stderr);
+  fprintf(stderr, "  -b <border>       border mode from:\n");
+  print_border_modes(stderr);
+  fprintf(stderr, "  -t <trials>       runs per variant; the best time is kept (default %d)\n",
+		  DEFAULT_TRIALS);
+  fprintf(stderr, "  -z <level>        PNG compression level for the encode stage, 0-9\n");
+  fprintf(stderr, "  -Z <codecs>       comma-separated zlib codecs to compare (default all);\n");
+  fprintf(stderr, "                    the kernel runs use the default, from:\n");
+  print_codecs(stderr);
+  exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+  char *prog_name = argv[0];	/* Convenience */
+#define ERR_MSGE_LEN 128
+  char err_msge[ERR_MSGE_LEN];	/* Dynamic error messages */
+
+  int rows = DEFAULT_ROWS;
+  int columns = DEFAULT_COLUMNS;
+  unsigned int seed = 1;
+  int trials = DEFAULT_TRIALS;
+  int level = -1;
+  char thread_list[LIST_LEN] = DEFAULT_THREADS;
+  char kernel_list[LIST_LEN] = DEFAULT_KERNELS;
+  char codec_list[LIST_LEN] = "";
+  border_t border;
+  parse_border(&border, DEFAULT_BORDER_NAME);
+
+  int ch;
+  while ((ch = getopt(argc, argv, "b:c:hk:n:r:s:t:z:Z:")) != -1) {
+	switch (ch) {
+	case 'b':
+	  if (!parse_border(&border, optarg)) {
+		snprintf(err_msge, ERR_MSGE_LEN, "no border mode named '%s'", optarg);
+		usage(prog_name, err_msge);
+	  }
+	  break;
+	case 'c':
+	  columns = atoi(optarg);
+	  break;
+	case 'k':
+	  snprintf(kernel_list, sizeof(kernel_list), "%s", optarg);
+	  break;
+	case 'n':
+	  snprintf(thread_list, sizeof(thread_list), "%s", optarg);
+	  break;
+	case 'r':
+	  rows = atoi(optarg);
+	  break;
+	case 's':
+	  seed = atoi(optarg);
+	  break;
+	case 't':
+	  trials = atoi(optarg);
+	  break;
+	case 'z':
+	  level = atoi(optarg);
+	  if (level < 0 || level > 9) {
+		usage(prog_name, "compression level must be 0 to 9");
+	  }
+	  break;
+	case 'Z':
+	  snprintf(codec_list, sizeof(codec_list), "%s", optarg);
+	  break;
+	case 'h':
+	default:
+	  usage(prog_name, "");
+	}
+  }
+
+  if (rows < 1 || columns < 1) {
+	usage(prog_name, "image size must be positive");
+  }
+  if (trials < 1) {
+	usage(prog_name, "need at least one trial");
+  }
+
+  char *items[MAX_LIST];
+  int thread_counts[MAX_LIST];
+  int num_counts = split_list(thread_list, items, MAX_LIST);
+  if (num_counts < 1) {
+	usage(prog_name, "bad thread count list");
+  }
+  for (int i = 0;  i < num_counts;  i++) {
+	thread_counts[i] = atoi(items[i]);
+	if (thread_counts[i] < 1) {
+	  snprintf(err_msge, ERR_MSGE_LEN, "bad thread count '%s'", items[i]);
+	  usage(prog_name, err_msge);
+	}
+  }
+
+  kernel_t kernels[MAX_LIST];
+  char *kernel_names[MAX_LIST];
+  int num_kernels = split_list(kernel_list, kernel_names, MAX_LIST);
+  if (num_kernels < 1) {
+	usage(prog_name, "bad kernel list");
+  }
+  for (int i = 0;  i < num_kernels;  i++) {
+	char *size = strchr(kernel_names[i], ':');
+	int dim = DEFAULT_KERNEL_DIM;
+	if (size) {
+	  *size++ = '\0';
+	  dim = atoi(size);
+	}
+	catalog_entry_t *entry = find_entry_by_name(kernel_names[i]);
+	if (!entry) {
+	  snprintf(err_msge, ERR_MSGE_LEN, "no kernel named '%s'", kernel_names[i]);
+	  usage(prog_name, err_msge);
+	}
+	if (!make_kernel(&kernels[i], entry, dim)) {
+	  snprintf(err_msge, ERR_MSGE_LEN, "kernel '%s' can't be %dx%d",
+			   kernel_names[i], dim, dim);
+	  usage(prog_name, err_msge);
+	}
+  }
+
+  codec_t *codecs[MAX_LIST];
+  int num_codecs = 0;
+  if (codec_list[0]) {
+	char *codec_names[MAX_LIST];
+	num_codecs = split_list(codec_list, codec_names, MAX_LIST);
+	if (num_codecs < 1) {
+	  usage(prog_name, "bad codec list");
+	}
+	for (int i = 0;  i < num_codecs;  i++) {
+	  codecs[i] = find_codec_by_name(codec_names[i]);
+	  if (!codecs[i]) {
+		snprintf(err_msge, ERR_MSGE_LEN, "no codec named '%s'", codec_names[i]);
+		usage(prog_name, err_msge);
+	  }
+	}
+  } else {
+	for (codec_t *cp = codec_catalog;  cp->name;  cp++) {
+	  codecs[num_codecs++] = cp;
+	}
+  }
+
+  /* The encode stage reuses one set of LZ77 tables across all variants. */
+  LodePNGDecompressSettings decompress;
+  LodePNGCompressSettings compress;
+  lodepng_decompress_settings_init(&decompress);
+  lodepng_compress_settings_init(&compress);
+  compress.cache = lodepng_deflate_cache_new();
+
+  /* Encode the test image once; every variant starts from these bytes. */
+  image_t source;
+  unsigned char *png;
+  size_t png_size;
+  make_synthetic(&source, rows, columns, seed);
+  unsigned int error = lodepng_encode32(&png, &png_size, source.pixels, columns, rows);
+  if (error) {
+	fprintf(stderr, "error %u: %s\n", error, lodepng_error_text(error));
+	exit(1);
+  }
+
+  double megapixels = (double) rows * columns / 1000000.0;
+  printf("Synthetic image %dx%d (%.2f MP, %lu byte PNG), best of %d\n",
+		 columns, rows, megapixels, (unsigned long) png_size, trials);
+
+  /* Time the codecs for "auto" now rather than inside its first timed call. */
+  LodePNGCompressSettings tuned = compress;
+  use_codec(find_codec_by_name("auto"), level, NULL, &tuned);
+  printf("Codec auto decodes with %s and encodes with %s; kernel runs use %s\n",
+		 fastest_decoder()->name, fastest_encoder(&tuned)->name, default_codec()->name);
+
+  int failures = 0;
+  printf("%-20s %7s %12s %12s %12s  %s\n", "codec", "threads",
+		 "decode MP/s", "encode MP/s", "PNG bytes", "check");
+  for (int i = 0;  i < num_codecs;  i++) {
+	for (int t = 0;  t < num_counts;  t++) {
+	  stage_times_t best;
+	  size_t encoded_size = 0;
+
+	  if (run_codec(&best, &encoded_size, &source, png, png_size, codecs[i], &compress,
+					level, thread_counts[t], trials)) {
+		printf("%-20s %7d %12s %12s %12s  FAIL\n", codecs[i]->name, thread_counts[t],
+			   "-", "-", "-");
+		failures++;
+		continue;
+	  }
+	  printf("%-20s %7d %12.2f %12.2f %12lu  ok\n", codecs[i]->name, thread_counts[t],
+			 megapixels / best.decode, megapixels / best.encode, (unsigned long) encoded_size);
+	}
+  }
+  printf("\n");
+
+  codec_t *codec = default_codec();
+  use_codec(codec, level, &decompress, &compress);
+  printf("%-20s %-7s %7s %12s %12s %12s  %s\n", "kernel", "backend", "threads",
+		 "decode MP/s", "conv MP/s", "encode MP/s", "check");
+
+  /* Run the FFT autotuner now rather than inside the first timed call. */
+  fft_crossover();
+
+  for (int k = 0;  k < num_kernels;  k++) {
+	kernel_t *kernel = &kernels[k];
+	char label[ERR_MSGE_LEN];
+	snprintf(label, ERR_MSGE_LEN, "%s %dx%d", kernel_names[k], kernel->dim, kernel->dim);
+
+	/* The reference is always summed directly, so the FFT backend is
+	   checked against an independent result rather than itself. */
+	image_t reference;
+	double start = now();
+	init_image(&reference, source.rows, source.columns);
+	reference.traits = convolve_direct_rows(&reference, &source, kernel, &border, 0,
+											source.rows);
+	double reference_seconds = now() - start;
+	printf("%-20s %-7s %7s %12s %12.2f %12s  reference\n", label, "serial", "1",
+		   "-", megapixels / reference_seconds, "-");
+
+	int num_backends = kernel->dim >= FFT_MIN_DIM ? 2 : 1;
+	for (backend_t backend = BACKEND_DIRECT;  backend < num_backends;  backend++) {
+	  for (int t = 0;  t < num_counts;  t++) {
+		image_t output;
+		stage_times_t best;
+
+		if (run_variant(&best, &output, png, png_size, kernel, &border, &decompress,
+						&compress, backend, thread_counts[t], trials)) {
+		  exit(1);
+		}
+		long mismatches = count_mismatches(&output, &reference);
+		if (mismatches) {
+		  failures++;
+		}
+		printf("%-20s %-7s %7d %12.2f %12.2f %12.2f  ", label, backend_names[backend],
+			   thread_counts[t], megapixels / best.decode,
+			   megapixels / best.convolve, megapixels / best.encode);
+		if (mismatches) {
+		  printf("FAIL (%ld pixels differ)\n", mismatches);
+		} else {
+		  printf("ok\n");
+		}
+		free_image(&output);
+	  }
+	}
+	free_image(&reference);
+	free_kernel(kernel);
+  }
+
+  free_image(&source);
+  free(png);
+  lodepng_deflate_cache_free(compress.cache);
+  if (failures) {
+	printf("%d variant(s) failed their check\n", failures);
+	exit(1);
+  }
+  exit(0);
+}
@@ -0,0 +1,484 @@
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "convolve-engine.h"
+
+/* Initialize an image_t structure 'image' for an image of size 'rows' by 'columns'.
+ */
+void
+init_image(image_t *image, int rows, int columns)
+{
+  image->rows = rows;
+  image->columns = columns;
+  image->traits = 0;
+  image->pixels = (pixel_t *)malloc((size_t)image->columns * image->rows * BYTES_PER_PIXEL);
+}
+
+/* Free a previously initialized image.
+ */
+void
+free_image(image_t *image)
+{
+  free(image->pixels);
+}
+
+/* Copy an existing 'input' image to an 'output' image. Initializes the
+   'output' image, on which you should later invoke 'free_image'.
+ */
+void
+copy(image_t *output, image_t *input)
+{
+  int rows = input->rows;
+  int columns = input->columns;
+  init_image(output, rows, columns);
+
+  for (int r = 0;  r < rows;  r++) {
+	for (int c = 0;  c < columns;  c++) {
+	  for (int b = 0;  b < BYTES_PER_PIXEL;  b++) {
+		output->pixels[IMG_BYTE(columns, r, c, b)] = input->pixels[IMG_BYTE(columns, r, c, b)];
+	  }
+	}
+  }
+  output->traits = input->traits;
+}
+
+/* Return the PIXELS_* traits shared by the 'count' pixels at 'pixels'.
+ */
+unsigned int
+pixel_traits(const pixel_t *pixels, size_t count)
+{
+  int translucent = 0;
+  int colored = 0;
+
+  for (size_t i = 0;  i < count * BYTES_PER_PIXEL;  i += BYTES_PER_PIXEL) {
+	translucent |= pixels[i + ALPHA_OFFSET] ^ 0xFF;
+	colored |= (pixels[i + RED_OFFSET] ^ pixels[i + GREEN_OFFSET]) |
+	  (pixels[i + GREEN_OFFSET] ^ pixels[i + BLUE_OFFSET]);
+  }
+  return PIXELS_KNOWN | (translucent ? 0 : PIXELS_OPAQUE) | (colored ? 0 : PIXELS_GREY);
+}
+
+/* Fill a 'dim' x 'dim' kernel with ones.
+ */
+static void
+generate_box_blur(int dim, int *weights)
+{
+  for (int i = 0;  i < dim * dim;  i++) {
+	weights[i] = 1;
+  }
+}
+
+/* Fill a 'dim' x 'dim' kernel with a Gaussian whose standard deviation is a
+   sixth of the kernel width, quantized to integers of at most 16 per axis.
+   Every weight is at least one so the whole kernel contributes.
+ */
+static void
+generate_gaussian(int dim, int *weights)
+{
+  int half_dim = dim / 2;
+  double sigma = dim / 6.0;
+  int axis[MAX_KERNEL_DIM];
+
+  for (int i = 0;  i < dim;  i++) {
+	double x = i - half_dim;
+	axis[i] = (int) lround(16.0 * exp(-(x * x) / (2.0 * sigma * sigma)));
+	if (axis[i] < 1) {
+	  axis[i] = 1;
+	}
+  }
+  for (int r = 0;  r < dim;  r++) {
+	for (int c = 0;  c < dim;  c++) {
+	  weights[r * dim + c] = axis[r] * axis[c];
+	}
+  }
+}
+
+catalog_entry_t kernel_catalog[] =
+  {
+   {
+	DEFAULT_KERNEL_NAME,
+	{ { 0, 0, 0 },
+	  { 0, 1, 0 },
+	  { 0, 0, 0 } }
+   },
+   {
+	"edge-detect",
+	{ { -1, -1, -1 },
+	  { -1, +8, -1 },
+	  { -1, -1, -1 } }
+   },
+   {
+	"sharpen",
+	{ { +0, -1, +0 },
+	  { -1, +5, -1 },
+	  { +0, -1, +0 } }
+   },
+   {
+	"emboss",
+	{ { -2, -1, +0 },
+	  { -1, +1, +1 },
+	  { +0, -2, +2 } }
+   },
+   {
+	"gaussian-blur",
+	{ { 1, 2, 1 },
+	  { 2, 4, 2 },
+	  { 1, 2, 1 } }
+   },
+   { "box-blur", {}, generate_box_blur },
+   { "gaussian", {}, generate_gaussian },
+   { NULL, {} }					/* Must be last! */
+  };
+
+/* Locate an entry in the kernel catalog by name. Returns a null pointer if no
+   kernel found.
+ */
+catalog_entry_t *
+find_entry_by_name(char *name)
+{
+  for (catalog_entry_t *cp = kernel_catalog;  cp->name;  cp++) {
+	if (strcmp(cp->name, name) == 0) {
+	  return(cp);
+	}
+  }
+  return (catalog_entry_t *) NULL;
+}
+
+/* List the kernel catalog for a usage message.
+ */
+void
+print_kernels(FILE *stream)
+{
+  for (int i = 0;  kernel_catalog[i].name;  i++) {
+	char *name = kernel_catalog[i].name;
+	fprintf(stream, "       %s%s%s\n", name,
+			kernel_catalog[i].generate ? " (any size)" : "",
+			strcmp(name, DEFAULT_KERNEL_NAME) ? "" : " (default)");
+  }
+}
+
+/* Build a 'dim' x 'dim' kernel from a catalog 'entry'. Entries without a
+   generator only come in 3x3. Returns zero if 'dim' is not supported; on
+   success, release the kernel with 'free_kernel'.
+ */
+int
+make_kernel(kernel_t *kernel, catalog_entry_t *entry, int dim)
+{
+  if (dim < 1 || dim > MAX_KERNEL_DIM || dim % 2 == 0) {
+	return 0;
+  }
+  if (!entry->generate && dim != 3) {
+	return 0;
+  }
+
+  kernel->dim = dim;
+  kernel->weights = malloc(sizeof(int) * dim * dim);
+  if (entry->generate) {
+	entry->generate(dim, kernel->weights);
+  } else {
+	memcpy(kernel->weights, entry->fixed, sizeof(entry->fixed));
+  }
+  kernel->norm = normalize_kernel(kernel);
+  return 1;
+}
+
+/* Free a kernel built by 'make_kernel'.
+ */
+void
+free_kernel(kernel_t *kernel)
+{
+  free(kernel->weights);
+}
+
+/* Compute the normal value of the given 'kernel'.
+ */
+int
+normalize_kernel(kernel_t *kernel)
+{
+  int norm = 0;
+
+  for (int r = 0;  r < kernel->dim;  r++) {
+	for (int c = 0;  c < kernel->dim;  c++) {
+	  norm += KERNEL_WEIGHT(kernel, r, c);
+	}
+  }
+  if (norm == 0) {
+	norm = 1;
+  }
+
+  return norm;
+}
+
+/* Names accepted by 'parse_border', in the same order as border_mode_t.
+ */
+static const char *border_names[] = { "clamp", "mirror", "wrap", "constant", "skip" };
+#define NUM_BORDER_MODES (int)(sizeof(border_names) / sizeof(border_names[0]))
+
+/* Fill in 'border' from a mode 'name' such as "mirror". The constant mode
+   takes an optional channel value, as in "constant=128"; it defaults to
+   zero. Returns zero if the name is not recognized.
+ */
+int
+parse_border(border_t *border, const char *name)
+{
+  for (int m = 0;  m < NUM_BORDER_MODES;  m++) {
+	size_t length = strlen(border_names[m]);
+	if (strncmp(name, border_names[m], length) != 0) {
+	  continue;
+	}
+	if (name[length] == '\0') {
+	  border->mode = (border_mode_t) m;
+	  border->constant = 0;
+	  return 1;
+	}
+	if (m == BORDER_CONSTANT && name[length] == '=') {
+	  char *end;
+	  long value = strtol(name + length + 1, &end, 0);
+	  if (*end != '\0' || value < 0 || value > 0xFF) {
+		return 0;
+	  }
+	  border->mode = BORDER_CONSTANT;
+	  border->constant = (pixel_t) value;
+	  return 1;
+	}
+  }
+  return 0;
+}
+
+/* List the border modes for a usage message.
+ */
+void
+print_border_modes(FILE *stream)
+{
+  for (int m = 0;  m < NUM_BORDER_MODES;  m++) {
+	fprintf(stream, "       %s%s%s\n", border_names[m],
+			m == BORDER_CONSTANT ? "[=<value>]" : "",
+			strcmp(border_names[m], DEFAULT_BORDER_NAME) ? "" : " (default)");
+  }
+}
+
+/* Map a row or column 'index' that may lie outside [0, 'length') back into
+   the image according to 'mode'. Returns -1 when the tap should read the
+   border constant instead of a pixel.
+ */
+int
+border_index(int index, int length, border_mode_t mode)
+{
+  if (index >= 0 && index < length) {
+	return index;
+  }
+
+  switch (mode) {
+  case BORDER_MIRROR:
+	if (length == 1) {
+	  return 0;
+	}
+	while (index < 0 || index >= length) {
+	  index = index < 0 ? -index : 2 * (length - 1) - index;
+	}
+	return index;
+  case BORDER_WRAP:
+	index %= length;
+	return index < 0 ? index + length : index;
+  case BORDER_CONSTANT:
+	return -1;
+  case BORDER_CLAMP:
+  case BORDER_SKIP:
+  default:
+	return index < 0 ? 0 : length - 1;
+  }
+}
+
+/* Convolve the pixels in columns ['first', 'last') of one row. Every tap
+   lies inside the row, so no border checks are needed. 'taps' holds the
+   'dim' input rows the kernel covers; 'center' is the input row matching
+   'out'. Callers pass 'dim' as a constant for common sizes so the compiler
+   can unroll the tap loops.
+ */
+static inline void
+convolve_interior(pixel_t *out, const pixel_t **taps, const pixel_t *center,
+				  int first, int last, kernel_t *kernel, const int dim)
+{
+  int half_dim = dim / 2;
+  const int *weights = kernel->weights;
+  int kernel_norm = kernel->norm;
+
+  for (int c = first;  c < last;  c++) {
+	int left = (c - half_dim) * BYTES_PER_PIXEL;
+
+	for (int b = 0;  b < BYTES_PER_PIXEL;  b++) {
+	  if (b == ALPHA_OFFSET) {
+		/* Retain the alpha channel. */
+		out[c * BYTES_PER_PIXEL + b] = center[c * BYTES_PER_PIXEL + b];
+		continue;
+	  }
+
+	  int value = 0;
+	  for (int kr = 0;  kr < dim;  kr++) {
+		const pixel_t *tap = taps[kr] + left + b;
+		const int *weight = weights + kr * dim;
+		for (int kc = 0;  kc < dim;  kc++) {
+		  value += weight[kc] * tap[kc * BYTES_PER_PIXEL];
+		}
+	  }
+
+	  value /= kernel_norm;
+	  out[c * BYTES_PER_PIXEL + b] = CLAMP(value, 0, 0xFF);
+	}
+  }
+}
+
+/* Convolve the single pixel in column 'c' of a row, mapping each tap column
+   through the border mode. Only used for the few columns near the left and
+   right edges.
+ */
+static void
+convolve_edge(pixel_t *out, const pixel_t **taps, const pixel_t *center,
+			  int c, int columns, kernel_t *kernel, border_t *border)
+{
+  int dim = kernel->dim;
+  int half_dim = dim / 2;
+
+  if (border->mode == BORDER_SKIP) {
+	memcpy(out + c * BYTES_PER_PIXEL, center + c * BYTES_PER_PIXEL, BYTES_PER_PIXEL);
+	return;
+  }
+
+  int tap_columns[MAX_KERNEL_DIM];
+  for (int kc = 0;  kc < dim;  kc++) {
+	tap_columns[kc] = border_index(c + kc - half_dim, columns, border->mode);
+  }
+
+  for (int b = 0;  b < BYTES_PER_PIXEL;  b++) {
+	if (b == ALPHA_OFFSET) {
+	  out[c * BYTES_PER_PIXEL + b] = center[c * BYTES_PER_PIXEL + b];
+	  continue;
+	}
+
+	int value = 0;
+	for (int kr = 0;  kr < dim;  kr++) {
+	  for (int kc = 0;  kc < dim;  kc++) {
+		int C = tap_columns[kc];
+		int pixel = C < 0 ? border->constant : taps[kr][C * BYTES_PER_PIXEL + b];
+		value += KERNEL_WEIGHT(kernel, kr, kc) * pixel;
+	  }
+	}
+
+	value /= kernel->norm;
+	out[c * BYTES_PER_PIXEL + b] = CLAMP(value, 0, 0xFF);
+  }
+}
+
+/* Convolve output row 'r' of an image with 'rows' rows and 'columns'
+   columns. 'taps' holds the 'dim' input rows the kernel covers, already
+   mapped through the border mode, and 'center' is input row 'r'. Only the
+   'dim / 2' columns at either edge take the slow path; everything else
+   runs through 'convolve_interior'.
+ */
+void
+convolve_row(pixel_t *out, const pixel_t **taps, const pixel_t *center,
+			 int r, int rows, int columns, kernel_t *kernel, border_t *border)
+{
+  int dim = kernel->dim;
+  int half_dim = dim / 2;
+
+  if (border->mode == BORDER_SKIP && (r < half_dim || r >= rows - half_dim)) {
+	memcpy(out, center, (size_t)columns * BYTES_PER_PIXEL);
+	return;
+  }
+
+  /* Columns whose taps all fall inside the image. */
+  int first_inner = half_dim < columns ? half_dim : columns;
+  int last_inner = columns - half_dim > first_inner ? columns - half_dim : first_inner;
+
+  for (int c = 0;  c < first_inner;  c++) {
+	convolve_edge(out, taps, center, c, columns, kernel, border);
+  }
+  switch (dim) {
+  case 3:
+	convolve_interior(out, taps, center, first_inner, last_inner, kernel, 3);
+	break;
+  case 5:
+	convolve_interior(out, taps, center, first_inner, last_inner, kernel, 5);
+	break;
+  default:
+	convolve_interior(out, taps, center, first_inner, last_inner, kernel, dim);
+	break;
+  }
+  for (int c = last_inner;  c < columns;  c++) {
+	convolve_edge(out, taps, center, c, columns, kernel, border);
+  }
+}
+
+/* Convolve rows ['first_row', 'last_row') of 'input' with 'kernel' into
+   'output' by direct summation. 'output' must already be initialized to the
+   size of 'input'. Rows are independent, so threads may call this on
+   disjoint ranges of the same image. Border handling for the vertical taps
+   is resolved once per row. Returns the traits of the rows written, which
+   are checked while each row is still in cache.
+ */
+unsigned int
+convolve_direct_rows(image_t *output, image_t *input, kernel_t *kernel,
+					 border_t *border, int first_row, int last_row)
+{
+  int columns = input->columns;
+  int rows = input->rows;
+  int dim = kernel->dim;
+  int half_dim = dim / 2;
+  size_t row_bytes = (size_t)columns * BYTES_PER_PIXEL;
+
+  /* Stand-in row for taps above or below the image in constant mode. */
+  pixel_t *constant_row = NULL;
+  if (border->mode == BORDER_CONSTANT) {
+	constant_row = malloc(row_bytes);
+	memset(constant_row, border->constant, row_bytes);
+  }
+
+  unsigned int traits = PIXELS_ALL;
+  for (int r = first_row;  r < last_row;  r++) {
+	const pixel_t *taps[MAX_KERNEL_DIM];
+	for (int kr = 0;  kr < dim;  kr++) {
+	  int R = border_index(r + kr - half_dim, rows, border->mode);
+	  taps[kr] = R < 0 ? constant_row : input->pixels + R * row_bytes;
+	}
+
+	convolve_row(output->pixels + r * row_bytes, taps, input->pixels + r * row_bytes,
+				 r, rows, columns, kernel, border);
+	/* Once the rows are known to need every channel there is no point
+	   looking further. */
+	if (traits != PIXELS_KNOWN) {
+	  traits &= pixel_traits(output->pixels + r * row_bytes, columns);
+	}
+  }
+
+  free(constant_row);
+  return traits;
+}
+
+/* Convolve rows ['first_row', 'last_row') of 'input' with 'kernel' into
+   'output', which must already be initialized to the size of 'input'.
+   Large kernels go through the FFT backend once they reach the crossover
+   size measured by 'fft_crossover'; smaller ones are summed directly.
+   Returns the PIXELS_* traits of the rows written; callers that split an
+   image into bands combine them and store the result in 'output->traits'.
+ */
+unsigned int
+convolve_rows(image_t *output, image_t *input, kernel_t *kernel,
+			  border_t *border, int first_row, int last_row)
+{
+  if (kernel->dim >= FFT_MIN_DIM && kernel->dim >= fft_crossover()) {
+	return convolve_fft_rows(output, input, kernel, border, first_row, last_row);
+  }
+  return convolve_direct_rows(output, input, kernel, border, first_row, last_row);
+}
+
+/* Convolve image 'input' with 'kernel' into image 'output', which is
+   allocated here and should later be freed.
+ */
+void
+convolve(image_t *output, image_t *input, kernel_t *kernel, border_t *border)
+{
+  init_image(output, input->rows, input->columns);
+  output->traits = convolve_rows(output, input, kernel, border, 0, input->rows);
+}
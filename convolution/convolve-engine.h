@@ -0,0 +1,111 @@
+#ifndef CONVOLVE_ENGINE_H
+#define CONVOLVE_ENGINE_H
+
+#include <stdio.h>
+
+#define BYTES_PER_PIXEL 4
+#define RED_OFFSET 0
+#define GREEN_OFFSET 1
+#define BLUE_OFFSET 2
+#define ALPHA_OFFSET 3
+
+#define IMG_BYTE(columns, r, c, b) ((columns * BYTES_PER_PIXEL * r) + (BYTES_PER_PIXEL * c) + b)
+#define CLAMP(val, min, max) (val < min ? min : val > max ? max : val)
+
+typedef unsigned char pixel_t;
+
+typedef struct {
+  pixel_t *pixels;
+  unsigned int rows;
+  unsigned int columns;
+  unsigned int traits;			/* PIXELS_* flags, zero if unknown */
+} image_t;
+
+/* Properties of a run of pixels that let the encoder store fewer channels.
+   The convolution routines gather them for the rows they write, so saving
+   needn't scan the image again. Traits of two runs combine with '&'.
+ */
+#define PIXELS_KNOWN 1			/* The other flags are valid */
+#define PIXELS_OPAQUE 2			/* Every alpha is 0xFF */
+#define PIXELS_GREY 4			/* Red, green and blue are equal */
+#define PIXELS_ALL (PIXELS_KNOWN | PIXELS_OPAQUE | PIXELS_GREY)
+
+/* Square convolution kernel of odd size. Weights are small integers; each
+   weighted sum is divided by 'norm'. The largest size is chosen so that a
+   sum over a full kernel of catalog weights cannot overflow an int.
+ */
+#define MAX_KERNEL_DIM 127
+
+typedef struct {
+  int dim;						/* Width and height */
+  int norm;						/* Divisor for each weighted sum */
+  int *weights;					/* dim * dim weights, row-major */
+} kernel_t;
+
+#define KERNEL_WEIGHT(kernel, kr, kc) ((kernel)->weights[(kr) * (kernel)->dim + (kc)])
+
+/* Catalog of kernels; allows user to select the kernel to use by name at run
+   time. Entries either have fixed 3x3 weights or a generator that builds a
+   kernel of any odd size. If you add more kernels, make sure the "null"
+   kernel remains at the end of the list.
+ */
+#define DEFAULT_KERNEL_NAME "identity"
+#define DEFAULT_KERNEL_DIM 3
+
+typedef struct {
+  char *name;					/* Kernel name */
+  int fixed[3][3];				/* Weights when there is no generator */
+  void (*generate)(int dim, int *weights); /* Builds a dim x dim kernel */
+} catalog_entry_t;
+
+extern catalog_entry_t kernel_catalog[];
+
+/* How to treat kernel taps that fall outside the image.
+ */
+typedef enum {
+  BORDER_CLAMP,					/* Repeat the edge pixel: aaa|abcd|ddd */
+  BORDER_MIRROR,				/* Reflect about the edge: cb|abcd|cb */
+  BORDER_WRAP,					/* Tile the image: bcd|abcd|abc */
+  BORDER_CONSTANT,				/* Use a fixed value: kk|abcd|kk */
+  BORDER_SKIP					/* Copy edge pixels through unfiltered */
+} border_mode_t;
+
+typedef struct {
+  border_mode_t mode;
+  pixel_t constant;				/* Channel value for BORDER_CONSTANT */
+} border_t;
+
+#define DEFAULT_BORDER_NAME "clamp"
+
+void init_image(image_t *image, int rows, int columns);
+void free_image(image_t *image);
+void copy(image_t *output, image_t *input);
+unsigned int pixel_traits(const pixel_t *pixels, size_t count);
+
+catalog_entry_t *find_entry_by_name(char *name);
+void print_kernels(FILE *stream);
+int make_kernel(kernel_t *kernel, catalog_entry_t *entry, int dim);
+void free_kernel(kernel_t *kernel);
+int normalize_kernel(kernel_t *kernel);
+
+int parse_border(border_t *border, const char *name);
+void print_border_modes(FILE *stream);
+int border_index(int index, int length, border_mode_t mode);
+
+/* Kernels narrower than this never use the FFT backend. */
+#define FFT_MIN_DIM 9
+
+void convolve_row(pixel_t *out, const pixel_t **taps, const pixel_t *center,
+				  int r, int rows, int columns, kernel_t *kernel, border_t *border);
+unsigned int convolve_direct_rows(image_t *output, image_t *input, kernel_t *kernel,
+								   border_t *border, int first_row, int last_row);
+unsigned int convolve_fft_rows(image_t *output, image_t *input, kernel_t *kernel,
+								border_t *border, int first_row, int last_row);
+int fft_crossover(void);
+unsigned int convolve_rows(image_t *output, image_t *input, kernel_t *kernel,
+						   border_t *border, int first_row, int last_row);
+void convolve(image_t *output, image_t *input, kernel_t *kernel, border_t *border);
+unsigned int convolve_stream(const char *output_file_name, const char *input_file_name,
+							 kernel_t *kernel, border_t *border);
+
+#endif
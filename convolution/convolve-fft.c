@@ -0,0 +1,363 @@
+/* FFT convolution backend for large kernels.
+
+   The image is convolved tile by tile with overlap-add: each B x B tile of
+   the border-padded input is zero-padded to N x N (N a power of two with
+   B + dim - 1 <= N), transformed, multiplied by the transform of the
+   kernel and transformed back; the N x N results of neighboring tiles
+   overlap by dim - 1 pixels and are summed. Because the kernel is real, two
+   real color channels ride in one complex transform (red in the real part,
+   green in the imaginary part), so RGB costs two transforms per tile.
+
+   Weights and pixels are integers, so each output sum is an integer that
+   the transform reproduces to well within 0.5; rounding it and dividing by
+   the kernel norm gives exactly what direct summation would.
+ */
+
+#include <complex.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "convolve-engine.h"
+
+typedef double complex sample_t;
+
+typedef struct {
+  int n;						/* Transform length, a power of two */
+  sample_t *twiddles;			/* exp(-2 pi i k / n) for k < n / 2 */
+  sample_t *column;				/* Scratch for column transforms */
+} fft_plan_t;
+
+static void
+fft_plan_init(fft_plan_t *plan, int n)
+{
+  plan->n = n;
+  plan->twiddles = malloc(sizeof(sample_t) * (n / 2 + 1));
+  for (int k = 0;  k < n / 2;  k++) {
+	plan->twiddles[k] = cexp(-2.0 * M_PI * I * k / n);
+  }
+  plan->column = malloc(sizeof(sample_t) * n);
+}
+
+static void
+fft_plan_free(fft_plan_t *plan)
+{
+  free(plan->twiddles);
+  free(plan->column);
+}
+
+/* In-place iterative radix-2 transform of 'plan->n' contiguous samples.
+   The inverse transform is unscaled.
+ */
+static void
+fft_1d(fft_plan_t *plan, sample_t *data, int inverse)
+{
+  int n = plan->n;
+
+  for (int i = 1, j = 0;  i < n;  i++) {
+	int bit = n >> 1;
+	for (;  j & bit;  bit >>= 1) {
+	  j ^= bit;
+	}
+	j |= bit;
+	if (i < j) {
+	  sample_t swap = data[i];
+	  data[i] = data[j];
+	  data[j] = swap;
+	}
+  }
+
+  for (int length = 2;  length <= n;  length <<= 1) {
+	int half = length / 2;
+	int step = n / length;
+	for (int start = 0;  start < n;  start += length) {
+	  for (int k = 0;  k < half;  k++) {
+		sample_t w = plan->twiddles[k * step];
+		if (inverse) {
+		  w = conj(w);
+		}
+		sample_t even = data[start + k];
+		sample_t odd = data[start + k + half] * w;
+		data[start + k] = even + odd;
+		data[start + k + half] = even - odd;
+	  }
+	}
+  }
+}
+
+/* In-place 2D transform of an n x n row-major array. Only the first
+   'live_rows' rows may hold nonzero input, so the other row transforms,
+   which would produce zeros, are skipped on the forward pass.
+ */
+static void
+fft_2d(fft_plan_t *plan, sample_t *data, int live_rows, int inverse)
+{
+  int n = plan->n;
+
+  for (int r = 0;  r < (inverse ? n : live_rows);  r++) {
+	fft_1d(plan, data + (size_t)r * n, inverse);
+  }
+  for (int c = 0;  c < n;  c++) {
+	for (int r = 0;  r < n;  r++) {
+	  plan->column[r] = data[(size_t)r * n + c];
+	}
+	fft_1d(plan, plan->column, inverse);
+	for (int r = 0;  r < n;  r++) {
+	  data[(size_t)r * n + c] = plan->column[r];
+	}
+  }
+}
+
+/* Pick the transform size for a kernel of width 'dim': big enough that the
+   useful tile is at least three times the kernel overlap.
+ */
+static int
+fft_size(int dim)
+{
+  int n = 32;
+  while (n < 4 * dim) {
+	n <<= 1;
+  }
+  return n;
+}
+
+/* Look up the pixel channel that padded coordinate ('r', 'c') maps to under
+   the border mode.
+ */
+static inline int
+padded_pixel(image_t *input, border_t *border, int r, int c, int b)
+{
+  border_mode_t mode = border->mode == BORDER_SKIP ? BORDER_CLAMP : border->mode;
+  int R = border_index(r, input->rows, mode);
+  int C = border_index(c, input->columns, mode);
+
+  if (R < 0 || C < 0) {
+	return border->constant;
+  }
+  return input->pixels[(size_t)R * input->columns * BYTES_PER_PIXEL + C * BYTES_PER_PIXEL + b];
+}
+
+/* Convolve rows ['first_row', 'last_row') of 'input' with 'kernel' into
+   'output' using overlap-add FFT convolution. Same contract as
+   'convolve_direct_rows', and produces identical pixels.
+ */
+unsigned int
+convolve_fft_rows(image_t *output, image_t *input, kernel_t *kernel,
+				  border_t *border, int first_row, int last_row)
+{
+  int columns = input->columns;
+  int rows = input->rows;
+  int dim = kernel->dim;
+  int half_dim = dim / 2;
+  int n = fft_size(dim);
+  int tile = n - dim + 1;		/* Input pixels per tile side */
+
+  if (first_row >= last_row) {
+	return PIXELS_ALL;
+  }
+
+  /* Padded input covering this band: band rows plus half a kernel above
+	 and below, all columns plus half a kernel on each side. Row and column
+	 zero of the padded input sit at image (first_row - half_dim, -half_dim). */
+  int padded_rows = last_row - first_row + dim - 1;
+  int padded_columns = columns + dim - 1;
+  int tile_columns = (padded_columns + tile - 1) / tile;
+
+  fft_plan_t plan;
+  fft_plan_init(&plan, n);
+
+  /* Transform of the kernel flipped in both directions, which turns the
+	 correlation computed by direct summation into a convolution. */
+  size_t plane = (size_t)n * n;
+  sample_t *kernel_fft = calloc(plane, sizeof(sample_t));
+  for (int kr = 0;  kr < dim;  kr++) {
+	for (int kc = 0;  kc < dim;  kc++) {
+	  kernel_fft[(size_t)(dim - 1 - kr) * n + (dim - 1 - kc)] = KERNEL_WEIGHT(kernel, kr, kc);
+	}
+  }
+  fft_2d(&plan, kernel_fft, dim, 0);
+
+  /* Accumulators span one row of tiles plus the overlap that spills into
+	 the next; finished rows are emitted and the rest shifted up. */
+  size_t accumulator_columns = (size_t)tile_columns * tile + dim - 1;
+  size_t accumulator_size = (size_t)n * accumulator_columns;
+  sample_t *red_green = calloc(accumulator_size, sizeof(sample_t));
+  sample_t *blue = calloc(accumulator_size, sizeof(sample_t));
+  sample_t *work_rg = malloc(sizeof(sample_t) * plane);
+  sample_t *work_b = malloc(sizeof(sample_t) * plane);
+  double scale = 1.0 / ((double) n * n);
+  unsigned int traits = PIXELS_ALL;
+
+  for (int tile_row = 0;  tile_row * tile < padded_rows;  tile_row++) {
+	int top = tile_row * tile;
+	int height = padded_rows - top < tile ? padded_rows - top : tile;
+
+	for (int tile_column = 0;  tile_column < tile_columns;  tile_column++) {
+	  int left = tile_column * tile;
+	  int width = padded_columns - left < tile ? padded_columns - left : tile;
+
+	  memset(work_rg, 0, sizeof(sample_t) * plane);
+	  memset(work_b, 0, sizeof(sample_t) * plane);
+	  for (int y = 0;  y < height;  y++) {
+		int r = first_row - half_dim + top + y;
+		for (int x = 0;  x < width;  x++) {
+		  int c = left + x - half_dim;
+		  work_rg[(size_t)y * n + x] =
+			padded_pixel(input, border, r, c, RED_OFFSET) +
+			I * padded_pixel(input, border, r, c, GREEN_OFFSET);
+		  work_b[(size_t)y * n + x] = padded_pixel(input, border, r, c, BLUE_OFFSET);
+		}
+	  }
+
+	  fft_2d(&plan, work_rg, height, 0);
+	  fft_2d(&plan, work_b, height, 0);
+	  for (size_t i = 0;  i < plane;  i++) {
+		work_rg[i] *= kernel_fft[i];
+		work_b[i] *= kernel_fft[i];
+	  }
+	  fft_2d(&plan, work_rg, n, 1);
+	  fft_2d(&plan, work_b, n, 1);
+
+	  int spread_rows = height + dim - 1;
+	  int spread_columns = width + dim - 1;
+	  for (int y = 0;  y < spread_rows;  y++) {
+		sample_t *rg_row = red_green + (size_t)y * accumulator_columns + left;
+		sample_t *b_row = blue + (size_t)y * accumulator_columns + left;
+		for (int x = 0;  x < spread_columns;  x++) {
+		  rg_row[x] += work_rg[(size_t)y * n + x] * scale;
+		  b_row[x] += work_b[(size_t)y * n + x] * scale;
+		}
+	  }
+	}
+
+	/* Accumulator rows below 'tile' receive nothing from later tile rows.
+	   Full convolution row 'top + y' holds output row
+	   'first_row + top + y - (dim - 1)'. */
+	int finished = top + tile >= padded_rows ? n : tile;
+	for (int y = 0;  y < finished;  y++) {
+	  int r = first_row + top + y - (dim - 1);
+	  if (r < first_row || r >= last_row) {
+		continue;
+	  }
+	  const pixel_t *center = input->pixels + (size_t)r * columns * BYTES_PER_PIXEL;
+	  pixel_t *out = output->pixels + (size_t)r * columns * BYTES_PER_PIXEL;
+	  sample_t *rg_row = red_green + (size_t)y * accumulator_columns + (dim - 1);
+	  sample_t *b_row = blue + (size_t)y * accumulator_columns + (dim - 1);
+
+	  for (int c = 0;  c < columns;  c++) {
+		int sums[ALPHA_OFFSET];
+		sums[RED_OFFSET] = (int) lround(creal(rg_row[c]));
+		sums[GREEN_OFFSET] = (int) lround(cimag(rg_row[c]));
+		sums[BLUE_OFFSET] = (int) lround(creal(b_row[c]));
+		for (int b = 0;  b < ALPHA_OFFSET;  b++) {
+		  int value = sums[b] / kernel->norm;
+		  out[c * BYTES_PER_PIXEL + b] = CLAMP(value, 0, 0xFF);
+		}
+		/* Retain the alpha channel. */
+		out[c * BYTES_PER_PIXEL + ALPHA_OFFSET] = center[c * BYTES_PER_PIXEL + ALPHA_OFFSET];
+	  }
+	  if (traits != PIXELS_KNOWN) {
+		traits &= pixel_traits(out, columns);
+	  }
+	}
+
+	size_t keep = (size_t)(n - tile) * accumulator_columns;
+	memmove(red_green, red_green + (size_t)tile * accumulator_columns, sizeof(sample_t) * keep);
+	memmove(blue, blue + (size_t)tile * accumulator_columns, sizeof(sample_t) * keep);
+	memset(red_green + keep, 0, sizeof(sample_t) * (accumulator_size - keep));
+	memset(blue + keep, 0, sizeof(sample_t) * (accumulator_size - keep));
+  }
+
+  /* Skip mode passes the frame of edge pixels through unfiltered. */
+  if (border->mode == BORDER_SKIP) {
+	for (int r = first_row;  r < last_row;  r++) {
+	  size_t row_start = (size_t)r * columns * BYTES_PER_PIXEL;
+	  for (int c = 0;  c < columns;  c++) {
+		if (r < half_dim || r >= rows - half_dim || c < half_dim || c >= columns - half_dim) {
+		  memcpy(output->pixels + row_start + c * BYTES_PER_PIXEL,
+				 input->pixels + row_start + c * BYTES_PER_PIXEL, BYTES_PER_PIXEL);
+		  traits &= pixel_traits(output->pixels + row_start + c * BYTES_PER_PIXEL, 1);
+		}
+	  }
+	}
+  }
+
+  free(kernel_fft);
+  free(red_green);
+  free(blue);
+  free(work_rg);
+  free(work_b);
+  fft_plan_free(&plan);
+  return traits;
+}
+
+/* ==== Autotuner ================ */
+
+static int crossover_dim;
+static pthread_once_t crossover_once = PTHREAD_ONCE_INIT;
+
+static double
+seconds(void)
+{
+  struct timespec current_time;
+  clock_gettime(CLOCK_MONOTONIC, &current_time);
+  return current_time.tv_sec + current_time.tv_nsec / 1e9;
+}
+
+/* Time both backends on a small synthetic image at increasing kernel sizes
+   and record the first size at which the FFT wins.
+ */
+static void
+tune_crossover(void)
+{
+  static const int trial_dims[] = { FFT_MIN_DIM, 15, 21, 31, 45, 63, 91, MAX_KERNEL_DIM };
+  const int side = 128;
+  image_t input;
+  image_t output;
+  border_t border = { BORDER_CLAMP, 0 };
+  catalog_entry_t *entry = find_entry_by_name("box-blur");
+
+  init_image(&input, side, side);
+  init_image(&output, side, side);
+  unsigned int seed = 12345;
+  for (size_t i = 0;  i < (size_t)side * side * BYTES_PER_PIXEL;  i++) {
+	seed = seed * 1103515245 + 12345;
+	input.pixels[i] = seed >> 16;
+  }
+
+  crossover_dim = MAX_KERNEL_DIM + 1;
+  for (size_t t = 0;  t < sizeof(trial_dims) / sizeof(trial_dims[0]);  t++) {
+	kernel_t kernel;
+	make_kernel(&kernel, entry, trial_dims[t]);
+
+	double start = seconds();
+	convolve_direct_rows(&output, &input, &kernel, &border, 0, side);
+	double direct = seconds() - start;
+
+	start = seconds();
+	convolve_fft_rows(&output, &input, &kernel, &border, 0, side);
+	double fft = seconds() - start;
+
+	free_kernel(&kernel);
+	if (fft < direct) {
+	  crossover_dim = trial_dims[t];
+	  break;
+	}
+  }
+
+  free_image(&input);
+  free_image(&output);
+}
+
+/* Smallest kernel width for which 'convolve_rows' uses the FFT backend.
+   Measured once per process, the first time a kernel of at least
+   FFT_MIN_DIM is convolved.
+ */
+int
+fft_crossover(void)
+{
+  pthread_once(&crossover_once, tune_crossover);
+  return crossover_dim;
+}
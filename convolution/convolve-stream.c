@@ -0,0 +1,180 @@
+/* Streaming convolution: scanlines are decoded one at a time, convolved
+   from a ring buffer holding the 'dim' input rows the kernel covers, and
+   each finished row is compressed straight into the output file. Memory
+   use is proportional to the image width times the kernel size.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "convolve-engine.h"
+#include "png-stream.h"
+
+typedef struct {
+  png_reader_t reader;
+  int rows;
+  int dim;
+  size_t row_bytes;
+  pixel_t *ring;				/* Input row i lives in slot i % dim */
+  int rows_read;				/* Input rows decoded so far */
+  pixel_t *head;				/* First dim / 2 rows, for wrap mode */
+  pixel_t *tail;				/* Last dim / 2 rows, for wrap mode */
+  int tail_start;				/* First row saved in 'tail' */
+} row_source_t;
+
+/* Decode the next input row into the ring, keeping a copy of the first
+   rows when the bottom of the image will wrap around to them.
+ */
+static int
+read_next_row(row_source_t *source)
+{
+  int r = source->rows_read;
+  pixel_t *slot = source->ring + (size_t)(r % source->dim) * source->row_bytes;
+
+  if (png_reader_next_row(&source->reader, slot)) {
+	return -1;
+  }
+  if (source->head && r < source->dim / 2) {
+	memcpy(source->head + (size_t)r * source->row_bytes, slot, source->row_bytes);
+  }
+  source->rows_read++;
+  return 0;
+}
+
+/* Return input row 'r', which must either be in the ring or saved in the
+   head or tail buffers.
+ */
+static const pixel_t *
+source_row(row_source_t *source, int r)
+{
+  if (r >= source->rows_read - source->dim && r < source->rows_read) {
+	return source->ring + (size_t)(r % source->dim) * source->row_bytes;
+  }
+  if (r >= source->tail_start) {
+	return source->tail + (size_t)(r - source->tail_start) * source->row_bytes;
+  }
+  return source->head + (size_t)r * source->row_bytes;
+}
+
+/* Wrap mode needs the bottom rows before the first output row can be
+   produced, so make an extra decoding pass to pick them up. Only the last
+   'dim / 2' rows are kept.
+ */
+static int
+load_tail(row_source_t *source, const char *input_file_name)
+{
+  png_reader_t pass;
+  int half_dim = source->dim / 2;
+  int kept = half_dim < source->rows ? half_dim : source->rows;
+  int error = 0;
+
+  source->tail_start = source->rows - kept;
+  source->tail = malloc((size_t)(kept > 0 ? kept : 1) * source->row_bytes);
+  pixel_t *scratch = malloc(source->row_bytes);
+
+  error = png_reader_open(&pass, input_file_name);
+  for (int r = 0;  !error && r < source->rows;  r++) {
+	pixel_t *out = r >= source->tail_start ?
+	  source->tail + (size_t)(r - source->tail_start) * source->row_bytes : scratch;
+	error = png_reader_next_row(&pass, out);
+  }
+  if (error) {
+	fprintf(stderr, "%s: %s\n", input_file_name, pass.error);
+  }
+  png_reader_close(&pass);
+  free(scratch);
+  return error;
+}
+
+/* Convolve PNG file 'input_file_name' with 'kernel' into PNG file
+   'output_file_name' without holding either image in memory. Kernels of any
+   size are summed directly. Returns zero on success.
+ */
+unsigned int
+convolve_stream(const char *output_file_name, const char *input_file_name,
+				kernel_t *kernel, border_t *border)
+{
+  row_source_t source;
+  png_writer_t writer;
+  int dim = kernel->dim;
+  int half_dim = dim / 2;
+  int error = 0;
+
+  memset(&source, 0, sizeof(row_source_t));
+  writer.file = NULL;
+  if (png_reader_open(&source.reader, input_file_name)) {
+	fprintf(stderr, "%s: %s\n", input_file_name, source.reader.error);
+	png_reader_close(&source.reader);
+	return 1;
+  }
+
+  int rows = source.rows = source.tail_start = source.reader.rows;
+  int columns = source.reader.columns;
+  source.dim = dim;
+  source.row_bytes = (size_t)columns * BYTES_PER_PIXEL;
+  source.ring = malloc(dim * source.row_bytes);
+  pixel_t *out = malloc(source.row_bytes);
+  pixel_t *constant_row = malloc(source.row_bytes);
+  memset(constant_row, border->constant, source.row_bytes);
+
+  if (border->mode == BORDER_WRAP) {
+	source.head = malloc((size_t)(half_dim > 0 ? half_dim : 1) * source.row_bytes);
+	error = load_tail(&source, input_file_name);
+  }
+
+  int writing = 0;
+  if (!error) {
+	writing = 1;
+	if (png_writer_open(&writer, output_file_name, columns, rows)) {
+	  fprintf(stderr, "%s: %s\n", output_file_name, writer.error);
+	  png_writer_close(&writer);
+	  error = 1;
+	}
+  }
+  if (!error) {
+	printf("Streaming %s (%dx%d) into %s\n", input_file_name, columns, rows, output_file_name);
+  }
+
+  for (int r = 0;  !error && r < rows;  r++) {
+	int needed = r + half_dim < rows ? r + half_dim : rows - 1;
+	while (!error && source.rows_read <= needed) {
+	  if (read_next_row(&source)) {
+		fprintf(stderr, "%s: %s\n", input_file_name, source.reader.error);
+		error = 1;
+	  }
+	}
+	if (error) {
+	  break;
+	}
+
+	const pixel_t *taps[MAX_KERNEL_DIM];
+	for (int kr = 0;  kr < dim;  kr++) {
+	  int R = border_index(r + kr - half_dim, rows, border->mode);
+	  taps[kr] = R < 0 ? constant_row : source_row(&source, R);
+	}
+	convolve_row(out, taps, source_row(&source, r), r, rows, columns, kernel, border);
+
+	if (png_writer_write_row(&writer, out)) {
+	  fprintf(stderr, "%s: %s\n", output_file_name, writer.error);
+	  error = 1;
+	}
+  }
+
+  if (writer.file && png_writer_close(&writer) && !error) {
+	fprintf(stderr, "%s: %s\n", output_file_name, writer.error);
+	error = 1;
+  }
+  if (error && writing) {
+	remove(output_file_name);
+  } else if (!error) {
+	printf("Stored %s (%dx%d)\n", output_file_name, columns, rows);
+  }
+
+  png_reader_close(&source.reader);
+  free(source.ring);
+  free(source.head);
+  free(source.tail);
+  free(out);
+  free(constant_row);
+  return error;
+}
@@ -34,6 +34,19 @@ Rename this file to lodepng.cpp to use it for C++, or to lodepng.c to use it for
 #include <stdio.h>
 #include <stdlib.h>
 
+#ifdef LODEPNG_COMPILE_THREADS
+#include <pthread.h>
+#endif /*LODEPNG_COMPILE_THREADS*/
+
+/*SSE2 is always there on x86-64; SSSE3 and PCLMUL are used when the running CPU has them*/
+#if defined(__GNUC__) && (defined(__x86_64__) || (defined(__i386__) && defined(__SSE2__)))
+#define LODEPNG_SIMD_SSE2
+#include <emmintrin.h>
+#include <tmmintrin.h>
+#include <smmintrin.h>
+#include <wmmintrin.h>
+#endif /*__GNUC__ && x86*/
+
 #if defined(_MSC_VER) && (_MSC_VER >= 1310) /*Visual Studio: A few warning types are not desired here.*/
 #pragma warning( disable : 4244 ) /*implicit conversions: not warned by gcc -Wall -Wextra and requires too much casts*/
 #pragma warning( disable : 4996 ) /*VS does not like fopen, but fopen_s is not standard C so unusable here*/
@@ -123,6 +136,35 @@ Example: if(!uivector_resizev(&frequencies_ll, 286, 0)) ERROR_BREAK(83);
   return;										\
 }
 
+#ifdef LODEPNG_COMPILE_THREADS
+/*more threads than this are not useful for the chunk sizes used by the encoder*/
+#define LODEPNG_MAX_THREADS 64
+
+/*
+Run 'run' on each of the 'count' jobs stored 'jobsize' bytes apart in 'jobs', each
+on its own thread. The first job runs on the calling thread. If a thread can't be
+created, its job runs on the calling thread too once the first job is done, so this
+always completes all jobs, and other jobs may wait for the first one.
+*/
+static void lodepng_run_jobs(void* (*run)(void*), void* jobs, size_t jobsize, unsigned count)
+{
+  pthread_t threads[LODEPNG_MAX_THREADS];
+  int started[LODEPNG_MAX_THREADS];
+  unsigned i;
+  if(count > LODEPNG_MAX_THREADS) count = LODEPNG_MAX_THREADS;
+  for(i = 1; i < count; ++i)
+  {
+    started[i] = pthread_create(&threads[i], 0, run, (unsigned char*)jobs + i * jobsize) == 0;
+  }
+  if(count > 0) run(jobs);
+  for(i = 1; i < count; ++i)
+  {
+    if(started[i]) pthread_join(threads[i], 0);
+    else run((unsigned char*)jobs + i * jobsize);
+  }
+}
+#endif /*LODEPNG_COMPILE_THREADS*/
+
 /*
 About uivector, ucvector and string:
 -All of them wrap dynamic arrays or text strings in a similar way.
@@ -508,7 +550,9 @@ Huffman tree struct, containing multiple representations of the tree
 */
 typedef struct HuffmanTree
 {
-  unsigned* tree2d;
+  /*decoding tables, see HuffmanTree_makeTable*/
+  unsigned char* table_len; /*code length of the symbol, or total length of the subtable*/
+  unsigned short* table_value; /*the symbol, or the start of the subtable*/
   unsigned* tree1d;
   unsigned* lengths; /*the lengths of the codes of the 1d-tree*/
   unsigned maxbitlen; /*maximum number of bits a single code can get*/
@@ -530,74 +574,123 @@ static void HuffmanTree_draw(HuffmanTree* tree)
 
 static void HuffmanTree_init(HuffmanTree* tree)
 {
-  tree->tree2d = 0;
+  tree->table_len = 0;
+  tree->table_value = 0;
   tree->tree1d = 0;
   tree->lengths = 0;
 }
 
 static void HuffmanTree_cleanup(HuffmanTree* tree)
 {
-  lodepng_free(tree->tree2d);
+  lodepng_free(tree->table_len);
+  lodepng_free(tree->table_value);
   lodepng_free(tree->tree1d);
   lodepng_free(tree->lengths);
 }
 
-/*the tree representation used by the decoder. return value is error*/
-static unsigned HuffmanTree_make2DTree(HuffmanTree* tree)
+/*the decoder looks up the next FIRSTBITS bits of the stream in one table*/
+#define FIRSTBITS 9u
+#define FIRSTMASK ((1u << FIRSTBITS) - 1u)
+/*marks table entries for bit patterns that no code starts with*/
+#define INVALIDSYMBOL 65535u
+
+/*reverse the order of the lowest num bits: deflate stores codes starting at their most significant bit*/
+static unsigned reverseBits(unsigned bits, unsigned num)
+{
+  unsigned i, result = 0;
+  for(i = 0; i < num; ++i) result |= ((bits >> (num - i - 1u)) & 1u) << i;
+  return result;
+}
+
+/*
+The tables used by the decoder. The next FIRSTBITS bits of the stream, in the order
+they are read, index the primary table. Codes up to FIRSTBITS long fill every entry
+that starts with them, so one lookup gives both the symbol and how many bits it used.
+Longer codes share a primary entry by their first FIRSTBITS bits; that entry holds the
+total length of the longest of them (more than FIRSTBITS, which marks it) and the start
+of a subtable that is indexed by the bits after the first FIRSTBITS. Return value is error.
+*/
+static unsigned HuffmanTree_makeTable(HuffmanTree* tree)
 {
-  unsigned nodefilled = 0; /*up to which node it is filled*/
-  unsigned treepos = 0; /*position in the tree (1 of the numcodes columns)*/
-  unsigned n, i;
+  static const unsigned headsize = 1u << FIRSTBITS;
+  unsigned maxlens[1u << FIRSTBITS];
+  size_t i, size, pointer;
+
+  /*find the longest code for each primary entry, which sets the size of its subtable*/
+  for(i = 0; i != headsize; ++i) maxlens[i] = 0;
+  for(i = 0; i != tree->numcodes; ++i)
+  {
+    unsigned l = tree->lengths[i];
+    unsigned index;
+    if(l <= FIRSTBITS) continue;
+    index = reverseBits(tree->tree1d[i] >> (l - FIRSTBITS), FIRSTBITS);
+    if(l > maxlens[index]) maxlens[index] = l;
+  }
+  size = headsize;
+  for(i = 0; i != headsize; ++i)
+  {
+    if(maxlens[i] > FIRSTBITS) size += 1u << (maxlens[i] - FIRSTBITS);
+  }
 
-  tree->tree2d = (unsigned*)lodepng_malloc(tree->numcodes * 2 * sizeof(unsigned));
-  if(!tree->tree2d) return 83; /*alloc fail*/
+  tree->table_len = (unsigned char*)lodepng_malloc(size * sizeof(*tree->table_len));
+  tree->table_value = (unsigned short*)lodepng_malloc(size * sizeof(*tree->table_value));
+  if(!tree->table_len || !tree->table_value) return 83; /*alloc fail*/
 
-  /*
-  convert tree1d[] to tree2d[][]. In the 2D array, a value of 32767 means
-  uninited, a value >= numcodes is an address to another bit, a value < numcodes
-  is a code. The 2 rows are the 2 possible bit values (0 or 1), there are as
-  many columns as codes - 1.
-  A good huffman tree has N * 2 - 1 nodes, of which N - 1 are internal nodes.
-  Here, the internal nodes are stored (what their 0 and 1 option point to).
-  There is only memory for such good tree currently, if there are more nodes
-  (due to too long length codes), error 55 will happen
-  */
-  for(n = 0; n < tree->numcodes * 2; ++n)
+  /*length 0 marks entries not filled in yet*/
+  for(i = 0; i != size; ++i) tree->table_len[i] = 0;
+
+  pointer = headsize;
+  for(i = 0; i != headsize; ++i)
   {
-    tree->tree2d[n] = 32767; /*32767 here means the tree2d isn't filled there yet*/
+    if(maxlens[i] <= FIRSTBITS) continue;
+    tree->table_len[i] = (unsigned char)maxlens[i];
+    tree->table_value[i] = (unsigned short)pointer;
+    pointer += 1u << (maxlens[i] - FIRSTBITS);
   }
 
-  for(n = 0; n < tree->numcodes; ++n) /*the codes*/
+  for(i = 0; i != tree->numcodes; ++i)
   {
-    for(i = 0; i != tree->lengths[n]; ++i) /*the bits for this code*/
+    unsigned l = tree->lengths[i];
+    unsigned reverse, j, num;
+    if(l == 0) continue;
+    reverse = reverseBits(tree->tree1d[i], l);
+    if(l <= FIRSTBITS)
     {
-      unsigned char bit = (unsigned char)((tree->tree1d[n] >> (tree->lengths[n] - i - 1)) & 1);
-      /*oversubscribed, see comment in lodepng_error_text*/
-      if(treepos > 2147483647 || treepos + 2 > tree->numcodes) return 55;
-      if(tree->tree2d[2 * treepos + bit] == 32767) /*not yet filled in*/
+      num = 1u << (FIRSTBITS - l);
+      for(j = 0; j != num; ++j)
       {
-        if(i + 1 == tree->lengths[n]) /*last bit*/
-        {
-          tree->tree2d[2 * treepos + bit] = n; /*put the current code in it*/
-          treepos = 0;
-        }
-        else
-        {
-          /*put address of the next step in here, first that address has to be found of course
-          (it's just nodefilled + 1)...*/
-          ++nodefilled;
-          /*addresses encoded with numcodes added to it*/
-          tree->tree2d[2 * treepos + bit] = nodefilled + tree->numcodes;
-          treepos = nodefilled;
-        }
+        unsigned index = reverse | (j << l);
+        /*oversubscribed, see comment in lodepng_error_text*/
+        if(tree->table_len[index] != 0) return 55;
+        tree->table_len[index] = (unsigned char)l;
+        tree->table_value[index] = (unsigned short)i;
+      }
+    }
+    else
+    {
+      unsigned index = reverse & FIRSTMASK;
+      unsigned tablebits = tree->table_len[index] - FIRSTBITS;
+      unsigned start = tree->table_value[index];
+      num = 1u << (tablebits - (l - FIRSTBITS));
+      for(j = 0; j != num; ++j)
+      {
+        unsigned index2 = start + ((reverse >> FIRSTBITS) | (j << (l - FIRSTBITS)));
+        if(tree->table_len[index2] != 0) return 55;
+        tree->table_len[index2] = (unsigned char)l;
+        tree->table_value[index2] = (unsigned short)i;
       }
-      else treepos = tree->tree2d[2 * treepos + bit] - tree->numcodes;
     }
   }
 
-  for(n = 0; n < tree->numcodes * 2; ++n)
+  /*Bit patterns that no code uses, as in incomplete trees or trees with a single
+  code, decode to an invalid symbol, so the error only shows if they are read.*/
+  for(i = 0; i != size; ++i)
   {
-    if(tree->tree2d[n] == 32767) tree->tree2d[n] = 0; /*remove possible remaining 32767's*/
+    if(tree->table_len[i] == 0)
+    {
+      tree->table_len[i] = (unsigned char)(i < headsize ? 1 : FIRSTBITS + 1);
+      tree->table_value[i] = INVALIDSYMBOL;
+    }
   }
 
   return 0;
@@ -644,8 +737,7 @@ static unsigned HuffmanTree_makeFromLengths2(HuffmanTree* tree)
   uivector_cleanup(&blcount);
   uivector_cleanup(&nextcode);
 
-  if(!error) return HuffmanTree_make2DTree(tree);
-  else return error;
+  return error;
 }
 
 /*
@@ -662,7 +754,8 @@ static unsigned HuffmanTree_makeFromLengths(HuffmanTree* tree, const unsigned* b
   for(i = 0; i != numcodes; ++i) tree->lengths[i] = bitlen[i];
   tree->numcodes = (unsigned)numcodes; /*number of symbols*/
   tree->maxbitlen = maxbitlen;
-  return HuffmanTree_makeFromLengths2(tree);
+  CERROR_TRY_RETURN(HuffmanTree_makeFromLengths2(tree));
+  return HuffmanTree_makeTable(tree);
 }
 
 #ifdef LODEPNG_COMPILE_ENCODER
@@ -940,6 +1033,45 @@ static unsigned generateFixedDistanceTree(HuffmanTree* tree)
 
 #ifdef LODEPNG_COMPILE_DECODER
 
+/*
+Return the bits of the stream from bit position bp on, as many as fit in 64 bits
+after dropping the bits before bp in the first byte (at least 57). Past the end of
+the input the bits are 0; callers check bp against the input size afterwards.
+*/
+static unsigned long long peekBits(const unsigned char* in, size_t inlength, size_t bp)
+{
+  size_t p = bp >> 3;
+  unsigned long long result = 0;
+#if defined(__GNUC__) && defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+  if(p + 8 <= inlength)
+  {
+    memcpy(&result, in + p, 8);
+    return result >> (bp & 7u);
+  }
+#endif
+  {
+    unsigned i;
+    for(i = 0; i != 8 && p + i < inlength; ++i) result |= (unsigned long long)in[p + i] << (8u * i);
+  }
+  return result >> (bp & 7u);
+}
+
+/*decode the symbol at the start of bits, setting *used to the length of its code*/
+static unsigned huffmanDecodeBits(const HuffmanTree* codetree, unsigned long long bits, unsigned* used)
+{
+  unsigned index = (unsigned)(bits & FIRSTMASK);
+  unsigned l = codetree->table_len[index];
+  unsigned value = codetree->table_value[index];
+  if(l > FIRSTBITS)
+  {
+    index = value + (unsigned)((bits >> FIRSTBITS) & ((1u << (l - FIRSTBITS)) - 1u));
+    l = codetree->table_len[index];
+    value = codetree->table_value[index];
+  }
+  *used = l;
+  return value;
+}
+
 /*
 returns the code, or (unsigned)(-1) if error happened
 inbitlength is the length of the complete buffer, in bits (so its byte length times 8)
@@ -947,21 +1079,12 @@ inbitlength is the length of the complete buffer, in bits (so its byte length ti
 static unsigned huffmanDecodeSymbol(const unsigned char* in, size_t* bp,
                                     const HuffmanTree* codetree, size_t inbitlength)
 {
-  unsigned treepos = 0, ct;
-  for(;;)
-  {
-    if(*bp >= inbitlength) return (unsigned)(-1); /*error: end of input memory reached without endcode*/
-    /*
-    decode the symbol from the tree. The "readBitFromStream" code is inlined in
-    the expression below because this is the biggest bottleneck while decoding
-    */
-    ct = codetree->tree2d[(treepos << 1) + READBIT(*bp, in)];
-    ++(*bp);
-    if(ct < codetree->numcodes) return ct; /*the symbol is decoded, return it*/
-    else treepos = ct - codetree->numcodes; /*symbol not yet decoded, instead move tree position*/
-
-    if(treepos >= codetree->numcodes) return (unsigned)(-1); /*error: it appeared outside the codetree*/
-  }
+  unsigned used;
+  unsigned code = huffmanDecodeBits(codetree, peekBits(in, inbitlength >> 3, *bp), &used);
+  if(code == INVALIDSYMBOL) return (unsigned)(-1); /*error: a bit pattern no code starts with*/
+  *bp += used;
+  if(*bp > inbitlength) return (unsigned)(-1); /*error: end of input memory reached without endcode*/
+  return code;
 }
 #endif /*LODEPNG_COMPILE_DECODER*/
 
@@ -1127,14 +1250,19 @@ static unsigned getTreeInflateDynamic(HuffmanTree* tree_ll, HuffmanTree* tree_d,
   return error;
 }
 
+/*output bytes between calls to the progress function of LodePNGDecompressSettings*/
+#define LODEPNG_PROGRESS_BYTES 65536
+
 /*inflate a block with dynamic of fixed Huffman tree*/
 static unsigned inflateHuffmanBlock(ucvector* out, const unsigned char* in, size_t* bp,
-                                    size_t* pos, size_t inlength, unsigned btype)
+                                    size_t* pos, size_t inlength, unsigned btype,
+                                    const LodePNGDecompressSettings* settings)
 {
   unsigned error = 0;
   HuffmanTree tree_ll; /*the huffman tree for literal and length codes*/
   HuffmanTree tree_d; /*the huffman tree for distance codes*/
   size_t inbitlength = inlength * 8;
+  size_t nextprogress = settings->progress ? *pos + LODEPNG_PROGRESS_BYTES : (size_t)(-1);
 
   HuffmanTree_init(&tree_ll);
   HuffmanTree_init(&tree_d);
@@ -1144,39 +1272,57 @@ static unsigned inflateHuffmanBlock(ucvector* out, const unsigned char* in, size
 
   while(!error) /*decode all symbols until end reached, breaks at end code*/
   {
+    /*A literal/length code, its extra bits, a distance code and its extra bits take
+    at most 15 + 5 + 15 + 13 = 48 bits, so one 64-bit read covers a whole symbol.*/
+    unsigned long long bits = peekBits(in, inlength, *bp);
+    unsigned used;
     /*code_ll is literal, length or end code*/
-    unsigned code_ll = huffmanDecodeSymbol(in, bp, &tree_ll, inbitlength);
+    unsigned code_ll = huffmanDecodeBits(&tree_ll, bits, &used);
+    bits >>= used;
+    *bp += used;
+
+    /*room for the longest match, so the output only has to grow every so often*/
+    if(out->allocsize < (*pos) + 258)
+    {
+      /*others may be reading the output, so it can't move; it is past expected_size anyway*/
+      if(settings->progress) ERROR_BREAK(91);
+      if(!ucvector_reserve(out, (*pos) + 258)) ERROR_BREAK(83 /*alloc fail*/);
+    }
+    if(*pos >= nextprogress)
+    {
+      settings->progress(out->data, *pos, settings->progress_context);
+      nextprogress = *pos + LODEPNG_PROGRESS_BYTES;
+    }
+
     if(code_ll <= 255) /*literal symbol*/
     {
-      /*ucvector_push_back would do the same, but for some reason the two lines below run 10% faster*/
-      if(!ucvector_resize(out, (*pos) + 1)) ERROR_BREAK(83 /*alloc fail*/);
-      out->data[*pos] = (unsigned char)code_ll;
-      ++(*pos);
+      if(*bp > inbitlength) ERROR_BREAK(10); /*error: end of input memory reached without endcode*/
+      out->data[(*pos)++] = (unsigned char)code_ll;
     }
     else if(code_ll >= FIRST_LENGTH_CODE_INDEX && code_ll <= LAST_LENGTH_CODE_INDEX) /*length code*/
     {
       unsigned code_d, distance;
       unsigned numextrabits_l, numextrabits_d; /*extra bits for length and distance*/
       size_t start, forward, backward, length;
+      unsigned char* dest;
 
       /*part 1: get length base*/
       length = LENGTHBASE[code_ll - FIRST_LENGTH_CODE_INDEX];
 
       /*part 2: get extra bits and add the value of that to length*/
       numextrabits_l = LENGTHEXTRA[code_ll - FIRST_LENGTH_CODE_INDEX];
-      if((*bp + numextrabits_l) > inbitlength) ERROR_BREAK(51); /*error, bit pointer will jump past memory*/
-      length += readBitsFromStream(bp, in, numextrabits_l);
+      length += (size_t)(bits & ((1u << numextrabits_l) - 1u));
+      bits >>= numextrabits_l;
+      *bp += numextrabits_l;
 
       /*part 3: get distance code*/
-      code_d = huffmanDecodeSymbol(in, bp, &tree_d, inbitlength);
+      code_d = huffmanDecodeBits(&tree_d, bits, &used);
+      bits >>= used;
+      *bp += used;
+      if(*bp > inbitlength) ERROR_BREAK(51); /*error, bit pointer will jump past memory*/
       if(code_d > 29)
       {
-        if(code_ll == (unsigned)(-1)) /*huffmanDecodeSymbol returns (unsigned)(-1) in case of error*/
-        {
-          /*return error code 10 or 11 depending on the situation that happened in huffmanDecodeSymbol
-          (10=no endcode, 11=wrong jump outside of tree)*/
-          error = (*bp) > inlength * 8 ? 10 : 11;
-        }
+        if(code_d == INVALIDSYMBOL) error = 11; /*error: a bit pattern no code starts with*/
         else error = 18; /*error: invalid distance code (30-31 are never used)*/
         break;
       }
@@ -1184,37 +1330,47 @@ static unsigned inflateHuffmanBlock(ucvector* out, const unsigned char* in, size
 
       /*part 4: get extra bits from distance*/
       numextrabits_d = DISTANCEEXTRA[code_d];
-      if((*bp + numextrabits_d) > inbitlength) ERROR_BREAK(51); /*error, bit pointer will jump past memory*/
-      distance += readBitsFromStream(bp, in, numextrabits_d);
+      distance += (unsigned)(bits & ((1u << numextrabits_d) - 1u));
+      *bp += numextrabits_d;
+      if(*bp > inbitlength) ERROR_BREAK(51); /*error, bit pointer will jump past memory*/
 
       /*part 5: fill in all the out[n] values based on the length and dist*/
       start = (*pos);
       if(distance > start) ERROR_BREAK(52); /*too long backward distance*/
       backward = start - distance;
+      dest = out->data + start;
 
-      if(!ucvector_resize(out, (*pos) + length)) ERROR_BREAK(83 /*alloc fail*/);
-      if (distance < length) {
-        for(forward = 0; forward < length; ++forward)
-        {
-          out->data[(*pos)++] = out->data[backward++];
-        }
-      } else {
-        memcpy(out->data + *pos, out->data + backward, length);
-        *pos += length;
+      if(distance >= length)
+      {
+        memcpy(dest, out->data + backward, length);
+      }
+      else if(distance >= 8)
+      {
+        /*the source runs into the bytes being written, but 8 byte pieces at least
+        'distance' apart never overlap*/
+        for(forward = 0; forward + 8 <= length; forward += 8) memcpy(dest + forward, dest + forward - distance, 8);
+        for(; forward < length; ++forward) dest[forward] = dest[forward - distance];
+      }
+      else
+      {
+        for(forward = 0; forward < length; ++forward) dest[forward] = out->data[backward + forward];
       }
+      *pos += length;
     }
     else if(code_ll == 256)
     {
+      if(*bp > inbitlength) error = 10; /*error: end of input memory reached without endcode*/
       break; /*end code, break the loop*/
     }
-    else /*if(code == (unsigned)(-1))*/ /*huffmanDecodeSymbol returns (unsigned)(-1) in case of error*/
+    else
     {
-      /*return error code 10 or 11 depending on the situation that happened in huffmanDecodeSymbol
-      (10=no endcode, 11=wrong jump outside of tree)*/
+      /*return error code 10 or 11 depending on the situation
+      (10=no endcode, 11=a bit pattern no code starts with)*/
       error = ((*bp) > inlength * 8) ? 10 : 11;
       break;
     }
   }
+  out->size = *pos;
 
   HuffmanTree_cleanup(&tree_ll);
   HuffmanTree_cleanup(&tree_d);
@@ -1222,7 +1378,8 @@ static unsigned inflateHuffmanBlock(ucvector* out, const unsigned char* in, size
   return error;
 }
 
-static unsigned inflateNoCompression(ucvector* out, const unsigned char* in, size_t* bp, size_t* pos, size_t inlength)
+static unsigned inflateNoCompression(ucvector* out, const unsigned char* in, size_t* bp, size_t* pos, size_t inlength,
+                                     const LodePNGDecompressSettings* settings)
 {
   size_t p;
   unsigned LEN, NLEN, n, error = 0;
@@ -1239,11 +1396,14 @@ static unsigned inflateNoCompression(ucvector* out, const unsigned char* in, siz
   /*check if 16-bit NLEN is really the one's complement of LEN*/
   if(LEN + NLEN != 65535) return 21; /*error: NLEN is not one's complement of LEN*/
 
+  /*the output can't move while others may be reading it*/
+  if(settings->progress && (*pos) + LEN > out->allocsize) return 91;
   if(!ucvector_resize(out, (*pos) + LEN)) return 83; /*alloc fail*/
 
   /*read the literal data: LEN bytes are now stored in the out buffer*/
   if(p + LEN > inlength) return 23; /*error: reading outside of in buffer*/
   for(n = 0; n < LEN; ++n) out->data[(*pos)++] = in[p++];
+  if(settings->progress) settings->progress(out->data, *pos, settings->progress_context);
 
   (*bp) = p * 8;
 
@@ -1260,8 +1420,6 @@ static unsigned lodepng_inflatev(ucvector* out,
   size_t pos = 0; /*byte position in the out buffer*/
   unsigned error = 0;
 
-  (void)settings;
-
   while(!BFINAL)
   {
     unsigned BTYPE;
@@ -1271,11 +1429,12 @@ static unsigned lodepng_inflatev(ucvector* out,
     BTYPE += 2u * readBitFromStream(&bp, in);
 
     if(BTYPE == 3) return 20; /*error: invalid BTYPE*/
-    else if(BTYPE == 0) error = inflateNoCompression(out, in, &bp, &pos, insize); /*no compression*/
-    else error = inflateHuffmanBlock(out, in, &bp, &pos, insize, BTYPE); /*compression, BTYPE 01 or 10*/
+    else if(BTYPE == 0) error = inflateNoCompression(out, in, &bp, &pos, insize, settings); /*no compression*/
+    else error = inflateHuffmanBlock(out, in, &bp, &pos, insize, BTYPE, settings); /*compression, BTYPE 01 or 10*/
 
     if(error) return error;
   }
+  if(settings->progress) settings->progress(out->data, pos, settings->progress_context);
 
   return error;
 }
@@ -1287,6 +1446,12 @@ unsigned lodepng_inflate(unsigned char** out, size_t* outsize,
   unsigned error;
   ucvector v;
   ucvector_init_buffer(&v, *out, *outsize);
+  /*the Huffman decoder keeps room for one longest match ahead, so add that to the
+  expected size too or the last symbols would regrow the buffer*/
+  if(settings->expected_size && !ucvector_reserve(&v, *outsize + settings->expected_size + 258))
+  {
+    return 83; /*alloc fail*/
+  }
   error = lodepng_inflatev(&v, in, insize, settings);
   *out = v.data;
   *outsize = v.size;
@@ -1363,6 +1528,7 @@ static void addLengthDistance(uivector* values, size_t length, size_t distance)
 bytes as input because 3 is the minimum match length for deflate*/
 static const unsigned HASH_NUM_VALUES = 65536;
 static const unsigned HASH_BIT_MASK = 65535; /*HASH_NUM_VALUES - 1, but C90 does not like that as initializer*/
+#define HASH_BITS 16u /*log2(HASH_NUM_VALUES)*/
 
 typedef struct Hash
 {
@@ -1378,9 +1544,8 @@ typedef struct Hash
   unsigned short* zeros; /*length of zeros streak, used as a second hash chain*/
 } Hash;
 
-static unsigned hash_init(Hash* hash, unsigned windowsize)
+static unsigned hash_alloc(Hash* hash, unsigned windowsize)
 {
-  unsigned i;
   hash->head = (int*)lodepng_malloc(sizeof(int) * HASH_NUM_VALUES);
   hash->val = (int*)lodepng_malloc(sizeof(int) * windowsize);
   hash->chain = (unsigned short*)lodepng_malloc(sizeof(unsigned short) * windowsize);
@@ -1393,6 +1558,12 @@ static unsigned hash_init(Hash* hash, unsigned windowsize)
   {
     return 83; /*alloc fail*/
   }
+  return 0;
+}
+
+static void hash_reset(Hash* hash, unsigned windowsize)
+{
+  unsigned i;
 
   /*initialize hash table*/
   for(i = 0; i != HASH_NUM_VALUES; ++i) hash->head[i] = -1;
@@ -1401,8 +1572,13 @@ static unsigned hash_init(Hash* hash, unsigned windowsize)
 
   for(i = 0; i <= MAX_SUPPORTED_DEFLATE_LENGTH; ++i) hash->headz[i] = -1;
   for(i = 0; i != windowsize; ++i) hash->chainz[i] = i; /*same value as index indicates uninitialized*/
+}
 
-  return 0;
+static unsigned hash_init(Hash* hash, unsigned windowsize)
+{
+  unsigned error = hash_alloc(hash, windowsize);
+  if(!error) hash_reset(hash, windowsize);
+  return error;
 }
 
 static void hash_cleanup(Hash* hash)
@@ -1416,6 +1592,47 @@ static void hash_cleanup(Hash* hash)
   lodepng_free(hash->chainz);
 }
 
+struct LodePNGDeflateCache
+{
+  Hash hash;
+  unsigned windowsize; /*size the hash was allocated for, 0 if not allocated yet*/
+};
+
+LodePNGDeflateCache* lodepng_deflate_cache_new(void)
+{
+  LodePNGDeflateCache* cache = (LodePNGDeflateCache*)lodepng_malloc(sizeof(LodePNGDeflateCache));
+  if(cache) cache->windowsize = 0;
+  return cache;
+}
+
+void lodepng_deflate_cache_free(LodePNGDeflateCache* cache)
+{
+  if(!cache) return;
+  if(cache->windowsize) hash_cleanup(&cache->hash);
+  lodepng_free(cache);
+}
+
+/*get the cached hash ready for a new stream, reallocating it only if the window size changed*/
+static unsigned deflate_cache_hash(Hash** hash, LodePNGDeflateCache* cache, unsigned windowsize)
+{
+  if(cache->windowsize != windowsize)
+  {
+    unsigned error;
+    if(cache->windowsize) hash_cleanup(&cache->hash);
+    cache->windowsize = 0;
+    error = hash_alloc(&cache->hash, windowsize);
+    if(error)
+    {
+      hash_cleanup(&cache->hash);
+      return error;
+    }
+    cache->windowsize = windowsize;
+  }
+  hash_reset(&cache->hash, windowsize);
+  *hash = &cache->hash;
+  return 0;
+}
+
 
 
 static unsigned getHash(const unsigned char* data, size_t size, size_t pos)
@@ -1423,13 +1640,11 @@ static unsigned getHash(const unsigned char* data, size_t size, size_t pos)
   unsigned result = 0;
   if(pos + 2 < size)
   {
-    /*A simple shift and xor hash is used. Since the data of PNGs is dominated
-    by zeroes due to the filters, a better hash does not have a significant
-    effect on speed in traversing the chain, and causes more time spend on
-    calculating the hash.*/
-    result ^= (unsigned)(data[pos + 0] << 0u);
-    result ^= (unsigned)(data[pos + 1] << 4u);
-    result ^= (unsigned)(data[pos + 2] << 8u);
+    /*Multiplicative (Fibonacci) hash of the next 3 bytes: the top bits of the product
+    depend on all of them, so chains stay short on non-zero data. A run of zeros still
+    hashes to 0, which the zeros chain relies on.*/
+    unsigned bytes = (unsigned)data[pos + 0] | ((unsigned)data[pos + 1] << 8u) | ((unsigned)data[pos + 2] << 16u);
+    return ((bytes * 2654435761u) & 0xffffffffu) >> (32u - HASH_BITS);
   } else {
     size_t amount, i;
     if(pos >= size) return 0;
@@ -1462,6 +1677,34 @@ static void updateHashChain(Hash* hash, size_t wpos, unsigned hashval, unsigned
   hash->headz[numzeros] = wpos;
 }
 
+/*
+Return the first position from 'fore' up to 'last' where the bytes differ from those
+starting at 'back'. Compares 8 bytes at a time where unaligned 64-bit loads are cheap.
+*/
+static const unsigned char* matchEnd(const unsigned char* fore, const unsigned char* back,
+                                     const unsigned char* last)
+{
+#if defined(__GNUC__) && defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+  while(last - fore >= 8)
+  {
+    unsigned long long a, b, diff;
+    memcpy(&a, fore, 8);
+    memcpy(&b, back, 8);
+    diff = a ^ b;
+    /*the lowest set bit belongs to the first differing byte on little endian*/
+    if(diff) return fore + (__builtin_ctzll(diff) >> 3);
+    fore += 8;
+    back += 8;
+  }
+#endif
+  while(fore != last && *back == *fore)
+  {
+    ++back;
+    ++fore;
+  }
+  return fore;
+}
+
 /*
 LZ77-encode the data. Return value is error code. The input are raw bytes, the output
 is in the form of unsigned integers with codes representing for example literal bytes, or
@@ -1473,12 +1716,13 @@ this hash technique is one out of several ways to speed this up.
 */
 static unsigned encodeLZ77(uivector* out, Hash* hash,
                            const unsigned char* in, size_t inpos, size_t insize, unsigned windowsize,
-                           unsigned minmatch, unsigned nicematch, unsigned lazymatching)
+                           unsigned minmatch, unsigned nicematch, unsigned lazymatching,
+                           unsigned chainlength)
 {
   size_t pos;
   unsigned i, error = 0;
   /*for large window lengths, assume the user wants no compression loss. Otherwise, max hash chain length speedup.*/
-  unsigned maxchainlength = windowsize >= 8192 ? windowsize : windowsize / 8;
+  unsigned maxchainlength = chainlength ? chainlength : windowsize >= 8192 ? windowsize : windowsize / 8;
   unsigned maxlazymatch = windowsize >= 8192 ? MAX_SUPPORTED_DEFLATE_LENGTH : 64;
 
   unsigned usezeros = 1; /*not sure if setting it to false for windowsize < 8192 is better or worse*/
@@ -1550,11 +1794,7 @@ static unsigned encodeLZ77(uivector* out, Hash* hash,
           foreptr += skip;
         }
 
-        while(foreptr != lastptr && *backptr == *foreptr) /*maximum supported length by deflate is max length*/
-        {
-          ++backptr;
-          ++foreptr;
-        }
+        foreptr = matchEnd(foreptr, backptr, lastptr); /*maximum supported length by deflate is max length*/
         current_length = (unsigned)(foreptr - &in[pos]);
 
         if(current_length > length)
@@ -1783,7 +2023,8 @@ static unsigned deflateDynamic(ucvector* out, size_t* bp, Hash* hash,
     if(settings->use_lz77)
     {
       error = encodeLZ77(&lz77_encoded, hash, data, datapos, dataend, settings->windowsize,
-                         settings->minmatch, settings->nicematch, settings->lazymatching);
+                         settings->minmatch, settings->nicematch, settings->lazymatching,
+                       settings->maxchainlength);
       if(error) break;
     }
     else
@@ -1993,7 +2234,8 @@ static unsigned deflateFixed(ucvector* out, size_t* bp, Hash* hash,
     uivector lz77_encoded;
     uivector_init(&lz77_encoded);
     error = encodeLZ77(&lz77_encoded, hash, data, datapos, dataend, settings->windowsize,
-                       settings->minmatch, settings->nicematch, settings->lazymatching);
+                       settings->minmatch, settings->nicematch, settings->lazymatching,
+                       settings->maxchainlength);
     if(!error) writeLZ77data(bp, out, &lz77_encoded, &tree_ll, &tree_d);
     uivector_cleanup(&lz77_encoded);
   }
@@ -2014,17 +2256,20 @@ static unsigned deflateFixed(ucvector* out, size_t* bp, Hash* hash,
   return error;
 }
 
-static unsigned lodepng_deflatev(ucvector* out, const unsigned char* in, size_t insize,
-                                 const LodePNGCompressSettings* settings)
+/*
+Deflate in[start..end) as a series of blocks with the given hash, which may
+already hold the bytes before 'start' so that matches can reach back into them.
+The last block is marked final only if 'final' is set.
+*/
+static unsigned deflateBlocks(ucvector* out, size_t* bp, Hash* hash,
+                              const unsigned char* in, size_t start, size_t end,
+                              const LodePNGCompressSettings* settings, unsigned final)
 {
   unsigned error = 0;
   size_t i, blocksize, numdeflateblocks;
-  size_t bp = 0; /*the bit pointer*/
-  Hash hash;
+  size_t insize = end - start;
 
-  if(settings->btype > 2) return 61;
-  else if(settings->btype == 0) return deflateNoCompression(out, in, insize);
-  else if(settings->btype == 1) blocksize = insize;
+  if(settings->btype == 1) blocksize = insize;
   else /*if(settings->btype == 2)*/
   {
     /*on PNGs, deflate blocks of 65-262k seem to give most dense encoding*/
@@ -2036,25 +2281,179 @@ static unsigned lodepng_deflatev(ucvector* out, const unsigned char* in, size_t
   numdeflateblocks = (insize + blocksize - 1) / blocksize;
   if(numdeflateblocks == 0) numdeflateblocks = 1;
 
+  for(i = 0; i != numdeflateblocks && !error; ++i)
+  {
+    unsigned blockfinal = final && (i == numdeflateblocks - 1);
+    size_t blockstart = start + i * blocksize;
+    size_t blockend = blockstart + blocksize;
+    if(blockend > end) blockend = end;
+
+    if(settings->btype == 1) error = deflateFixed(out, bp, hash, in, blockstart, blockend, settings, blockfinal);
+    else if(settings->btype == 2) error = deflateDynamic(out, bp, hash, in, blockstart, blockend, settings, blockfinal);
+  }
+
+  return error;
+}
+
+static unsigned lodepng_deflatev(ucvector* out, const unsigned char* in, size_t insize,
+                                 const LodePNGCompressSettings* settings)
+{
+  unsigned error = 0;
+  size_t bp = 0; /*the bit pointer*/
+  Hash hash;
+
+  if(settings->btype > 2) return 61;
+  else if(settings->btype == 0) return deflateNoCompression(out, in, insize);
+
+  if(settings->cache)
+  {
+    Hash* cached;
+    error = deflate_cache_hash(&cached, settings->cache, settings->windowsize);
+    if(!error) error = deflateBlocks(out, &bp, cached, in, 0, insize, settings, 1);
+    return error;
+  }
+
   error = hash_init(&hash, settings->windowsize);
   if(error) return error;
 
-  for(i = 0; i != numdeflateblocks && !error; ++i)
-  {
-    unsigned final = (i == numdeflateblocks - 1);
-    size_t start = i * blocksize;
-    size_t end = start + blocksize;
-    if(end > insize) end = insize;
+  error = deflateBlocks(out, &bp, &hash, in, 0, insize, settings, 1);
+
+  hash_cleanup(&hash);
 
-    if(settings->btype == 1) error = deflateFixed(out, &bp, &hash, in, start, end, settings, final);
-    else if(settings->btype == 2) error = deflateDynamic(out, &bp, &hash, in, start, end, settings, final);
+  return error;
+}
+
+#ifdef LODEPNG_COMPILE_THREADS
+
+/*the smallest piece of data worth deflating on its own thread*/
+#define PARALLEL_DEFLATE_MIN_CHUNK 131072
+
+/*
+Enter the bytes in[start..end) into the hash chains without encoding them, the
+same way encodeLZ77 does. Priming a chunk's hash with the window before it lets
+its matches reach back across the chunk boundary, like pigz's dictionary.
+*/
+static void hash_prime(Hash* hash, const unsigned char* in, size_t start, size_t end,
+                       size_t insize, unsigned windowsize)
+{
+  size_t pos;
+  unsigned numzeros = 0;
+  for(pos = start; pos < end; ++pos)
+  {
+    unsigned hashval = getHash(in, insize, pos);
+    if(hashval == 0)
+    {
+      if(numzeros == 0) numzeros = countZeros(in, insize, pos);
+      else if(pos + numzeros > insize || in[pos + numzeros - 1] != 0) --numzeros;
+    }
+    else
+    {
+      numzeros = 0;
+    }
+    updateHashChain(hash, pos & (windowsize - 1), hashval, numzeros);
   }
+}
+
+/*one chunk of a parallel deflate, with its own output and adler32*/
+typedef struct DeflateJob
+{
+  const unsigned char* in;
+  size_t start;
+  size_t end;
+  unsigned final; /*whether this is the last chunk of the stream*/
+  const LodePNGCompressSettings* settings;
+  ucvector out;
+  unsigned adler;
+  unsigned error;
+} DeflateJob;
+
+static unsigned update_adler32(unsigned adler, const unsigned char* data, unsigned len);
 
+static void* deflateJob(void* arg)
+{
+  DeflateJob* job = (DeflateJob*)arg;
+  unsigned windowsize = job->settings->windowsize;
+  size_t bp = 0;
+  Hash hash;
+
+  job->error = hash_init(&hash, windowsize);
+  if(!job->error)
+  {
+    hash_prime(&hash, job->in, job->start > windowsize ? job->start - windowsize : 0, job->start,
+               job->end, windowsize);
+    job->error = deflateBlocks(&job->out, &bp, &hash, job->in, job->start, job->end, job->settings, job->final);
+  }
   hash_cleanup(&hash);
 
+  if(!job->error && !job->final)
+  {
+    /*sync flush: an empty stored block brings the chunk to a byte boundary so the
+    next chunk's bits can simply be appended*/
+    ucvector* out = &job->out;
+    addBitToStream(&bp, out, 0); /*BFINAL*/
+    addBitToStream(&bp, out, 0); /*BTYPE 00*/
+    addBitToStream(&bp, out, 0);
+    if(!ucvector_push_back(out, 0) || !ucvector_push_back(out, 0)
+       || !ucvector_push_back(out, 255) || !ucvector_push_back(out, 255))
+    {
+      job->error = 83; /*alloc fail*/
+    }
+  }
+
+  job->adler = update_adler32(1L, job->in + job->start, (unsigned)(job->end - job->start));
+  return 0;
+}
+
+/*
+Deflate 'in' as one chunk per thread, each compressed on its own and ended with a
+sync flush, then join the chunks. Also returns the adler32 of 'in', combined from
+the adler32 of each chunk. Sets *count to the number of chunks, or to 0 without doing
+anything if the data is too small to be worth splitting.
+*/
+static unsigned deflateParallel(ucvector* out, unsigned* adler, unsigned* count,
+                                const unsigned char* in, size_t insize,
+                                const LodePNGCompressSettings* settings)
+{
+  DeflateJob jobs[LODEPNG_MAX_THREADS];
+  unsigned i, numjobs = settings->num_threads;
+  unsigned error = 0;
+
+  *count = 0;
+  if(numjobs > LODEPNG_MAX_THREADS) numjobs = LODEPNG_MAX_THREADS;
+  if(numjobs > insize / PARALLEL_DEFLATE_MIN_CHUNK) numjobs = (unsigned)(insize / PARALLEL_DEFLATE_MIN_CHUNK);
+  if(numjobs < 2 || settings->btype == 0 || settings->btype > 2) return 0;
+  *count = numjobs;
+
+  for(i = 0; i != numjobs; ++i)
+  {
+    jobs[i].in = in;
+    jobs[i].start = insize / numjobs * i;
+    jobs[i].end = i == numjobs - 1 ? insize : insize / numjobs * (i + 1);
+    jobs[i].final = i == numjobs - 1;
+    jobs[i].settings = settings;
+    ucvector_init(&jobs[i].out);
+  }
+
+  lodepng_run_jobs(deflateJob, jobs, sizeof(DeflateJob), numjobs);
+
+  *adler = 1L;
+  for(i = 0; i != numjobs; ++i)
+  {
+    size_t j;
+    if(!error) error = jobs[i].error;
+    for(j = 0; !error && j != jobs[i].out.size; ++j)
+    {
+      if(!ucvector_push_back(out, jobs[i].out.data[j])) error = 83; /*alloc fail*/
+    }
+    *adler = lodepng_adler32_combine(*adler, jobs[i].adler, jobs[i].end - jobs[i].start);
+    ucvector_cleanup(&jobs[i].out);
+  }
+
   return error;
 }
 
+#endif /*LODEPNG_COMPILE_THREADS*/
+
 unsigned lodepng_deflate(unsigned char** out, size_t* outsize,
                          const unsigned char* in, size_t insize,
                          const LodePNGCompressSettings* settings)
@@ -2088,11 +2487,58 @@ static unsigned deflate(unsigned char** out, size_t* outsize,
 /* / Adler32                                                                  */
 /* ////////////////////////////////////////////////////////////////////////// */
 
+#ifdef LODEPNG_SIMD_SSE2
+/*
+Adler32 sums of 16 byte blocks at a time: s1 grows by the byte sum of each block, and
+s2 by 16 times s1 before the block plus the bytes weighted 16 down to 1. At most 5552
+bytes are summed between reductions, like the scalar loop. Returns the number of bytes
+done; the rest is left for the scalar loop.
+*/
+static size_t adler32SSE2(unsigned* s1, unsigned* s2, const unsigned char* data, size_t len)
+{
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i weightslo = _mm_setr_epi16(16, 15, 14, 13, 12, 11, 10, 9);
+  const __m128i weightshi = _mm_setr_epi16(8, 7, 6, 5, 4, 3, 2, 1);
+  size_t blocks = len / 16;
+  size_t done = blocks * 16;
+
+  while(blocks > 0)
+  {
+    unsigned sums[4];
+    size_t n = blocks > 5552 / 16 ? 5552 / 16 : blocks;
+    __m128i vs1 = zero, vs2 = zero;
+    __m128i prev = _mm_cvtsi32_si128((int)(*s1 * n)); /*s1 before each block, summed*/
+    blocks -= n;
+    for(; n > 0; --n, data += 16)
+    {
+      __m128i x = _mm_loadu_si128((const __m128i*)data);
+      prev = _mm_add_epi32(prev, vs1);
+      vs1 = _mm_add_epi32(vs1, _mm_sad_epu8(x, zero));
+      vs2 = _mm_add_epi32(vs2, _mm_madd_epi16(_mm_unpacklo_epi8(x, zero), weightslo));
+      vs2 = _mm_add_epi32(vs2, _mm_madd_epi16(_mm_unpackhi_epi8(x, zero), weightshi));
+    }
+    vs2 = _mm_add_epi32(vs2, _mm_slli_epi32(prev, 4));
+    _mm_storeu_si128((__m128i*)sums, vs1);
+    *s1 = (*s1 + sums[0] + sums[2]) % 65521;
+    _mm_storeu_si128((__m128i*)sums, vs2);
+    *s2 = (*s2 + sums[0] + sums[1] + sums[2] + sums[3]) % 65521;
+  }
+  return done;
+}
+#endif /*LODEPNG_SIMD_SSE2*/
+
 static unsigned update_adler32(unsigned adler, const unsigned char* data, unsigned len)
 {
    unsigned s1 = adler & 0xffff;
    unsigned s2 = (adler >> 16) & 0xffff;
 
+#ifdef LODEPNG_SIMD_SSE2
+  {
+    size_t done = adler32SSE2(&s1, &s2, data, len);
+    data += done;
+    len -= (unsigned)done;
+  }
+#endif /*LODEPNG_SIMD_SSE2*/
   while(len > 0)
   {
     /*at least 5550 sums can be done before the sums overflow, saving a lot of module divisions*/
@@ -2117,6 +2563,32 @@ static unsigned adler32(const unsigned char* data, unsigned len)
   return update_adler32(1L, data, len);
 }
 
+unsigned lodepng_adler32_update(unsigned adler, const unsigned char* data, size_t len)
+{
+  while(len > 0)
+  {
+    unsigned amount = len > 1073741824u ? 1073741824u : (unsigned)len;
+    adler = update_adler32(adler, data, amount);
+    data += amount;
+    len -= amount;
+  }
+  return adler;
+}
+
+unsigned lodepng_adler32_combine(unsigned adler1, unsigned adler2, size_t len2)
+{
+  unsigned rem = (unsigned)(len2 % 65521);
+  unsigned s1 = adler1 & 0xffff;
+  unsigned s2 = (rem * s1) % 65521;
+  s1 += (adler2 & 0xffff) + 65521 - 1;
+  s2 += ((adler1 >> 16) & 0xffff) + ((adler2 >> 16) & 0xffff) + 65521 - rem;
+  if(s1 >= 65521) s1 -= 65521;
+  if(s1 >= 65521) s1 -= 65521;
+  if(s2 >= 65521 * 2) s2 -= 65521 * 2;
+  if(s2 >= 65521) s2 -= 65521;
+  return (s2 << 16) | s1;
+}
+
 /* ////////////////////////////////////////////////////////////////////////// */
 /* / Zlib                                                                   / */
 /* ////////////////////////////////////////////////////////////////////////// */
@@ -2210,6 +2682,21 @@ unsigned lodepng_zlib_compress(unsigned char** out, size_t* outsize, const unsig
   ucvector_push_back(&outv, (unsigned char)(CMFFLG >> 8));
   ucvector_push_back(&outv, (unsigned char)(CMFFLG & 255));
 
+#ifdef LODEPNG_COMPILE_THREADS
+  if(settings->num_threads > 1 && !settings->custom_deflate)
+  {
+    unsigned ADLER32, numchunks;
+    error = deflateParallel(&outv, &ADLER32, &numchunks, in, insize, settings);
+    if(numchunks > 1)
+    {
+      if(!error) lodepng_add32bitInt(&outv, ADLER32);
+      *out = outv.data;
+      *outsize = outv.size;
+      return error;
+    }
+  }
+#endif /*LODEPNG_COMPILE_THREADS*/
+
   error = deflate(&deflatedata, &deflatesize, in, insize, settings);
 
   if(!error)
@@ -2279,13 +2766,46 @@ void lodepng_compress_settings_init(LodePNGCompressSettings* settings)
   settings->minmatch = 3;
   settings->nicematch = 128;
   settings->lazymatching = 1;
+  settings->maxchainlength = 0;
+  settings->num_threads = 1;
+  settings->cache = 0;
 
   settings->custom_zlib = 0;
   settings->custom_deflate = 0;
   settings->custom_context = 0;
 }
 
-const LodePNGCompressSettings lodepng_default_compress_settings = {2, 1, DEFAULT_WINDOWSIZE, 3, 128, 1, 0, 0, 0};
+const LodePNGCompressSettings lodepng_default_compress_settings = {2, 1, DEFAULT_WINDOWSIZE, 3, 128, 1, 0, 1, 0, 0, 0, 0};
+
+void lodepng_compress_settings_level(LodePNGCompressSettings* settings, unsigned level)
+{
+  /*windowsize, maxchainlength, nicematch, lazymatching for levels 1 to 9*/
+  static const unsigned presets[9][4] =
+  {
+    {2048, 8, 128, 0},
+    {8192, 16, 128, 0},
+    {8192, 32, 128, 1},
+    {16384, 64, 128, 1},
+    {32768, 128, 128, 1},
+    {32768, 256, 192, 1},
+    {32768, 512, 258, 1},
+    {32768, 1024, 258, 1},
+    {32768, 4096, 258, 1}
+  };
+  if(level > 9) level = 9;
+  settings->use_lz77 = 1;
+  settings->minmatch = 3;
+  if(level == 0)
+  {
+    settings->btype = 0;
+    return;
+  }
+  settings->btype = 2;
+  settings->windowsize = presets[level - 1][0];
+  settings->maxchainlength = presets[level - 1][1];
+  settings->nicematch = presets[level - 1][2];
+  settings->lazymatching = presets[level - 1][3];
+}
 
 
 #endif /*LODEPNG_COMPILE_ENCODER*/
@@ -2299,9 +2819,13 @@ void lodepng_decompress_settings_init(LodePNGDecompressSettings* settings)
   settings->custom_zlib = 0;
   settings->custom_inflate = 0;
   settings->custom_context = 0;
+  settings->expected_size = 0;
+  settings->num_threads = 1;
+  settings->progress = 0;
+  settings->progress_context = 0;
 }
 
-const LodePNGDecompressSettings lodepng_default_decompress_settings = {0, 0, 0, 0};
+const LodePNGDecompressSettings lodepng_default_decompress_settings = {0, 0, 0, 0, 0, 1, 0, 0};
 
 #endif /*LODEPNG_COMPILE_DECODER*/
 
@@ -2355,21 +2879,173 @@ static unsigned lodepng_crc32_table[256] = {
   3009837614u, 3294710456u, 1567103746u,  711928724u, 3020668471u, 3272380065u, 1510334235u,  755167117u
 };
 
-/*Return the CRC of the bytes buf[0..len-1].*/
-unsigned lodepng_crc32(const unsigned char* data, size_t length)
-{
-  unsigned r = 0xffffffffu;
-  size_t i;
-  for(i = 0; i < length; ++i)
+/*
+Tables for taking 8 bytes per step: lodepng_crc32_slices[k][b] is the CRC register
+after byte b followed by k + 1 zero bytes. Filled in on first use.
+*/
+static unsigned lodepng_crc32_slices[7][256];
+
+static void crc32InitSlices(void)
+{
+  unsigned i, k;
+  for(i = 0; i != 256; ++i)
   {
-    r = lodepng_crc32_table[(r ^ data[i]) & 0xff] ^ (r >> 8);
+    unsigned c = lodepng_crc32_table[i];
+    for(k = 0; k != 7; ++k)
+    {
+      c = lodepng_crc32_table[c & 0xff] ^ (c >> 8);
+      lodepng_crc32_slices[k][i] = c;
+    }
   }
-  return r ^ 0xffffffffu;
+}
+
+#ifdef LODEPNG_COMPILE_THREADS
+static pthread_once_t crc32_slices_once = PTHREAD_ONCE_INIT;
+#else /*LODEPNG_COMPILE_THREADS*/
+static int crc32_slices_ready = 0;
+#endif /*LODEPNG_COMPILE_THREADS*/
+
+static unsigned crc32Slice8(unsigned r, const unsigned char* data, size_t length)
+{
+  const unsigned (*S)[256] = (const unsigned (*)[256])lodepng_crc32_slices;
+#ifdef LODEPNG_COMPILE_THREADS
+  pthread_once(&crc32_slices_once, crc32InitSlices);
+#else /*LODEPNG_COMPILE_THREADS*/
+  if(!crc32_slices_ready) { crc32InitSlices(); crc32_slices_ready = 1; }
+#endif /*LODEPNG_COMPILE_THREADS*/
+  for(; length >= 8; length -= 8, data += 8)
+  {
+    unsigned lo = r ^ (data[0] | (data[1] << 8) | (data[2] << 16) | ((unsigned)data[3] << 24));
+    unsigned hi = data[4] | (data[5] << 8) | (data[6] << 16) | ((unsigned)data[7] << 24);
+    r = S[6][lo & 0xff] ^ S[5][(lo >> 8) & 0xff] ^ S[4][(lo >> 16) & 0xff] ^ S[3][lo >> 24]
+      ^ S[2][hi & 0xff] ^ S[1][(hi >> 8) & 0xff] ^ S[0][(hi >> 16) & 0xff] ^ lodepng_crc32_table[hi >> 24];
+  }
+  for(; length > 0; --length) r = lodepng_crc32_table[(r ^ *data++) & 0xff] ^ (r >> 8);
+  return r;
+}
+
+#ifdef LODEPNG_SIMD_SSE2
+/*
+Carry-less multiplication folding (Intel's "Fast CRC Computation Using PCLMULQDQ"):
+four 128-bit lanes are folded forward 64 bytes at a time, then into one lane, then
+reduced to 32 bits with a Barrett reduction. Takes the inverted CRC register like the
+table code; length must be a multiple of 16 and at least 64.
+*/
+__attribute__((target("pclmul,sse4.1")))
+static unsigned crc32PCLMUL(unsigned r, const unsigned char* data, size_t length)
+{
+  const __m128i k1k2 = _mm_set_epi64x(0x01c6e41596ll, 0x0154442bd4ll);
+  const __m128i k3k4 = _mm_set_epi64x(0x00ccaa009ell, 0x01751997d0ll);
+  const __m128i k5 = _mm_set_epi64x(0, 0x0163cd6124ll);
+  const __m128i poly = _mm_set_epi64x(0x01f7011641ll, 0x01db710641ll);
+  const __m128i mask32 = _mm_setr_epi32(-1, 0, -1, 0);
+  __m128i x1 = _mm_loadu_si128((const __m128i*)(data + 0));
+  __m128i x2 = _mm_loadu_si128((const __m128i*)(data + 16));
+  __m128i x3 = _mm_loadu_si128((const __m128i*)(data + 32));
+  __m128i x4 = _mm_loadu_si128((const __m128i*)(data + 48));
+  __m128i t;
+
+  x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128((int)r));
+  for(data += 64, length -= 64; length >= 64; data += 64, length -= 64)
+  {
+    t = _mm_clmulepi64_si128(x1, k1k2, 0x00);
+    x1 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x1, k1k2, 0x11), t),
+                       _mm_loadu_si128((const __m128i*)(data + 0)));
+    t = _mm_clmulepi64_si128(x2, k1k2, 0x00);
+    x2 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x2, k1k2, 0x11), t),
+                       _mm_loadu_si128((const __m128i*)(data + 16)));
+    t = _mm_clmulepi64_si128(x3, k1k2, 0x00);
+    x3 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x3, k1k2, 0x11), t),
+                       _mm_loadu_si128((const __m128i*)(data + 32)));
+    t = _mm_clmulepi64_si128(x4, k1k2, 0x00);
+    x4 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x4, k1k2, 0x11), t),
+                       _mm_loadu_si128((const __m128i*)(data + 48)));
+  }
+
+  /*fold the four lanes into one, then any remaining 16 byte blocks*/
+  t = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+  x1 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x1, k3k4, 0x11), t), x2);
+  t = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+  x1 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x1, k3k4, 0x11), t), x3);
+  t = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+  x1 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x1, k3k4, 0x11), t), x4);
+  for(; length >= 16; data += 16, length -= 16)
+  {
+    t = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+    x1 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x1, k3k4, 0x11), t),
+                       _mm_loadu_si128((const __m128i*)data));
+  }
+
+  /*128 bits to 64, then Barrett reduction to 32*/
+  t = _mm_clmulepi64_si128(x1, k3k4, 0x10);
+  x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), t);
+  t = _mm_srli_si128(x1, 4);
+  x1 = _mm_xor_si128(_mm_clmulepi64_si128(_mm_and_si128(x1, mask32), k5, 0x00), t);
+  t = _mm_clmulepi64_si128(_mm_and_si128(x1, mask32), poly, 0x10);
+  t = _mm_clmulepi64_si128(_mm_and_si128(t, mask32), poly, 0x00);
+  return (unsigned)_mm_extract_epi32(_mm_xor_si128(x1, t), 1);
+}
+
+static int cpuHasPCLMUL(void)
+{
+  return __builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1");
+}
+#endif /*LODEPNG_SIMD_SSE2*/
+
+unsigned lodepng_crc32_update(unsigned crc, const unsigned char* data, size_t length)
+{
+  unsigned r = crc ^ 0xffffffffu;
+#ifdef LODEPNG_SIMD_SSE2
+  if(length >= 64 && cpuHasPCLMUL())
+  {
+    size_t blocks = length & ~(size_t)15;
+    r = crc32PCLMUL(r, data, blocks);
+    data += blocks;
+    length -= blocks;
+  }
+#endif /*LODEPNG_SIMD_SSE2*/
+  return crc32Slice8(r, data, length) ^ 0xffffffffu;
+}
+
+/*Return the CRC of the bytes buf[0..len-1].*/
+unsigned lodepng_crc32(const unsigned char* data, size_t length)
+{
+  return lodepng_crc32_update(0, data, length);
 }
 #else /* !LODEPNG_NO_COMPILE_CRC */
 unsigned lodepng_crc32(const unsigned char* data, size_t length);
 #endif /* !LODEPNG_NO_COMPILE_CRC */
 
+/*product of two polynomials modulo the CRC polynomial, in the reflected bit order*/
+static unsigned crc32MultiplyMod(unsigned a, unsigned b)
+{
+  unsigned m = 1u << 31, p = 0;
+  for(;;)
+  {
+    if(a & m)
+    {
+      p ^= b;
+      if((a & (m - 1)) == 0) break;
+    }
+    m >>= 1;
+    b = b & 1 ? (b >> 1) ^ 0xedb88320u : b >> 1;
+  }
+  return p;
+}
+
+unsigned lodepng_crc32_combine(unsigned crc1, unsigned crc2, size_t len2)
+{
+  /*shift crc1 past len2 bytes by multiplying with x^(8 * len2), built from squares of x^8*/
+  unsigned xpow = 0x00800000u; /*x^8; bit 31 is x^0*/
+  unsigned shift = 0x80000000u; /*x^0*/
+  for(; len2 > 0; len2 >>= 1)
+  {
+    if(len2 & 1) shift = crc32MultiplyMod(xpow, shift);
+    xpow = crc32MultiplyMod(xpow, xpow);
+  }
+  return crc32MultiplyMod(shift, crc1) ^ crc2;
+}
+
 /* ////////////////////////////////////////////////////////////////////////// */
 /* / Reading and writing single bits and bytes from/to stream for LodePNG   / */
 /* ////////////////////////////////////////////////////////////////////////// */
@@ -3283,6 +3959,184 @@ static void getPixelColorRGBA8(unsigned char* r, unsigned char* g,
   }
 }
 
+#ifdef LODEPNG_SIMD_SSE2
+static int cpuHasSSSE3(void)
+{
+  return __builtin_cpu_supports("ssse3");
+}
+
+/*
+Vector conversions to RGBA8 for the input modes images are most often decoded from.
+Each converts whole groups of pixels and returns how many it did, leaving the rest to
+a scalar loop.
+*/
+
+/*8-bit grey, 16 pixels at a time; pixels equal to key (if below 256) get alpha 0*/
+static size_t greyToRGBA8SSE2(unsigned char* out, const unsigned char* in, size_t numpixels, unsigned key)
+{
+  size_t i;
+  __m128i keys = _mm_set1_epi8((char)key);
+  __m128i opaque = _mm_set1_epi8((char)255);
+  for(i = 0; i + 16 <= numpixels; i += 16)
+  {
+    __m128i g = _mm_loadu_si128((const __m128i*)(in + i));
+    __m128i a = key < 256 ? _mm_andnot_si128(_mm_cmpeq_epi8(g, keys), opaque) : opaque;
+    __m128i gg = _mm_unpacklo_epi8(g, g), ga = _mm_unpacklo_epi8(g, a);
+    _mm_storeu_si128((__m128i*)(out + i * 4 + 0), _mm_unpacklo_epi16(gg, ga));
+    _mm_storeu_si128((__m128i*)(out + i * 4 + 16), _mm_unpackhi_epi16(gg, ga));
+    gg = _mm_unpackhi_epi8(g, g);
+    ga = _mm_unpackhi_epi8(g, a);
+    _mm_storeu_si128((__m128i*)(out + i * 4 + 32), _mm_unpacklo_epi16(gg, ga));
+    _mm_storeu_si128((__m128i*)(out + i * 4 + 48), _mm_unpackhi_epi16(gg, ga));
+  }
+  return i;
+}
+
+/*8-bit RGB, 16 pixels from three loads, spread out with byte shuffles*/
+__attribute__((target("ssse3")))
+static size_t rgbToRGBA8SSSE3(unsigned char* out, const unsigned char* in, size_t numpixels)
+{
+  size_t i;
+  __m128i spread = _mm_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+  __m128i opaque = _mm_set1_epi32((int)0xff000000u);
+  for(i = 0; i + 16 <= numpixels; i += 16)
+  {
+    __m128i a = _mm_loadu_si128((const __m128i*)(in + i * 3 + 0));
+    __m128i b = _mm_loadu_si128((const __m128i*)(in + i * 3 + 16));
+    __m128i c = _mm_loadu_si128((const __m128i*)(in + i * 3 + 32));
+    _mm_storeu_si128((__m128i*)(out + i * 4 + 0), _mm_or_si128(_mm_shuffle_epi8(a, spread), opaque));
+    _mm_storeu_si128((__m128i*)(out + i * 4 + 16),
+                     _mm_or_si128(_mm_shuffle_epi8(_mm_alignr_epi8(b, a, 12), spread), opaque));
+    _mm_storeu_si128((__m128i*)(out + i * 4 + 32),
+                     _mm_or_si128(_mm_shuffle_epi8(_mm_alignr_epi8(c, b, 8), spread), opaque));
+    _mm_storeu_si128((__m128i*)(out + i * 4 + 48),
+                     _mm_or_si128(_mm_shuffle_epi8(_mm_srli_si128(c, 4), spread), opaque));
+  }
+  return i;
+}
+
+/*16-bit RGBA, 4 pixels at a time: the big-endian high bytes are packed together*/
+static size_t rgba16ToRGBA8SSE2(unsigned char* out, const unsigned char* in, size_t numpixels)
+{
+  size_t i;
+  __m128i high = _mm_set1_epi16(0x00ff);
+  for(i = 0; i + 4 <= numpixels; i += 4)
+  {
+    __m128i a = _mm_and_si128(_mm_loadu_si128((const __m128i*)(in + i * 8 + 0)), high);
+    __m128i b = _mm_and_si128(_mm_loadu_si128((const __m128i*)(in + i * 8 + 16)), high);
+    _mm_storeu_si128((__m128i*)(out + i * 4), _mm_packus_epi16(a, b));
+  }
+  return i;
+}
+#endif /*LODEPNG_SIMD_SSE2*/
+
+/*palette to RGBA8 through a table of all 256 indices, with the ones past the palette black
+like in getPixelColorsRGBA8. Sub-byte indices are unpacked a whole byte at a time*/
+static void paletteToRGBA8(unsigned char* out, const unsigned char* in, size_t numpixels,
+                           const LodePNGColorMode* mode)
+{
+  unsigned char table[256 * 4];
+  unsigned bits = mode->bitdepth, perbyte = 8 / bits, mask = (1u << bits) - 1u;
+  size_t i, j;
+  for(i = 0; i != 256; ++i)
+  {
+    if(i < mode->palettesize) memcpy(&table[i * 4], &mode->palette[i * 4], 4);
+    else
+    {
+      table[i * 4 + 0] = table[i * 4 + 1] = table[i * 4 + 2] = 0;
+      table[i * 4 + 3] = 255;
+    }
+  }
+
+  if(bits == 8)
+  {
+    for(i = 0; i != numpixels; ++i) memcpy(&out[i * 4], &table[in[i] * 4], 4);
+    return;
+  }
+  for(i = 0; i < numpixels; i += perbyte)
+  {
+    unsigned byte = in[i / perbyte];
+    size_t count = numpixels - i < perbyte ? numpixels - i : perbyte;
+    for(j = 0; j != count; ++j)
+    {
+      unsigned index = (byte >> (8 - bits * (j + 1))) & mask;
+      memcpy(&out[(i + j) * 4], &table[index * 4], 4);
+    }
+  }
+}
+
+/*Convert to RGBA8 if mode is one with a fast path: palette, 8-bit grey, 8-bit RGB
+without color key or 16-bit RGBA. Returns 0 for getPixelColorsRGBA8 to do the rest.*/
+static unsigned getPixelColorsRGBA8Fast(unsigned char* out, const unsigned char* in, size_t numpixels,
+                                        const LodePNGColorMode* mode)
+{
+  size_t i = 0;
+  if(mode->colortype == LCT_PALETTE)
+  {
+    paletteToRGBA8(out, in, numpixels, mode);
+  }
+  else if(mode->colortype == LCT_GREY && mode->bitdepth == 8)
+  {
+    unsigned key = mode->key_defined ? mode->key_r : 256;
+#ifdef LODEPNG_SIMD_SSE2
+    i = greyToRGBA8SSE2(out, in, numpixels, key);
+#endif /*LODEPNG_SIMD_SSE2*/
+    for(; i != numpixels; ++i)
+    {
+      out[i * 4 + 0] = out[i * 4 + 1] = out[i * 4 + 2] = in[i];
+      out[i * 4 + 3] = in[i] == key ? 0 : 255;
+    }
+  }
+  else if(mode->colortype == LCT_RGB && mode->bitdepth == 8 && !mode->key_defined)
+  {
+#ifdef LODEPNG_SIMD_SSE2
+    if(cpuHasSSSE3()) i = rgbToRGBA8SSSE3(out, in, numpixels);
+#endif /*LODEPNG_SIMD_SSE2*/
+    for(; i != numpixels; ++i)
+    {
+      out[i * 4 + 0] = in[i * 3 + 0];
+      out[i * 4 + 1] = in[i * 3 + 1];
+      out[i * 4 + 2] = in[i * 3 + 2];
+      out[i * 4 + 3] = 255;
+    }
+  }
+  else if(mode->colortype == LCT_RGBA && mode->bitdepth == 16)
+  {
+#ifdef LODEPNG_SIMD_SSE2
+    i = rgba16ToRGBA8SSE2(out, in, numpixels);
+#endif /*LODEPNG_SIMD_SSE2*/
+    for(; i != numpixels; ++i)
+    {
+      out[i * 4 + 0] = in[i * 8 + 0];
+      out[i * 4 + 1] = in[i * 8 + 2];
+      out[i * 4 + 2] = in[i * 8 + 4];
+      out[i * 4 + 3] = in[i * 8 + 6];
+    }
+  }
+  else return 0;
+  return 1;
+}
+
+/*Convert 8-bit RGBA to 8-bit grey, or grey with alpha if has_alpha is true. Like
+rgba8ToPixel, the red channel is taken as the grey value.*/
+static void rgba8ToGrey8(unsigned char* out, const unsigned char* in, size_t numpixels,
+                         unsigned has_alpha)
+{
+  size_t i;
+  if(has_alpha)
+  {
+    for(i = 0; i != numpixels; ++i)
+    {
+      out[i * 2 + 0] = in[i * 4 + 0];
+      out[i * 2 + 1] = in[i * 4 + 3];
+    }
+  }
+  else
+  {
+    for(i = 0; i != numpixels; ++i) out[i] = in[i * 4];
+  }
+}
+
 /*Similar to getPixelColorRGBA8, but with all the for loops inside of the color
 mode test cases, optimized to convert the colors much faster, when converting
 to RGBA or RGB with 8 bit per cannel. buffer must be RGBA or RGB output with
@@ -3504,12 +4358,17 @@ unsigned lodepng_convert(unsigned char* out, const unsigned char* in,
   }
   else if(mode_out->bitdepth == 8 && mode_out->colortype == LCT_RGBA)
   {
-    getPixelColorsRGBA8(out, numpixels, 1, in, mode_in);
+    if(!getPixelColorsRGBA8Fast(out, in, numpixels, mode_in)) getPixelColorsRGBA8(out, numpixels, 1, in, mode_in);
   }
   else if(mode_out->bitdepth == 8 && mode_out->colortype == LCT_RGB)
   {
     getPixelColorsRGBA8(out, numpixels, 0, in, mode_in);
   }
+  else if(mode_out->bitdepth == 8 && mode_in->bitdepth == 8 && mode_in->colortype == LCT_RGBA
+          && (mode_out->colortype == LCT_GREY || mode_out->colortype == LCT_GREY_ALPHA))
+  {
+    rgba8ToGrey8(out, in, numpixels, mode_out->colortype == LCT_GREY_ALPHA);
+  }
   else
   {
     unsigned char r = 0, g = 0, b = 0, a = 0;
@@ -3832,11 +4691,54 @@ static unsigned char paethPredictor(short a, short b, short c)
   short pb = abs(a - c);
   short pc = abs(a + b - c - c);
 
-  if(pc < pa && pc < pb) return (unsigned char)c;
-  else if(pb < pa) return (unsigned char)b;
-  else return (unsigned char)a;
+  /*keep the input with the smallest distance, preferring a, then b, then c on ties*/
+  if(pb < pa) { a = b; pa = pb; }
+  return (unsigned char)(pc < pa ? c : a);
+}
+
+#ifdef LODEPNG_SIMD_SSE2
+/*
+Vector helpers for the filters. Pixels of 3 or 4 bytes are moved in and out of
+the low lanes of a register one at a time, since Sub, Average and Paeth
+unfiltering depend on the pixel to the left.
+*/
+static __m128i loadPixel(const unsigned char* p, size_t bytewidth)
+{
+  int v;
+  if(bytewidth == 4) memcpy(&v, p, 4);
+  else v = p[0] | (p[1] << 8) | (p[2] << 16);
+  return _mm_cvtsi32_si128(v);
+}
+
+static void storePixel(unsigned char* p, __m128i v, size_t bytewidth)
+{
+  int x = _mm_cvtsi128_si32(v);
+  if(bytewidth == 4) memcpy(p, &x, 4);
+  else { p[0] = (unsigned char)x; p[1] = (unsigned char)(x >> 8); p[2] = (unsigned char)(x >> 16); }
+}
+
+/*floor((a + b) / 2) per byte; _mm_avg_epu8 rounds up*/
+static __m128i averageFloor(__m128i a, __m128i b)
+{
+  return _mm_sub_epi8(_mm_avg_epu8(a, b), _mm_and_si128(_mm_xor_si128(a, b), _mm_set1_epi8(1)));
 }
 
+static __m128i abs16(__m128i x)
+{
+  return _mm_max_epi16(x, _mm_sub_epi16(_mm_setzero_si128(), x));
+}
+
+/*Paeth predictor of 16-bit lanes given the distances pa, pb and pc, with paethPredictor's tie order*/
+static __m128i paethSelect(__m128i a, __m128i b, __m128i c, __m128i pa, __m128i pb, __m128i pc)
+{
+  __m128i useb = _mm_cmplt_epi16(pb, pa);
+  __m128i nearest = _mm_or_si128(_mm_and_si128(useb, b), _mm_andnot_si128(useb, a));
+  __m128i pnearest = _mm_min_epi16(pa, pb);
+  __m128i usec = _mm_cmplt_epi16(pc, pnearest);
+  return _mm_or_si128(_mm_and_si128(usec, c), _mm_andnot_si128(usec, nearest));
+}
+#endif /*LODEPNG_SIMD_SSE2*/
+
 /*shared values used by multiple Adam7 related functions*/
 
 static const unsigned ADAM7_IX[7] = { 0, 4, 0, 2, 0, 1, 0 }; /*x start values*/
@@ -3960,6 +4862,110 @@ unsigned lodepng_inspect(unsigned* w, unsigned* h, LodePNGState* state,
   return state->error;
 }
 
+#ifdef LODEPNG_SIMD_SSE2
+/*Up for any pixel size, 16 bytes at a time. Returns the index where the scalar loop takes over.*/
+static size_t unfilterUpSSE2(unsigned char* recon, const unsigned char* scanline, const unsigned char* precon,
+                             size_t length)
+{
+  size_t i;
+  for(i = 0; i + 16 <= length; i += 16)
+  {
+    __m128i x = _mm_loadu_si128((const __m128i*)(scanline + i));
+    __m128i b = _mm_loadu_si128((const __m128i*)(precon + i));
+    _mm_storeu_si128((__m128i*)(recon + i), _mm_add_epi8(x, b));
+  }
+  return i;
+}
+
+/*
+Sub, Average and Paeth for 3 and 4 byte pixels, one whole pixel per step. The left
+neighbour a and upper left neighbour c start at zero, which gives the same result as
+the special case for the first pixel of the scalar code.
+*/
+static void unfilterSubSSE2(unsigned char* recon, const unsigned char* scanline, size_t bytewidth, size_t length)
+{
+  size_t i;
+  __m128i a = _mm_setzero_si128();
+  for(i = 0; i != length; i += bytewidth)
+  {
+    a = _mm_add_epi8(loadPixel(scanline + i, bytewidth), a);
+    storePixel(recon + i, a, bytewidth);
+  }
+}
+
+static void unfilterAverageSSE2(unsigned char* recon, const unsigned char* scanline, const unsigned char* precon,
+                                size_t bytewidth, size_t length)
+{
+  size_t i;
+  __m128i a = _mm_setzero_si128();
+  for(i = 0; i != length; i += bytewidth)
+  {
+    __m128i b = loadPixel(precon + i, bytewidth);
+    a = _mm_add_epi8(loadPixel(scanline + i, bytewidth), averageFloor(a, b));
+    storePixel(recon + i, a, bytewidth);
+  }
+}
+
+static void unfilterPaethSSE2(unsigned char* recon, const unsigned char* scanline, const unsigned char* precon,
+                              size_t bytewidth, size_t length)
+{
+  size_t i;
+  __m128i zero = _mm_setzero_si128();
+  __m128i a = zero, c = zero; /*16-bit lanes*/
+  for(i = 0; i != length; i += bytewidth)
+  {
+    __m128i b = _mm_unpacklo_epi8(loadPixel(precon + i, bytewidth), zero);
+    __m128i x = _mm_unpacklo_epi8(loadPixel(scanline + i, bytewidth), zero);
+    __m128i bc = _mm_sub_epi16(b, c);
+    __m128i ac = _mm_sub_epi16(a, c);
+    __m128i predicted = paethSelect(a, b, c, abs16(bc), abs16(ac), abs16(_mm_add_epi16(bc, ac)));
+    a = _mm_and_si128(_mm_add_epi16(x, predicted), _mm_set1_epi16(255));
+    c = b;
+    storePixel(recon + i, _mm_packus_epi16(a, a), bytewidth);
+  }
+}
+
+/*the same with SSSE3's absolute value instruction*/
+__attribute__((target("ssse3")))
+static void unfilterPaethSSSE3(unsigned char* recon, const unsigned char* scanline, const unsigned char* precon,
+                               size_t bytewidth, size_t length)
+{
+  size_t i;
+  __m128i zero = _mm_setzero_si128();
+  __m128i a = zero, c = zero; /*16-bit lanes*/
+  for(i = 0; i != length; i += bytewidth)
+  {
+    __m128i b = _mm_unpacklo_epi8(loadPixel(precon + i, bytewidth), zero);
+    __m128i x = _mm_unpacklo_epi8(loadPixel(scanline + i, bytewidth), zero);
+    __m128i bc = _mm_sub_epi16(b, c);
+    __m128i ac = _mm_sub_epi16(a, c);
+    __m128i predicted = paethSelect(a, b, c, _mm_abs_epi16(bc), _mm_abs_epi16(ac),
+                                    _mm_abs_epi16(_mm_add_epi16(bc, ac)));
+    a = _mm_and_si128(_mm_add_epi16(x, predicted), _mm_set1_epi16(255));
+    c = b;
+    storePixel(recon + i, _mm_packus_epi16(a, a), bytewidth);
+  }
+}
+
+/*Unfilter a scanline that has a line above it with vector code. Returns 0 if the
+scalar code must do it instead.*/
+static int unfilterScanlineSSE2(unsigned char* recon, const unsigned char* scanline, const unsigned char* precon,
+                                size_t bytewidth, unsigned char filterType, size_t length)
+{
+  if(bytewidth != 3 && bytewidth != 4) return 0;
+  switch(filterType)
+  {
+    case 1: unfilterSubSSE2(recon, scanline, bytewidth, length); return 1;
+    case 3: unfilterAverageSSE2(recon, scanline, precon, bytewidth, length); return 1;
+    case 4:
+      if(cpuHasSSSE3()) unfilterPaethSSSE3(recon, scanline, precon, bytewidth, length);
+      else unfilterPaethSSE2(recon, scanline, precon, bytewidth, length);
+      return 1;
+    default: return 0;
+  }
+}
+#endif /*LODEPNG_SIMD_SSE2*/
+
 static unsigned unfilterScanline(unsigned char* recon, const unsigned char* scanline, const unsigned char* precon,
                                  size_t bytewidth, unsigned char filterType, size_t length)
 {
@@ -3973,6 +4979,9 @@ static unsigned unfilterScanline(unsigned char* recon, const unsigned char* scan
   */
 
   size_t i;
+#ifdef LODEPNG_SIMD_SSE2
+  if(precon && unfilterScanlineSSE2(recon, scanline, precon, bytewidth, filterType, length)) return 0;
+#endif /*LODEPNG_SIMD_SSE2*/
   switch(filterType)
   {
     case 0:
@@ -3985,7 +4994,11 @@ static unsigned unfilterScanline(unsigned char* recon, const unsigned char* scan
     case 2:
       if(precon)
       {
-        for(i = 0; i != length; ++i) recon[i] = scanline[i] + precon[i];
+        i = 0;
+#ifdef LODEPNG_SIMD_SSE2
+        i = unfilterUpSSE2(recon, scanline, precon, length);
+#endif /*LODEPNG_SIMD_SSE2*/
+        for(; i != length; ++i) recon[i] = scanline[i] + precon[i];
       }
       else
       {
@@ -4076,7 +5089,24 @@ out must be big enough AND must be 0 everywhere if bpp < 8 in the current implem
 (because that's likely a little bit faster)
 NOTE: comments about padding bits are only relevant if bpp < 8
 */
+static void Adam7_deinterlaceRows(unsigned char* out, const unsigned char* in, unsigned w, unsigned h,
+                                  unsigned bpp, unsigned y0, unsigned y1);
+
 static void Adam7_deinterlace(unsigned char* out, const unsigned char* in, unsigned w, unsigned h, unsigned bpp)
+{
+  Adam7_deinterlaceRows(out, in, w, h, bpp, 0, h);
+}
+
+/*first row of Adam7 pass i that lands on output row y or below*/
+static unsigned Adam7_passrow(unsigned i, unsigned y)
+{
+  return y <= ADAM7_IY[i] ? 0 : (y - ADAM7_IY[i] + ADAM7_DY[i] - 1) / ADAM7_DY[i];
+}
+
+/*Adam7_deinterlace, but only output rows y0 to y1. Different row ranges can be done at
+the same time if they start at multiples of 8, which keeps them in separate bytes*/
+static void Adam7_deinterlaceRows(unsigned char* out, const unsigned char* in, unsigned w, unsigned h,
+                                  unsigned bpp, unsigned y0, unsigned y1)
 {
   unsigned passw[7], passh[7];
   size_t filter_passstart[8], padded_passstart[8], passstart[8];
@@ -4090,7 +5120,8 @@ static void Adam7_deinterlace(unsigned char* out, const unsigned char* in, unsig
     {
       unsigned x, y, b;
       size_t bytewidth = bpp / 8;
-      for(y = 0; y < passh[i]; ++y)
+      unsigned yend = Adam7_passrow(i, y1) < passh[i] ? Adam7_passrow(i, y1) : passh[i];
+      for(y = Adam7_passrow(i, y0); y < yend; ++y)
       for(x = 0; x < passw[i]; ++x)
       {
         size_t pixelinstart = passstart[i] + (y * passw[i] + x) * bytewidth;
@@ -4110,7 +5141,8 @@ static void Adam7_deinterlace(unsigned char* out, const unsigned char* in, unsig
       unsigned ilinebits = bpp * passw[i];
       unsigned olinebits = bpp * w;
       size_t obp, ibp; /*bit pointers (for out and in buffer)*/
-      for(y = 0; y < passh[i]; ++y)
+      unsigned yend = Adam7_passrow(i, y1) < passh[i] ? Adam7_passrow(i, y1) : passh[i];
+      for(y = Adam7_passrow(i, y0); y < yend; ++y)
       for(x = 0; x < passw[i]; ++x)
       {
         ibp = (8 * passstart[i]) + (y * ilinebits + x * bpp);
@@ -4206,6 +5238,265 @@ static unsigned postProcessScanlines(unsigned char* out, unsigned char* in,
   return 0;
 }
 
+#ifdef LODEPNG_COMPILE_THREADS
+
+/*images with less image data than this are decoded on one thread, since starting threads
+would cost more than they save*/
+#define LODEPNG_PARALLEL_DECODE_BYTES 262144
+
+/*the inflated image data as the inflating thread hands it to the unfiltering threads*/
+typedef struct DecodeFeed
+{
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  const unsigned char* data;
+  size_t size; /*bytes inflated so far*/
+  unsigned done; /*inflating has finished, successfully or not*/
+} DecodeFeed;
+
+static void decodeFeedProgress(const unsigned char* data, size_t size, void* context)
+{
+  DecodeFeed* feed = (DecodeFeed*)context;
+  pthread_mutex_lock(&feed->mutex);
+  feed->data = data;
+  feed->size = size;
+  pthread_cond_broadcast(&feed->cond);
+  pthread_mutex_unlock(&feed->mutex);
+}
+
+/*wait until at least size bytes are inflated, return them and set *available to how many
+there are. Returns null if inflating ended with fewer bytes*/
+static const unsigned char* decodeFeedWait(DecodeFeed* feed, size_t size, size_t* available)
+{
+  const unsigned char* data;
+  pthread_mutex_lock(&feed->mutex);
+  while(feed->size < size && !feed->done) pthread_cond_wait(&feed->cond, &feed->mutex);
+  data = feed->size >= size ? feed->data : 0;
+  *available = feed->size;
+  pthread_mutex_unlock(&feed->mutex);
+  return data;
+}
+
+/*unfilter like unfilter() the image whose scanlines start start bytes into the inflated
+data, taking each scanline as soon as it has been inflated*/
+static unsigned unfilterFed(unsigned char* out, DecodeFeed* feed, size_t start,
+                            unsigned w, unsigned h, unsigned bpp)
+{
+  unsigned y;
+  unsigned char* prevline = 0;
+  const unsigned char* in = 0;
+  size_t available = 0;
+  size_t bytewidth = (bpp + 7) / 8;
+  size_t linebytes = (w * bpp + 7) / 8;
+
+  for(y = 0; y < h; ++y)
+  {
+    size_t outindex = linebytes * y;
+    size_t inindex = start + (1 + linebytes) * y;
+    if(inindex + 1 + linebytes > available)
+    {
+      in = decodeFeedWait(feed, inindex + 1 + linebytes, &available);
+      if(!in) return 91; /*the image data ended early*/
+    }
+
+    CERROR_TRY_RETURN(unfilterScanline(&out[outindex], &in[inindex + 1], prevline, bytewidth, in[inindex], linebytes));
+
+    prevline = &out[outindex];
+  }
+
+  return 0;
+}
+
+/*what all jobs of decodeParallel share*/
+typedef struct DecodeWork
+{
+  DecodeFeed feed;
+  ucvector* scanlines;
+  const unsigned char* idat;
+  size_t idatsize;
+  const LodePNGDecompressSettings* settings;
+  unsigned char* unfiltered; /*scanlines without filter bytes*/
+  unsigned char* packed; /*Adam7 passes without padding bits, may be the same as unfiltered*/
+  unsigned w, h, bpp;
+  unsigned interlaced;
+  unsigned numunfilter; /*number of unfiltering jobs*/
+  unsigned passw[7], passh[7];
+  size_t filter_passstart[8], padded_passstart[8], passstart[8];
+} DecodeWork;
+
+/*job 0 inflates, the others unfilter: the whole image, or every numunfilter'th Adam7 pass*/
+typedef struct DecodeJob
+{
+  DecodeWork* work;
+  unsigned index;
+  unsigned error;
+} DecodeJob;
+
+static void* decodeJob(void* arg)
+{
+  DecodeJob* job = (DecodeJob*)arg;
+  DecodeWork* work = job->work;
+  unsigned i;
+
+  if(job->index == 0)
+  {
+    job->error = zlib_decompress(&work->scanlines->data, &work->scanlines->size, work->idat,
+                                 work->idatsize, work->settings);
+    pthread_mutex_lock(&work->feed.mutex);
+    /*custom zlib decoders may never have reported progress*/
+    if(!job->error)
+    {
+      work->feed.data = work->scanlines->data;
+      work->feed.size = work->scanlines->size;
+    }
+    work->feed.done = 1;
+    pthread_cond_broadcast(&work->feed.cond);
+    pthread_mutex_unlock(&work->feed.mutex);
+  }
+  else if(!work->interlaced)
+  {
+    job->error = unfilterFed(work->unfiltered, &work->feed, 0, work->w, work->h, work->bpp);
+  }
+  else
+  {
+    for(i = job->index - 1; i < 7 && !job->error; i += work->numunfilter)
+    {
+      job->error = unfilterFed(&work->unfiltered[work->padded_passstart[i]], &work->feed,
+                               work->filter_passstart[i], work->passw[i], work->passh[i], work->bpp);
+      if(!job->error && work->bpp < 8)
+      {
+        removePaddingBits(&work->packed[work->passstart[i]], &work->unfiltered[work->padded_passstart[i]],
+                          work->passw[i] * work->bpp, ((work->passw[i] * work->bpp + 7) / 8) * 8, work->passh[i]);
+      }
+    }
+  }
+  return 0;
+}
+
+/*one band of output rows for Adam7_deinterlaceRows*/
+typedef struct DeinterlaceJob
+{
+  unsigned char* out;
+  const unsigned char* in;
+  unsigned w, h, bpp;
+  unsigned y0, y1;
+} DeinterlaceJob;
+
+static void* deinterlaceJob(void* arg)
+{
+  DeinterlaceJob* job = (DeinterlaceJob*)arg;
+  Adam7_deinterlaceRows(job->out, job->in, job->w, job->h, job->bpp, job->y0, job->y1);
+  return 0;
+}
+
+/*
+zlib_decompress and postProcessScanlines together, on settings->num_threads threads: the
+scanlines are unfiltered as soon as they are inflated, Adam7 passes each on their own
+thread, and then Adam7 images are deinterlaced in bands of rows. out must be zeroed and
+settings->expected_size set. Image data that inflates to more than expected_size fails with
+error 91 here, where the serial decoder may give another error code for it.
+*/
+static unsigned decodeParallel(unsigned char* out, ucvector* scanlines,
+                               const unsigned char* idat, size_t idatsize,
+                               unsigned w, unsigned h, const LodePNGInfo* info_png,
+                               const LodePNGDecompressSettings* settings)
+{
+  DecodeWork work;
+  DecodeJob jobs[8];
+  DeinterlaceJob bands[LODEPNG_MAX_THREADS];
+  LodePNGDecompressSettings zlibsettings = *settings;
+  unsigned i, numjobs, numbands, error = 0;
+  unsigned bpp = lodepng_get_bpp(&info_png->color);
+  size_t linebits = (size_t)w * bpp;
+  if(bpp == 0) return 31; /*error: invalid colortype*/
+
+  work.scanlines = scanlines;
+  work.idat = idat;
+  work.idatsize = idatsize;
+  work.settings = &zlibsettings;
+  work.w = w;
+  work.h = h;
+  work.bpp = bpp;
+  work.interlaced = info_png->interlace_method != 0;
+  work.unfiltered = work.packed = 0;
+  if(!work.interlaced)
+  {
+    /*with padding bits the scanlines have to be unfiltered apart and then packed into out*/
+    if(bpp < 8 && linebits % 8 != 0) work.unfiltered = (unsigned char*)lodepng_malloc(((linebits + 7) / 8) * h);
+    else work.unfiltered = out;
+    work.numunfilter = 1;
+  }
+  else
+  {
+    Adam7_getpassvalues(work.passw, work.passh, work.filter_passstart, work.padded_passstart, work.passstart,
+                        w, h, bpp);
+    work.unfiltered = (unsigned char*)lodepng_malloc(work.padded_passstart[7]);
+    work.packed = bpp < 8 ? (unsigned char*)lodepng_malloc(work.passstart[7]) : work.unfiltered;
+    work.numunfilter = settings->num_threads - 1 < 7 ? settings->num_threads - 1 : 7;
+  }
+  if(!work.unfiltered || (work.interlaced && !work.packed))
+  {
+    if(work.unfiltered != out) lodepng_free(work.unfiltered);
+    if(work.packed != work.unfiltered) lodepng_free(work.packed);
+    return 83; /*alloc fail*/
+  }
+
+  /*the inflater tells the unfiltering jobs about its progress, while they read its output*/
+  pthread_mutex_init(&work.feed.mutex, 0);
+  pthread_cond_init(&work.feed.cond, 0);
+  work.feed.data = 0;
+  work.feed.size = 0;
+  work.feed.done = 0;
+  zlibsettings.progress = decodeFeedProgress;
+  zlibsettings.progress_context = &work.feed;
+
+  numjobs = 1 + work.numunfilter;
+  for(i = 0; i != numjobs; ++i)
+  {
+    jobs[i].work = &work;
+    jobs[i].index = i;
+    jobs[i].error = 0;
+  }
+  lodepng_run_jobs(decodeJob, jobs, sizeof(DecodeJob), numjobs);
+  pthread_cond_destroy(&work.feed.cond);
+  pthread_mutex_destroy(&work.feed.mutex);
+
+  error = jobs[0].error;
+  if(!error && scanlines->size != settings->expected_size) error = 91; /*decompressed size doesn't match prediction*/
+  for(i = 1; i != numjobs; ++i)
+  {
+    if(!error) error = jobs[i].error;
+  }
+
+  if(!error && !work.interlaced && work.unfiltered != out)
+  {
+    removePaddingBits(out, work.unfiltered, linebits, ((linebits + 7) / 8) * 8, h);
+  }
+  else if(!error && work.interlaced)
+  {
+    numbands = (h + 7) / 8 < settings->num_threads ? (h + 7) / 8 : settings->num_threads;
+    if(numbands > LODEPNG_MAX_THREADS) numbands = LODEPNG_MAX_THREADS;
+    for(i = 0; i != numbands; ++i)
+    {
+      bands[i].out = out;
+      bands[i].in = work.packed;
+      bands[i].w = w;
+      bands[i].h = h;
+      bands[i].bpp = bpp;
+      /*bands start at multiples of 8 rows*/
+      bands[i].y0 = (unsigned)(((size_t)(h + 7) / 8 * i / numbands) * 8);
+      bands[i].y1 = i + 1 == numbands ? h : (unsigned)(((size_t)(h + 7) / 8 * (i + 1) / numbands) * 8);
+    }
+    lodepng_run_jobs(deinterlaceJob, bands, sizeof(DeinterlaceJob), numbands);
+  }
+
+  if(work.unfiltered != out) lodepng_free(work.unfiltered);
+  if(work.packed != work.unfiltered) lodepng_free(work.packed);
+  return error;
+}
+
+#endif /*LODEPNG_COMPILE_THREADS*/
+
 static unsigned readChunk_PLTE(LodePNGColorMode* color, const unsigned char* data, size_t chunkLength)
 {
   unsigned pos = 0, i;
@@ -4513,15 +5804,19 @@ static unsigned readChunk_pHYs(LodePNGInfo* info, const unsigned char* data, siz
 #endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
 
 /*read a PNG, the result will be in the same color type as the PNG (hence "generic")*/
-static void decodeGeneric(unsigned char** out, unsigned* w, unsigned* h,
-                          LodePNGState* state,
+/*dest, if not null, is a buffer of destsize bytes to decode into instead of allocating *out*/
+static void decodeGeneric(unsigned char** out, unsigned char* dest, size_t destsize,
+                          unsigned* w, unsigned* h, LodePNGState* state,
                           const unsigned char* in, size_t insize)
 {
   unsigned char IEND = 0;
   const unsigned char* chunk;
   size_t i;
-  ucvector idat; /*the data from idat chunks*/
+  ucvector idat; /*the data from idat chunks, when there is more than one*/
+  const unsigned char* idatdata = 0; /*all the idat data, pointing into in when there is only one chunk*/
+  size_t idatsize = 0;
   ucvector scanlines;
+  LodePNGDecompressSettings zlibsettings;
   size_t predict;
   size_t numpixels;
   size_t outsize = 0;
@@ -4571,12 +5866,28 @@ static void decodeGeneric(unsigned char** out, unsigned* w, unsigned* h,
 
     data = lodepng_chunk_data_const(chunk);
 
-    /*IDAT chunk, containing compressed image data*/
+    /*IDAT chunk, containing compressed image data. A single IDAT chunk is used in place,
+    several are concatenated into a buffer that can hold all of the input*/
     if(lodepng_chunk_type_equals(chunk, "IDAT"))
     {
-      size_t oldsize = idat.size;
-      if(!ucvector_resize(&idat, oldsize + chunkLength)) CERROR_BREAK(state->error, 83 /*alloc fail*/);
-      for(i = 0; i != chunkLength; ++i) idat.data[oldsize + i] = data[i];
+      if(!idatdata)
+      {
+        idatdata = data;
+        idatsize = chunkLength;
+      }
+      else
+      {
+        if(!idat.data)
+        {
+          if(!ucvector_reserve(&idat, insize)) CERROR_BREAK(state->error, 83 /*alloc fail*/);
+          idat.size = idatsize;
+          for(i = 0; i != idatsize; ++i) idat.data[i] = idatdata[i];
+        }
+        if(!ucvector_resize(&idat, idat.size + chunkLength)) CERROR_BREAK(state->error, 83 /*alloc fail*/);
+        for(i = 0; i != chunkLength; ++i) idat.data[idat.size - chunkLength + i] = data[i];
+        idatdata = idat.data;
+        idatsize = idat.size;
+      }
 #ifdef LODEPNG_COMPILE_ANCILLARY_CHUNKS
       critical_pos = 3;
 #endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
@@ -4691,27 +6002,51 @@ static void decodeGeneric(unsigned char** out, unsigned* w, unsigned* h,
     if(*w > 1) predict += lodepng_get_raw_size_idat((*w + 0) >> 1, (*h + 1) >> 1, color) + ((*h + 1) >> 1);
     predict += lodepng_get_raw_size_idat((*w + 0), (*h + 0) >> 1, color) + ((*h + 0) >> 1);
   }
-  if(!state->error && !ucvector_reserve(&scanlines, predict)) state->error = 83; /*alloc fail*/
+  /*the output comes first, so that other threads can unfilter into it while inflating*/
   if(!state->error)
   {
-    state->error = zlib_decompress(&scanlines.data, &scanlines.size, idat.data,
-                                   idat.size, &state->decoder.zlibsettings);
-    if(!state->error && scanlines.size != predict) state->error = 91; /*decompressed size doesn't match prediction*/
+    outsize = lodepng_get_raw_size(*w, *h, &state->info_png.color);
+    if(dest)
+    {
+      if(destsize < outsize) state->error = 95; /*output buffer too small*/
+      else *out = dest;
+    }
+    else
+    {
+      *out = (unsigned char*)lodepng_malloc(outsize);
+      if(!*out) state->error = 83; /*alloc fail*/
+    }
   }
-  ucvector_cleanup(&idat);
-
   if(!state->error)
   {
-    outsize = lodepng_get_raw_size(*w, *h, &state->info_png.color);
-    *out = (unsigned char*)lodepng_malloc(outsize);
-    if(!*out) state->error = 83; /*alloc fail*/
+    for(i = 0; i < outsize; i++) (*out)[i] = 0;
   }
+
+  /*let the zlib decoder allocate the scanlines once, at the predicted size*/
+  zlibsettings = state->decoder.zlibsettings;
+  zlibsettings.expected_size = predict;
+#ifdef LODEPNG_COMPILE_THREADS
+  if(!state->error && zlibsettings.num_threads > 1 && predict >= LODEPNG_PARALLEL_DECODE_BYTES)
+  {
+    state->error = decodeParallel(*out, &scanlines, idatdata, idatsize, *w, *h, &state->info_png, &zlibsettings);
+  }
+  else
+#endif /*LODEPNG_COMPILE_THREADS*/
   if(!state->error)
   {
-    for(i = 0; i < outsize; i++) (*out)[i] = 0;
-    state->error = postProcessScanlines(*out, scanlines.data, *w, *h, &state->info_png);
+    state->error = zlib_decompress(&scanlines.data, &scanlines.size, idatdata,
+                                   idatsize, &zlibsettings);
+    if(!state->error && scanlines.size != predict) state->error = 91; /*decompressed size doesn't match prediction*/
+    if(!state->error) state->error = postProcessScanlines(*out, scanlines.data, *w, *h, &state->info_png);
   }
+  ucvector_cleanup(&idat);
   ucvector_cleanup(&scanlines);
+
+  if(state->error && *out != dest)
+  {
+    lodepng_free(*out);
+    *out = 0;
+  }
 }
 
 unsigned lodepng_decode(unsigned char** out, unsigned* w, unsigned* h,
@@ -4719,7 +6054,7 @@ unsigned lodepng_decode(unsigned char** out, unsigned* w, unsigned* h,
                         const unsigned char* in, size_t insize)
 {
   *out = 0;
-  decodeGeneric(out, w, h, state, in, insize);
+  decodeGeneric(out, 0, 0, w, h, state, in, insize);
   if(state->error) return state->error;
   if(!state->decoder.color_convert || lodepng_color_mode_equal(&state->info_raw, &state->info_png.color))
   {
@@ -4759,6 +6094,43 @@ unsigned lodepng_decode(unsigned char** out, unsigned* w, unsigned* h,
   return state->error;
 }
 
+unsigned lodepng_decode_into(unsigned char* out, size_t outsize, unsigned* w, unsigned* h,
+                             LodePNGState* state,
+                             const unsigned char* in, size_t insize)
+{
+  unsigned char* data = 0;
+  unsigned convert;
+
+  state->error = lodepng_inspect(w, h, state, in, insize);
+  if(state->error) return state->error;
+  /*the PNG's palette isn't known until PLTE is read, so palette output always goes through lodepng_convert*/
+  convert = state->decoder.color_convert && (state->info_raw.colortype == LCT_PALETTE
+            || !lodepng_color_mode_equal(&state->info_raw, &state->info_png.color));
+  if(!convert)
+  {
+    /*same color type: the scanlines are unfiltered straight into out*/
+    decodeGeneric(&data, out, outsize, w, h, state, in, insize);
+    if(state->error) return state->error;
+    if(!state->decoder.color_convert)
+    {
+      state->error = lodepng_color_mode_copy(&state->info_raw, &state->info_png.color);
+    }
+    return state->error;
+  }
+
+  if(!(state->info_raw.colortype == LCT_RGB || state->info_raw.colortype == LCT_RGBA)
+     && !(state->info_raw.bitdepth == 8))
+  {
+    return 56; /*unsupported color mode conversion*/
+  }
+  if(outsize < lodepng_get_raw_size(*w, *h, &state->info_raw)) CERROR_RETURN_ERROR(state->error, 95);
+
+  decodeGeneric(&data, 0, 0, w, h, state, in, insize);
+  if(!state->error) state->error = lodepng_convert(out, data, &state->info_raw, &state->info_png.color, *w, *h);
+  lodepng_free(data);
+  return state->error;
+}
+
 unsigned lodepng_decode_memory(unsigned char** out, unsigned* w, unsigned* h, const unsigned char* in,
                                size_t insize, LodePNGColorType colortype, unsigned bitdepth)
 {
@@ -5135,6 +6507,80 @@ static unsigned addChunk_pHYs(ucvector* out, const LodePNGInfo* info)
 
 #endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
 
+#ifdef LODEPNG_SIMD_SSE2
+/*
+Filtering only reads the unfiltered neighbours, so every byte is independent and
+16 are done per step, for any pixel size. Each function starts at byte 'start' and
+returns the index where the scalar loop takes over.
+*/
+static size_t filterSubSSE2(unsigned char* out, const unsigned char* scanline, size_t start, size_t length,
+                            size_t bytewidth)
+{
+  size_t i;
+  for(i = start; i + 16 <= length; i += 16)
+  {
+    __m128i x = _mm_loadu_si128((const __m128i*)(scanline + i));
+    __m128i a = _mm_loadu_si128((const __m128i*)(scanline + i - bytewidth));
+    _mm_storeu_si128((__m128i*)(out + i), _mm_sub_epi8(x, a));
+  }
+  return i;
+}
+
+static size_t filterUpSSE2(unsigned char* out, const unsigned char* scanline, const unsigned char* prevline,
+                           size_t length)
+{
+  size_t i;
+  for(i = 0; i + 16 <= length; i += 16)
+  {
+    __m128i x = _mm_loadu_si128((const __m128i*)(scanline + i));
+    __m128i b = _mm_loadu_si128((const __m128i*)(prevline + i));
+    _mm_storeu_si128((__m128i*)(out + i), _mm_sub_epi8(x, b));
+  }
+  return i;
+}
+
+static size_t filterAverageSSE2(unsigned char* out, const unsigned char* scanline, const unsigned char* prevline,
+                                size_t start, size_t length, size_t bytewidth)
+{
+  size_t i;
+  for(i = start; i + 16 <= length; i += 16)
+  {
+    __m128i x = _mm_loadu_si128((const __m128i*)(scanline + i));
+    __m128i a = _mm_loadu_si128((const __m128i*)(scanline + i - bytewidth));
+    __m128i b = _mm_loadu_si128((const __m128i*)(prevline + i));
+    _mm_storeu_si128((__m128i*)(out + i), _mm_sub_epi8(x, averageFloor(a, b)));
+  }
+  return i;
+}
+
+static size_t filterPaethSSE2(unsigned char* out, const unsigned char* scanline, const unsigned char* prevline,
+                              size_t start, size_t length, size_t bytewidth)
+{
+  size_t i;
+  int half;
+  __m128i zero = _mm_setzero_si128();
+  for(i = start; i + 16 <= length; i += 16)
+  {
+    __m128i x8 = _mm_loadu_si128((const __m128i*)(scanline + i));
+    __m128i a8 = _mm_loadu_si128((const __m128i*)(scanline + i - bytewidth));
+    __m128i b8 = _mm_loadu_si128((const __m128i*)(prevline + i));
+    __m128i c8 = _mm_loadu_si128((const __m128i*)(prevline + i - bytewidth));
+    __m128i predicted[2];
+    for(half = 0; half != 2; ++half)
+    {
+      __m128i a = half ? _mm_unpackhi_epi8(a8, zero) : _mm_unpacklo_epi8(a8, zero);
+      __m128i b = half ? _mm_unpackhi_epi8(b8, zero) : _mm_unpacklo_epi8(b8, zero);
+      __m128i c = half ? _mm_unpackhi_epi8(c8, zero) : _mm_unpacklo_epi8(c8, zero);
+      __m128i bc = _mm_sub_epi16(b, c);
+      __m128i ac = _mm_sub_epi16(a, c);
+      predicted[half] = paethSelect(a, b, c, abs16(bc), abs16(ac), abs16(_mm_add_epi16(bc, ac)));
+    }
+    _mm_storeu_si128((__m128i*)(out + i), _mm_sub_epi8(x8, _mm_packus_epi16(predicted[0], predicted[1])));
+  }
+  return i;
+}
+#endif /*LODEPNG_SIMD_SSE2*/
+
 static void filterScanline(unsigned char* out, const unsigned char* scanline, const unsigned char* prevline,
                            size_t length, size_t bytewidth, unsigned char filterType)
 {
@@ -5146,12 +6592,19 @@ static void filterScanline(unsigned char* out, const unsigned char* scanline, co
       break;
     case 1: /*Sub*/
       for(i = 0; i != bytewidth; ++i) out[i] = scanline[i];
-      for(i = bytewidth; i < length; ++i) out[i] = scanline[i] - scanline[i - bytewidth];
+#ifdef LODEPNG_SIMD_SSE2
+      i = filterSubSSE2(out, scanline, i, length, bytewidth);
+#endif /*LODEPNG_SIMD_SSE2*/
+      for(; i < length; ++i) out[i] = scanline[i] - scanline[i - bytewidth];
       break;
     case 2: /*Up*/
       if(prevline)
       {
-        for(i = 0; i != length; ++i) out[i] = scanline[i] - prevline[i];
+        i = 0;
+#ifdef LODEPNG_SIMD_SSE2
+        i = filterUpSSE2(out, scanline, prevline, length);
+#endif /*LODEPNG_SIMD_SSE2*/
+        for(; i != length; ++i) out[i] = scanline[i] - prevline[i];
       }
       else
       {
@@ -5162,7 +6615,10 @@ static void filterScanline(unsigned char* out, const unsigned char* scanline, co
       if(prevline)
       {
         for(i = 0; i != bytewidth; ++i) out[i] = scanline[i] - (prevline[i] >> 1);
-        for(i = bytewidth; i < length; ++i) out[i] = scanline[i] - ((scanline[i - bytewidth] + prevline[i]) >> 1);
+#ifdef LODEPNG_SIMD_SSE2
+        i = filterAverageSSE2(out, scanline, prevline, i, length, bytewidth);
+#endif /*LODEPNG_SIMD_SSE2*/
+        for(; i < length; ++i) out[i] = scanline[i] - ((scanline[i - bytewidth] + prevline[i]) >> 1);
       }
       else
       {
@@ -5175,7 +6631,10 @@ static void filterScanline(unsigned char* out, const unsigned char* scanline, co
       {
         /*paethPredictor(0, prevline[i], 0) is always prevline[i]*/
         for(i = 0; i != bytewidth; ++i) out[i] = (scanline[i] - prevline[i]);
-        for(i = bytewidth; i < length; ++i)
+#ifdef LODEPNG_SIMD_SSE2
+        i = filterPaethSSE2(out, scanline, prevline, i, length, bytewidth);
+#endif /*LODEPNG_SIMD_SSE2*/
+        for(; i < length; ++i)
         {
           out[i] = (scanline[i] - paethPredictor(scanline[i - bytewidth], prevline[i], prevline[i - bytewidth]));
         }
@@ -5200,6 +6659,153 @@ static float flog2(float f)
   return result + 1.442695f * (f * f * f / 3 - 3 * f * f / 2 + 3 * f - 1.83333f);
 }
 
+/*
+Filter rows y0 to y1 (exclusive) of the image with adaptive filtering: every row
+is filtered with all five filter types, and the one with the smallest sum of
+absolute values (LFS_MINSUM) or the smallest entropy (LFS_ENTROPY) is kept.
+*/
+static unsigned filterAdaptive(unsigned char* out, const unsigned char* in, unsigned y0, unsigned y1,
+                               size_t linebytes, size_t bytewidth, LodePNGFilterStrategy strategy)
+{
+  unsigned char* attempt[5]; /*five filtering attempts, one for each filter type*/
+  const unsigned char* prevline = y0 == 0 ? 0 : &in[(y0 - 1) * linebytes];
+  unsigned type, bestType = 0;
+  unsigned count[256];
+  size_t x;
+  unsigned y;
+  unsigned error = 0;
+
+  for(type = 0; type != 5; ++type) attempt[type] = 0;
+  for(type = 0; type != 5; ++type)
+  {
+    attempt[type] = (unsigned char*)lodepng_malloc(linebytes);
+    if(!attempt[type]) error = 83; /*alloc fail*/
+  }
+
+  for(y = y0; y != y1 && !error; ++y)
+  {
+    size_t smallest = 0;
+    float smallestentropy = 0;
+
+    /*try the 5 filter types*/
+    for(type = 0; type != 5; ++type)
+    {
+      filterScanline(attempt[type], &in[y * linebytes], prevline, linebytes, bytewidth, (unsigned char)type);
+
+      if(strategy == LFS_MINSUM)
+      {
+        /*calculate the sum of the result*/
+        size_t sum = 0;
+        if(type == 0)
+        {
+          for(x = 0; x != linebytes; ++x) sum += (unsigned char)(attempt[type][x]);
+        }
+        else
+        {
+          for(x = 0; x != linebytes; ++x)
+          {
+            /*For differences, each byte should be treated as signed, values above 127 are negative
+            (converted to signed char). Filtertype 0 isn't a difference though, so use unsigned there.
+            This means filtertype 0 is almost never chosen, but that is justified.*/
+            unsigned char s = attempt[type][x];
+            sum += s < 128 ? s : (255U - s);
+          }
+        }
+
+        /*check if this is smallest sum (or if type == 0 it's the first case so always store the values)*/
+        if(type == 0 || sum < smallest)
+        {
+          bestType = type;
+          smallest = sum;
+        }
+      }
+      else /*LFS_ENTROPY*/
+      {
+        float sum = 0;
+        for(x = 0; x != 256; ++x) count[x] = 0;
+        for(x = 0; x != linebytes; ++x) ++count[attempt[type][x]];
+        ++count[type]; /*the filter type itself is part of the scanline*/
+        for(x = 0; x != 256; ++x)
+        {
+          float p = count[x] / (float)(linebytes + 1);
+          sum += count[x] == 0 ? 0 : flog2(1 / p) * p;
+        }
+        /*check if this is smallest sum (or if type == 0 it's the first case so always store the values)*/
+        if(type == 0 || sum < smallestentropy)
+        {
+          bestType = type;
+          smallestentropy = sum;
+        }
+      }
+    }
+
+    prevline = &in[y * linebytes];
+
+    /*now fill the out values*/
+    out[y * (linebytes + 1)] = bestType; /*the first byte of a scanline will be the filter type*/
+    for(x = 0; x != linebytes; ++x) out[y * (linebytes + 1) + 1 + x] = attempt[bestType][x];
+  }
+
+  for(type = 0; type != 5; ++type) lodepng_free(attempt[type]);
+
+  return error;
+}
+
+#ifdef LODEPNG_COMPILE_THREADS
+
+/*one band of rows for filterAdaptiveParallel*/
+typedef struct FilterJob
+{
+  unsigned char* out;
+  const unsigned char* in;
+  unsigned y0;
+  unsigned y1;
+  size_t linebytes;
+  size_t bytewidth;
+  LodePNGFilterStrategy strategy;
+  unsigned error;
+} FilterJob;
+
+static void* filterJob(void* arg)
+{
+  FilterJob* job = (FilterJob*)arg;
+  job->error = filterAdaptive(job->out, job->in, job->y0, job->y1, job->linebytes, job->bytewidth, job->strategy);
+  return 0;
+}
+
+/*filterAdaptive on all h rows, split into one band of rows per thread*/
+static unsigned filterAdaptiveParallel(unsigned char* out, const unsigned char* in, unsigned h,
+                                       size_t linebytes, size_t bytewidth, LodePNGFilterStrategy strategy,
+                                       unsigned num_threads)
+{
+  FilterJob jobs[LODEPNG_MAX_THREADS];
+  unsigned i, numjobs = num_threads;
+  unsigned error = 0;
+
+  if(numjobs > LODEPNG_MAX_THREADS) numjobs = LODEPNG_MAX_THREADS;
+  if(numjobs > h) numjobs = h;
+  for(i = 0; i != numjobs; ++i)
+  {
+    jobs[i].out = out;
+    jobs[i].in = in;
+    jobs[i].y0 = (unsigned)((size_t)h * i / numjobs);
+    jobs[i].y1 = (unsigned)((size_t)h * (i + 1) / numjobs);
+    jobs[i].linebytes = linebytes;
+    jobs[i].bytewidth = bytewidth;
+    jobs[i].strategy = strategy;
+  }
+
+  lodepng_run_jobs(filterJob, jobs, sizeof(FilterJob), numjobs);
+
+  for(i = 0; i != numjobs; ++i)
+  {
+    if(!error) error = jobs[i].error;
+  }
+  return error;
+}
+
+#endif /*LODEPNG_COMPILE_THREADS*/
+
 static unsigned filter(unsigned char* out, const unsigned char* in, unsigned w, unsigned h,
                        const LodePNGColorMode* info, const LodePNGEncoderSettings* settings)
 {
@@ -5248,110 +6854,21 @@ static unsigned filter(unsigned char* out, const unsigned char* in, unsigned w,
       prevline = &in[inindex];
     }
   }
-  else if(strategy == LFS_MINSUM)
+  else if(strategy == LFS_MINSUM || strategy == LFS_ENTROPY)
   {
-    /*adaptive filtering*/
-    size_t sum[5];
-    unsigned char* attempt[5]; /*five filtering attempts, one for each filter type*/
-    size_t smallest = 0;
-    unsigned char type, bestType = 0;
-
-    for(type = 0; type != 5; ++type)
-    {
-      attempt[type] = (unsigned char*)lodepng_malloc(linebytes);
-      if(!attempt[type]) return 83; /*alloc fail*/
-    }
-
-    if(!error)
-    {
-      for(y = 0; y != h; ++y)
-      {
-        /*try the 5 filter types*/
-        for(type = 0; type != 5; ++type)
-        {
-          filterScanline(attempt[type], &in[y * linebytes], prevline, linebytes, bytewidth, type);
-
-          /*calculate the sum of the result*/
-          sum[type] = 0;
-          if(type == 0)
-          {
-            for(x = 0; x != linebytes; ++x) sum[type] += (unsigned char)(attempt[type][x]);
-          }
-          else
-          {
-            for(x = 0; x != linebytes; ++x)
-            {
-              /*For differences, each byte should be treated as signed, values above 127 are negative
-              (converted to signed char). Filtertype 0 isn't a difference though, so use unsigned there.
-              This means filtertype 0 is almost never chosen, but that is justified.*/
-              unsigned char s = attempt[type][x];
-              sum[type] += s < 128 ? s : (255U - s);
-            }
-          }
-
-          /*check if this is smallest sum (or if type == 0 it's the first case so always store the values)*/
-          if(type == 0 || sum[type] < smallest)
-          {
-            bestType = type;
-            smallest = sum[type];
-          }
-        }
-
-        prevline = &in[y * linebytes];
-
-        /*now fill the out values*/
-        out[y * (linebytes + 1)] = bestType; /*the first byte of a scanline will be the filter type*/
-        for(x = 0; x != linebytes; ++x) out[y * (linebytes + 1) + 1 + x] = attempt[bestType][x];
-      }
-    }
-
-    for(type = 0; type != 5; ++type) lodepng_free(attempt[type]);
-  }
-  else if(strategy == LFS_ENTROPY)
-  {
-    float sum[5];
-    unsigned char* attempt[5]; /*five filtering attempts, one for each filter type*/
-    float smallest = 0;
-    unsigned type, bestType = 0;
-    unsigned count[256];
-
-    for(type = 0; type != 5; ++type)
+    /*adaptive filtering: each row only depends on itself and the row above, so rows can be
+    filtered in independent bands*/
+#ifdef LODEPNG_COMPILE_THREADS
+    if(settings->zlibsettings.num_threads > 1 && h > 1)
     {
-      attempt[type] = (unsigned char*)lodepng_malloc(linebytes);
-      if(!attempt[type]) return 83; /*alloc fail*/
+      error = filterAdaptiveParallel(out, in, h, linebytes, bytewidth, strategy,
+                                     settings->zlibsettings.num_threads);
     }
-
-    for(y = 0; y != h; ++y)
+    else
+#endif /*LODEPNG_COMPILE_THREADS*/
     {
-      /*try the 5 filter types*/
-      for(type = 0; type != 5; ++type)
-      {
-        filterScanline(attempt[type], &in[y * linebytes], prevline, linebytes, bytewidth, type);
-        for(x = 0; x != 256; ++x) count[x] = 0;
-        for(x = 0; x != linebytes; ++x) ++count[attempt[type][x]];
-        ++count[type]; /*the filter type itself is part of the scanline*/
-        sum[type] = 0;
-        for(x = 0; x != 256; ++x)
-        {
-          float p = count[x] / (float)(linebytes + 1);
-          sum[type] += count[x] == 0 ? 0 : flog2(1 / p) * p;
-        }
-        /*check if this is smallest sum (or if type == 0 it's the first case so always store the values)*/
-        if(type == 0 || sum[type] < smallest)
-        {
-          bestType = type;
-          smallest = sum[type];
-        }
-      }
-
-      prevline = &in[y * linebytes];
-
-      /*now fill the out values*/
-      out[y * (linebytes + 1)] = bestType; /*the first byte of a scanline will be the filter type*/
-      for(x = 0; x != linebytes; ++x) out[y * (linebytes + 1) + 1 + x] = attempt[bestType][x];
+      error = filterAdaptive(out, in, 0, h, linebytes, bytewidth, strategy);
     }
-
-    for(type = 0; type != 5; ++type) lodepng_free(attempt[type]);
   }
   else if(strategy == LFS_PREDEFINED)
   {
@@ -5992,6 +7509,7 @@ const char* lodepng_error_text(unsigned code)
     case 92: return "too many pixels, not supported";
     case 93: return "zero width or height is invalid";
     case 94: return "header chunk must have a size of 13 bytes";
+    case 95: return "output buffer too small for the decoded image";
   }
   return "unknown error code";
 }
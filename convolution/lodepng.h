@@ -74,6 +74,11 @@ source files with custom allocators.*/
 #ifndef LODEPNG_NO_COMPILE_ALLOCATORS
 #define LODEPNG_COMPILE_ALLOCATORS
 #endif
+/*multithreaded encoding: scanline filters are chosen and the zlib stream is
+deflated in parallel chunks, using num_threads from LodePNGCompressSettings.
+This needs POSIX threads, so unlike the sections above it is off unless you
+define it, e.g. -DLODEPNG_COMPILE_THREADS for gcc (and link with -pthread).*/
+/*#define LODEPNG_COMPILE_THREADS*/
 /*compile the C++ version (you can disable the C++ wrapper here even when compiling for C++)*/
 #ifdef __cplusplus
 #ifndef LODEPNG_NO_COMPILE_CPP
@@ -269,6 +274,23 @@ struct LodePNGDecompressSettings
                              const LodePNGDecompressSettings*);
 
   const void* custom_context; /*optional custom settings for custom functions*/
+
+  /*size of the decompressed data when it is known in advance, or 0. The PNG decoder
+  sets this from the header so that decoders can allocate their output just once*/
+  size_t expected_size;
+
+  /*number of threads for decoding PNG image data. With more than one, scanlines are
+  unfiltered while the rest of the image is still being inflated, and Adam7 passes are
+  unfiltered and deinterlaced in parallel. Ignored unless compiled with
+  LODEPNG_COMPILE_THREADS. Default: 1*/
+  unsigned num_threads;
+
+  /*if not null, inflaters call this now and then with their output so far, so that it can
+  be used before the whole stream is inflated. Only valid with expected_size set: other
+  threads may be reading the output, so it must not move, and inflaters fail with error 91
+  rather than grow it past expected_size. The PNG decoder sets this itself. Default: null*/
+  void (*progress)(const unsigned char* data, size_t size, void* context);
+  void* progress_context;
 };
 
 extern const LodePNGDecompressSettings lodepng_default_decompress_settings;
@@ -280,6 +302,16 @@ void lodepng_decompress_settings_init(LodePNGDecompressSettings* settings);
 Settings for zlib compression. Tweaking these settings tweaks the balance
 between speed and compression ratio.
 */
+/*
+Hash tables for the LZ77 encoder, kept between calls so that they are not
+allocated again for every image. Create one with lodepng_deflate_cache_new, set it
+as the cache of the compress settings, and free it with lodepng_deflate_cache_free.
+A cache may only be used by one call at a time, so give each thread its own.
+*/
+typedef struct LodePNGDeflateCache LodePNGDeflateCache;
+LodePNGDeflateCache* lodepng_deflate_cache_new(void);
+void lodepng_deflate_cache_free(LodePNGDeflateCache* cache);
+
 typedef struct LodePNGCompressSettings LodePNGCompressSettings;
 struct LodePNGCompressSettings /*deflate = compress*/
 {
@@ -290,6 +322,14 @@ struct LodePNGCompressSettings /*deflate = compress*/
   unsigned minmatch; /*mininum lz77 length. 3 is normally best, 6 can be better for some PNGs. Default: 0*/
   unsigned nicematch; /*stop searching if >= this length found. Set to 258 for best compression. Default: 128*/
   unsigned lazymatching; /*use lazy matching: better compression but a bit slower. Default: true*/
+  /*most hash chain entries to try per byte; lower is faster. 0 means windowsize for windows of 8192
+  or more and windowsize / 8 below that. Default: 0*/
+  unsigned maxchainlength;
+  /*number of threads for filtering scanlines and deflating the image data. With more than
+  one, the data is deflated as independent chunks joined with sync flushes, which makes the
+  result a little larger. Ignored unless compiled with LODEPNG_COMPILE_THREADS. Default: 1*/
+  unsigned num_threads;
+  LodePNGDeflateCache* cache; /*hash tables to reuse, or null to allocate them per call. Default: null*/
 
   /*use custom zlib encoder instead of built in one (default: null)*/
   unsigned (*custom_zlib)(unsigned char**, size_t*,
@@ -307,6 +347,9 @@ struct LodePNGCompressSettings /*deflate = compress*/
 
 extern const LodePNGCompressSettings lodepng_default_compress_settings;
 void lodepng_compress_settings_init(LodePNGCompressSettings* settings);
+/*Set the LZ77 settings to a preset for a compression level like zlib's: 0 stores the
+data uncompressed, 1 is fastest and 9 gives the smallest output.*/
+void lodepng_compress_settings_level(LodePNGCompressSettings* settings, unsigned level);
 #endif /*LODEPNG_COMPILE_ENCODER*/
 
 #ifdef LODEPNG_COMPILE_PNG
@@ -659,6 +702,17 @@ information is placed in the info_png field of the LodePNGState.
 unsigned lodepng_inspect(unsigned* w, unsigned* h,
                          LodePNGState* state,
                          const unsigned char* in, size_t insize);
+
+/*
+Same as lodepng_decode, but decodes into the caller's buffer instead of allocating one.
+outsize must be at least the raw size of the image in the requested color mode, which
+lodepng_inspect and lodepng_get_raw_size give before decoding; error 95 if it is smaller.
+With color_convert off the image keeps the PNG's own color mode, so use
+state->info_png.color after lodepng_inspect to compute the size.
+*/
+unsigned lodepng_decode_into(unsigned char* out, size_t outsize, unsigned* w, unsigned* h,
+                             LodePNGState* state,
+                             const unsigned char* in, size_t insize);
 #endif /*LODEPNG_COMPILE_DECODER*/
 
 
@@ -736,6 +790,12 @@ unsigned lodepng_chunk_create(unsigned char** out, size_t* outlength, unsigned l
 
 /*Calculate CRC32 of buffer*/
 unsigned lodepng_crc32(const unsigned char* buf, size_t len);
+/*Continue a CRC32 over more data: crc is the CRC32 of what came before (0 for nothing).
+Not available with LODEPNG_NO_COMPILE_CRC.*/
+unsigned lodepng_crc32_update(unsigned crc, const unsigned char* buf, size_t len);
+/*CRC32 of two pieces of data joined, from crc1 of the first, crc2 of the second and
+the length len2 of the second. Lets the pieces be checksummed on separate threads.*/
+unsigned lodepng_crc32_combine(unsigned crc1, unsigned crc2, size_t len2);
 #endif /*LODEPNG_COMPILE_PNG*/
 
 
@@ -746,6 +806,13 @@ buffer. It cannot be used to create gzip files however, and it only supports the
 part of zlib that is required for PNG, it does not support dictionaries.
 */
 
+/*Continue an Adler32 checksum over more data: adler is the checksum of what came
+before (1 for nothing).*/
+unsigned lodepng_adler32_update(unsigned adler, const unsigned char* data, size_t len);
+/*Adler32 of two pieces of data joined, from adler1 of the first, adler2 of the second
+and the length len2 of the second.*/
+unsigned lodepng_adler32_combine(unsigned adler1, unsigned adler2, size_t len2);
+
 #ifdef LODEPNG_COMPILE_DECODER
 /*Inflate a buffer. Inflate is the decompression step of deflate. Out buffer must be freed after use.*/
 unsigned lodepng_inflate(unsigned char** out, size_t* outsize,
@@ -1,37 +1,29 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <pthread.h>
 #include <time.h>
+#include <dirent.h>
+#include <limits.h>
+#include <strings.h>
+#include <sys/stat.h>
 
 #include "lodepng.h"
+#include "convolve-engine.h"
+#include "png-codec.h"
+#include "work-queue.h"
 
-#define BYTES_PER_PIXEL 4
-#define RED_OFFSET 0
-#define GREEN_OFFSET 1
-#define BLUE_OFFSET 2
-#define ALPHA_OFFSET 3
 #define ONE_BILLION (double)1000000000.0
 
-#define IMG_BYTE(columns, r, c, b) ((columns * BYTES_PER_PIXEL * r) + (BYTES_PER_PIXEL * c) + b)
-#define CLAMP(val, min, max) (val < min ? min : val > max ? max : val)
-
-typedef unsigned char pixel_t; 
-typedef struct {
-  pixel_t *pixels;
-  unsigned int rows;
-  unsigned int columns;
-} image_t;
-
-#define KERNEL_DIM 3
-typedef int kernel_t[KERNEL_DIM][KERNEL_DIM];
-
 typedef struct {
   int tid;
   int num_threads;
   kernel_t kernel;
+  border_t border;
   image_t *output;
   image_t *input;
+  unsigned int traits;			/* Of this thread's rows, once done */
 } thread_args_t;
 
 double
@@ -43,267 +35,408 @@ now(void)
 }
 
 
-/* Load PNG image from 'file_name' into 'image'. 
+/* Load PNG image from 'file_name' into 'image', inflating with the codec
+   set in 'decompress'. The file is memory-mapped, and lodepng works in
+   'arena' unless it is NULL. Returns the lodepng error code, which is zero
+   on success.
  */
-void
-load_and_decode(image_t *image, const char *file_name)
+unsigned int
+load_and_decode(image_t *image, const char *file_name,
+				const LodePNGDecompressSettings *decompress, arena_t *arena)
 {
-  unsigned int error =
-	lodepng_decode32_file(&image->pixels, &image->columns, &image->rows, file_name);
+  mapped_file_t png;
+
+  image->traits = 0;
+  unsigned int error = map_file(&png, file_name);
+  if (!error) {
+	error = decode_rgba(&image->pixels, &image->columns, &image->rows, png.data, png.size,
+						decompress, arena);
+  }
+  unmap_file(&png);
   if (error) {
-	fprintf(stderr, "error %u: %s\n", error, lodepng_error_text(error));
+	fprintf(stderr, "%s: error %u: %s\n", file_name, error, lodepng_error_text(error));
+	return error;
   }
   printf("Loaded %s (%dx%d)\n", file_name, image->columns, image->rows);
+  return 0;
 }
 
-/* Encode image in PNG format into file 'file_name'. 
+/* Encode image in PNG format into file 'file_name', compressing with
+   'compress' (codec, compression level, threads and reusable tables).
+   Channels the image's traits show to be redundant are left out. Returns
+   the lodepng error, having printed it, or 0.
  */
-void
-encode_and_store(image_t *image, const char *file_name)
+unsigned int
+encode_and_store(image_t *image, const char *file_name,
+				 const LodePNGCompressSettings *compress)
 {
+  LodePNGState state;
+  unsigned char *png = NULL;
+  size_t png_size = 0;
+
+  lodepng_state_init(&state);
+  state.encoder.zlibsettings = *compress;
+  if (image->traits & PIXELS_KNOWN) {
+	use_color_type(&state, image->traits & PIXELS_OPAQUE, image->traits & PIXELS_GREY);
+  }
   unsigned int error =
-	lodepng_encode32_file(file_name, image->pixels, image->columns, image->rows);
+	lodepng_encode(&png, &png_size, image->pixels, image->columns, image->rows, &state);
+  if (!error) {
+	error = lodepng_save_file(png, png_size, file_name);
+  }
+  lodepng_state_cleanup(&state);
+  free(png);
   if (error) {
-	fprintf(stderr, "error %u: %s\n", error, lodepng_error_text(error));
+	fprintf(stderr, "%s: error %u: %s\n", file_name, error, lodepng_error_text(error));
+	return error;
   }
   printf("Stored %s (%dx%d)\n", file_name, image->columns, image->rows);
+  return 0;
 }
 
-/* Initialize an image_t structure 'image' for an image of size 'rows' by 'columns'. 
+/* Thread body: convolve this thread's contiguous band of rows. The output
+   image is initialized by the main thread before any workers start, which
+   combines the bands' traits after they finish.
  */
-void
-init_image(image_t *image, int rows, int columns)
+void *
+parallel_convolve(void *args_pointer)
 {
-  image->rows = rows;
-  image->columns = columns;
-  image->pixels = (pixel_t *)malloc(image->columns * image->rows * BYTES_PER_PIXEL);
+  thread_args_t *args = (thread_args_t *) args_pointer;
+  int rows = args->input->rows;
+  int first_row = (long) rows * args->tid / args->num_threads;
+  int last_row = (long) rows * (args->tid + 1) / args->num_threads;
+
+  args->traits = convolve_rows(args->output, args->input, &args->kernel, &args->border,
+							   first_row, last_row);
+  return NULL;
 }
 
-/* Free a previously initialized image.
+/* Print an optional message, usage information, and exit in error.
  */
 void
-free_image(image_t *image)
+usage(char *prog_name, char *msge)
 {
-  free(image->pixels);
+  if (msge && strlen(msge)) {
+	fprintf(stderr, "\n%s\n\n", msge);
+  }
+  
+  fprintf(stderr, "usage: %s [flags]\n", prog_name);
+  fprintf(stderr, "  -h                print help\n");
+  fprintf(stderr, "  -n                set number of threads\n");
+  fprintf(stderr, "  -b <border>       border mode from:\n");
+  print_border_modes(stderr);
+  fprintf(stderr, "  -i <input file>   set input file\n");
+  fprintf(stderr, "  -o <output file>  set output file\n");
+  fprintf(stderr, "  -s                stream rows through a buffer of kernel height\n");
+  fprintf(stderr, "                    instead of loading the whole image (one thread)\n");
+  fprintf(stderr, "  -B <dir|list>     batch mode: convolve every .png in <dir>, or every\n");
+  fprintf(stderr, "                    file named in <list>, in place of -i/-o\n");
+  fprintf(stderr, "  -D <output dir>   directory for batch mode output\n");
+  fprintf(stderr, "  -d <decoders>     batch mode decoder threads (default: -n)\n");
+  fprintf(stderr, "  -e <encoders>     batch mode encoder threads (default: -n)\n");
+  fprintf(stderr, "  -k <kernel>       kernel from:\n");
+  print_kernels(stderr);
+  fprintf(stderr, "  -K <size>         kernel width and height (odd, default %d)\n",
+		  DEFAULT_KERNEL_DIM);
+  fprintf(stderr, "  -z <level>        PNG compression level, 0 (none) and 1 (fastest)\n");
+  fprintf(stderr, "                    to 9 (smallest); default is lodepng's own\n");
+  fprintf(stderr, "  -Z <codec>        zlib codec for reading and writing PNGs, from:\n");
+  print_codecs(stderr);
+  exit(1);
 }
 
-/* Copy an existing 'input' image to an 'output' image. Initializes the
-   'output' image, on which you should later invoke 'free_image'.
+void
+check_thread_rtn(char *msge, int rtn) {
+  if (rtn) {
+    fprintf(stderr, "ERROR: %s (%d)\n", msge,rtn);
+    exit(1);
+  }
+}
+
+/* ==== Batch mode ================ */
+
+/* In batch mode every image passes through three stages connected by
+   bounded queues: decoder threads load PNGs, convolution workers filter
+   whole images, and encoder threads store the results. Each stage works on
+   a different image, so PNG codec time overlaps with filtering.
+ */
+typedef struct {
+  char *input_file_name;
+  char *output_file_name;
+  image_t input;
+  image_t output;
+} batch_job_t;
+
+typedef struct {
+  batch_job_t *jobs;
+  int num_jobs;
+  int next_job;					/* Next job for a decoder to claim */
+  int failures;
+  double decode_seconds;		/* Busy time summed over each stage's threads */
+  double convolve_seconds;
+  double encode_seconds;
+  pthread_mutex_t lock;			/* Guards the fields above */
+  kernel_t kernel;
+  border_t border;
+  LodePNGDecompressSettings decompress;
+  LodePNGCompressSettings compress;
+  work_queue_t decoded;			/* Decoders -> convolution workers */
+  work_queue_t convolved;		/* Convolution workers -> encoders */
+} batch_t;
+
+/* Add 'seconds' to one of the batch's stage totals.
  */
 void
-copy(image_t *output, image_t *input)
+add_seconds(batch_t *batch, double *total, double seconds)
 {
-  int rows = input->rows;
-  int columns = input->columns;
-  init_image(output, rows, columns);
-
-  for (int r = 0;  r < rows;  r++) {
-	for (int c = 0;  c < columns;  c++) {
-	  for (int b = 0;  b < BYTES_PER_PIXEL;  b++) {
-		output->pixels[IMG_BYTE(columns, r, c, b)] = input->pixels[IMG_BYTE(columns, r, c, b)];
-	  }
-	}
-  }
+  pthread_mutex_lock(&batch->lock);
+  *total += seconds;
+  pthread_mutex_unlock(&batch->lock);
 }
 
-/* Compute the normal value of the given 'kernel'. 
+/* Return true if 'a' and 'b' name the same existing file.
  */
 int
-normalize_kernel(kernel_t kernel)
+same_file(const char *a, const char *b)
 {
-  int norm = 0;
+  struct stat a_stat;
+  struct stat b_stat;
 
-  for (int r = 0;  r < KERNEL_DIM;  r++) {
-	for (int c = 0;  c < KERNEL_DIM;  c++) {
-	  norm += kernel[r][c];
-	}
-  }
-  if (norm == 0) {
-	norm = 1;
+  if (stat(a, &a_stat) != 0 || stat(b, &b_stat) != 0) {
+	return 0;
   }
-
-  return norm;
+  return a_stat.st_dev == b_stat.st_dev && a_stat.st_ino == b_stat.st_ino;
 }
 
-/* Convolve image 'input' with 'kernel' into image 'output', which is
-   allocated here and should later be freed.
+/* Append a job converting 'input_file_name' into a file of the same base
+   name in 'output_dir'.
  */
+void
+add_job(batch_t *batch, int *capacity, const char *input_file_name, const char *output_dir)
+{
+  if (batch->num_jobs == *capacity) {
+	*capacity = *capacity ? 2 * *capacity : 64;
+	batch->jobs = realloc(batch->jobs, sizeof(batch_job_t) * *capacity);
+  }
 
-void *
-parallel_convolve(void *args_pointer)
+  const char *base_name = strrchr(input_file_name, '/');
+  base_name = base_name ? base_name + 1 : input_file_name;
+
+  batch_job_t *job = &batch->jobs[batch->num_jobs++];
+  job->input_file_name = strdup(input_file_name);
+  job->output_file_name = malloc(strlen(output_dir) + strlen(base_name) + 2);
+  sprintf(job->output_file_name, "%s/%s", output_dir, base_name);
+}
+
+int
+compare_jobs(const void *a, const void *b)
 {
-  thread_args_t *args = (thread_args_t *) args_pointer;
-  image_t *input = args->input;
-  image_t *output = args->output;
-  kernel_t kernel;
-  memcpy(kernel, args->kernel, sizeof(kernel_t));
+  return strcmp(((batch_job_t *) a)->input_file_name, ((batch_job_t *) b)->input_file_name);
+}
 
-  int columns = args->input->columns;
-  int rows = args->input->rows;
-  int half_dim = KERNEL_DIM / 2;
-  int kernel_norm = normalize_kernel(kernel);
-
-  init_image(output, rows, columns);
-
-  for (int r = 1;  r < rows - 1;  r += 1) {
-	for (int c = 1 + args->tid;  c < columns - 1;  c += args->num_threads) {
-	  for (int b = 0;  b < BYTES_PER_PIXEL;  b++) {
-		int value = 0;
-
-		if (b == ALPHA_OFFSET) {
-		  /* Retain the alpha channel. */
-		  value = input->pixels[IMG_BYTE(columns, r, c, b)];
-		} else {
-		  /* Convolve red, green, and blue. */
-		  for (int kr = 0;  kr < KERNEL_DIM;  kr++) {
-			for (int kc = 0;  kc < KERNEL_DIM;  kc++) {
-			  int R = r + (kr - half_dim);
-			  int C = c + (kc - half_dim);
-			  value += kernel[kr][kc] * input->pixels[IMG_BYTE(columns, R, C, b)];
-			}
-		  }
-
-		  value /= kernel_norm;
-		  value = CLAMP(value, 0, 0xFF);
-		}
-
-		output->pixels[IMG_BYTE(columns, r, c, b)] = value;
+/* Build the job list from 'source', which is either a directory (every
+   *.png file in it is converted) or a text file listing one input file per
+   line. Returns the number of jobs.
+ */
+int
+collect_jobs(batch_t *batch, const char *source, const char *output_dir)
+{
+  int capacity = 0;
+  char path[PATH_MAX];
+  DIR *dir = opendir(source);
+
+  if (dir) {
+	struct dirent *entry;
+	while ((entry = readdir(dir)) != NULL) {
+	  size_t length = strlen(entry->d_name);
+	  if (length > 4 && strcasecmp(entry->d_name + length - 4, ".png") == 0) {
+		snprintf(path, PATH_MAX, "%s/%s", source, entry->d_name);
+		add_job(batch, &capacity, path, output_dir);
 	  }
 	}
+	closedir(dir);
+	qsort(batch->jobs, batch->num_jobs, sizeof(batch_job_t), compare_jobs);
+  } else {
+	FILE *list = fopen(source, "r");
+	if (!list) {
+	  fprintf(stderr, "Can't open '%s' for reading\n", source);
+	  exit(1);
+	}
+	while (fgets(path, PATH_MAX, list)) {
+	  path[strcspn(path, "\r\n")] = '\0';
+	  if (path[0] != '\0') {
+		add_job(batch, &capacity, path, output_dir);
+	  }
+	}
+	fclose(list);
   }
-  return NULL;
+
+  return batch->num_jobs;
 }
 
-void
-convolve(image_t *output, image_t *input, kernel_t kernel)
+/* Decoder thread: claim jobs in order and load their input images. Each
+   decoder keeps its own arena for lodepng, sized by the largest image so
+   far, so a batch of similar images allocates only their pixels.
+ */
+void *
+decode_stage(void *batch_pointer)
 {
-  int columns = input->columns;
-  int rows = input->rows;
-  int half_dim = KERNEL_DIM / 2;
-  int kernel_norm = normalize_kernel(kernel);
-
-  init_image(output, rows, columns);
-
-  for (int r = 1;  r < rows - 1;  r++) {
-	for (int c = 1;  c < columns - 1;  c++) {
-	  for (int b = 0;  b < BYTES_PER_PIXEL;  b++) {
-		int value = 0;
-
-		if (b == ALPHA_OFFSET) {
-		  /* Retain the alpha channel. */
-		  value = input->pixels[IMG_BYTE(columns, r, c, b)];
-		} else {
-		  /* Convolve red, green, and blue. */
-		  for (int kr = 0;  kr < KERNEL_DIM;  kr++) {
-			for (int kc = 0;  kc < KERNEL_DIM;  kc++) {
-			  int R = r + (kr - half_dim);
-			  int C = c + (kc - half_dim);
-			  value += kernel[kr][kc] * input->pixels[IMG_BYTE(columns, R, C, b)];
-			}
-		  }
-
-		  value /= kernel_norm;
-		  value = CLAMP(value, 0, 0xFF);
-		}
-
-		output->pixels[IMG_BYTE(columns, r, c, b)] = value;
-	  }
+  batch_t *batch = (batch_t *) batch_pointer;
+  arena_t arena;
+
+  arena_init(&arena, 0);
+  for (;;) {
+	pthread_mutex_lock(&batch->lock);
+	int idx = batch->next_job++;
+	pthread_mutex_unlock(&batch->lock);
+	if (idx >= batch->num_jobs) {
+	  break;
+	}
+
+	batch_job_t *job = &batch->jobs[idx];
+	if (same_file(job->input_file_name, job->output_file_name)) {
+	  fprintf(stderr, "Skipping %s: input and output file can't be the same\n",
+			  job->input_file_name);
+	  pthread_mutex_lock(&batch->lock);
+	  batch->failures++;
+	  pthread_mutex_unlock(&batch->lock);
+	  continue;
+	}
+
+	double start = now();
+	unsigned int error =
+	  load_and_decode(&job->input, job->input_file_name, &batch->decompress, &arena);
+	add_seconds(batch, &batch->decode_seconds, now() - start);
+	if (error) {
+	  pthread_mutex_lock(&batch->lock);
+	  batch->failures++;
+	  pthread_mutex_unlock(&batch->lock);
+	  continue;
 	}
+	queue_push(&batch->decoded, job);
   }
+
+  arena_free(&arena);
+  queue_close(&batch->decoded);
+  return NULL;
 }
 
-/* Catalog of kernels; allows user to select the kernel to use by name at run
-   time. If you add more kernels, make sure the "null" kernel remains at the
-   end of the list.
+/* Convolution worker: filter one whole image at a time.
  */
-#define DEFAULT_KERNEL_NAME "identity"
+void *
+convolve_stage(void *batch_pointer)
+{
+  batch_t *batch = (batch_t *) batch_pointer;
+  batch_job_t *job;
+
+  while ((job = queue_pop(&batch->decoded)) != NULL) {
+	double start = now();
+	init_image(&job->output, job->input.rows, job->input.columns);
+	job->output.traits = convolve_rows(&job->output, &job->input, &batch->kernel,
+									   &batch->border, 0, job->input.rows);
+	free_image(&job->input);
+	add_seconds(batch, &batch->convolve_seconds, now() - start);
+	queue_push(&batch->convolved, job);
+  }
 
-typedef struct {
-  char *name;					/* Kernel name */
-  kernel_t kernel;				/* Kernel itself */
-} catalog_entry_t;
-
-catalog_entry_t kernel_catalog[] =
-  {
-   {
-	DEFAULT_KERNEL_NAME,
-	{ { 0, 0, 0 },
-	  { 0, 1, 0 },
-	  { 0, 0, 0 } }
-   },
-   {
-	"edge-detect",
-	{ { -1, -1, -1 },
-	  { -1, +8, -1 },
-	  { -1, -1, -1 } }
-   },
-   {
-	"sharpen",
-	{ { +0, -1, +0 },
-	  { -1, +5, -1 },
-	  { +0, -1, +0 } }
-   },
-   {
-	"emboss",
-	{ { -2, -1, +0 },
-	  { -1, +1, +1 },
-	  { +0, -2, +2 } }
-   },
-   {
-	"gaussian-blur",
-	{ { 1, 2, 1 },
-	  { 2, 4, 2 },
-	  { 1, 2, 1 } }
-   },
-   { NULL, {} }					/* Must be last! */
-  };
-
-/* Locate an entry in the kernel catalog by name. Returns a null pointer if no
-   kernel found.
+  queue_close(&batch->convolved);
+  return NULL;
+}
+
+/* Encoder thread: store finished images.
  */
-catalog_entry_t *
-find_entry_by_name(char *name)
+void *
+encode_stage(void *batch_pointer)
 {
-  for (catalog_entry_t *cp = kernel_catalog;  cp->name;  cp++) {
-	if (strcmp(cp->name, name) == 0) {
-	  return(cp);
+  batch_t *batch = (batch_t *) batch_pointer;
+  batch_job_t *job;
+
+  /* Encoders already run side by side, so each compresses on one thread,
+	 reusing its own hash tables from image to image. */
+  LodePNGCompressSettings compress = batch->compress;
+  compress.num_threads = 1;
+  compress.cache = lodepng_deflate_cache_new();
+
+  while ((job = queue_pop(&batch->convolved)) != NULL) {
+	double start = now();
+	unsigned int error = encode_and_store(&job->output, job->output_file_name, &compress);
+	free_image(&job->output);
+	add_seconds(batch, &batch->encode_seconds, now() - start);
+	if (error) {
+	  pthread_mutex_lock(&batch->lock);
+	  batch->failures++;
+	  pthread_mutex_unlock(&batch->lock);
 	}
   }
-  return (catalog_entry_t *) NULL;
+  lodepng_deflate_cache_free(compress.cache);
+  return NULL;
 }
 
-/* Print an optional message, usage information, and exit in error.
+/* Convolve every image named by 'source' into 'output_dir' using the given
+   number of threads in each pipeline stage. Returns the number of images
+   that could not be processed.
  */
-void
-usage(char *prog_name, char *msge)
+int
+run_batch(const char *source, const char *output_dir, kernel_t *kernel, border_t *border,
+		  const LodePNGDecompressSettings *decompress,
+		  const LodePNGCompressSettings *compress,
+		  int num_decoders, int num_workers, int num_encoders)
 {
-  if (msge && strlen(msge)) {
-	fprintf(stderr, "\n%s\n\n", msge);
+  batch_t batch;
+  memset(&batch, 0, sizeof(batch_t));
+  batch.kernel = *kernel;
+  batch.border = *border;
+  batch.decompress = *decompress;
+  batch.compress = *compress;
+  pthread_mutex_init(&batch.lock, NULL);
+
+  if (collect_jobs(&batch, source, output_dir) == 0) {
+	fprintf(stderr, "No input images in '%s'\n", source);
+	exit(1);
   }
-  
-  fprintf(stderr, "usage: %s [flags]\n", prog_name);
-  fprintf(stderr, "  -h                print help\n");
-  fprintf(stderr, "  -n                set number of threads\n");
-  fprintf(stderr, "  -i <input file>   set input file\n");
-  fprintf(stderr, "  -o <output file>  set output file\n");
-  fprintf(stderr, "  -k <kernel>       kernel from:\n");
 
-  for (int i = 0;  kernel_catalog[i].name;  i++) {
-	char *name = kernel_catalog[i].name;
-	fprintf(stderr, "       %s%s\n", name,
-			strcmp(name, DEFAULT_KERNEL_NAME) ? "" : " (default)");
-  }
-  exit(1);
-}
+  /* A couple of images per worker in each queue keeps every stage fed
+	 without holding the whole batch in memory. */
+  queue_init(&batch.decoded, 2 * num_workers, num_decoders);
+  queue_init(&batch.convolved, 2 * num_workers, num_workers);
 
-void
-check_thread_rtn(char *msge, int rtn) {
-  if (rtn) {
-    fprintf(stderr, "ERROR: %s (%d)\n", msge,rtn);
-    exit(1);
+  int num_stage_threads = num_decoders + num_workers + num_encoders;
+  pthread_t *threads = malloc(sizeof(pthread_t) * num_stage_threads);
+  int rtn;
+
+  double start = now();
+  for (int i = 0;  i < num_stage_threads;  i++) {
+	void *(*stage)(void *) =
+	  i < num_decoders ? decode_stage :
+	  i < num_decoders + num_workers ? convolve_stage : encode_stage;
+	rtn = pthread_create(&threads[i], NULL, stage, &batch);
+	check_thread_rtn("create", rtn);
   }
-}
+  for (int i = 0;  i < num_stage_threads;  i++) {
+	rtn = pthread_join(threads[i], NULL);
+	check_thread_rtn("join", rtn);
+  }
+  double elapsed = now() - start;
+
+  printf("   BATCH %d images (%d failed), %d decoders, %d workers, %d encoders\n",
+		 batch.num_jobs, batch.failures, num_decoders, num_workers, num_encoders);
+  printf("    TOOK %5.3f seconds\n", elapsed);
+  printf("  DECODE %8.3f thread-seconds\n", batch.decode_seconds);
+  printf("CONVOLVE %8.3f thread-seconds\n", batch.convolve_seconds);
+  printf("  ENCODE %8.3f thread-seconds\n", batch.encode_seconds);
+
+  for (int i = 0;  i < batch.num_jobs;  i++) {
+	free(batch.jobs[i].input_file_name);
+	free(batch.jobs[i].output_file_name);
+  }
+  free(batch.jobs);
+  free(threads);
+  queue_destroy(&batch.decoded);
+  queue_destroy(&batch.convolved);
+  pthread_mutex_destroy(&batch.lock);
 
+  return batch.failures;
+}
 
 int
 main(int argc, char **argv)
@@ -312,18 +445,45 @@ main(int argc, char **argv)
 #define ERR_MSGE_LEN 128
   char err_msge[ERR_MSGE_LEN];	/* Dynamic error messages */
   
-  catalog_entry_t *selected_entry = malloc(sizeof(catalog_entry_t));
-  selected_entry = find_entry_by_name(DEFAULT_KERNEL_NAME);
+  catalog_entry_t *selected_entry = find_entry_by_name(DEFAULT_KERNEL_NAME);
+  int kernel_dim = DEFAULT_KERNEL_DIM;
+  int stream = 0;
   char *input_file_name = NULL;
   char *output_file_name = NULL;
+  char *batch_source = NULL;
+  char *batch_output_dir = NULL;
+  int num_decoders = 0;
+  int num_encoders = 0;
+  int level = -1;
+  codec_t *codec = default_codec();
 
   int ch;
-  int num_threads;
-  while ((ch = getopt(argc, argv, "n:hi:k:o:")) != -1) {
+  int num_threads = 1;
+  border_t border;
+  parse_border(&border, DEFAULT_BORDER_NAME);
+  while ((ch = getopt(argc, argv, "B:D:b:d:e:n:hi:k:K:o:sz:Z:")) != -1) {
       switch (ch) {
+          case 'b':
+              if (!parse_border(&border, optarg)) {
+                  snprintf(err_msge, ERR_MSGE_LEN, "no border mode named '%s'", optarg);
+                  usage(prog_name, err_msge);
+              }
+              break;
           case 'n':
               num_threads = atol(optarg);
               break;
+          case 'B':
+              batch_source = optarg;
+              break;
+          case 'D':
+              batch_output_dir = optarg;
+              break;
+          case 'd':
+              num_decoders = atol(optarg);
+              break;
+          case 'e':
+              num_encoders = atol(optarg);
+              break;
           case 'i':
               input_file_name = optarg;
               break;
@@ -334,15 +494,64 @@ main(int argc, char **argv)
                   usage(prog_name, err_msge);
               }
               break;
+          case 'K':
+              kernel_dim = atol(optarg);
+              break;
           case 'o':
               output_file_name = optarg;
               break;
+          case 's':
+              stream = 1;
+              break;
+          case 'z':
+              level = atol(optarg);
+              if (level < 0 || level > 9) {
+                  usage(prog_name, "Compression level must be 0 to 9");
+              }
+              break;
+          case 'Z':
+              codec = find_codec_by_name(optarg);
+              if (codec == (codec_t *)NULL) {
+                  snprintf(err_msge, ERR_MSGE_LEN, "no codec named '%s'", optarg);
+                  usage(prog_name, err_msge);
+              }
+              break;
           case 'h':
           default:
               usage(prog_name, "");
       }
   }
 
+  if (num_threads < 1) {
+	usage(prog_name, "Need at least one thread");
+  }
+
+  kernel_t kernel;
+  if (!make_kernel(&kernel, selected_entry, kernel_dim)) {
+	snprintf(err_msge, ERR_MSGE_LEN, "kernel '%s' can't be %dx%d",
+			 selected_entry->name, kernel_dim, kernel_dim);
+	usage(prog_name, err_msge);
+  }
+
+  LodePNGDecompressSettings decompress;
+  LodePNGCompressSettings compress;
+  lodepng_decompress_settings_init(&decompress);
+  lodepng_compress_settings_init(&compress);
+  use_codec(codec, level, &decompress, &compress);
+  decompress.num_threads = num_threads;
+  compress.num_threads = num_threads;
+
+  if (batch_source) {
+	if (!batch_output_dir) {
+	  usage(prog_name, "Batch mode needs an output directory (-D)");
+	}
+	num_decoders = num_decoders > 0 ? num_decoders : num_threads;
+	num_encoders = num_encoders > 0 ? num_encoders : num_threads;
+	int failures = run_batch(batch_source, batch_output_dir, &kernel, &border,
+							 &decompress, &compress, num_decoders, num_threads, num_encoders);
+	exit(failures ? 1 : 0);
+  }
+
   if (!input_file_name) {
 	usage(prog_name, "No input file specified");
   }
@@ -353,13 +562,24 @@ main(int argc, char **argv)
 	usage(prog_name, "Input and output file can't be the same");
   }
 
+  if (stream) {
+	unsigned int error = convolve_stream(output_file_name, input_file_name, &kernel, &border);
+	free_kernel(&kernel);
+	exit(error ? 1 : 0);
+  }
+
   image_t *images = malloc(sizeof(image_t) * 2);
   image_t *input = &images[0];
   image_t *output = &images[1];
 
-  load_and_decode(input, input_file_name);
-
   double start = now();
+  if (load_and_decode(input, input_file_name, &decompress, NULL)) {
+	exit(1);
+  }
+  printf("    DECODE %5.3f seconds\n", now() - start);
+  init_image(output, input->rows, input->columns);
+
+  start = now();
   pthread_t *threads = malloc(sizeof(pthread_t) * num_threads);
   thread_args_t *thread_args = malloc(sizeof(thread_args_t) * num_threads);
   int rtn;
@@ -369,23 +589,30 @@ main(int argc, char **argv)
       thread_args[i].num_threads = num_threads;
       thread_args[i].input = input;
       thread_args[i].output = output;
-      memcpy(thread_args[i].kernel, selected_entry->kernel, sizeof(kernel_t));
+      thread_args[i].border = border;
+      thread_args[i].kernel = kernel;
       rtn = pthread_create(&threads[i], NULL, parallel_convolve, &thread_args[i]);
       check_thread_rtn("create", rtn);
   }
 
+  output->traits = PIXELS_ALL;
   for (int i = 0;  i < num_threads;  i++) {
       rtn = pthread_join(threads[i], NULL);
       check_thread_rtn("join", rtn);
+      output->traits &= thread_args[i].traits;
   }
   printf("    TOOK %5.3f seconds\n", now() - start);
 
-      
 
-  encode_and_store(output, output_file_name);
+  start = now();
+  if (encode_and_store(output, output_file_name, &compress)) {
+	exit(1);
+  }
+  printf("    ENCODE %5.3f seconds\n", now() - start);
 
   free_image(input);
   free_image(output);
+  free_kernel(&kernel);
   free(threads);
   free(thread_args);
 }
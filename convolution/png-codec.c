@@ -0,0 +1,750 @@
+/* zlib codecs for lodepng. Every codec but lodepng's own handles the two
+   byte zlib header and the Adler-32 trailer here and only deflates or
+   inflates the raw stream in between, so all of them report the same
+   lodepng error codes for broken headers and checksums. Also lodepng's
+   allocators, with their per-thread arenas, and memory-mapped PNG loading.
+ */
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include <zlib.h>
+#ifdef HAVE_LIBDEFLATE
+#include <libdeflate.h>
+#endif
+
+#include "png-codec.h"
+
+/* Arena blocks start with their size and stay 16-byte aligned.
+ */
+#define ARENA_ALIGN 16
+
+static __thread arena_t *current_arena;
+
+static size_t
+block_bytes(size_t size)
+{
+  return ARENA_ALIGN + (size + ARENA_ALIGN - 1) / ARENA_ALIGN * ARENA_ALIGN;
+}
+
+static size_t *
+block_header(void *ptr)
+{
+  return (size_t *) ((unsigned char *) ptr - ARENA_ALIGN);
+}
+
+static int
+in_arena(const arena_t *arena, const void *ptr)
+{
+  const unsigned char *p = ptr;
+  return arena && arena->base && p >= arena->base && p < arena->base + arena->size;
+}
+
+static void
+add_demand(arena_t *arena, size_t added, size_t removed)
+{
+  arena->demand = arena->demand + added - removed;
+  if (arena->demand > arena->peak) {
+	arena->peak = arena->demand;
+  }
+}
+
+void *
+lodepng_malloc(size_t size)
+{
+  arena_t *arena = current_arena;
+  if (!arena) {
+	return malloc(size);
+  }
+
+  size_t bytes = block_bytes(size);
+  add_demand(arena, bytes, 0);
+  if (!arena->base || bytes > arena->size - arena->used) {
+	return malloc(size);
+  }
+  unsigned char *block = arena->base + arena->used;
+  arena->used += bytes;
+  arena->last = block + ARENA_ALIGN;
+  *block_header(arena->last) = size;
+  return arena->last;
+}
+
+void
+lodepng_free(void *ptr)
+{
+  arena_t *arena = current_arena;
+  if (!in_arena(arena, ptr)) {
+	free(ptr);
+	return;
+  }
+  if (ptr == arena->last) {
+	size_t bytes = block_bytes(*block_header(ptr));
+	arena->used -= bytes;
+	add_demand(arena, 0, bytes);
+	arena->last = NULL;
+  }
+}
+
+void *
+lodepng_realloc(void *ptr, size_t new_size)
+{
+  arena_t *arena = current_arena;
+  if (!ptr) {
+	return lodepng_malloc(new_size);
+  }
+  if (!in_arena(arena, ptr)) {
+	return realloc(ptr, new_size);
+  }
+
+  size_t old_size = *block_header(ptr);
+  if (ptr == arena->last) {
+	size_t start = (unsigned char *) ptr - ARENA_ALIGN - arena->base;
+	size_t old_bytes = block_bytes(old_size);
+	size_t new_bytes = block_bytes(new_size);
+	if (new_bytes <= arena->size - start) {
+	  arena->used = start + new_bytes;
+	  add_demand(arena, new_bytes, old_bytes);
+	  *block_header(ptr) = new_size;
+	  return ptr;
+	}
+  }
+  void *moved = lodepng_malloc(new_size);
+  if (moved) {
+	memcpy(moved, ptr, old_size < new_size ? old_size : new_size);
+	lodepng_free(ptr);
+  }
+  return moved;
+}
+
+/* Set up 'arena' with room for 'size' bytes, which may be zero to let the
+   first image size it.
+ */
+void
+arena_init(arena_t *arena, size_t size)
+{
+  memset(arena, 0, sizeof(arena_t));
+  arena->base = size ? malloc(size) : NULL;
+  arena->size = arena->base ? size : 0;
+}
+
+void
+arena_free(arena_t *arena)
+{
+  free(arena->base);
+  memset(arena, 0, sizeof(arena_t));
+}
+
+/* Send lodepng's allocations on this thread to 'arena', which starts out
+   empty.
+ */
+void
+arena_begin(arena_t *arena)
+{
+  arena->used = arena->demand = arena->peak = 0;
+  arena->last = NULL;
+  current_arena = arena;
+}
+
+/* Stop using 'arena' on this thread, growing it if it overflowed.
+ */
+void
+arena_end(arena_t *arena)
+{
+  current_arena = NULL;
+  if (arena->peak > arena->size) {
+	free(arena->base);
+	arena->base = malloc(arena->peak);
+	arena->size = arena->base ? arena->peak : 0;
+  }
+  arena->used = 0;
+  arena->last = NULL;
+}
+
+/* zlib levels handed to the codecs through 'custom_context'; -1 is each
+   library's default.
+ */
+static const int codec_levels[] = { -1, 0, 1, 2, 3, 4, 5, 6, 7, 8, 9 };
+
+static int
+compress_level(const LodePNGCompressSettings *settings)
+{
+  return settings->custom_context ? *(const int *) settings->custom_context : -1;
+}
+
+/* Check the zlib header in front of a deflate stream. Returns a lodepng
+   error code.
+ */
+static unsigned
+check_zlib_header(const unsigned char *in, size_t insize)
+{
+  if (insize < 6) {
+	return 53;
+  }
+  if ((in[0] * 256 + in[1]) % 31 != 0) {
+	return 24;
+  }
+  if ((in[0] & 15) != 8 || (in[0] >> 4) > 7) {
+	return 25;
+  }
+  if (in[1] & 32) {
+	return 26;
+  }
+  return 0;
+}
+
+/* Compare the Adler-32 of the 'size' inflated bytes at 'data' with the
+   trailer of the zlib stream 'in'.
+ */
+static unsigned
+check_adler32(const unsigned char *data, size_t size, const unsigned char *in, size_t insize,
+			  const LodePNGDecompressSettings *settings)
+{
+  const unsigned char *trailer = in + insize - 4;
+  unsigned long expected = ((unsigned long) trailer[0] << 24) | (trailer[1] << 16) |
+	(trailer[2] << 8) | trailer[3];
+
+  if (settings->ignore_adler32) {
+	return 0;
+  }
+  return lodepng_adler32_update(1, data, size) == expected ? 0 : 58;
+}
+
+/* Grow '*out' so at least 'needed' bytes fit. Returns zero on success.
+ */
+static int
+reserve(unsigned char **out, size_t *capacity, size_t needed)
+{
+  if (needed <= *capacity) {
+	return 0;
+  }
+  size_t grown = *capacity * 2 > needed ? *capacity * 2 : needed;
+  unsigned char *data = lodepng_realloc(*out, grown);
+  if (!data) {
+	return 1;
+  }
+  *out = data;
+  *capacity = grown;
+  return 0;
+}
+
+/* Output bytes between calls to a decompress 'progress' function.
+ */
+#define PROGRESS_BYTES (1 << 16)
+
+/* Room to inflate into: exactly what the caller expects, if it knows, plus
+   a byte so a full buffer doesn't look like a truncated stream.
+ */
+static size_t
+inflate_room(size_t insize, const LodePNGDecompressSettings *settings)
+{
+  if (settings->expected_size) {
+	return settings->expected_size + 1;
+  }
+  return insize * 4 > 4096 ? insize * 4 : 4096;
+}
+
+/* Add the zlib header in front of, and the Adler-32 of 'in' behind, the
+   'deflated' bytes written at offset *outsize + 2 of '*out'.
+ */
+static void
+wrap_zlib(unsigned char *out, size_t *outsize, size_t deflated,
+		  const unsigned char *in, size_t insize)
+{
+  unsigned char *header = out + *outsize;
+  unsigned char *trailer = header + 2 + deflated;
+  unsigned long checksum = lodepng_adler32_update(1, in, insize);
+
+  header[0] = 0x78;
+  header[1] = 0x01;
+  trailer[0] = checksum >> 24;
+  trailer[1] = checksum >> 16;
+  trailer[2] = checksum >> 8;
+  trailer[3] = checksum;
+  *outsize += 2 + deflated + 4;
+}
+
+static unsigned
+zlib_decompress(unsigned char **out, size_t *outsize, const unsigned char *in, size_t insize,
+				const LodePNGDecompressSettings *settings)
+{
+  unsigned error = check_zlib_header(in, insize);
+  if (error) {
+	return error;
+  }
+
+  z_stream stream;
+  memset(&stream, 0, sizeof(z_stream));
+  if (inflateInit2(&stream, -15) != Z_OK) {
+	return 83;
+  }
+
+  size_t start = *outsize;
+  size_t capacity = *outsize;
+  size_t room = inflate_room(insize, settings);
+  stream.next_in = (unsigned char *) in + 2;
+  stream.avail_in = insize - 6;
+  int status = Z_OK;
+  while (status == Z_OK) {
+	if (*outsize == capacity) {
+	  /* Reported output may be in use on other threads, so it can't move. */
+	  if (settings->progress && capacity > start) {
+		error = 91;
+		break;
+	  }
+	  if (reserve(out, &capacity, *outsize + room)) {
+		error = 83;
+		break;
+	  }
+	}
+	size_t avail = capacity - *outsize;
+	if (settings->progress && avail > PROGRESS_BYTES) {
+	  avail = PROGRESS_BYTES;
+	}
+	stream.next_out = *out + *outsize;
+	stream.avail_out = avail;
+	status = inflate(&stream, Z_NO_FLUSH);
+	*outsize += avail - stream.avail_out;
+	if (settings->progress) {
+	  settings->progress(*out, *outsize, settings->progress_context);
+	}
+	if (status == Z_BUF_ERROR && stream.avail_in == 0) {
+	  error = 23;				/* Ran out of input before the final block */
+	} else if (status == Z_BUF_ERROR) {
+	  status = Z_OK;
+	} else if (status == Z_MEM_ERROR) {
+	  error = 83;
+	} else if (status != Z_OK && status != Z_STREAM_END) {
+	  error = 52;
+	}
+  }
+  inflateEnd(&stream);
+
+  if (!error) {
+	error = check_adler32(*out + start, *outsize - start, in, insize, settings);
+  }
+  return error;
+}
+
+static unsigned
+zlib_compress(unsigned char **out, size_t *outsize, const unsigned char *in, size_t insize,
+			  const LodePNGCompressSettings *settings)
+{
+  z_stream stream;
+  memset(&stream, 0, sizeof(z_stream));
+  if (deflateInit2(&stream, compress_level(settings), Z_DEFLATED, -15, 8,
+				   Z_DEFAULT_STRATEGY) != Z_OK) {
+	return 83;
+  }
+
+  size_t bound = deflateBound(&stream, insize);
+  unsigned char *data = lodepng_realloc(*out, *outsize + 2 + bound + 4);
+  if (!data) {
+	deflateEnd(&stream);
+	return 83;
+  }
+  *out = data;
+
+  stream.next_in = (unsigned char *) in;
+  stream.avail_in = insize;
+  stream.next_out = data + *outsize + 2;
+  stream.avail_out = bound;
+  int status = deflate(&stream, Z_FINISH);
+  size_t deflated = bound - stream.avail_out;
+  deflateEnd(&stream);
+  if (status != Z_STREAM_END) {
+	return 83;
+  }
+
+  wrap_zlib(data, outsize, deflated, in, insize);
+  return 0;
+}
+
+#ifdef HAVE_LIBDEFLATE
+/* libdeflate decompresses whole buffers only, so retry with twice the room
+   until the output fits.
+ */
+static unsigned
+libdeflate_decompress(unsigned char **out, size_t *outsize, const unsigned char *in,
+					  size_t insize, const LodePNGDecompressSettings *settings)
+{
+  unsigned error = check_zlib_header(in, insize);
+  if (error) {
+	return error;
+  }
+
+  struct libdeflate_decompressor *decompressor = libdeflate_alloc_decompressor();
+  if (!decompressor) {
+	return 83;
+  }
+
+  size_t start = *outsize;
+  size_t capacity = *outsize;
+  size_t room = inflate_room(insize, settings);
+  size_t inflated = 0;
+  enum libdeflate_result result = LIBDEFLATE_INSUFFICIENT_SPACE;
+  while (result == LIBDEFLATE_INSUFFICIENT_SPACE) {
+	if (reserve(out, &capacity, start + room)) {
+	  error = 83;
+	  break;
+	}
+	result = libdeflate_deflate_decompress(decompressor, in + 2, insize - 6, *out + start,
+										   capacity - start, &inflated);
+	room = (capacity - start) * 2;
+  }
+  libdeflate_free_decompressor(decompressor);
+
+  if (!error && result != LIBDEFLATE_SUCCESS) {
+	error = result == LIBDEFLATE_SHORT_OUTPUT ? 23 : 52;
+  }
+  if (!error) {
+	*outsize = start + inflated;
+	error = check_adler32(*out + start, inflated, in, insize, settings);
+  }
+  return error;
+}
+
+static unsigned
+libdeflate_compress(unsigned char **out, size_t *outsize, const unsigned char *in,
+					size_t insize, const LodePNGCompressSettings *settings)
+{
+  int level = compress_level(settings);
+  struct libdeflate_compressor *compressor = libdeflate_alloc_compressor(level < 0 ? 6 : level);
+  if (!compressor) {
+	return 83;
+  }
+
+  size_t bound = libdeflate_deflate_compress_bound(compressor, insize);
+  unsigned char *data = lodepng_realloc(*out, *outsize + 2 + bound + 4);
+  if (!data) {
+	libdeflate_free_compressor(compressor);
+	return 83;
+  }
+  *out = data;
+
+  size_t deflated = libdeflate_deflate_compress(compressor, in, insize,
+												data + *outsize + 2, bound);
+  libdeflate_free_compressor(compressor);
+  if (deflated == 0) {
+	return 83;
+  }
+
+  wrap_zlib(data, outsize, deflated, in, insize);
+  return 0;
+}
+#endif
+
+static unsigned auto_decompress(unsigned char **out, size_t *outsize,
+								const unsigned char *in, size_t insize,
+								const LodePNGDecompressSettings *settings);
+static unsigned auto_compress(unsigned char **out, size_t *outsize,
+							  const unsigned char *in, size_t insize,
+							  const LodePNGCompressSettings *settings);
+
+/* "auto" must stay just before the end; the timing loops stop at it.
+ */
+codec_t codec_catalog[] =
+  {
+	{ "lodepng", "built-in lodepng inflate and deflate",
+	  lodepng_zlib_decompress, lodepng_zlib_compress },
+	{ "zlib", "system zlib library",
+	  zlib_decompress, zlib_compress },
+#ifdef HAVE_LIBDEFLATE
+	{ "libdeflate", "libdeflate whole-buffer codec",
+	  libdeflate_decompress, libdeflate_compress },
+#endif
+	{ "auto", "fastest of the above, timed on first use",
+	  auto_decompress, auto_compress },
+	{ NULL }
+  };
+
+/* Look up a codec by name. Returns NULL if there is no such codec or it
+   wasn't built in.
+ */
+codec_t *
+find_codec_by_name(const char *name)
+{
+  for (codec_t *cp = codec_catalog;  cp->name;  cp++) {
+	if (strcmp(cp->name, name) == 0) {
+	  return cp;
+	}
+  }
+  return (codec_t *) NULL;
+}
+
+/* The codec chosen at build time with DEFAULT_CODEC_NAME, or "auto" if that
+   one wasn't built in.
+ */
+codec_t *
+default_codec(void)
+{
+  codec_t *codec = find_codec_by_name(DEFAULT_CODEC_NAME);
+  return codec ? codec : find_codec_by_name("auto");
+}
+
+/* List the codec catalog for a usage message.
+ */
+void
+print_codecs(FILE *stream)
+{
+  for (int i = 0;  codec_catalog[i].name;  i++) {
+	fprintf(stream, "       %-11s %s%s\n", codec_catalog[i].name, codec_catalog[i].description,
+			&codec_catalog[i] == default_codec() ? " (default)" : "");
+  }
+}
+
+/* Route the zlib streams of 'decompress' and 'compress' through 'codec',
+   compressing at zlib 'level' (0 to 9, or -1 for each codec's default).
+   The lodepng codec also gets its LZ77 settings from the level.
+ */
+void
+use_codec(codec_t *codec, int level, LodePNGDecompressSettings *decompress,
+		  LodePNGCompressSettings *compress)
+{
+  if (decompress) {
+	decompress->custom_zlib = codec->decompress;
+  }
+  if (compress) {
+	if (level >= 0) {
+	  lodepng_compress_settings_level(compress, level);
+	}
+	compress->custom_zlib = codec->compress;
+	compress->custom_context = &codec_levels[level < 0 ? 0 : level + 1];
+  }
+}
+
+static double
+seconds(void)
+{
+  struct timespec current_time;
+  clock_gettime(CLOCK_MONOTONIC, &current_time);
+  return current_time.tv_sec + current_time.tv_nsec / 1e9;
+}
+
+/* Stand-in for filtered scanlines: small residues around zero, some noise.
+ */
+#define SAMPLE_BYTES (1 << 20)
+#define SAMPLE_TRIALS 3
+
+static unsigned char *
+make_sample(void)
+{
+  unsigned char *sample = malloc(SAMPLE_BYTES);
+  unsigned int seed = 12345;
+
+  for (size_t i = 0;  i < SAMPLE_BYTES;  i++) {
+	seed = seed * 1103515245 + 12345;
+	sample[i] = (seed >> 16) % 16 == 0 ? seed >> 24 : (seed >> 20) % 25 - 12;
+  }
+  return sample;
+}
+
+static pthread_once_t decoder_once = PTHREAD_ONCE_INIT;
+static codec_t *decoder;
+
+/* Inflate the same stream with each codec and keep the quickest.
+ */
+static void
+tune_decoder(void)
+{
+  LodePNGDecompressSettings settings;
+  unsigned char *sample = make_sample();
+  unsigned char *zlib = NULL;
+  size_t zlib_size = 0;
+  double best = 0;
+  arena_t *arena = current_arena;
+
+  /* Tuning may start inside an image's decode, so keep it out of the arena. */
+  current_arena = NULL;
+  lodepng_decompress_settings_init(&settings);
+  decoder = find_codec_by_name("lodepng");
+  if (zlib_compress(&zlib, &zlib_size, sample, SAMPLE_BYTES, &lodepng_default_compress_settings)) {
+	free(sample);
+	current_arena = arena;
+	return;
+  }
+
+  for (codec_t *cp = codec_catalog;  cp->decompress != auto_decompress;  cp++) {
+	for (int t = 0;  t < SAMPLE_TRIALS;  t++) {
+	  unsigned char *out = NULL;
+	  size_t out_size = 0;
+	  double start = seconds();
+	  unsigned error = cp->decompress(&out, &out_size, zlib, zlib_size, &settings);
+	  double elapsed = seconds() - start;
+	  lodepng_free(out);
+	  if (!error && (best == 0 || elapsed < best)) {
+		best = elapsed;
+		decoder = cp;
+	  }
+	}
+  }
+  lodepng_free(zlib);
+  free(sample);
+  current_arena = arena;
+}
+
+/* Codec "auto" decompresses with. Measured once per process.
+ */
+codec_t *
+fastest_decoder(void)
+{
+  pthread_once(&decoder_once, tune_decoder);
+  return decoder;
+}
+
+static pthread_mutex_t encoder_lock = PTHREAD_MUTEX_INITIALIZER;
+static codec_t *encoders[sizeof(codec_levels) / sizeof(codec_levels[0])];
+
+/* Codec "auto" compresses with at the level of 'compress'. Each level is
+   measured once per process, with the thread count and LZ77 settings of
+   the first 'compress' seen at that level.
+ */
+codec_t *
+fastest_encoder(const LodePNGCompressSettings *compress)
+{
+  int level = compress_level(compress);
+
+  pthread_mutex_lock(&encoder_lock);
+  if (!encoders[level + 1]) {
+	unsigned char *sample = make_sample();
+	double best = 0;
+	arena_t *arena = current_arena;
+
+	current_arena = NULL;
+
+	encoders[level + 1] = find_codec_by_name("lodepng");
+	for (codec_t *cp = codec_catalog;  cp->compress != auto_compress;  cp++) {
+	  for (int t = 0;  t < SAMPLE_TRIALS;  t++) {
+		unsigned char *out = NULL;
+		size_t out_size = 0;
+		double start = seconds();
+		unsigned error = cp->compress(&out, &out_size, sample, SAMPLE_BYTES, compress);
+		double elapsed = seconds() - start;
+		lodepng_free(out);
+		if (!error && (best == 0 || elapsed < best)) {
+		  best = elapsed;
+		  encoders[level + 1] = cp;
+		}
+	  }
+	}
+	free(sample);
+	current_arena = arena;
+  }
+  codec_t *encoder = encoders[level + 1];
+  pthread_mutex_unlock(&encoder_lock);
+  return encoder;
+}
+
+static unsigned
+auto_decompress(unsigned char **out, size_t *outsize, const unsigned char *in, size_t insize,
+				const LodePNGDecompressSettings *settings)
+{
+  return fastest_decoder()->decompress(out, outsize, in, insize, settings);
+}
+
+static unsigned
+auto_compress(unsigned char **out, size_t *outsize, const unsigned char *in, size_t insize,
+			  const LodePNGCompressSettings *settings)
+{
+  return fastest_encoder(settings)->compress(out, outsize, in, insize, settings);
+}
+
+/* Map 'file_name' into memory, or read it if it can't be mapped (empty
+   files and pipes, for instance). Returns a lodepng error code.
+ */
+unsigned
+map_file(mapped_file_t *file, const char *file_name)
+{
+  struct stat info;
+  int fd = open(file_name, O_RDONLY);
+
+  file->data = NULL;
+  file->size = 0;
+  file->mapped = 0;
+  if (fd >= 0 && fstat(fd, &info) == 0 && S_ISREG(info.st_mode) && info.st_size > 0) {
+	void *data = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (data != MAP_FAILED) {
+	  madvise(data, info.st_size, MADV_SEQUENTIAL);
+	  file->data = data;
+	  file->size = info.st_size;
+	  file->mapped = 1;
+	}
+  }
+  if (fd >= 0) {
+	close(fd);
+  }
+  return file->mapped ? 0 : lodepng_load_file(&file->data, &file->size, file_name);
+}
+
+void
+unmap_file(mapped_file_t *file)
+{
+  if (file->mapped) {
+	munmap(file->data, file->size);
+  } else {
+	lodepng_free(file->data);
+  }
+  file->data = NULL;
+  file->size = 0;
+}
+
+/* Decode the PNG at 'png' to 8-bit RGBA in '*pixels', which is allocated
+   with malloc at its exact size from the header before anything is
+   inflated. lodepng's working buffers come from 'arena' unless it is NULL.
+   Returns a lodepng error code, leaving '*pixels' NULL on error.
+ */
+unsigned
+decode_rgba(unsigned char **pixels, unsigned *columns, unsigned *rows,
+			const unsigned char *png, size_t png_size,
+			const LodePNGDecompressSettings *decompress, arena_t *arena)
+{
+  LodePNGState state;
+  size_t bytes = 0;
+
+  *pixels = NULL;
+  if (arena) {
+	arena_begin(arena);
+  }
+  lodepng_state_init(&state);
+  state.decoder.zlibsettings = *decompress;
+  unsigned error = lodepng_inspect(columns, rows, &state, png, png_size);
+  if (!error && (size_t) *columns * *rows > 268435455) {
+	error = 92;
+  }
+  if (!error) {
+	bytes = lodepng_get_raw_size(*columns, *rows, &state.info_raw);
+	*pixels = malloc(bytes);
+	error = *pixels ? 0 : 83;
+  }
+  if (!error) {
+	error = lodepng_decode_into(*pixels, bytes, columns, rows, &state, png, png_size);
+  }
+  lodepng_state_cleanup(&state);
+  if (arena) {
+	arena_end(arena);
+  }
+  if (error) {
+	free(*pixels);
+	*pixels = NULL;
+  }
+  return error;
+}
+
+/* Have 'state' store 8-bit RGBA pixels with only the channels they need:
+   no alpha when they are all 'opaque', and one grey value in place of red,
+   green and blue when they are all 'grey'. This replaces lodepng's
+   auto_convert, which learns the same by scanning the whole image before
+   encoding (and may also find a palette or fewer bits per channel).
+ */
+void
+use_color_type(LodePNGState *state, int opaque, int grey)
+{
+  state->encoder.auto_convert = 0;
+  state->info_png.color.bitdepth = 8;
+  state->info_png.color.colortype =
+	opaque ? (grey ? LCT_GREY : LCT_RGB) : (grey ? LCT_GREY_ALPHA : LCT_RGBA);
+}
@@ -0,0 +1,79 @@
+#ifndef PNG_CODEC_H
+#define PNG_CODEC_H
+
+#include <stdio.h>
+
+#include "lodepng.h"
+
+/* Catalog of zlib codecs that lodepng can call through the 'custom_zlib'
+   hooks of its compress and decompress settings. "lodepng" is the built-in
+   codec, "zlib" the system library and "libdeflate" is only present when
+   built with HAVE_LIBDEFLATE. "auto" times the others the first time it is
+   used and then hands every call to the fastest. The last entry has a NULL
+   name.
+ */
+#ifndef DEFAULT_CODEC_NAME
+#define DEFAULT_CODEC_NAME "auto"
+#endif
+
+typedef struct {
+  char *name;					/* Codec name */
+  char *description;			/* One line for usage messages */
+  unsigned (*decompress)(unsigned char **out, size_t *outsize,
+						 const unsigned char *in, size_t insize,
+						 const LodePNGDecompressSettings *settings);
+  unsigned (*compress)(unsigned char **out, size_t *outsize,
+					   const unsigned char *in, size_t insize,
+					   const LodePNGCompressSettings *settings);
+} codec_t;
+
+extern codec_t codec_catalog[];
+
+codec_t *find_codec_by_name(const char *name);
+codec_t *default_codec(void);
+void print_codecs(FILE *stream);
+void use_codec(codec_t *codec, int level, LodePNGDecompressSettings *decompress,
+			   LodePNGCompressSettings *compress);
+codec_t *fastest_decoder(void);
+codec_t *fastest_encoder(const LodePNGCompressSettings *compress);
+
+/* lodepng is built with LODEPNG_NO_COMPILE_ALLOCATORS and gets
+   lodepng_malloc, lodepng_realloc and lodepng_free from png-codec.c. They
+   use the heap, except between arena_begin and arena_end on the calling
+   thread, when they carve blocks out of that arena instead. Blocks are
+   never returned one by one, except the most recent which can also grow in
+   place, and arena_end releases them all at once; if the arena ran out it
+   is regrown then to the most it had to hold, so after one image of each
+   size decoding makes no more calls to malloc. Nothing allocated inside
+   the arena may outlive arena_end.
+ */
+typedef struct {
+  unsigned char *base;
+  size_t size;
+  size_t used;					/* Bytes handed out since arena_begin */
+  size_t demand;				/* Bytes needed, counting blocks that didn't fit */
+  size_t peak;					/* Most 'demand' reached since arena_begin */
+  void *last;					/* Most recent block, NULL once freed */
+} arena_t;
+
+void arena_init(arena_t *arena, size_t size);
+void arena_free(arena_t *arena);
+void arena_begin(arena_t *arena);
+void arena_end(arena_t *arena);
+
+/* A PNG file's bytes: memory-mapped when possible, otherwise read in.
+ */
+typedef struct {
+  unsigned char *data;
+  size_t size;
+  int mapped;					/* Nonzero if 'data' is mapped rather than read */
+} mapped_file_t;
+
+unsigned map_file(mapped_file_t *file, const char *file_name);
+void unmap_file(mapped_file_t *file);
+unsigned decode_rgba(unsigned char **pixels, unsigned *columns, unsigned *rows,
+					 const unsigned char *png, size_t png_size,
+					 const LodePNGDecompressSettings *decompress, arena_t *arena);
+void use_color_type(LodePNGState *state, int opaque, int grey);
+
+#endif
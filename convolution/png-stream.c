@@ -0,0 +1,589 @@
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "png-stream.h"
+
+static const unsigned char png_signature[8] = { 137, 80, 78, 71, 13, 10, 26, 10 };
+
+static unsigned long
+read_u32(const unsigned char *bytes)
+{
+  return ((unsigned long) bytes[0] << 24) | ((unsigned long) bytes[1] << 16) |
+	((unsigned long) bytes[2] << 8) | (unsigned long) bytes[3];
+}
+
+static void
+write_u32(unsigned char *bytes, unsigned long value)
+{
+  bytes[0] = (value >> 24) & 0xFF;
+  bytes[1] = (value >> 16) & 0xFF;
+  bytes[2] = (value >> 8) & 0xFF;
+  bytes[3] = value & 0xFF;
+}
+
+static int
+reader_fail(png_reader_t *reader, const char *error)
+{
+  if (!reader->error) {
+	reader->error = error;
+  }
+  return -1;
+}
+
+static int
+read_exact(png_reader_t *reader, unsigned char *data, size_t length)
+{
+  if (fread(data, 1, length, reader->file) != length) {
+	return reader_fail(reader, "unexpected end of file");
+  }
+  return 0;
+}
+
+/* Read the data and CRC of a small chunk whose 'type' has already been read,
+   checking the CRC.
+ */
+static int
+read_small_chunk(png_reader_t *reader, const unsigned char *type,
+				 unsigned char *data, unsigned long length)
+{
+  unsigned char crc_bytes[4];
+
+  if (read_exact(reader, data, length) || read_exact(reader, crc_bytes, 4)) {
+	return -1;
+  }
+  unsigned long crc = crc32(crc32(0L, type, 4), data, length);
+  if (crc != read_u32(crc_bytes)) {
+	return reader_fail(reader, "chunk CRC mismatch");
+  }
+  return 0;
+}
+
+/* Check that the IHDR color type and bit depth form a legal PNG format.
+ */
+static int
+valid_color(unsigned int colortype, unsigned int bitdepth)
+{
+  switch (colortype) {
+  case LCT_GREY:
+	return bitdepth == 1 || bitdepth == 2 || bitdepth == 4 || bitdepth == 8 || bitdepth == 16;
+  case LCT_PALETTE:
+	return bitdepth == 1 || bitdepth == 2 || bitdepth == 4 || bitdepth == 8;
+  case LCT_RGB:
+  case LCT_GREY_ALPHA:
+  case LCT_RGBA:
+	return bitdepth == 8 || bitdepth == 16;
+  default:
+	return 0;
+  }
+}
+
+/* Parse one IHDR chunk body.
+ */
+static int
+parse_header(png_reader_t *reader, const unsigned char *data)
+{
+  reader->columns = read_u32(data);
+  reader->rows = read_u32(data + 4);
+  unsigned int bitdepth = data[8];
+  unsigned int colortype = data[9];
+
+  if (reader->columns == 0 || reader->rows == 0) {
+	return reader_fail(reader, "image has no pixels");
+  }
+  if (!valid_color(colortype, bitdepth)) {
+	return reader_fail(reader, "invalid color type or bit depth");
+  }
+  if (data[10] != 0 || data[11] != 0) {
+	return reader_fail(reader, "unknown compression or filter method");
+  }
+  if (data[12] != 0) {
+	return reader_fail(reader, "interlaced PNGs can't be streamed");
+  }
+
+  reader->color.colortype = (LodePNGColorType) colortype;
+  reader->color.bitdepth = bitdepth;
+  unsigned int bits_per_pixel = lodepng_get_bpp(&reader->color);
+  reader->scanline_bytes = ((size_t) reader->columns * bits_per_pixel + 7) / 8;
+  reader->filter_distance = (bits_per_pixel + 7) / 8;
+  return 0;
+}
+
+/* Apply the transparency chunk to the color mode.
+ */
+static int
+parse_transparency(png_reader_t *reader, const unsigned char *data, unsigned long length)
+{
+  LodePNGColorMode *color = &reader->color;
+
+  if (color->colortype == LCT_PALETTE) {
+	if (length > color->palettesize) {
+	  return reader_fail(reader, "tRNS chunk larger than palette");
+	}
+	for (unsigned long i = 0;  i < length;  i++) {
+	  color->palette[4 * i + 3] = data[i];
+	}
+  } else if (color->colortype == LCT_GREY && length == 2) {
+	color->key_defined = 1;
+	color->key_r = color->key_g = color->key_b = 256U * data[0] + data[1];
+  } else if (color->colortype == LCT_RGB && length == 6) {
+	color->key_defined = 1;
+	color->key_r = 256U * data[0] + data[1];
+	color->key_g = 256U * data[2] + data[3];
+	color->key_b = 256U * data[4] + data[5];
+  } else {
+	return reader_fail(reader, "invalid tRNS chunk");
+  }
+  return 0;
+}
+
+/* Open 'file_name' and read chunks up to the start of the image data.
+   Returns zero on success; on failure 'reader->error' says why. Either way,
+   finish with 'png_reader_close'.
+ */
+int
+png_reader_open(png_reader_t *reader, const char *file_name)
+{
+  memset(reader, 0, offsetof(png_reader_t, buffer));
+  reader->idat_left = 0;
+  reader->idat_done = 0;
+  reader->rows_read = 0;
+  reader->error = NULL;
+  lodepng_color_mode_init(&reader->color);
+
+  reader->file = fopen(file_name, "rb");
+  if (!reader->file) {
+	return reader_fail(reader, "can't open file for reading");
+  }
+
+  unsigned char signature[8];
+  if (read_exact(reader, signature, 8)) {
+	return -1;
+  }
+  if (memcmp(signature, png_signature, 8) != 0) {
+	return reader_fail(reader, "not a PNG file");
+  }
+
+  int have_header = 0;
+  for (;;) {
+	unsigned char header[8];
+	if (read_exact(reader, header, 8)) {
+	  return -1;
+	}
+	unsigned long length = read_u32(header);
+	const unsigned char *type = header + 4;
+
+	if (memcmp(type, "IDAT", 4) == 0) {
+	  if (!have_header) {
+		return reader_fail(reader, "IDAT before IHDR");
+	  }
+	  reader->idat_left = length;
+	  reader->idat_crc = crc32(0L, type, 4);
+	  break;
+	}
+	if (memcmp(type, "IEND", 4) == 0) {
+	  return reader_fail(reader, "no image data");
+	}
+
+	if (memcmp(type, "IHDR", 4) == 0 || memcmp(type, "PLTE", 4) == 0 ||
+		memcmp(type, "tRNS", 4) == 0) {
+	  unsigned char data[3 * 256];
+	  if (length > sizeof(data)) {
+		return reader_fail(reader, "chunk too large");
+	  }
+	  if (read_small_chunk(reader, type, data, length)) {
+		return -1;
+	  }
+
+	  if (memcmp(type, "IHDR", 4) == 0) {
+		if (length != 13 || parse_header(reader, data)) {
+		  return reader_fail(reader, "invalid IHDR chunk");
+		}
+		have_header = 1;
+	  } else if (memcmp(type, "PLTE", 4) == 0) {
+		if (length % 3 != 0 || length == 0) {
+		  return reader_fail(reader, "invalid PLTE chunk");
+		}
+		lodepng_palette_clear(&reader->color);
+		for (unsigned long i = 0;  i < length;  i += 3) {
+		  lodepng_palette_add(&reader->color, data[i], data[i + 1], data[i + 2], 255);
+		}
+	  } else if (parse_transparency(reader, data, length)) {
+		return -1;
+	  }
+	} else if (fseek(reader->file, length + 4, SEEK_CUR) != 0) {
+	  return reader_fail(reader, "unexpected end of file");
+	}
+  }
+
+  if (reader->color.colortype == LCT_PALETTE && reader->color.palettesize == 0) {
+	return reader_fail(reader, "palette image without PLTE chunk");
+  }
+
+  reader->scanline = malloc(reader->scanline_bytes + 1);
+  reader->current = malloc(reader->scanline_bytes);
+  reader->previous = calloc(reader->scanline_bytes, 1);
+
+  if (inflateInit(&reader->inflater) != Z_OK) {
+	return reader_fail(reader, "can't initialize inflate");
+  }
+  reader->inflater_ready = 1;
+  return 0;
+}
+
+/* Refill the inflater's input from the IDAT chunks. Returns zero when there
+   is no more image data.
+ */
+static int
+fill_input(png_reader_t *reader)
+{
+  while (reader->idat_left == 0) {
+	unsigned char trailer[12];
+
+	if (reader->idat_done) {
+	  return 0;
+	}
+	/* CRC of the finished chunk, then the next chunk's header. */
+	if (read_exact(reader, trailer, 12)) {
+	  return 0;
+	}
+	if (read_u32(trailer) != reader->idat_crc) {
+	  reader_fail(reader, "IDAT CRC mismatch");
+	  return 0;
+	}
+	if (memcmp(trailer + 8, "IDAT", 4) != 0) {
+	  reader->idat_done = 1;
+	  return 0;
+	}
+	reader->idat_left = read_u32(trailer + 4);
+	reader->idat_crc = crc32(0L, trailer + 8, 4);
+  }
+
+  size_t length = reader->idat_left < PNG_STREAM_BUFFER ? reader->idat_left : PNG_STREAM_BUFFER;
+  if (read_exact(reader, reader->buffer, length)) {
+	return 0;
+  }
+  reader->idat_left -= length;
+  reader->idat_crc = crc32(reader->idat_crc, reader->buffer, length);
+  reader->inflater.next_in = reader->buffer;
+  reader->inflater.avail_in = length;
+  return 1;
+}
+
+static unsigned char
+paeth(int a, int b, int c)
+{
+  int p = a + b - c;
+  int pa = abs(p - a);
+  int pb = abs(p - b);
+  int pc = abs(p - c);
+
+  if (pa <= pb && pa <= pc) {
+	return a;
+  }
+  return pb <= pc ? b : c;
+}
+
+/* Undo the PNG 'filter' applied to scanline 'in', given the unfiltered
+   scanline 'above'.
+ */
+static int
+unfilter(unsigned char *out, const unsigned char *in, const unsigned char *above,
+		 int filter, size_t length, size_t distance)
+{
+  size_t i;
+
+  switch (filter) {
+  case 0:
+	memcpy(out, in, length);
+	break;
+  case 1:
+	for (i = 0;  i < distance;  i++) {
+	  out[i] = in[i];
+	}
+	for (;  i < length;  i++) {
+	  out[i] = in[i] + out[i - distance];
+	}
+	break;
+  case 2:
+	for (i = 0;  i < length;  i++) {
+	  out[i] = in[i] + above[i];
+	}
+	break;
+  case 3:
+	for (i = 0;  i < distance;  i++) {
+	  out[i] = in[i] + (above[i] >> 1);
+	}
+	for (;  i < length;  i++) {
+	  out[i] = in[i] + ((out[i - distance] + above[i]) >> 1);
+	}
+	break;
+  case 4:
+	for (i = 0;  i < distance;  i++) {
+	  out[i] = in[i] + above[i];
+	}
+	for (;  i < length;  i++) {
+	  out[i] = in[i] + paeth(out[i - distance], above[i], above[i - distance]);
+	}
+	break;
+  default:
+	return -1;
+  }
+  return 0;
+}
+
+/* Decode the next scanline into 'rgba_row', which holds 'columns' RGBA8
+   pixels. Returns zero on success.
+ */
+int
+png_reader_next_row(png_reader_t *reader, unsigned char *rgba_row)
+{
+  if (reader->error) {
+	return -1;
+  }
+  if (reader->rows_read == reader->rows) {
+	return reader_fail(reader, "read past the last row");
+  }
+
+  z_stream *z = &reader->inflater;
+  z->next_out = reader->scanline;
+  z->avail_out = reader->scanline_bytes + 1;
+  while (z->avail_out > 0) {
+	if (z->avail_in == 0 && !fill_input(reader)) {
+	  return reader_fail(reader, "image data ends early");
+	}
+	int rtn = inflate(z, Z_NO_FLUSH);
+	if (rtn == Z_STREAM_END && z->avail_out > 0) {
+	  return reader_fail(reader, "image data ends early");
+	}
+	if (rtn != Z_OK && rtn != Z_STREAM_END) {
+	  return reader_fail(reader, "corrupt image data");
+	}
+  }
+
+  if (unfilter(reader->current, reader->scanline + 1, reader->previous, reader->scanline[0],
+			   reader->scanline_bytes, reader->filter_distance)) {
+	return reader_fail(reader, "unknown filter type");
+  }
+
+  LodePNGColorMode rgba;
+  lodepng_color_mode_init(&rgba);
+  if (lodepng_convert(rgba_row, reader->current, &rgba, &reader->color, reader->columns, 1)) {
+	return reader_fail(reader, "can't convert pixels to RGBA");
+  }
+
+  unsigned char *swap = reader->previous;
+  reader->previous = reader->current;
+  reader->current = swap;
+  reader->rows_read++;
+  return 0;
+}
+
+/* Release everything held by 'reader'.
+ */
+void
+png_reader_close(png_reader_t *reader)
+{
+  if (reader->inflater_ready) {
+	inflateEnd(&reader->inflater);
+  }
+  if (reader->file) {
+	fclose(reader->file);
+  }
+  free(reader->scanline);
+  free(reader->current);
+  free(reader->previous);
+  lodepng_color_mode_cleanup(&reader->color);
+}
+
+/* ==== Writer ================ */
+
+static int
+writer_fail(png_writer_t *writer, const char *error)
+{
+  if (!writer->error) {
+	writer->error = error;
+  }
+  return -1;
+}
+
+static int
+write_chunk(png_writer_t *writer, const char *type, const unsigned char *data, size_t length)
+{
+  unsigned char header[8];
+  unsigned char crc_bytes[4];
+
+  write_u32(header, length);
+  memcpy(header + 4, type, 4);
+  write_u32(crc_bytes, crc32(crc32(0L, header + 4, 4), data, length));
+
+  if (fwrite(header, 1, 8, writer->file) != 8 ||
+	  fwrite(data, 1, length, writer->file) != length ||
+	  fwrite(crc_bytes, 1, 4, writer->file) != 4) {
+	return writer_fail(writer, "write failed");
+  }
+  return 0;
+}
+
+/* Create 'file_name' and write the header for an RGBA8 image of the given
+   size. Returns zero on success; finish with 'png_writer_close' either way.
+ */
+int
+png_writer_open(png_writer_t *writer, const char *file_name,
+				unsigned int columns, unsigned int rows)
+{
+  memset(writer, 0, offsetof(png_writer_t, buffer));
+  writer->columns = columns;
+  writer->rows = rows;
+  writer->row_bytes = (size_t) columns * 4;
+
+  writer->file = fopen(file_name, "wb");
+  if (!writer->file) {
+	return writer_fail(writer, "can't open file for writing");
+  }
+
+  writer->previous = calloc(writer->row_bytes, 1);
+  for (int f = 0;  f < 5;  f++) {
+	writer->candidates[f] = malloc(writer->row_bytes + 1);
+	writer->candidates[f][0] = f;
+  }
+
+  unsigned char header[13];
+  write_u32(header, columns);
+  write_u32(header + 4, rows);
+  header[8] = 8;				/* Bit depth */
+  header[9] = LCT_RGBA;
+  header[10] = header[11] = header[12] = 0;
+  if (fwrite(png_signature, 1, 8, writer->file) != 8 ||
+	  write_chunk(writer, "IHDR", header, 13)) {
+	return writer_fail(writer, "write failed");
+  }
+
+  if (deflateInit(&writer->deflater, Z_DEFAULT_COMPRESSION) != Z_OK) {
+	return writer_fail(writer, "can't initialize deflate");
+  }
+  writer->deflater.next_out = writer->buffer;
+  writer->deflater.avail_out = PNG_STREAM_BUFFER;
+  return 0;
+}
+
+/* Run the deflater with 'flush', emitting an IDAT chunk each time the
+   output buffer fills.
+ */
+static int
+deflate_rows(png_writer_t *writer, int flush)
+{
+  z_stream *z = &writer->deflater;
+
+  for (;;) {
+	int rtn = deflate(z, flush);
+	if (rtn == Z_STREAM_ERROR) {
+	  return writer_fail(writer, "deflate failed");
+	}
+	if (z->avail_out == 0 || (rtn == Z_STREAM_END && z->avail_out < PNG_STREAM_BUFFER)) {
+	  if (write_chunk(writer, "IDAT", writer->buffer, PNG_STREAM_BUFFER - z->avail_out)) {
+		return -1;
+	  }
+	  z->next_out = writer->buffer;
+	  z->avail_out = PNG_STREAM_BUFFER;
+	  continue;
+	}
+	if (flush == Z_FINISH ? rtn == Z_STREAM_END : z->avail_in == 0) {
+	  return 0;
+	}
+  }
+}
+
+/* Filter one row of 'columns' RGBA8 pixels and feed it to the compressor.
+   Like lodepng's default strategy, the filter with the smallest sum of
+   absolute values is chosen for each row.
+ */
+int
+png_writer_write_row(png_writer_t *writer, const unsigned char *rgba_row)
+{
+  const size_t distance = 4;
+  size_t length = writer->row_bytes;
+  const unsigned char *above = writer->previous;
+  unsigned char *out;
+  size_t i;
+
+  if (writer->error) {
+	return -1;
+  }
+  if (writer->rows_written == writer->rows) {
+	return writer_fail(writer, "wrote past the last row");
+  }
+
+  memcpy(writer->candidates[0] + 1, rgba_row, length);
+  out = writer->candidates[1] + 1;
+  for (i = 0;  i < distance;  i++) {
+	out[i] = rgba_row[i];
+  }
+  for (;  i < length;  i++) {
+	out[i] = rgba_row[i] - rgba_row[i - distance];
+  }
+  out = writer->candidates[2] + 1;
+  for (i = 0;  i < length;  i++) {
+	out[i] = rgba_row[i] - above[i];
+  }
+  out = writer->candidates[3] + 1;
+  for (i = 0;  i < distance;  i++) {
+	out[i] = rgba_row[i] - (above[i] >> 1);
+  }
+  for (;  i < length;  i++) {
+	out[i] = rgba_row[i] - ((rgba_row[i - distance] + above[i]) >> 1);
+  }
+  out = writer->candidates[4] + 1;
+  for (i = 0;  i < distance;  i++) {
+	out[i] = rgba_row[i] - above[i];
+  }
+  for (;  i < length;  i++) {
+	out[i] = rgba_row[i] - paeth(rgba_row[i - distance], above[i], above[i - distance]);
+  }
+
+  int best = 0;
+  unsigned long best_sum = 0;
+  for (int f = 0;  f < 5;  f++) {
+	unsigned long sum = 0;
+	out = writer->candidates[f] + 1;
+	for (i = 0;  i < length;  i++) {
+	  sum += f == 0 ? out[i] : out[i] < 128 ? out[i] : 255U - out[i];
+	}
+	if (f == 0 || sum < best_sum) {
+	  best = f;
+	  best_sum = sum;
+	}
+  }
+
+  memcpy(writer->previous, rgba_row, length);
+  writer->deflater.next_in = writer->candidates[best];
+  writer->deflater.avail_in = length + 1;
+  writer->rows_written++;
+  return deflate_rows(writer, Z_NO_FLUSH);
+}
+
+/* Finish the compressed stream and the file. Returns zero if every row was
+   written and the file was completed successfully.
+ */
+int
+png_writer_close(png_writer_t *writer)
+{
+  if (writer->file) {
+	if (!writer->error && writer->rows_written != writer->rows) {
+	  writer_fail(writer, "file closed before the last row");
+	}
+	if (!writer->error && deflate_rows(writer, Z_FINISH) == 0) {
+	  write_chunk(writer, "IEND", (const unsigned char *) "", 0);
+	}
+	deflateEnd(&writer->deflater);
+	if (fclose(writer->file) != 0) {
+	  writer_fail(writer, "write failed");
+	}
+	writer->file = NULL;
+  }
+  free(writer->previous);
+  for (int f = 0;  f < 5;  f++) {
+	free(writer->candidates[f]);
+  }
+  return writer->error ? -1 : 0;
+}
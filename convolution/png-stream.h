@@ -0,0 +1,58 @@
+#ifndef PNG_STREAM_H
+#define PNG_STREAM_H
+
+#include <stdio.h>
+#include <zlib.h>
+
+#include "lodepng.h"
+
+/* Incremental PNG reader and writer that handle one RGBA8 scanline at a
+   time, so memory use depends on the image width rather than its area.
+   Interlaced (Adam7) files can't be streamed this way and are rejected.
+ */
+
+#define PNG_STREAM_BUFFER (64 * 1024)
+
+typedef struct {
+  FILE *file;
+  z_stream inflater;
+  int inflater_ready;
+  unsigned int columns;
+  unsigned int rows;
+  LodePNGColorMode color;		/* Pixel format stored in the file */
+  size_t scanline_bytes;		/* Scanline size without the filter byte */
+  unsigned int filter_distance;	/* Bytes per pixel for filtering, at least 1 */
+  unsigned char *scanline;		/* Filter type byte, then filtered scanline */
+  unsigned char *current;		/* Unfiltered scanline being returned */
+  unsigned char *previous;		/* Unfiltered scanline above it */
+  unsigned char buffer[PNG_STREAM_BUFFER];	/* Compressed IDAT bytes */
+  unsigned long idat_left;		/* Unread bytes of the current IDAT chunk */
+  unsigned long idat_crc;		/* Running CRC of the current IDAT chunk */
+  int idat_done;				/* Set once a non-IDAT chunk follows the data */
+  unsigned int rows_read;
+  const char *error;			/* Description of the first failure */
+} png_reader_t;
+
+typedef struct {
+  FILE *file;
+  z_stream deflater;
+  unsigned int columns;
+  unsigned int rows;
+  size_t row_bytes;
+  unsigned char *previous;		/* Last raw row written (zeros at first) */
+  unsigned char *candidates[5];	/* Filter byte plus row, one per filter */
+  unsigned char buffer[PNG_STREAM_BUFFER];	/* Compressed bytes for IDAT */
+  unsigned int rows_written;
+  const char *error;
+} png_writer_t;
+
+int png_reader_open(png_reader_t *reader, const char *file_name);
+int png_reader_next_row(png_reader_t *reader, unsigned char *rgba_row);
+void png_reader_close(png_reader_t *reader);
+
+int png_writer_open(png_writer_t *writer, const char *file_name,
+					unsigned int columns, unsigned int rows);
+int png_writer_write_row(png_writer_t *writer, const unsigned char *rgba_row);
+int png_writer_close(png_writer_t *writer);
+
+#endif
@@ -0,0 +1,80 @@
+#include <stdlib.h>
+
+#include "work-queue.h"
+
+/* Initialize 'queue' to hold up to 'capacity' items fed by 'producers'
+   producer threads.
+ */
+void
+queue_init(work_queue_t *queue, int capacity, int producers)
+{
+  queue->items = malloc(sizeof(void *) * capacity);
+  queue->capacity = capacity;
+  queue->head = 0;
+  queue->count = 0;
+  queue->producers = producers;
+  pthread_mutex_init(&queue->lock, NULL);
+  pthread_cond_init(&queue->not_empty, NULL);
+  pthread_cond_init(&queue->not_full, NULL);
+}
+
+/* Release a queue once no thread uses it any more.
+ */
+void
+queue_destroy(work_queue_t *queue)
+{
+  free(queue->items);
+  pthread_mutex_destroy(&queue->lock);
+  pthread_cond_destroy(&queue->not_empty);
+  pthread_cond_destroy(&queue->not_full);
+}
+
+/* Append 'item', waiting for room if the queue is full.
+ */
+void
+queue_push(work_queue_t *queue, void *item)
+{
+  pthread_mutex_lock(&queue->lock);
+  while (queue->count == queue->capacity) {
+	pthread_cond_wait(&queue->not_full, &queue->lock);
+  }
+  queue->items[(queue->head + queue->count) % queue->capacity] = item;
+  queue->count++;
+  pthread_cond_signal(&queue->not_empty);
+  pthread_mutex_unlock(&queue->lock);
+}
+
+/* Remove and return the oldest item, waiting for one if necessary. Returns
+   NULL once the queue is empty and all producers have closed it.
+ */
+void *
+queue_pop(work_queue_t *queue)
+{
+  void *item = NULL;
+
+  pthread_mutex_lock(&queue->lock);
+  while (queue->count == 0 && queue->producers > 0) {
+	pthread_cond_wait(&queue->not_empty, &queue->lock);
+  }
+  if (queue->count > 0) {
+	item = queue->items[queue->head];
+	queue->head = (queue->head + 1) % queue->capacity;
+	queue->count--;
+	pthread_cond_signal(&queue->not_full);
+  }
+  pthread_mutex_unlock(&queue->lock);
+  return item;
+}
+
+/* Called by each producer when it has no more items to push.
+ */
+void
+queue_close(work_queue_t *queue)
+{
+  pthread_mutex_lock(&queue->lock);
+  queue->producers--;
+  if (queue->producers == 0) {
+	pthread_cond_broadcast(&queue->not_empty);
+  }
+  pthread_mutex_unlock(&queue->lock);
+}
@@ -0,0 +1,28 @@
+#ifndef WORK_QUEUE_H
+#define WORK_QUEUE_H
+
+#include <pthread.h>
+
+/* Bounded, blocking FIFO of pointers connecting pipeline stages. Producers
+   block when the queue is full and consumers block when it is empty. Once
+   every producer has called 'queue_close', consumers drain what is left and
+   then receive NULL.
+ */
+typedef struct {
+  void **items;
+  int capacity;
+  int head;						/* Index of the oldest item */
+  int count;					/* Items currently queued */
+  int producers;				/* Producers that have not yet closed */
+  pthread_mutex_t lock;
+  pthread_cond_t not_empty;
+  pthread_cond_t not_full;
+} work_queue_t;
+
+void queue_init(work_queue_t *queue, int capacity, int producers);
+void queue_destroy(work_queue_t *queue);
+void queue_push(work_queue_t *queue, void *item);
+void *queue_pop(work_queue_t *queue);
+void queue_close(work_queue_t *queue);
+
+#endif
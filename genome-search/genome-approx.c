@@ -0,0 +1,338 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "genome-approx.h"
+
+/* Bases each lane scans in one go, not counting the overlap before them. */
+#define APPROX_STRIPE_BASES (64 * 1024)
+
+/* One word per lane; GCC spreads the operations over whatever vector
+   registers the target has, or runs them a word at a time.
+ */
+typedef uint64_t lanes_t __attribute__((vector_size(APPROX_LANES * sizeof(uint64_t))));
+typedef int64_t scores_t __attribute__((vector_size(APPROX_LANES * sizeof(int64_t))));
+
+/* A stretch of one contig: matches ending in ['first', 'end') are wanted,
+   and the scan starts at 'scan' to see the start of those.
+ */
+typedef struct {
+  long scan;
+  long first;
+  long end;
+} stripe_t;
+
+/* Set up 'approx' to find 'text' with up to 'max_edits' differences, or
+   mismatches only if 'mismatches_only'. As with the other searches, bytes
+   match only the same bytes. Returns nonzero, having said why, if the
+   pattern can't be searched for this way.
+ */
+int
+approx_init(approx_pattern_t *approx, const char *text, int max_edits, int mismatches_only)
+{
+  approx->text = text;
+  approx->length = strlen(text);
+  approx->max_edits = max_edits;
+  approx->mismatches_only = mismatches_only;
+
+  if (approx->length == 0 || approx->length > APPROX_MAX_LENGTH) {
+	fprintf(stderr, "Approximate search needs a pattern of 1 to %d bases\n", APPROX_MAX_LENGTH);
+	return 1;
+  }
+  if (max_edits < 0 || max_edits >= approx->length) {
+	fprintf(stderr, "Approximate search allows 0 to %d differences for '%s'\n",
+			approx->length - 1, text);
+	return 1;
+  }
+
+  memset(approx->peq, 0, sizeof(approx->peq));
+  for (int i = 0;  i < approx->length;  i++) {
+	approx->peq[(unsigned char) text[i]] |= (uint64_t) 1 << i;
+  }
+  return 0;
+}
+
+/* Count and report the match ending at 'end' with 'distance' differences. */
+static inline void
+report_match(long end, int distance, long *counts, approx_fn_t report, void *context)
+{
+  counts[distance]++;
+  if (report) {
+	report(end, distance, context);
+  }
+}
+
+/* Scan 'num_stripes' stripes side by side, one to a lane, with Myers'
+   bit-vector algorithm: bit i of the vertical deltas 'pv' and 'mv' says
+   whether the distance of the first i + 1 pattern bases to the best
+   substring ending here went up or down from the row above, and 'score'
+   follows the last row. 'bytes' holds each stripe's bases from its scan
+   start, padded with zeros. Returns the number of matches.
+ */
+static long
+myers_lanes(const approx_pattern_t *approx, const stripe_t *stripes, int num_stripes,
+			char **bytes, long steps, long *counts, approx_fn_t report, void *context)
+{
+  const uint64_t *peq = approx->peq;
+  const uint64_t high = (uint64_t) 1 << (approx->length - 1);
+  const int last = approx->length - 1;
+  lanes_t pv = ~(lanes_t) {};
+  lanes_t mv = {};
+  scores_t score = (scores_t) {} + approx->length;
+  scores_t limit = (scores_t) {} + approx->max_edits;
+  long match_count = 0;
+
+  for (long t = 0;  t < steps;  t++) {
+	lanes_t eq;
+	for (int l = 0;  l < APPROX_LANES;  l++) {
+	  eq[l] = peq[(unsigned char) bytes[l][t]];
+	}
+	lanes_t xv = eq | mv;
+	lanes_t xh = (((eq & pv) + pv) ^ pv) | eq;
+	lanes_t ph = mv | ~(xh | pv);
+	lanes_t mh = pv & xh;
+	score += (scores_t) ((ph & high) >> last);
+	score -= (scores_t) ((mh & high) >> last);
+	ph <<= 1;
+	mh <<= 1;
+	pv = mh | ~(xv | ph);
+	mv = ph & xv;
+
+	scores_t hit = score <= limit;
+	int any = 0;
+	for (int l = 0;  l < APPROX_LANES;  l++) {
+	  any |= hit[l] != 0;
+	}
+	if (!any) {
+	  continue;
+	}
+	for (int l = 0;  l < num_stripes;  l++) {
+	  long end = stripes[l].scan + t;
+	  if (hit[l] && end >= stripes[l].first && end < stripes[l].end) {
+		report_match(end, score[l], counts, report, context);
+		match_count++;
+	  }
+	}
+  }
+  return match_count;
+}
+
+/* As 'myers_lanes', with Wu-Manber's shift-and for mismatches only: bit i
+   of 'r[d]' says whether the first i + 1 pattern bases match the bytes
+   ending here with at most d mismatches.
+ */
+static long
+shift_and_lanes(const approx_pattern_t *approx, const stripe_t *stripes, int num_stripes,
+				char **bytes, long steps, long *counts, approx_fn_t report, void *context)
+{
+  const uint64_t *peq = approx->peq;
+  const uint64_t high = (uint64_t) 1 << (approx->length - 1);
+  const int k = approx->max_edits;
+  lanes_t r[APPROX_MAX_LENGTH];
+  long match_count = 0;
+
+  for (int d = 0;  d <= k;  d++) {
+	r[d] = (lanes_t) {};
+  }
+  for (long t = 0;  t < steps;  t++) {
+	lanes_t eq;
+	for (int l = 0;  l < APPROX_LANES;  l++) {
+	  eq[l] = peq[(unsigned char) bytes[l][t]];
+	}
+	lanes_t before = r[0];
+	r[0] = (r[0] << 1 | 1) & eq;
+	for (int d = 1;  d <= k;  d++) {
+	  lanes_t old = r[d];
+	  r[d] = ((r[d] << 1 | 1) & eq) | (before << 1 | 1);
+	  before = old;
+	}
+
+	lanes_t hit = r[k] & high;
+	int any = 0;
+	for (int l = 0;  l < APPROX_LANES;  l++) {
+	  any |= hit[l] != 0;
+	}
+	if (!any) {
+	  continue;
+	}
+	for (int l = 0;  l < num_stripes;  l++) {
+	  long end = stripes[l].scan + t;
+	  if (hit[l] && end >= stripes[l].first && end < stripes[l].end) {
+		int d = 0;
+		while (!(r[d][l] & high)) {
+		  d++;
+		}
+		report_match(end, d, counts, report, context);
+		match_count++;
+	  }
+	}
+  }
+  return match_count;
+}
+
+/* Unpack 'num_stripes' stripes into 'bytes' and scan them together. */
+static long
+search_stripes(const approx_pattern_t *approx, const fasta_t *fasta, const stripe_t *stripes,
+			   int num_stripes, char **bytes, long *counts, approx_fn_t report, void *context)
+{
+  long steps = 0;
+
+  for (int l = 0;  l < APPROX_LANES;  l++) {
+	long length = l < num_stripes ? stripes[l].end - stripes[l].scan : 0;
+	if (length > steps) {
+	  steps = length;
+	}
+  }
+  for (int l = 0;  l < APPROX_LANES;  l++) {
+	long length = l < num_stripes ? stripes[l].end - stripes[l].scan : 0;
+	fasta_unpack(fasta, l < num_stripes ? stripes[l].scan : 0, length, bytes[l]);
+	memset(bytes[l] + length, 0, steps - length);
+  }
+
+  if (approx->mismatches_only) {
+	return shift_and_lanes(approx, stripes, num_stripes, bytes, steps, counts, report, context);
+  }
+  return myers_lanes(approx, stripes, num_stripes, bytes, steps, counts, report, context);
+}
+
+/* Find every approximate match of 'approx' that ends in ['first', 'end'),
+   adding to 'counts' (one per number of differences, 0 to 'max_edits') and
+   calling 'report' for each if it isn't NULL. A match is a position where
+   some substring ending there is within 'max_edits' of the pattern, so a
+   close match usually shows up at a few neighbouring positions. Each
+   contig is searched on its own, so no match spans two, and the scan
+   starts far enough before 'first' to see every match ending in range, so
+   splitting the sequence into adjacent ranges counts each match exactly
+   once. Matches are reported out of order. Returns the number of matches.
+ */
+long
+approx_search(const approx_pattern_t *approx, const fasta_t *fasta, long first, long end,
+			  long *counts, approx_fn_t report, void *context)
+{
+  /* How far before its end a match within 'max_edits' edits can start. */
+  const long overlap = approx->length - 1 + (approx->mismatches_only ? 0 : approx->max_edits);
+  const long lane_bytes = APPROX_STRIPE_BASES + overlap;
+  char *buffer = malloc(APPROX_LANES * lane_bytes);
+  char *bytes[APPROX_LANES];
+  stripe_t stripes[APPROX_LANES];
+  int num_stripes = 0;
+  long match_count = 0;
+  long position = first;
+  long contig = fasta_find_contig(fasta, first);
+
+  for (int l = 0;  l < APPROX_LANES;  l++) {
+	bytes[l] = buffer + l * lane_bytes;
+  }
+
+  /* Deal out stripes of up to APPROX_STRIPE_BASES, within one contig, to
+	 the lanes. */
+  while (position < end) {
+	long contig_start = contig >= 0 ? fasta->contigs[contig].start : 0;
+	long contig_end = contig + 1 < fasta->num_contigs ? fasta->contigs[contig + 1].start :
+	  fasta->cur_length;
+	if (position >= contig_end) {
+	  contig++;
+	  continue;
+	}
+
+	stripe_t *stripe = &stripes[num_stripes++];
+	stripe->first = position;
+	stripe->end = position + APPROX_STRIPE_BASES;
+	if (stripe->end > contig_end) {
+	  stripe->end = contig_end;
+	}
+	if (stripe->end > end) {
+	  stripe->end = end;
+	}
+	stripe->scan = position - overlap > contig_start ? position - overlap : contig_start;
+	position = stripe->end;
+
+	if (num_stripes == APPROX_LANES || position >= end) {
+	  match_count += search_stripes(approx, fasta, stripes, num_stripes, bytes, counts,
+									report, context);
+	  num_stripes = 0;
+	}
+  }
+
+  free(buffer);
+  return match_count;
+}
+
+/* An 'approx_fn_t' that appends each match to the 'approx_matches_t'
+   passed as its context.
+ */
+void
+approx_collect(long end, int distance, void *matches)
+{
+  approx_matches_t *list = matches;
+
+  if (list->num_matches == list->max_matches) {
+	list->max_matches = list->max_matches ? 2 * list->max_matches : 1024;
+	list->matches = realloc(list->matches, list->max_matches * sizeof(approx_match_t));
+  }
+  list->matches[list->num_matches].end = end;
+  list->matches[list->num_matches].distance = distance;
+  list->num_matches++;
+}
+
+/* Move the matches in 'from' to the end of 'into', leaving 'from' empty. */
+void
+approx_merge_matches(approx_matches_t *into, approx_matches_t *from)
+{
+  if (into->num_matches + from->num_matches > into->max_matches) {
+	into->max_matches = into->num_matches + from->num_matches;
+	into->matches = realloc(into->matches, into->max_matches * sizeof(approx_match_t));
+  }
+  if (from->num_matches > 0) {
+	memcpy(into->matches + into->num_matches, from->matches,
+		   from->num_matches * sizeof(approx_match_t));
+  }
+  into->num_matches += from->num_matches;
+  free(from->matches);
+  from->matches = NULL;
+  from->num_matches = 0;
+  from->max_matches = 0;
+}
+
+/* Order matches by distance, then by position. */
+static int
+compare_matches(const void *a, const void *b)
+{
+  const approx_match_t *x = a;
+  const approx_match_t *y = b;
+
+  if (x->distance != y->distance) {
+	return x->distance < y->distance ? -1 : 1;
+  }
+  return x->end < y->end ? -1 : x->end > y->end;
+}
+
+/* Print the count of matches with each number of differences and, if
+   'matches' isn't NULL, where each match is: the pattern's length of
+   bytes ending at the match, kept within its contig.
+ */
+void
+approx_print_results(const approx_pattern_t *approx, fasta_t *fasta, const long *counts,
+					 approx_matches_t *matches)
+{
+  const char *what = approx->mismatches_only ? "MISMATCH" : "EDIT";
+  const char *plural = approx->mismatches_only ? "ES" : "S";
+  long m = 0;
+
+  if (matches) {
+	qsort(matches->matches, matches->num_matches, sizeof(approx_match_t), compare_matches);
+  }
+  for (int d = 0;  d <= approx->max_edits;  d++) {
+	printf("  %2d %s%s %ld time%s\n", d, what, d == 1 ? "" : plural, counts[d],
+		   counts[d] == 1 ? "" : "s");
+	for (;  matches && m < matches->num_matches && matches->matches[m].distance == d;  m++) {
+	  long end = matches->matches[m].end;
+	  long contig = fasta_find_contig(fasta, end);
+	  long start = end - approx->length + 1;
+	  if (contig >= 0 && start < fasta->contigs[contig].start) {
+		start = fasta->contigs[contig].start;
+	  }
+	  bytes_around(fasta, start, end - start + 1);
+	}
+  }
+}
@@ -0,0 +1,49 @@
+#ifndef GENOME_APPROX_H
+#define GENOME_APPROX_H
+
+#include <stdint.h>
+
+#include "genome-engine.h"
+
+/* **************** Approximate search **************** */
+/* Finds where a pattern of up to 64 bases occurs with at most 'max_edits'
+   differences, by bit-parallel dynamic programming: Myers' algorithm for
+   edit distance (substitutions, insertions and deletions) or Wu-Manber's
+   shift-and for mismatches only. Each step of either is a handful of word
+   operations, run on APPROX_LANES stretches of the sequence at once.
+ */
+#define APPROX_MAX_LENGTH 64
+#define APPROX_LANES 4
+
+typedef struct {
+  const char *text;				/* Pattern as given */
+  int length;
+  int max_edits;
+  int mismatches_only;			/* Substitutions only, no insertions or deletions? */
+  uint64_t peq[256];			/* Pattern positions holding each byte, a bit each */
+} approx_pattern_t;
+
+/* Called by 'approx_search' for each match, with the caller's 'context'. */
+typedef void (*approx_fn_t)(long end, int distance, void *context);
+
+/* A match ending at 'end', kept by 'approx_collect'. */
+typedef struct {
+  long end;
+  int distance;
+} approx_match_t;
+
+typedef struct {
+  approx_match_t *matches;
+  long num_matches;
+  long max_matches;				/* Matches allocated */
+} approx_matches_t;
+
+int approx_init(approx_pattern_t *approx, const char *text, int max_edits, int mismatches_only);
+long approx_search(const approx_pattern_t *approx, const fasta_t *fasta, long first, long end,
+				   long *counts, approx_fn_t report, void *context);
+void approx_collect(long end, int distance, void *matches);
+void approx_merge_matches(approx_matches_t *into, approx_matches_t *from);
+void approx_print_results(const approx_pattern_t *approx, fasta_t *fasta, const long *counts,
+						  approx_matches_t *matches);
+
+#endif
@@ -0,0 +1,1116 @@
+/* For mremap. */
+#define _GNU_SOURCE
+
+#include <ctype.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "genome-engine.h"
+
+/* Bytes of a FASTA file decompressed at a time. */
+#define READ_BLOCK_BYTES (256 * 1024)
+
+static const char base_letters[] = "ACGT";
+
+/* Return the 2-bit code of an upper- or lower-case A, C, G or T, or -1 for
+   any other byte.
+ */
+static inline int
+base_code(char c)
+{
+  switch (c) {
+  case 'A': case 'a':
+	return 0;
+  case 'C': case 'c':
+	return 1;
+  case 'G': case 'g':
+	return 2;
+  case 'T': case 't':
+	return 3;
+  default:
+	return -1;
+  }
+}
+
+/* Words of packed sequence needed for 'length' bases. One spare word lets
+   'fasta_word' read past the last base.
+ */
+static inline size_t
+packed_words(long length)
+{
+  return length / BASES_PER_WORD + 2;
+}
+
+/* Reserve zeroed memory for 'words' words of packed sequence, moving the
+   'old_words' at 'old' if it isn't NULL. The pages are mapped, not
+   allocated: memory is only used as the sequence is written, so reserving
+   generously costs nothing.
+ */
+static uint64_t *
+packed_map(uint64_t *old, size_t old_words, size_t words)
+{
+  void *map;
+
+  if (old) {
+	map = mremap(old, old_words * sizeof(uint64_t), words * sizeof(uint64_t), MREMAP_MAYMOVE);
+  } else {
+	map = mmap(NULL, words * sizeof(uint64_t), PROT_READ | PROT_WRITE,
+			   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  }
+  if (map == MAP_FAILED) {
+	fprintf(stderr, "Can't reserve %ld bytes for FASTA data\n", (long)(words * sizeof(uint64_t)));
+	exit(1);
+  }
+  return map;
+}
+
+/* Create a FASTA object with room for 'max_length' bases to start with;
+   it grows as needed. Use 'fasta_size_hint' to pick 'max_length'.
+ */
+fasta_t *
+fasta_create(long max_length)
+{
+  if (verbose) {
+	printf("Allocate %ld bytes for %ld bases\n",
+		   (long)(packed_words(max_length) * sizeof(uint64_t)), max_length);
+  }
+  fasta_t *new = calloc(1, sizeof(fasta_t));
+  new->packed = packed_map(NULL, 0, packed_words(max_length));
+  new->max_length = max_length;
+  return new;
+}
+
+/* Destroy a FASTA object; deallocates memory. */
+void
+fasta_destroy(fasta_t *old)
+{
+  if (old->map) {
+	munmap(old->map, old->map_size);
+	free(old);
+	return;
+  }
+  if (old->packed) {
+	munmap(old->packed, packed_words(old->max_length) * sizeof(uint64_t));
+  }
+  free(old->runs);
+  free(old->contigs);
+  free(old->names);
+  free(old);
+}
+
+/* Start a contig at the end of the sequence. Its name follows from
+   'fasta_add_name'.
+ */
+static void
+fasta_add_contig(fasta_t *fasta)
+{
+  if (fasta->num_contigs == fasta->max_contigs) {
+	fasta->max_contigs = fasta->max_contigs ? 2 * fasta->max_contigs : 64;
+	fasta->contigs = realloc(fasta->contigs, sizeof(fasta_contig_t) * fasta->max_contigs);
+  }
+  fasta_contig_t *contig = &fasta->contigs[fasta->num_contigs++];
+  contig->start = fasta->cur_length;
+  contig->name = fasta->names_length;
+}
+
+/* Append 'length' bytes to the name of the last contig; a NUL ends it. */
+static void
+fasta_add_name(fasta_t *fasta, const char *bytes, long length)
+{
+  if (length == 0) {
+	return;
+  }
+  if (fasta->names_length + length > fasta->max_names) {
+	while (fasta->names_length + length > fasta->max_names) {
+	  fasta->max_names = fasta->max_names ? 2 * fasta->max_names : 1024;
+	}
+	fasta->names = realloc(fasta->names, fasta->max_names);
+  }
+  memcpy(fasta->names + fasta->names_length, bytes, length);
+  fasta->names_length += length;
+}
+
+/* Record that the byte at 'position', just appended, is 'base' (or a
+   lower-case acgt if 'base' is zero), extending the last run if it can.
+ */
+static void
+fasta_add_to_run(fasta_t *fasta, long position, char base)
+{
+  if (fasta->num_runs > 0) {
+	fasta_run_t *last = &fasta->runs[fasta->num_runs - 1];
+	if (last->start + last->length == position && last->base == base) {
+	  last->length++;
+	  return;
+	}
+  }
+  if (fasta->num_runs == fasta->max_runs) {
+	fasta->max_runs = fasta->max_runs ? 2 * fasta->max_runs : 1024;
+	fasta->runs = realloc(fasta->runs, sizeof(fasta_run_t) * fasta->max_runs);
+  }
+  fasta_run_t *run = &fasta->runs[fasta->num_runs++];
+  memset(run, 0, sizeof(fasta_run_t));	/* Padding too, for genome images */
+  run->start = position;
+  run->length = 1;
+  run->base = base;
+}
+
+/* Make room in a FASTA object for at least 'length' bases, doubling its
+   reservation; the new words are zeroed like the rest.
+ */
+static void
+fasta_grow(fasta_t *fasta, long length)
+{
+  size_t old_words = packed_words(fasta->max_length);
+
+  while (fasta->max_length < length) {
+	fasta->max_length = fasta->max_length ? 2 * fasta->max_length : ONE_MEGA;
+  }
+  fasta->packed = packed_map(fasta->packed, old_words, packed_words(fasta->max_length));
+}
+
+/* Append the 'length' bytes of sequence data at 'bytes', which hold no
+   newlines. Upper-case A, C, G and T only need packing; anything else
+   also goes into the runs.
+ */
+static void
+fasta_append_bytes(fasta_t *fasta, const char *bytes, long length)
+{
+  long position = fasta->cur_length;
+  uint64_t *word = fasta->packed + position / BASES_PER_WORD;
+  uint64_t bits = *word;
+  int shift = 2 * (position % BASES_PER_WORD);
+
+  for (long i = 0;  i < length;  i++) {
+	char c = bytes[i];
+	int code = base_code(c);
+	if (code < 0) {
+	  fasta_add_to_run(fasta, position + i, c);
+	  code = 0;
+	} else if (c >= 'a') {
+	  fasta_add_to_run(fasta, position + i, 0);
+	}
+	bits |= (uint64_t)code << shift;
+	shift += 2;
+	if (shift == 64) {
+	  *word++ = bits;
+	  bits = *word;
+	  shift = 0;
+	}
+  }
+  *word = bits;
+  fasta->cur_length += length;
+}
+
+/* Lines seen by 'fasta_load'. */
+typedef struct {
+  int lines_kept;
+  int lines_skipped;
+} fasta_lines_t;
+
+/* Read the FASTA data in 'file_name' from 'gzfp' onto the end of 'fasta',
+   a block at a time, skipping newlines. Annotation lines start contigs,
+   named by their first word. The FASTA object grows to fit.
+ */
+static void
+fasta_load(gzFile gzfp, const char *file_name, fasta_t *fasta, fasta_lines_t *lines)
+{
+  char *block = malloc(READ_BLOCK_BYTES);
+  int line_start = 1;
+  int in_annotation = 0;
+  int naming = 0;				/* Still reading a contig name? */
+  int have_contig = 0;			/* Has this file started a contig? */
+  int got;
+
+  lines->lines_kept = 0;
+  lines->lines_skipped = 0;
+  while ((got = gzread(gzfp, block, READ_BLOCK_BYTES)) > 0) {
+	if (fasta->cur_length + got > fasta->max_length) {
+	  fasta_grow(fasta, fasta->cur_length + got);
+	}
+
+	const char *p = block;
+	const char *end = block + got;
+	while (p < end) {
+	  if (line_start) {
+		line_start = 0;
+		if (*p == '>') {
+		  /* Line contains text annotation; it starts a contig. */
+		  lines->lines_skipped++;
+		  in_annotation = naming = have_contig = 1;
+		  fasta_add_contig(fasta);
+		  p++;
+		  continue;
+		}
+		lines->lines_kept++;
+	  }
+	  const char *newline = memchr(p, '\n', end - p);
+	  const char *line_end = newline ? newline : end;
+	  if (in_annotation) {
+		const char *name_end = p;
+		while (naming && name_end < line_end && !isspace((unsigned char) *name_end)) {
+		  name_end++;
+		}
+		if (naming) {
+		  fasta_add_name(fasta, p, name_end - p);
+		}
+		if (naming && (name_end < line_end || newline)) {
+		  fasta_add_name(fasta, "", 1);
+		  naming = 0;
+		}
+	  } else if (line_end > p) {
+		if (!have_contig) {
+		  fasta_add_contig(fasta);
+		  fasta_add_name(fasta, file_name, strlen(file_name) + 1);
+		  have_contig = 1;
+		}
+		fasta_append_bytes(fasta, p, line_end - p);
+	  }
+	  line_start = newline != NULL;
+	  in_annotation &= !line_start;
+	  p = newline ? newline + 1 : end;
+	}
+  }
+  if (naming) {
+	fasta_add_name(fasta, "", 1);
+  }
+
+  free(block);
+}
+
+/* Return an upper bound on the bases in the FASTA files 'file_names', from
+ * the uncompressed size in the trailer of each .gz file or the size of each
+ * text file. The trailer only holds the size modulo 4 GB, and only of the
+ * last member of a multi-member file, so the FASTA object may still have to
+ * grow; files that can't be read count as empty here and are reported when
+ * loaded.
+ */
+long
+fasta_size_hint(char **file_names, int num_files)
+{
+  long total = 0;
+
+  for (int i = 0;  i < num_files;  i++) {
+	FILE *fp = fopen(file_names[i], "rb");
+	if (!fp) {
+	  continue;
+	}
+	unsigned char magic[2];
+	unsigned char trailer[4];
+	struct stat info;
+	if (fread(magic, 1, 2, fp) == 2 && magic[0] == 0x1f && magic[1] == 0x8b &&
+		fseek(fp, -4, SEEK_END) == 0 && fread(trailer, 1, 4, fp) == 4) {
+	  total += (long)trailer[0] | (long)trailer[1] << 8 | (long)trailer[2] << 16 |
+		(long)trailer[3] << 24;
+	} else if (fstat(fileno(fp), &info) == 0) {
+	  total += info.st_size;
+	}
+	fclose(fp);
+  }
+  return total;
+}
+
+/* Read a FASTA file into a FASTA structure. Can be called multiple times and
+ * will append new data to whatever is already in existing structure. For
+ * example, can read multiple chromosome files into a single FASTA
+ * structure, which grows if they don't fit. Works with both .gz and flat
+ * text files (but prefer the zipped version to save disk space!).
+ */
+void
+fasta_read_file(char *file_name, fasta_t *fasta)
+{
+  gzFile gzfp = gzopen(file_name, "rb");
+  if (!gzfp) {
+	fprintf(stderr, "Can't open '%s' for reading\n", file_name);
+	exit(1);
+  }
+  printf(" LOADING %s\n", file_name);
+
+  fasta_lines_t lines;
+  gzbuffer(gzfp, READ_BLOCK_BYTES);
+  fasta_load(gzfp, file_name, fasta, &lines);
+
+  if (verbose) {
+	printf("%s: %d lines skipped, %d lines kept, %ld total bytes, %ld runs\n",
+		   file_name, lines.lines_skipped, lines.lines_kept, fasta->cur_length, fasta->num_runs);
+  }
+
+  gzclose(gzfp);
+}
+
+/* Append the FASTA object 'part', loaded on its own, to 'fasta': the
+   packed words are shifted into place a word at a time and the runs and
+   contigs moved along.
+ */
+static void
+fasta_append_part(fasta_t *fasta, const fasta_t *part)
+{
+  if (fasta->cur_length + part->cur_length > fasta->max_length) {
+	fasta_grow(fasta, fasta->cur_length + part->cur_length);
+  }
+
+  long position = fasta->cur_length;
+  uint64_t *out = fasta->packed + position / BASES_PER_WORD;
+  int shift = 2 * (position % BASES_PER_WORD);
+  long words = (part->cur_length + BASES_PER_WORD - 1) / BASES_PER_WORD;
+  if (shift == 0) {
+	memcpy(out, part->packed, words * sizeof(uint64_t));
+  } else {
+	for (long w = 0;  w < words;  w++) {
+	  out[w] |= part->packed[w] << shift;
+	  out[w + 1] = part->packed[w] >> (64 - shift);
+	}
+  }
+
+  /* The first run joins the last one if they meet. */
+  long r = 0;
+  if (part->num_runs > 0 && fasta->num_runs > 0) {
+	fasta_run_t *last = &fasta->runs[fasta->num_runs - 1];
+	if (last->start + last->length == position + part->runs[0].start &&
+		last->base == part->runs[0].base) {
+	  last->length += part->runs[0].length;
+	  r = 1;
+	}
+  }
+  if (fasta->num_runs + part->num_runs - r > fasta->max_runs) {
+	fasta->max_runs = fasta->num_runs + part->num_runs - r;
+	fasta->runs = realloc(fasta->runs, sizeof(fasta_run_t) * fasta->max_runs);
+  }
+  for (;  r < part->num_runs;  r++) {
+	fasta->runs[fasta->num_runs] = part->runs[r];
+	fasta->runs[fasta->num_runs].start += position;
+	fasta->num_runs++;
+  }
+
+  long name_offset = fasta->names_length;
+  fasta_add_name(fasta, part->names, part->names_length);
+  for (long c = 0;  c < part->num_contigs;  c++) {
+	fasta_add_contig(fasta);
+	fasta->contigs[fasta->num_contigs - 1].start = position + part->contigs[c].start;
+	fasta->contigs[fasta->num_contigs - 1].name = name_offset + part->contigs[c].name;
+  }
+  fasta->cur_length += part->cur_length;
+}
+
+/* One file of a 'fasta_read_files' call. */
+typedef struct {
+  char *file_name;
+  fasta_t *part;				/* Its data, loaded on its own */
+  fasta_lines_t lines;
+  int loaded;
+} fasta_file_t;
+
+typedef struct {
+  fasta_file_t *files;
+  int num_files;
+  int next_file;				/* First file no thread has taken */
+  pthread_mutex_t lock;
+  pthread_cond_t file_loaded;
+} fasta_loader_t;
+
+/* Take files in turn and load each into a FASTA object of its own. */
+static void *
+fasta_load_files(void *arg)
+{
+  fasta_loader_t *loader = arg;
+
+  for (;;) {
+	pthread_mutex_lock(&loader->lock);
+	int i = loader->next_file++;
+	pthread_mutex_unlock(&loader->lock);
+	if (i >= loader->num_files) {
+	  return NULL;
+	}
+
+	fasta_file_t *file = &loader->files[i];
+	gzFile gzfp = gzopen(file->file_name, "rb");
+	if (!gzfp) {
+	  fprintf(stderr, "Can't open '%s' for reading\n", file->file_name);
+	  exit(1);
+	}
+	gzbuffer(gzfp, READ_BLOCK_BYTES);
+	file->part = calloc(1, sizeof(fasta_t));
+	fasta_load(gzfp, file->file_name, file->part, &file->lines);
+	gzclose(gzfp);
+
+	pthread_mutex_lock(&loader->lock);
+	file->loaded = 1;
+	pthread_cond_broadcast(&loader->file_loaded);
+	pthread_mutex_unlock(&loader->lock);
+  }
+}
+
+/* Read 'num_files' FASTA files into a FASTA structure, in order, as
+ * 'fasta_read_file' would, decompressing up to 'num_threads' of them at
+ * once. Each file is loaded on its own and appended as soon as it and the
+ * files before it are done, while later files are still decompressing.
+ */
+void
+fasta_read_files(char **file_names, int num_files, fasta_t *fasta, int num_threads)
+{
+  if (num_threads > num_files) {
+	num_threads = num_files;
+  }
+  if (num_threads <= 1) {
+	for (int i = 0;  i < num_files;  i++) {
+	  fasta_read_file(file_names[i], fasta);
+	}
+	return;
+  }
+
+  fasta_loader_t loader;
+  loader.files = calloc(num_files, sizeof(fasta_file_t));
+  loader.num_files = num_files;
+  loader.next_file = 0;
+  pthread_mutex_init(&loader.lock, NULL);
+  pthread_cond_init(&loader.file_loaded, NULL);
+  for (int i = 0;  i < num_files;  i++) {
+	loader.files[i].file_name = file_names[i];
+  }
+
+  pthread_t *threads = malloc(sizeof(pthread_t) * num_threads);
+  for (int t = 0;  t < num_threads;  t++) {
+	if (pthread_create(&threads[t], NULL, fasta_load_files, &loader)) {
+	  fprintf(stderr, "Can't start a loading thread\n");
+	  exit(1);
+	}
+  }
+
+  for (int i = 0;  i < num_files;  i++) {
+	fasta_file_t *file = &loader.files[i];
+	pthread_mutex_lock(&loader.lock);
+	while (!file->loaded) {
+	  pthread_cond_wait(&loader.file_loaded, &loader.lock);
+	}
+	pthread_mutex_unlock(&loader.lock);
+
+	printf(" LOADING %s\n", file->file_name);
+	fasta_append_part(fasta, file->part);
+	if (verbose) {
+	  printf("%s: %d lines skipped, %d lines kept, %ld total bytes, %ld runs\n",
+			 file->file_name, file->lines.lines_skipped, file->lines.lines_kept,
+			 fasta->cur_length, fasta->num_runs);
+	}
+	fasta_destroy(file->part);
+  }
+
+  for (int t = 0;  t < num_threads;  t++) {
+	pthread_join(threads[t], NULL);
+  }
+  pthread_mutex_destroy(&loader.lock);
+  pthread_cond_destroy(&loader.file_loaded);
+  free(threads);
+  free(loader.files);
+}
+
+/* A genome image holds a loaded FASTA object as it sits in memory, so it
+   can be mapped and searched without decompressing or parsing anything:
+   this header, the packed words, the runs, the contigs and the names.
+ */
+#define IMAGE_MAGIC "SGGENOM1"
+#define IMAGE_HEADER_BYTES 64			/* Keeps the packed words cache-line aligned */
+
+typedef struct {
+  char magic[8];
+  int64_t length;
+  int64_t num_runs;
+  int64_t num_contigs;
+  int64_t names_length;
+} image_header_t;
+
+/* Return true if the sizes in 'header' add up to 'file_size', a size of
+   at least IMAGE_HEADER_BYTES. Each count is checked against the bytes
+   left before it is multiplied, so a corrupt header can't overflow.
+ */
+static int
+image_fits(const image_header_t *header, size_t file_size)
+{
+  size_t left = file_size - IMAGE_HEADER_BYTES;
+
+  if (header->length < 0 ||
+	  (uint64_t) header->length / BASES_PER_WORD + 2 > left / sizeof(uint64_t)) {
+	return 0;
+  }
+  left -= packed_words(header->length) * sizeof(uint64_t);
+  if (header->num_runs < 0 || (uint64_t) header->num_runs > left / sizeof(fasta_run_t)) {
+	return 0;
+  }
+  left -= header->num_runs * sizeof(fasta_run_t);
+  if (header->num_contigs < 0 ||
+	  (uint64_t) header->num_contigs > left / sizeof(fasta_contig_t)) {
+	return 0;
+  }
+  left -= header->num_contigs * sizeof(fasta_contig_t);
+  return header->names_length >= 0 && (uint64_t) header->names_length == left;
+}
+
+/* Return true if the runs, contigs and names of a mapped image are
+   consistent with each other and the sequence length: runs in order and
+   within the sequence, contigs in order with names in 'names', and the
+   last name ended. The searches rely on all of this, so an image that
+   doesn't pass is refused rather than read out of bounds.
+ */
+static int
+image_consistent(const fasta_t *fasta)
+{
+  long previous_end = 0;
+  for (long r = 0;  r < fasta->num_runs;  r++) {
+	const fasta_run_t *run = &fasta->runs[r];
+	if (run->start < previous_end || run->length <= 0 ||
+		run->length > fasta->cur_length - run->start) {
+	  return 0;
+	}
+	previous_end = run->start + run->length;
+  }
+
+  long previous_start = 0;
+  for (long c = 0;  c < fasta->num_contigs;  c++) {
+	const fasta_contig_t *contig = &fasta->contigs[c];
+	if (contig->start < previous_start || contig->start > fasta->cur_length ||
+		contig->name < 0 || contig->name >= fasta->names_length) {
+	  return 0;
+	}
+	previous_start = contig->start;
+  }
+
+  return fasta->names_length == 0 || fasta->names[fasta->names_length - 1] == '\0';
+}
+
+/* Return true if 'file_name' is a genome image written by 'fasta_save'. */
+int
+fasta_is_image(const char *file_name)
+{
+  char magic[8];
+  FILE *file = fopen(file_name, "rb");
+  if (!file) {
+	return 0;
+  }
+  int is_image = fread(magic, sizeof(magic), 1, file) == 1 &&
+	memcmp(magic, IMAGE_MAGIC, sizeof(magic)) == 0;
+  fclose(file);
+  return is_image;
+}
+
+/* Write 'fasta' to 'file_name' as a genome image for 'fasta_map'. Returns
+   zero on success.
+ */
+int
+fasta_save(const fasta_t *fasta, const char *file_name)
+{
+  char header_bytes[IMAGE_HEADER_BYTES];
+  image_header_t *header = (image_header_t *) header_bytes;
+
+  memset(header_bytes, 0, IMAGE_HEADER_BYTES);
+  memcpy(header->magic, IMAGE_MAGIC, sizeof(header->magic));
+  header->length = fasta->cur_length;
+  header->num_runs = fasta->num_runs;
+  header->num_contigs = fasta->num_contigs;
+  header->names_length = fasta->names_length;
+
+  FILE *file = fopen(file_name, "wb");
+  if (!file) {
+	fprintf(stderr, "Can't open '%s' for writing\n", file_name);
+	return 1;
+  }
+  size_t words = packed_words(fasta->cur_length);
+  int error = fwrite(header_bytes, IMAGE_HEADER_BYTES, 1, file) != 1 ||
+	fwrite(fasta->packed, sizeof(uint64_t), words, file) != words ||
+	fwrite(fasta->runs, sizeof(fasta_run_t), fasta->num_runs, file) != fasta->num_runs ||
+	fwrite(fasta->contigs, sizeof(fasta_contig_t), fasta->num_contigs, file) !=
+	fasta->num_contigs ||
+	fwrite(fasta->names, 1, fasta->names_length, file) != fasta->names_length;
+  if (fclose(file) != 0) {
+	error = 1;
+  }
+  if (error) {
+	fprintf(stderr, "Can't write genome image to '%s'\n", file_name);
+	remove(file_name);
+  }
+  return error;
+}
+
+/* Map the genome image in 'file_name' read-only as a FASTA object, which
+   can be searched but not added to. Processes mapping the same image share
+   its pages. Returns NULL on failure.
+ */
+fasta_t *
+fasta_map(const char *file_name)
+{
+  struct stat file_stat;
+
+  int fd = open(file_name, O_RDONLY);
+  if (fd < 0) {
+	fprintf(stderr, "Can't open '%s' for reading\n", file_name);
+	return NULL;
+  }
+  if (fstat(fd, &file_stat) != 0 || file_stat.st_size < IMAGE_HEADER_BYTES) {
+	fprintf(stderr, "'%s' is not a genome image\n", file_name);
+	close(fd);
+	return NULL;
+  }
+  void *map = mmap(NULL, file_stat.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+	fprintf(stderr, "Can't map '%s'\n", file_name);
+	return NULL;
+  }
+
+  const image_header_t *header = map;
+  if (memcmp(header->magic, IMAGE_MAGIC, sizeof(header->magic)) != 0 ||
+	  !image_fits(header, file_stat.st_size)) {
+	fprintf(stderr, "'%s' is not a genome image\n", file_name);
+	munmap(map, file_stat.st_size);
+	return NULL;
+  }
+
+  fasta_t *fasta = calloc(1, sizeof(fasta_t));
+  fasta->packed = (uint64_t *)((char *) map + IMAGE_HEADER_BYTES);
+  fasta->max_length = fasta->cur_length = header->length;
+  fasta->runs = (fasta_run_t *)(fasta->packed + packed_words(header->length));
+  fasta->num_runs = fasta->max_runs = header->num_runs;
+  fasta->contigs = (fasta_contig_t *)(fasta->runs + header->num_runs);
+  fasta->num_contigs = fasta->max_contigs = header->num_contigs;
+  fasta->names = (char *)(fasta->contigs + header->num_contigs);
+  fasta->names_length = fasta->max_names = header->names_length;
+  fasta->map = map;
+  fasta->map_size = file_stat.st_size;
+  if (!image_consistent(fasta)) {
+	fprintf(stderr, "'%s' is not a genome image\n", file_name);
+	fasta_destroy(fasta);
+	return NULL;
+  }
+
+  printf("  MAPPED %s\n", file_name);
+  if (verbose) {
+	printf("%s: %ld total bytes, %ld runs, %ld contigs\n", file_name, fasta->cur_length,
+		   fasta->num_runs, fasta->num_contigs);
+  }
+  return fasta;
+}
+
+/* Return a CRC-32 of the sequence: its length, packed bases, runs and
+   contig starts, for telling whether files derived from it (an index, say)
+   were built from the same data. Bits past the last base don't count.
+ */
+uint32_t
+fasta_fingerprint(const fasta_t *fasta)
+{
+  uLong crc = crc32(0L, Z_NULL, 0);
+  int64_t fields[3];
+
+  fields[0] = fasta->cur_length;
+  crc = crc32(crc, (const Bytef *) fields, sizeof(int64_t));
+
+  long full_words = fasta->cur_length / BASES_PER_WORD;
+  for (long w = 0;  w < full_words;  w += ONE_MEGA) {
+	long n = full_words - w < ONE_MEGA ? full_words - w : ONE_MEGA;
+	crc = crc32(crc, (const Bytef *)(fasta->packed + w), n * sizeof(uint64_t));
+  }
+  int last_bases = fasta->cur_length % BASES_PER_WORD;
+  if (last_bases) {
+	uint64_t last = fasta->packed[full_words] & (((uint64_t) 1 << (2 * last_bases)) - 1);
+	crc = crc32(crc, (const Bytef *) &last, sizeof(uint64_t));
+  }
+
+  /* Field by field, so that padding doesn't count either. */
+  for (long r = 0;  r < fasta->num_runs;  r++) {
+	fields[0] = fasta->runs[r].start;
+	fields[1] = fasta->runs[r].length;
+	fields[2] = fasta->runs[r].base;
+	crc = crc32(crc, (const Bytef *) fields, sizeof(fields));
+  }
+  for (long c = 0;  c < fasta->num_contigs;  c++) {
+	fields[0] = fasta->contigs[c].start;
+	crc = crc32(crc, (const Bytef *) fields, sizeof(int64_t));
+  }
+  return crc;
+}
+
+/* Return the index of the first run that ends after 'position'. */
+long
+fasta_find_run(const fasta_t *fasta, long position)
+{
+  long low = 0;
+  long high = fasta->num_runs;
+
+  while (low < high) {
+	long middle = low + (high - low) / 2;
+	const fasta_run_t *run = &fasta->runs[middle];
+	if (run->start + run->length <= position) {
+	  low = middle + 1;
+	} else {
+	  high = middle;
+	}
+  }
+  return low;
+}
+
+/* Copy the 'length' bytes starting at 'position' out of the sequence, as
+   they appeared in the file, into 'out'.
+ */
+void
+fasta_unpack(const fasta_t *fasta, long position, long length, char *out)
+{
+  for (long i = 0;  i < length;  i++) {
+	long p = position + i;
+	out[i] = base_letters[(fasta->packed[p / BASES_PER_WORD] >> (2 * (p % BASES_PER_WORD))) & 3];
+  }
+
+  /* Lay the runs over the plain bases. */
+  long last = position + length;
+  for (long r = fasta_find_run(fasta, position);
+	   r < fasta->num_runs && fasta->runs[r].start < last;  r++) {
+	const fasta_run_t *run = &fasta->runs[r];
+	long first = run->start > position ? run->start : position;
+	long end = run->start + run->length < last ? run->start + run->length : last;
+	for (long p = first;  p < end;  p++) {
+	  out[p - position] = run->base ? run->base : out[p - position] - 'A' + 'a';
+	}
+  }
+}
+
+/* Return true if the 'length' bytes starting at 'position' are all
+   upper-case A, C, G or T. '*cursor' is a run index that speeds up calls
+   made in order of position; start it at zero, and don't pass the same
+   cursor a smaller position than before.
+ */
+int
+fasta_is_plain(const fasta_t *fasta, long position, long length, long *cursor)
+{
+  long r = *cursor;
+
+  while (r < fasta->num_runs && fasta->runs[r].start + fasta->runs[r].length <= position) {
+	r++;
+  }
+  *cursor = r;
+  return r == fasta->num_runs || fasta->runs[r].start >= position + length;
+}
+
+/* Return the index of the contig holding 'position', found by binary
+   search, or -1 if there are no contigs yet.
+ */
+long
+fasta_find_contig(const fasta_t *fasta, long position)
+{
+  long low = 0;
+  long high = fasta->num_contigs;
+
+  while (low < high) {
+	long middle = low + (high - low) / 2;
+	if (fasta->contigs[middle].start <= position) {
+	  low = middle + 1;
+	} else {
+	  high = middle;
+	}
+  }
+  return low - 1;
+}
+
+/* Return true if the 'length' bytes starting at 'position' all lie in one
+   contig. '*contig' is a contig index that speeds up calls made in order
+   of position; start it at 'fasta_find_contig' of the first position, and
+   don't pass the same cursor a smaller position than before.
+ */
+int
+fasta_in_one_contig(const fasta_t *fasta, long position, long length, long *contig)
+{
+  long c = *contig;
+
+  while (c + 1 < fasta->num_contigs && fasta->contigs[c + 1].start <= position) {
+	c++;
+  }
+  *contig = c;
+  return c + 1 >= fasta->num_contigs || fasta->contigs[c + 1].start >= position + length;
+}
+
+/* Return the HORSPOOL_GRAM bases of 'pattern' starting at 'offset', packed. */
+static inline uint32_t
+pattern_gram(const pattern_t *pattern, int offset)
+{
+  const uint64_t *word = pattern->words + offset / BASES_PER_WORD;
+  int shift = 2 * (offset % BASES_PER_WORD);
+  uint64_t bases = shift ? word[0] >> shift | word[1] << (64 - shift) : word[0];
+
+  return bases & (((uint64_t)1 << (2 * HORSPOOL_GRAM)) - 1);
+}
+
+/* Return a word with the low bit of each 2-bit slot of 'bases' set where
+   that base is 'code', checking all 32 at once.
+ */
+static inline uint64_t
+bases_equal(uint64_t bases, int code)
+{
+  const uint64_t low_bits = 0x5555555555555555ull;
+  uint64_t diff = bases ^ (low_bits * code);
+
+  return ~(diff | diff >> 1) & low_bits;
+}
+
+/* Pack the pattern 'text' for searching. Free with 'pattern_free'. */
+void
+pattern_init(pattern_t *pattern, const char *text)
+{
+  pattern->text = text;
+  pattern->length = strlen(text);
+  pattern->plain = 1;
+  pattern->num_words = (pattern->length + BASES_PER_WORD - 1) / BASES_PER_WORD;
+  pattern->words = calloc(pattern->num_words + 1, sizeof(uint64_t));
+
+  for (int i = 0;  i < pattern->length;  i++) {
+	int code = base_code(text[i]);
+	if (code < 0 || text[i] >= 'a') {
+	  pattern->plain = 0;
+	  code = 0;
+	}
+	pattern->words[i / BASES_PER_WORD] |= (uint64_t)code << (2 * (i % BASES_PER_WORD));
+  }
+
+  int tail = pattern->length - (pattern->num_words - 1) * BASES_PER_WORD;
+  pattern->last_mask = tail == BASES_PER_WORD ? ~(uint64_t)0 : ((uint64_t)1 << (2 * tail)) - 1;
+
+  /* A gram ending at 'end' in the pattern (but not at its last base) lets
+	 the pattern slide until that occurrence lines up; grams it doesn't
+	 contain let it slide past them entirely. */
+  pattern->shifts = NULL;
+  if (pattern->plain && pattern->length >= HORSPOOL_MIN_LENGTH) {
+	const int grams = 1 << (2 * HORSPOOL_GRAM);
+	int slide = pattern->length - HORSPOOL_GRAM + 1;
+	pattern->shifts = malloc(grams * sizeof(uint16_t));
+	for (int g = 0;  g < grams;  g++) {
+	  pattern->shifts[g] = slide < UINT16_MAX ? slide : UINT16_MAX;
+	}
+	for (int end = HORSPOOL_GRAM - 1;  end < pattern->length - 1;  end++) {
+	  slide = pattern->length - 1 - end;
+	  pattern->shifts[pattern_gram(pattern, end + 1 - HORSPOOL_GRAM)] =
+		slide < UINT16_MAX ? slide : UINT16_MAX;
+	}
+  }
+}
+
+void
+pattern_free(pattern_t *pattern)
+{
+  free(pattern->words);
+  free(pattern->shifts);
+}
+
+/* Return true if 'pattern' occurs in the sequence at 'position', which
+   must leave room for the whole pattern. '*cursor' is as for
+   'fasta_is_plain'. Plain patterns are compared 32 bases per word and
+   can only match where the sequence is plain too; any other pattern is
+   compared byte by byte against the unpacked sequence.
+ */
+int
+pattern_matches_at(const pattern_t *pattern, const fasta_t *fasta, long position,
+				   long *cursor)
+{
+  if (pattern->plain) {
+	int last = pattern->num_words - 1;
+	for (int w = 0;  w < last;  w++) {
+	  if (fasta_word(fasta, position + (long)w * BASES_PER_WORD) != pattern->words[w]) {
+		return 0;
+	  }
+	}
+	if (last >= 0 &&
+		((fasta_word(fasta, position + (long)last * BASES_PER_WORD) ^ pattern->words[last]) &
+		 pattern->last_mask)) {
+	  return 0;
+	}
+	return fasta_is_plain(fasta, position, pattern->length, cursor);
+  }
+
+  char buffer[64];
+  for (int done = 0;  done < pattern->length;  done += sizeof(buffer)) {
+	int n = pattern->length - done < (int)sizeof(buffer) ? pattern->length - done : sizeof(buffer);
+	fasta_unpack(fasta, position + done, n, buffer);
+	if (memcmp(buffer, pattern->text + done, n) != 0) {
+	  return 0;
+	}
+  }
+  return 1;
+}
+
+/* Return 1 and call 'report' if 'pattern' occurs at 'position' within one
+   contig, or return 0 if it doesn't. '*cursor' and '*contig' are as for
+   'fasta_is_plain' and 'fasta_in_one_contig'.
+ */
+static inline int
+report_match(const pattern_t *pattern, fasta_t *fasta, long position, long *cursor,
+			 long *contig, match_fn_t report, void *context)
+{
+  if (!pattern_matches_at(pattern, fasta, position, cursor) ||
+	  !fasta_in_one_contig(fasta, position, pattern->length, contig)) {
+	return 0;
+  }
+  if (report) {
+	report(fasta, position, pattern->length, context);
+  }
+  return 1;
+}
+
+/* Count the matches of 'pattern' starting at positions 'first', 'first +
+   step', ... before 'end', calling 'report' (unless it is NULL) for each.
+   Positions too close to the end of the sequence for the whole pattern are
+   skipped. Plain patterns only look further at likely positions. When
+   every position is wanted, the first and last bases of the pattern are
+   checked against 32 positions at a time, a packed word each, or long
+   patterns slide along by their Horspool shifts. Otherwise the first 32
+   bases are compared in one word at each position.
+ */
+long
+pattern_search(const pattern_t *pattern, fasta_t *fasta, long first, long end, long step,
+			   match_fn_t report, void *context)
+{
+  long count = 0;
+
+  if (end > fasta->cur_length - pattern->length + 1) {
+	end = fasta->cur_length - pattern->length + 1;
+  }
+  if (first >= end) {
+	return 0;
+  }
+  long cursor = fasta_find_run(fasta, first);
+  long contig = fasta_find_contig(fasta, first);
+
+  if (!pattern->plain || pattern->num_words == 0) {
+	for (long position = first;  position < end;  position += step) {
+	  count += report_match(pattern, fasta, position, &cursor, &contig, report, context);
+	}
+	return count;
+  }
+
+  uint64_t head = pattern->words[0];
+  uint64_t head_mask = pattern->num_words == 1 ? pattern->last_mask : ~(uint64_t)0;
+
+  if (step == 1 && pattern->shifts) {
+	const int gram_offset = pattern->length - HORSPOOL_GRAM;
+	const uint64_t gram_mask = ((uint64_t)1 << (2 * HORSPOOL_GRAM)) - 1;
+	uint32_t last_gram = pattern_gram(pattern, gram_offset);
+	for (long position = first;  position < end;  ) {
+	  uint32_t gram = fasta_word(fasta, position + gram_offset) & gram_mask;
+	  if (gram == last_gram) {
+		count += report_match(pattern, fasta, position, &cursor, &contig, report, context);
+	  }
+	  position += pattern->shifts[gram];
+	}
+	return count;
+  }
+
+  if (step == 1) {
+	int last_offset = pattern->length - 1;
+	int first_code = head & 3;
+	int last_code = pattern->words[last_offset / BASES_PER_WORD] >>
+	  (2 * (last_offset % BASES_PER_WORD)) & 3;
+	for (long w = first / BASES_PER_WORD;  w * BASES_PER_WORD < end;  w++) {
+	  long base = w * BASES_PER_WORD;
+	  uint64_t hits = bases_equal(fasta->packed[w], first_code) &
+		bases_equal(fasta_word(fasta, base + last_offset), last_code);
+	  while (hits) {
+		long position = base + __builtin_ctzll(hits) / 2;
+		hits &= hits - 1;
+		if (position >= first && position < end) {
+		  count += report_match(pattern, fasta, position, &cursor, &contig, report, context);
+		}
+	  }
+	}
+	return count;
+  }
+
+  for (long position = first;  position < end;  position += step) {
+	if ((fasta_word(fasta, position) ^ head) & head_mask) {
+	  continue;
+	}
+	count += report_match(pattern, fasta, position, &cursor, &contig, report, context);
+  }
+  return count;
+}
+
+/* Count the matches of 'pattern' that run from one contig into the next,
+   which whole-sequence methods like the FM-index can't tell apart.
+ */
+long
+pattern_count_crossing(const pattern_t *pattern, const fasta_t *fasta)
+{
+  long count = 0;
+  long cursor = 0;
+  long previous = 0;
+
+  for (long c = 1;  c < fasta->num_contigs;  c++) {
+	long boundary = fasta->contigs[c].start;
+	long position = boundary - pattern->length + 1;
+	if (position < previous) {
+	  position = previous;
+	}
+	for (;  position < boundary && position + pattern->length <= fasta->cur_length;  position++) {
+	  count += pattern_matches_at(pattern, fasta, position, &cursor);
+	}
+	previous = boundary > previous ? boundary : previous;
+  }
+  return count;
+}
+
+/* Return the current time. */
+double
+now(void)
+{
+  struct timespec current_time;
+  clock_gettime(CLOCK_REALTIME, &current_time);
+  return current_time.tv_sec + (current_time.tv_nsec / ONE_BILLION);
+}
+
+/* Print 'n' padding characters to pretty-up the output. */
+static void
+print_padding(const int n)
+{
+  for (int i = 0;  i < n;  i++) {
+	printf(" ");
+  }
+}
+
+/* Print 'length' bytes starting at offset 'position' from within the current
+ * data in a FASTA structure. Also prints 'padding_bytes' bytes before and
+ * after the range of values for context, as well as the offset into its
+ * contig and the contig's name. Takes care not to blow past either end of
+ * the contig.
+ */
+void
+bytes_around(fasta_t *fasta, long position, int length)
+{
+  const int padding_bytes = 8;
+  long contig = fasta_find_contig(fasta, position);
+  long contig_start = contig >= 0 ? fasta->contigs[contig].start : 0;
+  long contig_end = contig + 1 < fasta->num_contigs ? fasta->contigs[contig + 1].start :
+	fasta->cur_length;
+  long first = position - padding_bytes > contig_start ? position - padding_bytes : contig_start;
+  long last = position + length + padding_bytes;
+  if (last > contig_end) {
+	last = contig_end;
+  }
+
+  char *bytes = malloc(last - first + 1);
+  fasta_unpack(fasta, first, last - first, bytes);
+
+  print_padding(padding_bytes - (position - first));
+
+  for (long p = first;  p < last;  p++) {
+	if (p == position) {
+	  printf("[");
+	}
+	printf("%c", bytes[p - first]);
+	if (p == position + length - 1) {
+	  printf("]");
+	}
+  }
+
+  print_padding(padding_bytes - (last - (position + length)));
+  printf("%15ld %s\n", position - contig_start,
+		 contig >= 0 ? fasta->names + fasta->contigs[contig].name : "");
+  free(bytes);
+}
@@ -0,0 +1,121 @@
+#ifndef GENOME_ENGINE_H
+#define GENOME_ENGINE_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+extern int verbose;				/* Output more info at run time? */
+
+/* Helpful constants */
+#define ONE_MEGA (long)(1024 * 1024)
+#define ONE_GIGA (long)(ONE_MEGA * 1024)
+#define ONE_BILLION (double)1000000000.0
+
+/* **************** FASTA ADT **************** */
+/* Genome data files .. https://en.wikipedia.org/wiki/FASTA_format */
+
+/* Bases are packed two bits each, 32 to a 64-bit word, with the first base
+   in the low bits: A = 0, C = 1, G = 2 and T = 3. Anything else in the
+   file (N gaps, other IUPAC codes and soft-masked lower-case bases) is
+   recorded in a table of runs, so the sequence takes a quarter of the
+   memory of one byte per base.
+ */
+#define BASES_PER_WORD 32
+
+/* A run of bytes that aren't upper-case A, C, G or T. Lower-case acgt keep
+   their 2-bit codes and have 'base' zero; any other byte is repeated
+   through the run as 'base' and packed as A. Runs are kept in sequence
+   order and don't overlap.
+ */
+typedef struct {
+  long start;					/* Offset of the first byte */
+  long length;					/* Bytes in the run */
+  char base;					/* Byte repeated, or 0 for lower-case acgt */
+} fasta_run_t;
+
+/* One sequence (chromosome, scaffold, ...) of the concatenated data,
+   started by a '>' line and named by its first word. Data before any '>'
+   line in a file is named after the file.
+ */
+typedef struct {
+  long start;					/* Offset of the first base */
+  long name;					/* Offset of the name in 'names' */
+} fasta_contig_t;
+
+typedef struct {
+  uint64_t *packed;				/* Entire sequence, 2 bits per base */
+  long max_length;				/* Length reserved, in bases */
+  long cur_length;				/* Current length, in bases */
+  fasta_run_t *runs;			/* Bytes that don't fit in 2 bits */
+  long num_runs;
+  long max_runs;				/* Runs allocated */
+  fasta_contig_t *contigs;		/* In sequence order */
+  long num_contigs;
+  long max_contigs;				/* Contigs allocated */
+  char *names;					/* Contig names, each ending in a NUL */
+  long names_length;
+  long max_names;				/* Name bytes allocated */
+  void *map;					/* Genome image, if mapped by 'fasta_map' */
+  size_t map_size;
+} fasta_t;
+
+fasta_t *fasta_create(long max_length);
+void fasta_destroy(fasta_t *old);
+long fasta_size_hint(char **file_names, int num_files);
+int fasta_is_image(const char *file_name);
+int fasta_save(const fasta_t *fasta, const char *file_name);
+fasta_t *fasta_map(const char *file_name);
+uint32_t fasta_fingerprint(const fasta_t *fasta);
+void fasta_read_file(char *file_name, fasta_t *fasta);
+void fasta_read_files(char **file_names, int num_files, fasta_t *fasta, int num_threads);
+long fasta_find_run(const fasta_t *fasta, long position);
+long fasta_find_contig(const fasta_t *fasta, long position);
+int fasta_in_one_contig(const fasta_t *fasta, long position, long length, long *contig);
+void fasta_unpack(const fasta_t *fasta, long position, long length, char *out);
+int fasta_is_plain(const fasta_t *fasta, long position, long length, long *cursor);
+
+/* Return the 32 bases starting at 'position', packed like the sequence.
+   Bases past the end of the sequence read as A.
+ */
+static inline uint64_t
+fasta_word(const fasta_t *fasta, long position)
+{
+  const uint64_t *word = fasta->packed + position / BASES_PER_WORD;
+  int shift = 2 * (position % BASES_PER_WORD);
+
+  return shift ? word[0] >> shift | word[1] << (64 - shift) : word[0];
+}
+
+/* A search pattern, packed the same way as the sequence so that up to 32
+   bases are compared at once. Long plain patterns also get a Horspool
+   table: how far the pattern can slide given the last HORSPOOL_GRAM bases
+   under it.
+ */
+#define HORSPOOL_GRAM 8
+#define HORSPOOL_MIN_LENGTH 24
+typedef struct {
+  const char *text;				/* Pattern as given */
+  int length;					/* Bases in the pattern */
+  int plain;					/* Only upper-case A, C, G and T? */
+  int num_words;
+  uint64_t *words;				/* Packed pattern */
+  uint64_t last_mask;			/* Bits of the last word holding bases */
+  uint16_t *shifts;				/* Horspool shifts by packed gram, or NULL */
+} pattern_t;
+
+void pattern_init(pattern_t *pattern, const char *text);
+void pattern_free(pattern_t *pattern);
+int pattern_matches_at(const pattern_t *pattern, const fasta_t *fasta, long position,
+					   long *cursor);
+long pattern_count_crossing(const pattern_t *pattern, const fasta_t *fasta);
+
+/* Called by 'pattern_search' for each match, with the caller's 'context'. */
+typedef void (*match_fn_t)(fasta_t *fasta, long position, int length, void *context);
+
+long pattern_search(const pattern_t *pattern, fasta_t *fasta, long first, long end, long step,
+					match_fn_t report, void *context);
+
+double now(void);
+void bytes_around(fasta_t *fasta, long position, int length);
+
+#endif
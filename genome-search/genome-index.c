@@ -0,0 +1,673 @@
+/* Suffix array construction by induced sorting (SA-IS), and the FM-index
+   built from it.
+ */
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "genome-index.h"
+
+/* **************** SA-IS **************** */
+/* Nong, Zhang and Chan, "Two Efficient Algorithms for Linear Time Suffix
+   Array Construction". The text must end in a unique smallest symbol.
+   Suffix array entries are 32 bits, which limits the text to 4G symbols.
+ */
+
+typedef uint32_t sa_t;
+#define SA_EMPTY UINT32_MAX
+#define SA_MAX_LENGTH ((long)UINT32_MAX - 1)
+
+/* Suffix types: S if smaller than the next suffix, otherwise L. */
+#define IS_S(types, i) (((types)[(i) >> 3] >> ((i) & 7)) & 1)
+
+/* Symbol 'i' of a text of bytes, or of sa_t names when 'wide'. */
+static inline sa_t
+symbol(const void *text, long i, int wide)
+{
+  return wide ? ((const sa_t *) text)[i] : ((const unsigned char *) text)[i];
+}
+
+/* Is suffix 'i' the leftmost of a run of S suffixes? */
+static inline int
+is_lms(const unsigned char *types, long i)
+{
+  return i > 0 && IS_S(types, i) && !IS_S(types, i - 1);
+}
+
+/* Fill 'buckets' with the start (or, if 'ends', one past the end) of each
+   symbol's bucket in the suffix array.
+ */
+static void
+get_buckets(const void *text, int wide, long n, long alphabet, sa_t *buckets, int ends)
+{
+  sa_t sum = 0;
+
+  memset(buckets, 0, sizeof(sa_t) * alphabet);
+  for (long i = 0;  i < n;  i++) {
+	buckets[symbol(text, i, wide)]++;
+  }
+  for (long c = 0;  c < alphabet;  c++) {
+	sa_t size = buckets[c];
+	sum += size;
+	buckets[c] = ends ? sum : sum - size;
+  }
+}
+
+/* Place L suffixes, scanning left to right from the suffixes already in
+   'sa'.
+ */
+static void
+induce_l(const unsigned char *types, sa_t *sa, const void *text, int wide, long n,
+		 long alphabet, sa_t *buckets)
+{
+  get_buckets(text, wide, n, alphabet, buckets, 0);
+  for (long i = 0;  i < n;  i++) {
+	sa_t j = sa[i];
+	if (j != SA_EMPTY && j > 0 && !IS_S(types, j - 1)) {
+	  sa[buckets[symbol(text, j - 1, wide)]++] = j - 1;
+	}
+  }
+}
+
+/* Place S suffixes, scanning right to left. */
+static void
+induce_s(const unsigned char *types, sa_t *sa, const void *text, int wide, long n,
+		 long alphabet, sa_t *buckets)
+{
+  get_buckets(text, wide, n, alphabet, buckets, 1);
+  for (long i = n - 1;  i >= 0;  i--) {
+	sa_t j = sa[i];
+	if (j != SA_EMPTY && j > 0 && IS_S(types, j - 1)) {
+	  sa[--buckets[symbol(text, j - 1, wide)]] = j - 1;
+	}
+  }
+}
+
+/* Sort the 'n' suffixes of 'text', whose symbols are below 'alphabet', into
+   'sa'.
+ */
+static void
+sa_is(const void *text, int wide, sa_t *sa, long n, long alphabet)
+{
+  if (n == 1) {
+	sa[0] = 0;
+	return;
+  }
+
+  unsigned char *types = calloc(n / 8 + 1, 1);
+  types[(n - 1) >> 3] |= 1 << ((n - 1) & 7);
+  for (long i = n - 3;  i >= 0;  i--) {
+	sa_t c = symbol(text, i, wide);
+	sa_t next = symbol(text, i + 1, wide);
+	if (c < next || (c == next && IS_S(types, i + 1))) {
+	  types[i >> 3] |= 1 << (i & 7);
+	}
+  }
+
+  /* Stage 1: sort the LMS substrings by inducing from their last symbols. */
+  sa_t *buckets = malloc(sizeof(sa_t) * alphabet);
+  get_buckets(text, wide, n, alphabet, buckets, 1);
+  for (long i = 0;  i < n;  i++) {
+	sa[i] = SA_EMPTY;
+  }
+  for (long i = 1;  i < n;  i++) {
+	if (is_lms(types, i)) {
+	  sa[--buckets[symbol(text, i, wide)]] = i;
+	}
+  }
+  induce_l(types, sa, text, wide, n, alphabet, buckets);
+  induce_s(types, sa, text, wide, n, alphabet, buckets);
+  free(buckets);
+
+  /* Name each LMS substring by its rank, equal substrings sharing a name,
+	 and gather the names in text order at the end of 'sa'. */
+  long n1 = 0;
+  for (long i = 0;  i < n;  i++) {
+	if (sa[i] != SA_EMPTY && is_lms(types, sa[i])) {
+	  sa[n1++] = sa[i];
+	}
+  }
+  for (long i = n1;  i < n;  i++) {
+	sa[i] = SA_EMPTY;
+  }
+  long name = 0;
+  long previous = -1;
+  for (long i = 0;  i < n1;  i++) {
+	long position = sa[i];
+	int differ = 0;
+	for (long d = 0;  d < n;  d++) {
+	  if (previous < 0 ||
+		  symbol(text, position + d, wide) != symbol(text, previous + d, wide) ||
+		  IS_S(types, position + d) != IS_S(types, previous + d)) {
+		differ = 1;
+		break;
+	  } else if (d > 0 && (is_lms(types, position + d) || is_lms(types, previous + d))) {
+		break;
+	  }
+	}
+	if (differ) {
+	  name++;
+	  previous = position;
+	}
+	sa[n1 + position / 2] = name - 1;
+  }
+  for (long i = n - 1, j = n - 1;  i >= n1;  i--) {
+	if (sa[i] != SA_EMPTY) {
+	  sa[j--] = sa[i];
+	}
+  }
+
+  /* Stage 2: sort the LMS suffixes, recursing unless the names are
+	 already unique. */
+  sa_t *sa1 = sa;
+  sa_t *text1 = sa + n - n1;
+  if (name < n1) {
+	sa_is(text1, 1, sa1, n1, name);
+  } else {
+	for (long i = 0;  i < n1;  i++) {
+	  sa1[text1[i]] = i;
+	}
+  }
+
+  /* Stage 3: induce the whole suffix array from the sorted LMS suffixes. */
+  buckets = malloc(sizeof(sa_t) * alphabet);
+  get_buckets(text, wide, n, alphabet, buckets, 1);
+  for (long i = 1, j = 0;  i < n;  i++) {
+	if (is_lms(types, i)) {
+	  text1[j++] = i;
+	}
+  }
+  for (long i = 0;  i < n1;  i++) {
+	sa1[i] = text1[sa1[i]];
+  }
+  for (long i = n1;  i < n;  i++) {
+	sa[i] = SA_EMPTY;
+  }
+  for (long i = n1 - 1;  i >= 0;  i--) {
+	sa_t j = sa[i];
+	sa[i] = SA_EMPTY;
+	sa[--buckets[symbol(text, j, wide)]] = j;
+  }
+  induce_l(types, sa, text, wide, n, alphabet, buckets);
+  induce_s(types, sa, text, wide, n, alphabet, buckets);
+  free(buckets);
+  free(types);
+}
+
+/* **************** Building **************** */
+
+/* Text symbols for suffix sorting: the sentinel, then A, C, G, T and
+   FM_OTHER each one higher than their FM-index codes. */
+#define TEXT_SENTINEL 0
+#define TEXT_SYMBOLS (FM_SYMBOLS + 1)
+
+typedef struct {
+  const fasta_t *fasta;
+  unsigned char *text;
+  const sa_t *sa;
+  fm_index_t *index;
+  long first;					/* First position or block of this thread's share */
+  long last;					/* One past its last */
+  long counts[FM_SYMBOLS];		/* Rows of each symbol in this share */
+  long samples;					/* Sampled rows in this share */
+} build_args_t;
+
+/* Thread body: unpack positions ['first', 'last') of the sequence into
+   suffix sorting symbols.
+ */
+static void *
+unpack_text(void *args_pointer)
+{
+  build_args_t *args = (build_args_t *) args_pointer;
+  const fasta_t *fasta = args->fasta;
+
+  for (long p = args->first;  p < args->last;  p++) {
+	args->text[p] = ((fasta->packed[p / BASES_PER_WORD] >> (2 * (p % BASES_PER_WORD))) & 3) + 1;
+  }
+  for (long r = fasta_find_run(fasta, args->first);
+	   r < fasta->num_runs && fasta->runs[r].start < args->last;  r++) {
+	const fasta_run_t *run = &fasta->runs[r];
+	long first = run->start > args->first ? run->start : args->first;
+	long end = run->start + run->length < args->last ? run->start + run->length : args->last;
+	for (long p = first;  p < end;  p++) {
+	  args->text[p] = FM_OTHER + 1;
+	}
+  }
+  return NULL;
+}
+
+/* FM-index symbol of 'row': the text symbol before its suffix, or -1 for
+   the sentinel.
+ */
+static inline int
+row_symbol(const build_args_t *args, long row)
+{
+  sa_t position = args->sa[row];
+  return position == 0 ? -1 : args->text[position - 1] - 1;
+}
+
+/* Thread body: count the symbols and samples in blocks ['first', 'last'). */
+static void *
+count_blocks(void *args_pointer)
+{
+  build_args_t *args = (build_args_t *) args_pointer;
+  long length = args->index->length;
+  long end = args->last * FM_ROWS_PER_BLOCK < length ? args->last * FM_ROWS_PER_BLOCK : length;
+
+  for (long row = args->first * FM_ROWS_PER_BLOCK;  row < end;  row++) {
+	int c = row_symbol(args, row);
+	if (c >= 0) {
+	  args->counts[c]++;
+	}
+	if (args->sa[row] % FM_SAMPLE_RATE == 0) {
+	  args->samples++;
+	}
+  }
+  return NULL;
+}
+
+/* Thread body: fill blocks ['first', 'last'), starting from the totals in
+   'counts' and 'samples' of the shares before.
+ */
+static void *
+fill_blocks(void *args_pointer)
+{
+  build_args_t *args = (build_args_t *) args_pointer;
+  fm_index_t *index = args->index;
+  long length = index->length;
+
+  for (long b = args->first;  b < args->last;  b++) {
+	fm_block_t *block = &index->blocks[b];
+	memset(block, 0, sizeof(fm_block_t));
+	for (int c = 0;  c < 4;  c++) {
+	  block->occ[c] = args->counts[c];
+	}
+	block->samples = args->samples;
+
+	for (long k = 0;  k < FM_ROWS_PER_BLOCK && b * FM_ROWS_PER_BLOCK + k < length;  k++) {
+	  long row = b * FM_ROWS_PER_BLOCK + k;
+	  int c = row_symbol(args, row);
+	  int shift = 2 * (k % 32);
+	  if (c < 0 || c == FM_OTHER) {
+		block->other[k / 32] |= (uint64_t)1 << shift;
+	  } else {
+		block->codes[k / 32] |= (uint64_t)c << shift;
+		args->counts[c]++;
+	  }
+	  if (args->sa[row] % FM_SAMPLE_RATE == 0) {
+		block->sampled |= (uint64_t)1 << k;
+		index->samples[args->samples++] = args->sa[row];
+	  }
+	}
+  }
+  return NULL;
+}
+
+/* Run 'body' on 'num_threads' threads, each with its own share of 'count'
+   positions or blocks in 'args'.
+ */
+static void
+run_shares(void *(*body)(void *), build_args_t *args, int num_threads, long count)
+{
+  pthread_t threads[num_threads];
+
+  for (int i = 0;  i < num_threads;  i++) {
+	args[i].first = count * i / num_threads;
+	args[i].last = count * (i + 1) / num_threads;
+	if (pthread_create(&threads[i], NULL, body, &args[i])) {
+	  body(&args[i]);
+	  threads[i] = 0;
+	}
+  }
+  for (int i = 0;  i < num_threads;  i++) {
+	if (threads[i]) {
+	  pthread_join(threads[i], NULL);
+	}
+  }
+}
+
+/* Build the FM-index of the sequence in 'fasta'. Unpacking the sequence
+   and filling in the index are split over 'num_threads' threads; suffix
+   sorting itself is sequential. Returns zero on success.
+ */
+int
+fm_build(fm_index_t *index, const fasta_t *fasta, int num_threads)
+{
+  long length = fasta->cur_length + 1;
+
+  memset(index, 0, sizeof(fm_index_t));
+  if (length > SA_MAX_LENGTH) {
+	fprintf(stderr, "Sequence of %ld bytes is too long to index\n", fasta->cur_length);
+	return 1;
+  }
+  if (num_threads < 1) {
+	num_threads = 1;
+  }
+
+  build_args_t *args = calloc(num_threads, sizeof(build_args_t));
+  unsigned char *text = malloc(length);
+  sa_t *sa = malloc(sizeof(sa_t) * length);
+  if (!text || !sa) {
+	fprintf(stderr, "Can't allocate %ld bytes to build the index\n",
+			(long)(length * (1 + sizeof(sa_t))));
+	free(args);
+	free(text);
+	free(sa);
+	return 1;
+  }
+  for (int i = 0;  i < num_threads;  i++) {
+	args[i].fasta = fasta;
+	args[i].text = text;
+	args[i].sa = sa;
+	args[i].index = index;
+  }
+
+  run_shares(unpack_text, args, num_threads, length - 1);
+  text[length - 1] = TEXT_SENTINEL;
+  sa_is(text, 0, sa, length, TEXT_SYMBOLS);
+
+  long num_blocks = length / FM_ROWS_PER_BLOCK + 1;
+  index->length = length;
+  index->blocks = malloc(sizeof(fm_block_t) * num_blocks);
+  run_shares(count_blocks, args, num_threads, num_blocks);
+
+  /* Turn each share's counts into totals for the shares before it. */
+  long totals[FM_SYMBOLS] = { 0 };
+  long samples = 0;
+  for (int i = 0;  i < num_threads;  i++) {
+	for (int c = 0;  c < FM_SYMBOLS;  c++) {
+	  long count = args[i].counts[c];
+	  args[i].counts[c] = totals[c];
+	  totals[c] += count;
+	}
+	long count = args[i].samples;
+	args[i].samples = samples;
+	samples += count;
+  }
+  index->num_samples = samples;
+  index->samples = malloc(sizeof(uint32_t) * (samples > 0 ? samples : 1));
+  run_shares(fill_blocks, args, num_threads, num_blocks);
+
+  for (long row = 0;  row < length;  row++) {
+	if (sa[row] == 0) {
+	  index->primary = row;
+	  break;
+	}
+  }
+  long first_row = 1;
+  for (int c = 0;  c < FM_SYMBOLS;  c++) {
+	index->first_row[c] = first_row;
+	first_row += totals[c];
+  }
+  index->fingerprint = fasta_fingerprint(fasta);
+
+  free(args);
+  free(text);
+  free(sa);
+  return 0;
+}
+
+/* **************** Files **************** */
+
+#define FM_MAGIC "SGFMIDX2"
+#define FM_HEADER_BYTES 128		/* Keeps the blocks cache-line aligned */
+
+typedef struct {
+  char magic[8];
+  int64_t length;
+  int64_t primary;
+  int64_t first_row[FM_SYMBOLS];
+  int64_t num_samples;
+  int64_t sample_rate;
+  int64_t fingerprint;			/* Of the sequence, to tell if it's the same */
+} fm_header_t;
+
+static long
+num_blocks(const fm_index_t *index)
+{
+  return index->length / FM_ROWS_PER_BLOCK + 1;
+}
+
+/* Write 'index' to 'file_name'. Returns zero on success. */
+int
+fm_save(const fm_index_t *index, const char *file_name)
+{
+  char header_bytes[FM_HEADER_BYTES];
+  fm_header_t *header = (fm_header_t *) header_bytes;
+
+  memset(header_bytes, 0, FM_HEADER_BYTES);
+  memcpy(header->magic, FM_MAGIC, sizeof(header->magic));
+  header->length = index->length;
+  header->primary = index->primary;
+  for (int c = 0;  c < FM_SYMBOLS;  c++) {
+	header->first_row[c] = index->first_row[c];
+  }
+  header->num_samples = index->num_samples;
+  header->sample_rate = FM_SAMPLE_RATE;
+  header->fingerprint = index->fingerprint;
+
+  FILE *file = fopen(file_name, "wb");
+  if (!file) {
+	fprintf(stderr, "Can't open '%s' for writing\n", file_name);
+	return 1;
+  }
+  size_t blocks = num_blocks(index);
+  int error = fwrite(header_bytes, FM_HEADER_BYTES, 1, file) != 1 ||
+	fwrite(index->blocks, sizeof(fm_block_t), blocks, file) != blocks ||
+	fwrite(index->samples, sizeof(uint32_t), index->num_samples, file) != index->num_samples;
+  if (fclose(file) != 0) {
+	error = 1;
+  }
+  if (error) {
+	fprintf(stderr, "Can't write index to '%s'\n", file_name);
+	remove(file_name);
+  }
+  return error;
+}
+
+/* Map the index in 'file_name', written by 'fm_save', into 'index'.
+   Returns zero on success.
+ */
+int
+fm_load(fm_index_t *index, const char *file_name)
+{
+  struct stat file_stat;
+
+  memset(index, 0, sizeof(fm_index_t));
+  int fd = open(file_name, O_RDONLY);
+  if (fd < 0) {
+	fprintf(stderr, "Can't open '%s' for reading\n", file_name);
+	return 1;
+  }
+  if (fstat(fd, &file_stat) != 0 || file_stat.st_size < FM_HEADER_BYTES) {
+	fprintf(stderr, "'%s' is not an index\n", file_name);
+	close(fd);
+	return 1;
+  }
+  void *map = mmap(NULL, file_stat.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+	fprintf(stderr, "Can't map '%s'\n", file_name);
+	return 1;
+  }
+
+  const fm_header_t *header = map;
+  index->length = header->length;
+  index->primary = header->primary;
+  for (int c = 0;  c < FM_SYMBOLS;  c++) {
+	index->first_row[c] = header->first_row[c];
+  }
+  index->num_samples = header->num_samples;
+  index->fingerprint = header->fingerprint;
+  index->blocks = (fm_block_t *)((char *) map + FM_HEADER_BYTES);
+  index->samples = (uint32_t *)(index->blocks + num_blocks(index));
+  index->map = map;
+  index->map_size = file_stat.st_size;
+
+  if (memcmp(header->magic, FM_MAGIC, sizeof(header->magic)) != 0 ||
+	  header->sample_rate != FM_SAMPLE_RATE || index->length < 1 ||
+	  FM_HEADER_BYTES + sizeof(fm_block_t) * num_blocks(index) +
+	  sizeof(uint32_t) * index->num_samples != (size_t) file_stat.st_size) {
+	fprintf(stderr, "'%s' is not an index\n", file_name);
+	fm_free(index);
+	return 1;
+  }
+  return 0;
+}
+
+/* Release an index from 'fm_build' or 'fm_load'. */
+void
+fm_free(fm_index_t *index)
+{
+  if (index->map) {
+	munmap(index->map, index->map_size);
+  } else {
+	free(index->blocks);
+	free(index->samples);
+  }
+  memset(index, 0, sizeof(fm_index_t));
+}
+
+/* **************** Queries **************** */
+
+#define EVEN_BITS 0x5555555555555555ull
+
+/* Mark (at the low bit of each slot) where the 2-bit codes in 'word' are
+   'c', ignoring rows marked in 'other'.
+ */
+static inline uint64_t
+code_matches(uint64_t word, uint64_t other, int c)
+{
+  uint64_t same = ~(word ^ (EVEN_BITS * c));
+  return same & (same >> 1) & EVEN_BITS & ~other;
+}
+
+/* Number of rows before 'row' whose symbol is 'c' (A, C, G or T). */
+static inline long
+rank(const fm_index_t *index, int c, long row)
+{
+  const fm_block_t *block = &index->blocks[row / FM_ROWS_PER_BLOCK];
+  int k = row % FM_ROWS_PER_BLOCK;
+  long count = block->occ[c];
+
+  if (k >= 32) {
+	count += __builtin_popcountll(code_matches(block->codes[0], block->other[0], c));
+	k -= 32;
+	if (k > 0) {
+	  uint64_t mask = ((uint64_t)1 << (2 * k)) - 1;
+	  count += __builtin_popcountll(code_matches(block->codes[1], block->other[1], c) & mask);
+	}
+  } else if (k > 0) {
+	uint64_t mask = ((uint64_t)1 << (2 * k)) - 1;
+	count += __builtin_popcountll(code_matches(block->codes[0], block->other[0], c) & mask);
+  }
+  return count;
+}
+
+/* Count the occurrences of a plain 'pattern' by backward search, leaving
+   the rows of the suffixes it starts in ['*first_row', '*end_row').
+   Returns -1 if the pattern isn't plain.
+ */
+long
+fm_count(const fm_index_t *index, const pattern_t *pattern, long *first_row, long *end_row)
+{
+  long first = 0;
+  long end = index->length;
+
+  if (!pattern->plain) {
+	return -1;
+  }
+  for (int i = pattern->length - 1;  i >= 0 && first < end;  i--) {
+	int c = (pattern->words[i / BASES_PER_WORD] >> (2 * (i % BASES_PER_WORD))) & 3;
+	first = index->first_row[c] + rank(index, c, first);
+	end = index->first_row[c] + rank(index, c, end);
+  }
+  if (first > end) {
+	end = first;
+  }
+  *first_row = first;
+  *end_row = end;
+  return end - first;
+}
+
+/* Return the sequence position of the suffix in 'row', stepping back
+   through the text until reaching a row whose position was sampled.
+ */
+long
+fm_locate(const fm_index_t *index, long row)
+{
+  long steps = 0;
+
+  for (;;) {
+	const fm_block_t *block = &index->blocks[row / FM_ROWS_PER_BLOCK];
+	int k = row % FM_ROWS_PER_BLOCK;
+	if ((block->sampled >> k) & 1) {
+	  uint64_t before = block->sampled & (((uint64_t)1 << k) - 1);
+	  return index->samples[block->samples + __builtin_popcountll(before)] + steps;
+	}
+
+	/* The sentinel's row is always sampled, so this row has a symbol. */
+	int shift = 2 * (k % 32);
+	if ((block->other[k / 32] >> shift) & 1) {
+	  long ranks = 0;
+	  for (int c = 0;  c < 4;  c++) {
+		ranks += rank(index, c, row);
+	  }
+	  row = index->first_row[FM_OTHER] + row - ranks - (index->primary < row);
+	} else {
+	  int c = (block->codes[k / 32] >> shift) & 3;
+	  row = index->first_row[c] + rank(index, c, row);
+	}
+	steps++;
+  }
+}
+
+/* Order match positions for reporting. */
+static int
+compare_positions(const void *a, const void *b)
+{
+  long x = *(const long *) a;
+  long y = *(const long *) b;
+  return x < y ? -1 : x > y;
+}
+
+/* Count the occurrences of a plain 'pattern' in 'fasta' with its index,
+   calling 'report' for each in sequence order if it isn't NULL. The index
+   covers the contigs end to end, so matches that run from one contig into
+   the next are found in the FASTA data and taken off. Returns -1 if the
+   pattern isn't plain; those need a scan of the sequence.
+ */
+long
+fm_match(const fm_index_t *index, fasta_t *fasta, const pattern_t *pattern,
+		 match_fn_t report, void *context)
+{
+  long first_row;
+  long end_row;
+
+  if (!pattern->plain) {
+	return -1;
+  }
+  long match_count = fm_count(index, pattern, &first_row, &end_row) -
+	pattern_count_crossing(pattern, fasta);
+  if (report) {
+	long *positions = malloc(sizeof(long) * (end_row > first_row ? end_row - first_row : 1));
+	for (long row = first_row;  row < end_row;  row++) {
+	  positions[row - first_row] = fm_locate(index, row);
+	}
+	qsort(positions, end_row - first_row, sizeof(long), compare_positions);
+	long contig = 0;
+	for (long i = 0;  i < end_row - first_row;  i++) {
+	  if (fasta_in_one_contig(fasta, positions[i], pattern->length, &contig)) {
+		report(fasta, positions[i], pattern->length, context);
+	  }
+	}
+	free(positions);
+  }
+  return match_count;
+}
@@ -0,0 +1,58 @@
+#ifndef GENOME_INDEX_H
+#define GENOME_INDEX_H
+
+#include <stdint.h>
+
+#include "genome-engine.h"
+
+/* **************** FM-index **************** */
+/* The Burrows-Wheeler transform of the sequence with a sentinel appended,
+   built from its suffix array, answers "how many times does this pattern
+   occur?" in time proportional to the pattern length. Each row is a suffix
+   of the sequence in sorted order. Bytes that aren't upper-case A, C, G or
+   T all become a single symbol that no plain pattern can match, so the
+   index serves plain patterns; the rest need a scan of the sequence.
+ */
+#define FM_SYMBOLS 5			/* A, C, G, T and anything else */
+#define FM_OTHER 4
+#define FM_SAMPLE_RATE 32		/* Suffix array entries kept, one in this many */
+
+/* 64 rows of the transform in one cache line. Symbols are packed two bits
+   each like the sequence; rows holding the sentinel or FM_OTHER are marked
+   in 'other' (at the low bit of each 2-bit slot) and packed as A. The
+   counts cover every row before the block.
+ */
+typedef struct {
+  uint32_t occ[4];				/* A, C, G and T in earlier rows */
+  uint32_t samples;				/* Sampled rows in earlier rows */
+  uint32_t unused;
+  uint64_t codes[2];			/* Symbols of rows 0-31 and 32-63 */
+  uint64_t other[2];			/* Rows that aren't A, C, G or T */
+  uint64_t sampled;				/* Rows whose suffix array entry is kept */
+} fm_block_t;
+
+#define FM_ROWS_PER_BLOCK 64
+
+typedef struct {
+  long length;					/* Rows: sequence length plus one */
+  long primary;					/* Row of the whole sequence, ending in the sentinel */
+  long first_row[FM_SYMBOLS];	/* First row starting with each symbol */
+  long num_samples;
+  fm_block_t *blocks;
+  uint32_t *samples;			/* Positions of the sampled rows, in row order */
+  uint32_t fingerprint;			/* 'fasta_fingerprint' of the sequence indexed */
+  void *map;					/* File mapping, if loaded with 'fm_load' */
+  size_t map_size;
+} fm_index_t;
+
+int fm_build(fm_index_t *index, const fasta_t *fasta, int num_threads);
+int fm_save(const fm_index_t *index, const char *file_name);
+int fm_load(fm_index_t *index, const char *file_name);
+void fm_free(fm_index_t *index);
+long fm_count(const fm_index_t *index, const pattern_t *pattern, long *first_row,
+			  long *end_row);
+long fm_locate(const fm_index_t *index, long row);
+long fm_match(const fm_index_t *index, fasta_t *fasta, const pattern_t *pattern,
+			  match_fn_t report, void *context);
+
+#endif
@@ -0,0 +1,340 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+#include "genome-multi.h"
+
+static const int line_buffer_length = 1024;
+
+/* Bytes unpacked from the sequence at a time while searching. */
+#define AC_BLOCK_BYTES 4096
+
+/* Read one pattern per line from 'file_name', which can be text or .gz.
+   Blank lines and FASTA header lines ('>') are skipped. Sets
+   '*num_patterns'; free the result with 'ac_free_patterns'.
+ */
+char **
+ac_read_patterns(const char *file_name, int *num_patterns)
+{
+  gzFile gzfp = gzopen(file_name, "rb");
+  if (!gzfp) {
+	fprintf(stderr, "Can't open '%s' for reading\n", file_name);
+	exit(1);
+  }
+
+  char **patterns = NULL;
+  int max_patterns = 0;
+  char line_buffer[line_buffer_length];
+  char *pattern = NULL;
+  size_t pattern_length = 0;
+
+  *num_patterns = 0;
+  while (gzgets(gzfp, line_buffer, line_buffer_length) != NULL) {
+	/* Lines longer than the buffer arrive in pieces; gather them. */
+	size_t piece_length = strcspn(line_buffer, "\r\n");
+	int line_done = line_buffer[piece_length] != '\0';
+	pattern = realloc(pattern, pattern_length + piece_length + 1);
+	memcpy(pattern + pattern_length, line_buffer, piece_length);
+	pattern_length += piece_length;
+	pattern[pattern_length] = '\0';
+	if (!line_done && !gzeof(gzfp)) {
+	  continue;
+	}
+
+	if (pattern_length > 0 && pattern[0] != '>') {
+	  if (*num_patterns == max_patterns) {
+		max_patterns = max_patterns ? 2 * max_patterns : 64;
+		patterns = realloc(patterns, max_patterns * sizeof(char *));
+	  }
+	  patterns[(*num_patterns)++] = pattern;
+	  pattern = NULL;
+	}
+	pattern_length = 0;
+  }
+
+  free(pattern);
+  gzclose(gzfp);
+  return patterns;
+}
+
+/* Free the patterns read by 'ac_read_patterns'. */
+void
+ac_free_patterns(char **patterns, int num_patterns)
+{
+  for (int i = 0;  i < num_patterns;  i++) {
+	free(patterns[i]);
+  }
+  free(patterns);
+}
+
+/* Build the automaton for 'patterns', which must outlive it. Patterns
+   match byte for byte, so lower-case and IUPAC letters in a pattern only
+   match the same letters in the sequence. Free with 'ac_free'.
+ */
+void
+ac_build(ac_automaton_t *ac, char **patterns, int num_patterns)
+{
+  ac->patterns = patterns;
+  ac->num_patterns = num_patterns;
+  ac->lengths = malloc(num_patterns * sizeof(int));
+  ac->max_length = 0;
+
+  /* Give each byte used by a pattern its own column; the rest share the
+	 last one, which always leads back to the root. */
+  int columns[256];
+  int num_columns = 0;
+  long max_states = 1;
+  memset(columns, -1, sizeof(columns));
+  for (int i = 0;  i < num_patterns;  i++) {
+	ac->lengths[i] = strlen(patterns[i]);
+	if (ac->lengths[i] > ac->max_length) {
+	  ac->max_length = ac->lengths[i];
+	}
+	max_states += ac->lengths[i];
+	for (const unsigned char *c = (const unsigned char *) patterns[i];  *c;  c++) {
+	  if (columns[*c] < 0) {
+		columns[*c] = num_columns++;
+	  }
+	}
+  }
+  ac->symbol_bits = 0;
+  while ((1 << ac->symbol_bits) < num_columns + 1) {
+	ac->symbol_bits++;
+  }
+  for (int b = 0;  b < 256;  b++) {
+	ac->symbol[b] = columns[b] >= 0 ? columns[b] : num_columns;
+  }
+
+  if (max_states << ac->symbol_bits >= AC_HIT) {
+	fprintf(stderr, "Too many patterns: %ld states\n", max_states);
+	exit(1);
+  }
+
+  /* Lay out the trie; missing edges are zero, the root, until filled. */
+  const int width = 1 << ac->symbol_bits;
+  uint32_t *next = calloc(max_states << ac->symbol_bits, sizeof(uint32_t));
+  ac->output = malloc(max_states * sizeof(int32_t));
+  ac->same = malloc((num_patterns > 0 ? num_patterns : 1) * sizeof(int32_t));
+  ac->output[0] = -1;
+  ac->num_states = 1;
+  for (int i = 0;  i < num_patterns;  i++) {
+	uint32_t state = 0;
+	for (const unsigned char *c = (const unsigned char *) patterns[i];  *c;  c++) {
+	  uint32_t *edge = &next[state * width + ac->symbol[*c]];
+	  if (*edge == 0) {
+		*edge = ac->num_states;
+		ac->output[ac->num_states++] = -1;
+	  }
+	  state = *edge;
+	}
+
+	/* Repeated patterns hang off the first, in file order. */
+	ac->same[i] = -1;
+	if (state == 0) {
+	  continue;
+	}
+	if (ac->output[state] < 0) {
+	  ac->output[state] = i;
+	} else {
+	  int last = ac->output[state];
+	  while (ac->same[last] >= 0) {
+		last = ac->same[last];
+	  }
+	  ac->same[last] = i;
+	}
+  }
+
+  /* Breadth first, fill in each missing edge with the edge from the
+	 state's longest proper suffix in the trie, and chain the states that
+	 end patterns. */
+  uint32_t *fail = calloc(ac->num_states, sizeof(uint32_t));
+  uint32_t *queue = malloc(ac->num_states * sizeof(uint32_t));
+  long head = 0;
+  long tail = 0;
+  ac->dict = calloc(ac->num_states, sizeof(uint32_t));
+  for (int c = 0;  c < width;  c++) {
+	if (next[c]) {
+	  queue[tail++] = next[c];
+	}
+  }
+  while (head < tail) {
+	uint32_t state = queue[head++];
+	for (int c = 0;  c < width;  c++) {
+	  uint32_t *edge = &next[state * width + c];
+	  uint32_t suffix_edge = next[fail[state] * width + c];
+	  if (*edge) {
+		uint32_t child = *edge;
+		fail[child] = suffix_edge;
+		ac->dict[child] = ac->output[suffix_edge] >= 0 ? suffix_edge : ac->dict[suffix_edge];
+		queue[tail++] = child;
+	  } else {
+		*edge = suffix_edge;
+	  }
+	}
+  }
+
+  /* Turn state numbers into row offsets and mark the states that end
+	 patterns, so the search only looks further on a hit. */
+  long entries = ac->num_states << ac->symbol_bits;
+  for (long e = 0;  e < entries;  e++) {
+	uint32_t state = next[e];
+	int hit = ac->output[state] >= 0 || ac->dict[state] != 0;
+	next[e] = state << ac->symbol_bits | (hit ? AC_HIT : 0);
+  }
+  ac->next = realloc(next, entries * sizeof(uint32_t));
+
+  if (verbose) {
+	printf("AUTOMATON %d patterns, %ld states, %ld bytes\n", num_patterns, ac->num_states,
+		   (long)(entries * sizeof(uint32_t)));
+  }
+
+  free(fail);
+  free(queue);
+}
+
+/* Free an automaton built with 'ac_build'; the patterns are left alone. */
+void
+ac_free(ac_automaton_t *ac)
+{
+  free(ac->lengths);
+  free(ac->next);
+  free(ac->output);
+  free(ac->dict);
+  free(ac->same);
+}
+
+/* Count, and report if asked, every pattern ending at 'position' given
+   that the automaton reached 'state' there, unless it starts in an earlier
+   contig. '*contig' is as for 'fasta_in_one_contig', kept at the contig
+   holding 'position'.
+ */
+static inline long
+report_matches(const ac_automaton_t *ac, const fasta_t *fasta, uint32_t state, long position,
+			   long *contig, long *counts, ac_match_fn_t report, void *context)
+{
+  long found = 0;
+
+  fasta_in_one_contig(fasta, position, 1, contig);
+  long contig_start = *contig >= 0 ? fasta->contigs[*contig].start : 0;
+  for (uint32_t s = (state & ~AC_HIT) >> ac->symbol_bits;  s;  s = ac->dict[s]) {
+	for (int p = ac->output[s];  p >= 0;  p = ac->same[p]) {
+	  if (position - ac->lengths[p] + 1 < contig_start) {
+		continue;
+	  }
+	  counts[p]++;
+	  found++;
+	  if (report) {
+		report(p, position - ac->lengths[p] + 1, context);
+	  }
+	}
+  }
+  return found;
+}
+
+/* Find every occurrence of the automaton's patterns that ends in
+   ['first', 'end') and lies within one contig, adding to 'counts' (one per
+   pattern) and calling 'report' for each if it isn't NULL. The scan starts
+   far enough before 'first' to catch matches that straddle it, so
+   splitting the sequence into adjacent ranges counts each match exactly
+   once. Returns the number of matches.
+ */
+long
+ac_search(const ac_automaton_t *ac, const fasta_t *fasta, long first, long end,
+		  long *counts, ac_match_fn_t report, void *context)
+{
+  if (ac->max_length == 0) {
+	return 0;
+  }
+
+  char bytes[AC_BLOCK_BYTES];
+  const uint32_t *next = ac->next;
+  uint32_t state = 0;
+  long match_count = 0;
+  long position = first - ac->max_length + 1 > 0 ? first - ac->max_length + 1 : 0;
+  long contig = fasta_find_contig(fasta, position);
+
+  while (position < end) {
+	long length = end - position < AC_BLOCK_BYTES ? end - position : AC_BLOCK_BYTES;
+	fasta_unpack(fasta, position, length, bytes);
+	for (long i = 0;  i < length;  i++) {
+	  state = next[(state & ~AC_HIT) + ac->symbol[(unsigned char) bytes[i]]];
+	  if ((state & AC_HIT) && position + i >= first) {
+		match_count += report_matches(ac, fasta, state, position + i, &contig, counts,
+									  report, context);
+	  }
+	}
+	position += length;
+  }
+  return match_count;
+}
+
+/* An 'ac_match_fn_t' that appends each match to the 'ac_matches_t' passed
+   as its context.
+ */
+void
+ac_collect(int pattern, long position, void *matches)
+{
+  ac_matches_t *list = matches;
+
+  if (list->num_matches == list->max_matches) {
+	list->max_matches = list->max_matches ? 2 * list->max_matches : 1024;
+	list->matches = realloc(list->matches, list->max_matches * sizeof(ac_match_t));
+  }
+  list->matches[list->num_matches].pattern = pattern;
+  list->matches[list->num_matches].position = position;
+  list->num_matches++;
+}
+
+/* Move the matches in 'from' to the end of 'into', leaving 'from' empty. */
+void
+ac_merge_matches(ac_matches_t *into, ac_matches_t *from)
+{
+  if (into->num_matches + from->num_matches > into->max_matches) {
+	into->max_matches = into->num_matches + from->num_matches;
+	into->matches = realloc(into->matches, into->max_matches * sizeof(ac_match_t));
+  }
+  if (from->num_matches > 0) {
+	memcpy(into->matches + into->num_matches, from->matches,
+		   from->num_matches * sizeof(ac_match_t));
+  }
+  into->num_matches += from->num_matches;
+  free(from->matches);
+  from->matches = NULL;
+  from->num_matches = 0;
+  from->max_matches = 0;
+}
+
+/* Order matches by pattern, then by position. */
+static int
+compare_matches(const void *a, const void *b)
+{
+  const ac_match_t *x = a;
+  const ac_match_t *y = b;
+
+  if (x->pattern != y->pattern) {
+	return x->pattern < y->pattern ? -1 : 1;
+  }
+  return x->position < y->position ? -1 : x->position > y->position;
+}
+
+/* Print the count of each pattern in file order and, if 'matches' isn't
+   NULL, where each match is.
+ */
+void
+ac_print_results(const ac_automaton_t *ac, fasta_t *fasta, const long *counts,
+				 ac_matches_t *matches)
+{
+  long m = 0;
+
+  if (matches) {
+	qsort(matches->matches, matches->num_matches, sizeof(ac_match_t), compare_matches);
+  }
+  for (int p = 0;  p < ac->num_patterns;  p++) {
+	printf(" PATTERN %s\n", ac->patterns[p]);
+	printf("   MATCH %ld time%s\n", counts[p], counts[p] == 1 ? "" : "s");
+	for (;  matches && m < matches->num_matches && matches->matches[m].pattern == p;  m++) {
+	  bytes_around(fasta, matches->matches[m].position, ac->lengths[p]);
+	}
+  }
+}
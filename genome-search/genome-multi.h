@@ -0,0 +1,57 @@
+#ifndef GENOME_MULTI_H
+#define GENOME_MULTI_H
+
+#include <stdint.h>
+
+#include "genome-engine.h"
+
+/* **************** Multi-pattern search **************** */
+/* An Aho-Corasick automaton finds every occurrence of many patterns in one
+   pass over the sequence. The state table is a full transition table with
+   one row per state, each row a power of two wide so that the next state is
+   a single load: entries hold the offset of the next row, with AC_HIT set
+   when that state ends one or more patterns.
+ */
+#define AC_HIT 0x80000000u
+
+typedef struct {
+  char **patterns;				/* Patterns as given */
+  int num_patterns;
+  int *lengths;					/* Bases in each pattern */
+  int max_length;				/* Bases in the longest pattern */
+  unsigned char symbol[256];	/* Column for each byte; unused bytes share one */
+  int symbol_bits;				/* log2 of the row width */
+  long num_states;
+  uint32_t *next;				/* Row offset of the next state, maybe with AC_HIT */
+  int32_t *output;				/* Pattern ending at each state, or -1 */
+  uint32_t *dict;				/* Next state down the suffix chain with output, or 0 */
+  int32_t *same;				/* Next pattern with the same text, or -1 */
+} ac_automaton_t;
+
+/* Called by 'ac_search' for each match, with the caller's 'context'. */
+typedef void (*ac_match_fn_t)(int pattern, long position, void *context);
+
+/* A match of pattern number 'pattern', kept by 'ac_collect'. */
+typedef struct {
+  int pattern;
+  long position;
+} ac_match_t;
+
+typedef struct {
+  ac_match_t *matches;
+  long num_matches;
+  long max_matches;				/* Matches allocated */
+} ac_matches_t;
+
+char **ac_read_patterns(const char *file_name, int *num_patterns);
+void ac_free_patterns(char **patterns, int num_patterns);
+void ac_build(ac_automaton_t *ac, char **patterns, int num_patterns);
+void ac_free(ac_automaton_t *ac);
+long ac_search(const ac_automaton_t *ac, const fasta_t *fasta, long first, long end,
+			   long *counts, ac_match_fn_t report, void *context);
+void ac_collect(int pattern, long position, void *matches);
+void ac_merge_matches(ac_matches_t *into, ac_matches_t *from);
+void ac_print_results(const ac_automaton_t *ac, fasta_t *fasta, const long *counts,
+					  ac_matches_t *matches);
+
+#endif
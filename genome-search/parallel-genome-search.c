@@ -3,262 +3,414 @@
 
 #include <stdio.h>
 #include <stdlib.h>
-#include <zlib.h>
 #include <unistd.h>
 #include <string.h>
-#include <time.h>
 #include <pthread.h>
 
-int verbose = 0;				/* Output more info at run time? */
-pthread_mutex_t matches_mutex;
-//int matches = 0;
-
-/* Helpful constants */
-#define ONE_MEGA (long)(1024 * 1024)
-#define ONE_GIGA (long)(ONE_MEGA * 1024)
-#define ONE_BILLION (double)1000000000.0
+#include "genome-engine.h"
+#include "genome-index.h"
+#include "genome-multi.h"
+#include "genome-approx.h"
 
-const int line_buffer_length = 1024;
+int verbose = 0;				/* Output more info at run time? */
 
-/* **************** FASTA ADT **************** */
-/* Genome data files .. https://en.wikipedia.org/wiki/FASTA_format */
-
-typedef struct {
-  char *sequence;				/* Entire sequence */
-  char *seq_ptr;				/* Next location to store data */
-  long max_length;				/* Max length allocated */
-  long cur_length;				/* Current length */
-} fasta_t;
+/* Threads take the sequence a chunk at a time, in order, so each streams
+   its own stretch of memory and faster threads take more chunks. */
+#define CHUNK_BASES (1L << 20)
+pthread_mutex_t chunk_mutex;
+long next_chunk;				/* First position not yet handed out */
 
 typedef struct {
     int tid;
     int fasta_max_length;
     int num_threads;
     int local_matches;
-    char *pattern;
+    pattern_t *pattern;
     fasta_t *fasta;
 } thread_args_t;
 
-/* Create a FASTA object; allocates memory on the heap */
-fasta_t *
-fasta_create(long max_length)
-{
-  if (verbose) {
-	printf("Allocate %ld bytes\n", max_length);
-  }
-  fasta_t *new = malloc(sizeof(fasta_t));
-  new->sequence = new->seq_ptr = malloc(max_length);
-  new->max_length = max_length;
-  new->cur_length = 0;
-  return new;
-}
-
-/* Destroy a FASTA object; deallocates memory. */
+/* Print a match found by 'pattern_search' with its surroundings. */
 void
-fasta_destroy(fasta_t *old)
+show_match(fasta_t *fasta, long position, int length, void *context)
 {
-  free(old->sequence);
-  free(old);
+  bytes_around(fasta, position, length);
 }
 
-/* Read a FASTA file into a FASTA structure. Can be called multiple times and
- * will append new data to whatever is already in existing structure. For
- * example, can read multiple chromosome files into a single FASTA
- * structure. Will crater on attempts to read more data from file than will fit
- * in allocated FASTA structure. Works with both .gz and flat text files (but
- * prefer the zipped version to save disk space!).
+/* Search for all occurrences of 'pattern' in the FASTA structure. Returns the
+ * number of times the pattern occurs. Occurrences can overlap (e.g., "ACTACT"
+ * matches twice in "ACTACTACT". Returns the number of occurrences. Also tracks
+ * the time taken by the matching and reports the results to stdout.
  */
-void
-fasta_read_file(char *file_name, fasta_t *fasta)
+int 
+match(char *pattern, fasta_t *fasta)
 {
-  gzFile gzfp = gzopen(file_name, "rb");
-  if (!gzfp) {
-	fprintf(stderr, "Can't open '%s' for reading\n", file_name);
-	exit(1);
-  }
-  printf(" LOADING %s\n", file_name);
-  
-  /* Reads one line at a time from the FASTA file. */
-  char line_buffer[line_buffer_length];
-  int lines_kept = 0;
-  int lines_skipped = 0;
-  while ((gzgets(gzfp, line_buffer, line_buffer_length) != NULL)) {
-	char *line_ptr = line_buffer;
-	if (line_buffer[0] == '>') {
-	  /* Line contains text annotation; skip it. */
-	  lines_skipped++;
-	} else {
-	  /* Valid data; copy all ACGT data from line buffer. */
-	  lines_kept++;
-	  while (*line_ptr != '\n') {
-		*fasta->seq_ptr++ = *line_ptr++;
-		fasta->cur_length++;
-	  }
-	}
-	if (fasta->cur_length + line_buffer_length > fasta->max_length) {
-	  fprintf(stderr, "Read %ld bytes; fasta buffer too small (%ld bytes)\n",
-			  fasta->cur_length, fasta->max_length);
-	  exit(1);
-	}
-  }
+  pattern_t packed;
+  pattern_init(&packed, pattern);
+  long last_match_location = fasta->cur_length - packed.length;
+  long trial_count = last_match_location >= 0 ? last_match_location + 1 : 0;
+
+  double start_time = now();
+
+  long match_count = pattern_search(&packed, fasta, 0, fasta->cur_length, 1,
+									verbose ? show_match : NULL, NULL);
+
+  printf("    TOOK %5.3f seconds\n", now() - start_time);
+  printf("   TRIED %e matches\n", (double)trial_count);
 
-  if (verbose) {
-	printf("%s: %d lines skipped, %d lines kept, %ld total bytes\n",
-		   file_name, lines_skipped, lines_kept, fasta->cur_length);
+  pattern_free(&packed);
+  return match_count;
+}
+
+void
+check_thread_rtn(char *msge, int rtn) {
+  if (rtn) {
+    fprintf(stderr, "ERROR: %s (%d)\n", msge,rtn);
+    exit(1);
   }
-  
-  gzclose(gzfp);
 }
 
-/* Return the current time. */
-double
-now(void)
+/* Hand the calling thread the next chunk of the sequence in 'fasta', as
+ * positions ['*first', '*end'). A chunk ends at the last contig boundary
+ * within CHUNK_BASES if there is one, so only contigs longer than that are
+ * split. Returns 0 once the sequence is used up. Set 'next_chunk' to 0
+ * before starting the threads.
+ */
+int
+take_chunk(const fasta_t *fasta, long *first, long *end)
 {
-  struct timespec current_time;
-  clock_gettime(CLOCK_REALTIME, &current_time);
-  return current_time.tv_sec + (current_time.tv_nsec / ONE_BILLION);
+  pthread_mutex_lock(&chunk_mutex);
+  *first = next_chunk;
+  *end = next_chunk + CHUNK_BASES;
+  if (*end >= fasta->cur_length) {
+	*end = fasta->cur_length;
+  } else {
+	long contig = fasta_find_contig(fasta, *end);
+	if (contig >= 0 && fasta->contigs[contig].start > *first) {
+	  *end = fasta->contigs[contig].start;
+	}
+  }
+  next_chunk = *end;
+  pthread_mutex_unlock(&chunk_mutex);
+  return *first < *end;
 }
 
-/* Return the smaller of two pointers. */
-const char *
-min(const char *a, const char *b)
+typedef struct {
+  fasta_t *fasta;
+  int tid;
+  int num_threads;
+} place_args_t;
+
+/* Zero the packed words of every 'num_threads'th chunk, starting at
+ * chunk 'tid', so this thread touches their pages first.
+ */
+void *
+place_chunks(void *thread_args)
 {
-  return a < b ? a : b;
+  place_args_t *args = (place_args_t *) thread_args;
+  const long words_per_chunk = CHUNK_BASES / BASES_PER_WORD;
+  long words = args->fasta->max_length / BASES_PER_WORD + 2;
+
+  for (long w = args->tid * words_per_chunk;  w < words;
+	   w += args->num_threads * words_per_chunk) {
+	long n = words - w < words_per_chunk ? words - w : words_per_chunk;
+	memset(args->fasta->packed + w, 0, n * sizeof(uint64_t));
+  }
+  return (void *)NULL;
 }
 
-/* Return the larger of two pointers. */
-const char *
-max(const char *a, const char *b)
+/* Spread the pages of the sequence buffer over the threads' memory before
+ * it is loaded. Large buffers come from the kernel untouched, and each page
+ * lands on the NUMA node of the thread that first writes it; left to the
+ * loader, they would all land on one node and the searching threads would
+ * share its bandwidth.
+ */
+void
+place_sequence(fasta_t *fasta, int num_threads)
 {
-  return a > b ? a : b;
+  pthread_t *threads = malloc(sizeof(pthread_t) * num_threads);
+  place_args_t *thread_args = malloc(sizeof(place_args_t) * num_threads);
+  int rtn;
+
+  for (int i = 0;  i < num_threads;  i++) {
+	thread_args[i].fasta = fasta;
+	thread_args[i].tid = i;
+	thread_args[i].num_threads = num_threads;
+	rtn = pthread_create(&threads[i], NULL, place_chunks, &thread_args[i]);
+	check_thread_rtn("create", rtn);
+  }
+  for (int i = 0;  i < num_threads;  i++) {
+	rtn = pthread_join(threads[i], NULL);
+	check_thread_rtn("join", rtn);
+  }
+
+  free(threads);
+  free(thread_args);
 }
 
-/* Clamp 'value' to be in the range ['low' .. 'high'] */
-const char *
-clamp(const char *value, const char *low, const char *high)
+void *
+parallel_match(void *thread_args)
 {
-  if (low >= high) {
-	fprintf(stderr, "Bogus bounds [%p, %p]\n", low, high);
-	exit(1);
-  }
+    thread_args_t *args = (thread_args_t *) thread_args;
+    long first, end;
+
+    while (take_chunk(args->fasta, &first, &end)) {
+        args->local_matches += pattern_search(args->pattern, args->fasta, first, end, 1,
+                                              NULL, NULL);
+    }
 
-  return min(max(value, low), high);
+    return (void *)NULL;
 }
 
-/* Print 'n' padding characters to pretty-up the output. */
-void
-print_padding(const int n)
+/* Search for 'pattern' in the FASTA structure on 'num_threads' threads,
+ * reporting the time taken. Returns the number of occurrences.
+ */
+int
+threaded_match(char *pattern, fasta_t *fasta, int num_threads)
 {
-  for (int i = 0;  i < n;  i++) {
-	printf(" ");
+  pthread_t *threads = malloc(sizeof(pthread_t) * num_threads);
+  thread_args_t *thread_args = malloc(sizeof(thread_args_t) * num_threads);
+  int rtn;
+
+  pattern_t packed;
+  pattern_init(&packed, pattern);
+
+  double start_time = now();
+  int matches = 0;
+  next_chunk = 0;
+  for (int i = 0;  i < num_threads;  i++) {
+      thread_args[i].tid = i;
+      thread_args[i].pattern = &packed;
+      thread_args[i].fasta = fasta;
+      thread_args[i].num_threads = num_threads;
+      thread_args[i].local_matches = 0;
+      rtn = pthread_create(&threads[i], NULL, parallel_match, &thread_args[i]);
+      check_thread_rtn("create", rtn);
+  }
+
+  for (int i = 0;  i < num_threads;  i++) {
+      rtn = pthread_join(threads[i], NULL);
+      matches += thread_args[i].local_matches;
+      check_thread_rtn("join", rtn);
   }
+  printf("    TOOK %5.3f seconds\n", now() - start_time);
+
+  pattern_free(&packed);
+  free(threads);
+  free(thread_args);
+  return matches;
 }
 
-/* Print 'length' bytes starting at 'current' from within the current data in
- * a FASTA structure. Also prints 'padding_bytes' bytes before and after the
- * range of values for context, as well as the offset into the sequence. Takes
- * care not to blow past either end of the sequence data in the FASTA
- * structure.
+/* Search for 'pattern' with an FM-index instead of scanning, in time
+ * proportional to the pattern length, showing the matches in sequence
+ * order when verbose. Patterns the index can't serve (anything but
+ * upper-case ACGT) fall back to a scan of the FASTA data.
  */
-void
-bytes_around(fasta_t *fasta, char *current, int length)
+int
+match_index(char *pattern, fm_index_t *index, fasta_t *fasta, int num_threads)
 {
-  const int padding_bytes = 8;
-  const char *fasta_last = fasta->sequence + fasta->cur_length;
+  pattern_t packed;
+  pattern_init(&packed, pattern);
 
-  const char *first = clamp(current - padding_bytes, fasta->sequence, fasta_last);
-  const char *last = clamp(current + length + padding_bytes, fasta->sequence, fasta_last);
-
-  print_padding(padding_bytes - (current - first));
+  double start_time = now();
 
-  for (const char *p = first;  p < last;  p++) {
-	if (p == current) {
-	  printf("[");
-	}
-	printf("%c", *p);
-	if (p == current + length - 1) {
-	  printf("]");
-	}
+  long match_count = fm_match(index, fasta, &packed, verbose ? show_match : NULL, NULL);
+  pattern_free(&packed);
+  if (match_count < 0) {
+	return threaded_match(pattern, fasta, num_threads);
   }
 
-  print_padding(padding_bytes - (last - (current + length)));
-  printf("%15ld\n", current - fasta->sequence);
+  printf("    TOOK %5.3f seconds\n", now() - start_time);
+  return match_count;
 }
 
-/* Search for all occurrences of 'pattern' in the FASTA structure. Returns the
- * number of times the pattern occurs. Occurrences can overlap (e.g., "ACTACT"
- * matches twice in "ACTACTACT". Returns the number of occurrences. Also tracks
- * the time taken by the matching and reports the results to stdout.
+typedef struct {
+  ac_automaton_t *ac;
+  fasta_t *fasta;
+  long *counts;					/* Matches of each pattern in this thread's chunks */
+  long local_matches;
+  ac_matches_t matches;			/* Where, when verbose */
+} multi_args_t;
+
+/* Search chunks of the sequence for all the patterns until none are left. */
+void *
+parallel_multi(void *thread_args)
+{
+  multi_args_t *args = (multi_args_t *) thread_args;
+  long first, end;
+
+  while (take_chunk(args->fasta, &first, &end)) {
+	args->local_matches += ac_search(args->ac, args->fasta, first, end, args->counts,
+									 verbose ? ac_collect : NULL, &args->matches);
+  }
+  return (void *)NULL;
+}
+
+/* Search for every pattern in the file 'pattern_file' in one pass over the
+ * FASTA structure, taken a chunk at a time by the threads, and report how
+ * often each occurs (and where, when verbose). Returns the total number of
+ * matches.
  */
-int 
-match(char *pattern, fasta_t *fasta)
+long
+match_multi(char *pattern_file, fasta_t *fasta, int num_threads)
 {
-  int pattern_length = strlen(pattern);
-  char *seq_ptr = fasta->sequence;
-  char *last_match_location = fasta->sequence + fasta->cur_length - pattern_length;
-  long match_count = 0;
-  long trial_count = 0;
+  int num_patterns;
+  char **patterns = ac_read_patterns(pattern_file, &num_patterns);
+  ac_automaton_t ac;
+  ac_build(&ac, patterns, num_patterns);
+
+  pthread_t *threads = malloc(sizeof(pthread_t) * num_threads);
+  multi_args_t *thread_args = malloc(sizeof(multi_args_t) * num_threads);
+  long *counts = calloc(num_patterns + 1, sizeof(long));
+  ac_matches_t matches = { NULL, 0, 0 };
+  int rtn;
 
+  printf("MATCHING %d patterns ...\n", num_patterns);
   double start_time = now();
 
-  while (seq_ptr <= last_match_location) {
-	trial_count++;
-	if (strncmp(seq_ptr, pattern, pattern_length) == 0) {
-	  if (verbose) {
-		bytes_around(fasta, seq_ptr, pattern_length);
-	  }
-	  match_count++;
-	}
-	seq_ptr++;
+  next_chunk = 0;
+  for (int i = 0;  i < num_threads;  i++) {
+	thread_args[i].ac = &ac;
+	thread_args[i].fasta = fasta;
+	thread_args[i].local_matches = 0;
+	thread_args[i].counts = calloc(num_patterns + 1, sizeof(long));
+	thread_args[i].matches = (ac_matches_t) { NULL, 0, 0 };
+	rtn = pthread_create(&threads[i], NULL, parallel_multi, &thread_args[i]);
+	check_thread_rtn("create", rtn);
   }
 
+  long match_count = 0;
+  for (int i = 0;  i < num_threads;  i++) {
+	rtn = pthread_join(threads[i], NULL);
+	check_thread_rtn("join", rtn);
+	match_count += thread_args[i].local_matches;
+	for (int p = 0;  p < num_patterns;  p++) {
+	  counts[p] += thread_args[i].counts[p];
+	}
+	ac_merge_matches(&matches, &thread_args[i].matches);
+	free(thread_args[i].counts);
+  }
   printf("    TOOK %5.3f seconds\n", now() - start_time);
-  printf("   TRIED %e matches\n", (double)trial_count);
+  ac_print_results(&ac, fasta, counts, verbose ? &matches : NULL);
 
+  free(matches.matches);
+  free(counts);
+  free(threads);
+  free(thread_args);
+  ac_free(&ac);
+  ac_free_patterns(patterns, num_patterns);
   return match_count;
 }
 
-void
-check_thread_rtn(char *msge, int rtn) {
-  if (rtn) {
-    fprintf(stderr, "ERROR: %s (%d)\n", msge,rtn);
-    exit(1);
+typedef struct {
+  approx_pattern_t *approx;
+  fasta_t *fasta;
+  long *counts;					/* Matches at each distance in this thread's chunks */
+  long local_matches;
+  approx_matches_t matches;		/* Where, when verbose */
+} approx_args_t;
+
+/* Search chunks of the sequence for approximate matches until none are left. */
+void *
+parallel_approx(void *thread_args)
+{
+  approx_args_t *args = (approx_args_t *) thread_args;
+  long first, end;
+
+  while (take_chunk(args->fasta, &first, &end)) {
+	args->local_matches += approx_search(args->approx, args->fasta, first, end, args->counts,
+										 verbose ? approx_collect : NULL, &args->matches);
   }
+  return (void *)NULL;
 }
 
-void *
-parallel_match(void *thread_args)
+/* Search for 'pattern' allowing up to 'max_edits' differences (mismatches
+ * only if 'mismatches_only'), taking the FASTA structure a chunk at a time
+ * on 'num_threads' threads, and report how many positions end a match at
+ * each distance (and where, when verbose). Returns the total number of
+ * matches, or -1 if the pattern can't be searched for this way.
+ */
+long
+match_approx(char *pattern, int max_edits, int mismatches_only, fasta_t *fasta,
+			 int num_threads)
 {
-    thread_args_t *args = (thread_args_t *) thread_args;
-    int pattern_length = strlen(args->pattern);
-    char *seq_ptr = args->fasta->sequence + args->tid;
-    char *last_match_location = args->fasta->sequence + args->fasta->cur_length - pattern_length;
-
-    while(seq_ptr <= last_match_location) {
-        if (strncmp(seq_ptr, args->pattern, pattern_length) == 0) {
-            args->local_matches++;
-        }
-        seq_ptr += args->num_threads;
-    }
+  approx_pattern_t approx;
+  if (approx_init(&approx, pattern, max_edits, mismatches_only)) {
+	return -1;
+  }
 
+  pthread_t *threads = malloc(sizeof(pthread_t) * num_threads);
+  approx_args_t *thread_args = malloc(sizeof(approx_args_t) * num_threads);
+  long *counts = calloc(max_edits + 1, sizeof(long));
+  approx_matches_t matches = { NULL, 0, 0 };
+  int rtn;
 
-    return (void *)NULL;
+  double start_time = now();
+
+  next_chunk = 0;
+  for (int i = 0;  i < num_threads;  i++) {
+	thread_args[i].approx = &approx;
+	thread_args[i].fasta = fasta;
+	thread_args[i].local_matches = 0;
+	thread_args[i].counts = calloc(max_edits + 1, sizeof(long));
+	thread_args[i].matches = (approx_matches_t) { NULL, 0, 0 };
+	rtn = pthread_create(&threads[i], NULL, parallel_approx, &thread_args[i]);
+	check_thread_rtn("create", rtn);
+  }
+
+  long match_count = 0;
+  for (int i = 0;  i < num_threads;  i++) {
+	rtn = pthread_join(threads[i], NULL);
+	check_thread_rtn("join", rtn);
+	match_count += thread_args[i].local_matches;
+	for (int d = 0;  d <= max_edits;  d++) {
+	  counts[d] += thread_args[i].counts[d];
+	}
+	approx_merge_matches(&matches, &thread_args[i].matches);
+	free(thread_args[i].counts);
+  }
+  printf("    TOOK %5.3f seconds\n", now() - start_time);
+  printf("PATTERN %s\n", pattern);
+  approx_print_results(&approx, fasta, counts, verbose ? &matches : NULL);
+
+  free(matches.matches);
+  free(counts);
+  free(threads);
+  free(thread_args);
+  return match_count;
 }
 
 /* Print a usage message and exit. */
 void
 usage(char *prog_name)
 {
-  fprintf(stderr, "%s: [-v] -n <T> -b <B>|-m <MB>|-g <GB> -p <pattern> <fastafile>...\n", prog_name);
+  fprintf(stderr, "%s: [-v] -n <T> [-b <B>|-m <MB>|-g <GB>] -p <pattern> <fastafile>...\n", prog_name);
+  fprintf(stderr, "%s: [-v] -n <T> [-b <B>|-m <MB>|-g <GB>] -I <file> [-p <pattern>] <fastafile>...\n",
+		  prog_name);
+  fprintf(stderr, "%s: [-v] -n <T> [-b <B>|-m <MB>|-g <GB>] -k <K> [-s] -p <pattern> <fastafile>...\n",
+		  prog_name);
+  fprintf(stderr, "%s: [-v] -n <T> [-b <B>|-m <MB>|-g <GB>] -P <file> <fastafile>...\n",
+		  prog_name);
+  fprintf(stderr, "%s: [-v] -n <T> [-b <B>|-m <MB>|-g <GB>] -c <file> <fastafile>...\n",
+		  prog_name);
+  fprintf(stderr, "%s: [-v] -n <T> [-b <B>|-m <MB>|-g <GB>] -i <file> -p <pattern> <fastafile>...\n",
+		  prog_name);
   fprintf(stderr, "  -v           enable verbose output\n");
-  fprintf(stderr, "  -n <T>       use <T> threads to search for pattern\n");
-  fprintf(stderr, "  -b <B>       allocate <B> bytes for FASTA data\n");
-  fprintf(stderr, "  -m <MB>      allocate <MB> megabytes for FASTA data\n");
-  fprintf(stderr, "  -g <GB>      allocate <GB> gigabytes for FASTA data\n");
-  fprintf(stderr, "  -p <pattern> pattern for search [required]\n");
+  fprintf(stderr, "  -n <T>       use <T> threads to search for pattern or build the index\n");
+  fprintf(stderr, "  -b <B>       reserve room for <B> bases of FASTA data at first\n");
+  fprintf(stderr, "  -m <MB>      reserve room for <MB> megabases (2^20) at first\n");
+  fprintf(stderr, "  -g <GB>      reserve room for <GB> gigabases (2^30) at first\n");
+  fprintf(stderr, "  -p <pattern> pattern for search [required unless -I or -P]\n");
+  fprintf(stderr, "  -k <K>       match <pattern> with up to <K> edits (up to %d bases)\n",
+		  APPROX_MAX_LENGTH);
+  fprintf(stderr, "  -s           with -k, allow mismatches only, not insertions or deletions\n");
+  fprintf(stderr, "  -P <file>    search for every pattern in <file>, one per line\n");
+  fprintf(stderr, "  -c <file>    pack the FASTA data into the genome image <file>\n");
+  fprintf(stderr, "  -I <file>    build an FM-index of the FASTA data into <file>\n");
+  fprintf(stderr, "  -i <file>    search with the FM-index in <file> of the same FASTA data\n");
   fprintf(stderr, "  -h, -?       print this help and exit\n");
-  fprintf(stderr, "One of -b, -m, or -g must be provided");
+  fprintf(stderr, "Without -b, -m, or -g, room is reserved from the <fastafile> sizes\n");
   fprintf(stderr, "One or more <fastafile> must appear; can be text or .gz file\n");
+  fprintf(stderr, "A genome image from -c can be given instead, as the only <fastafile>\n");
   fprintf(stderr, "If multiple <fastafile>s, will be concatenated and searched\n");
   exit(1);
 }
@@ -269,11 +421,17 @@ main(int argc, char **argv)
   char *prog_name = argv[0];
   long fasta_max_length = 0;
   char *pattern = NULL;
+  char *index_name = NULL;
+  char *save_index_name = NULL;
+  char *pattern_file = NULL;
+  char *image_name = NULL;
   long num_threads = 0;
+  int max_edits = -1;
+  int mismatches_only = 0;
 
   /* Process command-line arguments; see 'man 3 getopt'. */
   int ch;
-  while ((ch = getopt(argc, argv, "n:b:hm:g:p:v")) != -1) {
+  while ((ch = getopt(argc, argv, "n:b:c:hi:I:k:m:g:p:P:sv")) != -1) {
 	switch (ch) {
 	case 'n':
 	  num_threads = atol(optarg);
@@ -281,15 +439,33 @@ main(int argc, char **argv)
 	case 'b':
 	  fasta_max_length = atol(optarg);
 	  break;
+	case 'c':
+	  image_name = optarg;
+	  break;
 	case 'g':
 	  fasta_max_length = atol(optarg) * ONE_GIGA;
 	  break;
 	case 'm':
 	  fasta_max_length = atol(optarg) * ONE_MEGA;
 	  break;
+	case 'i':
+	  index_name = optarg;
+	  break;
+	case 'I':
+	  save_index_name = optarg;
+	  break;
+	case 'k':
+	  max_edits = atoi(optarg);
+	  break;
 	case 'p':
 	  pattern = optarg;
 	  break;
+	case 'P':
+	  pattern_file = optarg;
+	  break;
+	case 's':
+	  mismatches_only = 1;
+	  break;
 	case 'v':
 	  verbose = 1;
 	  break;
@@ -304,52 +480,92 @@ main(int argc, char **argv)
 
   printf("NUM THREADS: %ld\n", num_threads);
 
-  if (fasta_max_length == 0 || pattern == NULL) {
+  if (argc == 0 ||
+	  (pattern == NULL && !save_index_name && !pattern_file && !image_name) ||
+	  (pattern && pattern_file) ||
+	  (index_name && (save_index_name || pattern_file)) ||
+	  (max_edits >= 0 && (!pattern || index_name || save_index_name)) ||
+	  (mismatches_only && max_edits < 0)) {
 	usage(prog_name);
   }
 
-  /* Create FASTA structure with the given length. */
-  fasta_t *fasta = fasta_create(fasta_max_length);
-
-  /* For each <fastafile> argument, read its data into the FASTA structure. */
-  for (int idx = 0;  idx < argc;  idx++) {
-	fasta_read_file(argv[idx], fasta);
-  }
-
-  int rtn = pthread_mutex_init(&matches_mutex, NULL);
+  int rtn = pthread_mutex_init(&chunk_mutex, NULL);
   check_thread_rtn("mutex init", rtn);
 
+  fasta_t *fasta;
+  if (argc == 1 && fasta_is_image(argv[0])) {
+	/* Map the genome image; there's nothing to read. */
+	fasta = fasta_map(argv[0]);
+	if (!fasta) {
+	  exit(1);
+	}
+  } else {
+	/* Create FASTA structure with the given length, or one to fit the
+	   files, spread over the threads. */
+	if (fasta_max_length == 0) {
+	  fasta_max_length = fasta_size_hint(argv, argc);
+	}
+	fasta = fasta_create(fasta_max_length);
+	place_sequence(fasta, num_threads);
 
-  pthread_t *threads = malloc(sizeof(pthread_t) * num_threads);
-  thread_args_t *thread_args = malloc(sizeof(thread_args_t) * num_threads);
-
-  printf("MATCHING ...\n");
+	/* Read the <fastafile>s into the FASTA structure, several at a time. */
+	fasta_read_files(argv, argc, fasta, num_threads);
+  }
 
-  double start_time = now();
-  int matches = 0;
-  for (int i = 0;  i < num_threads;  i++) {
-      thread_args[i].tid = i;
-      thread_args[i].pattern = pattern;
-      thread_args[i].fasta = fasta;
-      thread_args[i].num_threads = num_threads;
-      thread_args[i].local_matches = 0;
-      rtn = pthread_create(&threads[i], NULL, parallel_match, &thread_args[i]);
-      check_thread_rtn("create", rtn);
+  /* Save the FASTA data as a genome image for later runs to map. */
+  if (image_name) {
+	double start_time = now();
+	if (fasta_save(fasta, image_name)) {
+	  exit(1);
+	}
+	printf("  PACKED %ld bytes in %5.3f seconds\n", fasta->cur_length, now() - start_time);
   }
 
-  for (int i = 0;  i < num_threads;  i++) {
-      rtn = pthread_join(threads[i], NULL);
-      matches += thread_args[i].local_matches;
-      check_thread_rtn("join", rtn);
+  /* Build and save an index of the FASTA data, or load one built before. */
+  fm_index_t index;
+  int have_index = 0;
+  if (save_index_name) {
+	double start_time = now();
+	if (fm_build(&index, fasta, num_threads) || fm_save(&index, save_index_name)) {
+	  exit(1);
+	}
+	printf(" INDEXED %ld bytes in %5.3f seconds\n", fasta->cur_length, now() - start_time);
+	have_index = 1;
+  } else if (index_name) {
+	if (fm_load(&index, index_name)) {
+	  exit(1);
+	}
+	if (index.length != fasta->cur_length + 1 ||
+		index.fingerprint != fasta_fingerprint(fasta)) {
+	  fprintf(stderr, "Index '%s' doesn't match the FASTA data\n", index_name);
+	  exit(1);
+	}
+	have_index = 1;
   }
-  printf("    TOOK %5.3f seconds\n", now() - start_time);
 
-  printf("PATTERN %s\n", pattern);
-  printf("   MATCH %d time%s\n", matches, matches == 1 ? "" : "s");
+  if (pattern && max_edits >= 0) {
+	printf("MATCHING ...\n");
+	long matches = match_approx(pattern, max_edits, mismatches_only, fasta, num_threads);
+	if (matches < 0) {
+	  exit(1);
+	}
+	printf("   TOTAL %ld match%s\n", matches, matches == 1 ? "" : "es");
+  } else if (pattern) {
+	printf("MATCHING ...\n");
+	int matches = have_index ? match_index(pattern, &index, fasta, num_threads) :
+	  threaded_match(pattern, fasta, num_threads);
+
+	printf("PATTERN %s\n", pattern);
+	printf("   MATCH %d time%s\n", matches, matches == 1 ? "" : "s");
+  } else if (pattern_file) {
+	long matches = match_multi(pattern_file, fasta, num_threads);
+	printf("   TOTAL %ld match%s\n", matches, matches == 1 ? "" : "es");
+  }
 
   /* Clean up and be done. */
+  if (have_index) {
+	fm_free(&index);
+  }
   fasta_destroy(fasta);
-  free(threads);
-  free(thread_args);
   exit(0);
 }
@@ -3,206 +3,128 @@
 
 #include <stdio.h>
 #include <stdlib.h>
-#include <zlib.h>
 #include <unistd.h>
 #include <string.h>
-#include <time.h>
 
-int verbose = 0;				/* Output more info at run time? */
-
-/* Helpful constants */
-#define ONE_MEGA (long)(1024 * 1024)
-#define ONE_GIGA (long)(ONE_MEGA * 1024)
-#define ONE_BILLION (double)1000000000.0
-
-const int line_buffer_length = 1024;
+#include "genome-engine.h"
+#include "genome-index.h"
+#include "genome-multi.h"
+#include "genome-approx.h"
 
-/* **************** FASTA ADT **************** */
-/* Genome data files .. https://en.wikipedia.org/wiki/FASTA_format */
-
-typedef struct {
-  char *sequence;				/* Entire sequence */
-  char *seq_ptr;				/* Next location to store data */
-  long max_length;				/* Max length allocated */
-  long cur_length;				/* Current length */
-} fasta_t;
-
-/* Create a FASTA object; allocates memory on the heap */
-fasta_t *
-fasta_create(long max_length)
-{
-  if (verbose) {
-	printf("Allocate %ld bytes\n", max_length);
-  }
-  fasta_t *new = malloc(sizeof(fasta_t));
-  new->sequence = new->seq_ptr = malloc(max_length);
-  new->max_length = max_length;
-  new->cur_length = 0;
-  return new;
-}
+int verbose = 0;				/* Output more info at run time? */
 
-/* Destroy a FASTA object; deallocates memory. */
+/* Print a match found by 'pattern_search' with its surroundings. */
 void
-fasta_destroy(fasta_t *old)
+show_match(fasta_t *fasta, long position, int length, void *context)
 {
-  free(old->sequence);
-  free(old);
+  bytes_around(fasta, position, length);
 }
 
-/* Read a FASTA file into a FASTA structure. Can be called multiple times and
- * will append new data to whatever is already in existing structure. For
- * example, can read multiple chromosome files into a single FASTA
- * structure. Will crater on attempts to read more data from file than will fit
- * in allocated FASTA structure. Works with both .gz and flat text files (but
- * prefer the zipped version to save disk space!).
+/* Search for all occurrences of 'pattern' in the FASTA structure. Returns the
+ * number of times the pattern occurs. Occurrences can overlap (e.g., "ACTACT"
+ * matches twice in "ACTACTACT". Returns the number of occurrences. Also tracks
+ * the time taken by the matching and reports the results to stdout.
  */
-void
-fasta_read_file(char *file_name, fasta_t *fasta)
+int 
+match(char *pattern, fasta_t *fasta)
 {
-  gzFile gzfp = gzopen(file_name, "rb");
-  if (!gzfp) {
-	fprintf(stderr, "Can't open '%s' for reading\n", file_name);
-	exit(1);
-  }
-  printf(" LOADING %s\n", file_name);
-  
-  /* Reads one line at a time from the FASTA file. */
-  char line_buffer[line_buffer_length];
-  int lines_kept = 0;
-  int lines_skipped = 0;
-  while ((gzgets(gzfp, line_buffer, line_buffer_length) != NULL)) {
-	char *line_ptr = line_buffer;
-	if (line_buffer[0] == '>') {
-	  /* Line contains text annotation; skip it. */
-	  lines_skipped++;
-	} else {
-	  /* Valid data; copy all ACGT data from line buffer. */
-	  lines_kept++;
-	  while (*line_ptr != '\n') {
-		*fasta->seq_ptr++ = *line_ptr++;
-		fasta->cur_length++;
-	  }
-	}
-	if (fasta->cur_length + line_buffer_length > fasta->max_length) {
-	  fprintf(stderr, "Read %ld bytes; fasta buffer too small (%ld bytes)\n",
-			  fasta->cur_length, fasta->max_length);
-	  exit(1);
-	}
-  }
+  pattern_t packed;
+  pattern_init(&packed, pattern);
+  long last_match_location = fasta->cur_length - packed.length;
+  long trial_count = last_match_location >= 0 ? last_match_location + 1 : 0;
 
-  if (verbose) {
-	printf("%s: %d lines skipped, %d lines kept, %ld total bytes\n",
-		   file_name, lines_skipped, lines_kept, fasta->cur_length);
-  }
-  
-  gzclose(gzfp);
-}
+  double start_time = now();
 
-/* Return the current time. */
-double
-now(void)
-{
-  struct timespec current_time;
-  clock_gettime(CLOCK_REALTIME, &current_time);
-  return current_time.tv_sec + (current_time.tv_nsec / ONE_BILLION);
-}
+  long match_count = pattern_search(&packed, fasta, 0, fasta->cur_length, 1,
+									verbose ? show_match : NULL, NULL);
 
-/* Return the smaller of two pointers. */
-const char *
-min(const char *a, const char *b)
-{
-  return a < b ? a : b;
-}
+  printf("    TOOK %5.3f seconds\n", now() - start_time);
+  printf("   TRIED %e matches\n", (double)trial_count);
 
-/* Return the larger of two pointers. */
-const char *
-max(const char *a, const char *b)
-{
-  return a > b ? a : b;
+  pattern_free(&packed);
+  return match_count;
 }
 
-/* Clamp 'value' to be in the range ['low' .. 'high'] */
-const char *
-clamp(const char *value, const char *low, const char *high)
+/* Search for 'pattern' with an FM-index instead of scanning, in time
+ * proportional to the pattern length, showing the matches in sequence
+ * order when verbose. Patterns the index can't serve (anything but
+ * upper-case ACGT) fall back to a scan of the FASTA data.
+ */
+int
+match_index(char *pattern, fm_index_t *index, fasta_t *fasta)
 {
-  if (low >= high) {
-	fprintf(stderr, "Bogus bounds [%p, %p]\n", low, high);
-	exit(1);
-  }
+  pattern_t packed;
+  pattern_init(&packed, pattern);
 
-  return min(max(value, low), high);
-}
+  double start_time = now();
 
-/* Print 'n' padding characters to pretty-up the output. */
-void
-print_padding(const int n)
-{
-  for (int i = 0;  i < n;  i++) {
-	printf(" ");
+  long match_count = fm_match(index, fasta, &packed, verbose ? show_match : NULL, NULL);
+  pattern_free(&packed);
+  if (match_count < 0) {
+	return match(pattern, fasta);
   }
+
+  printf("    TOOK %5.3f seconds\n", now() - start_time);
+  return match_count;
 }
 
-/* Print 'length' bytes starting at 'current' from within the current data in
- * a FASTA structure. Also prints 'padding_bytes' bytes before and after the
- * range of values for context, as well as the offset into the sequence. Takes
- * care not to blow past either end of the sequence data in the FASTA
- * structure.
+/* Search for every pattern in the file 'pattern_file' in one pass over the
+ * FASTA structure with an Aho-Corasick automaton, and report how often each
+ * occurs (and where, when verbose). Returns the total number of matches.
  */
-void
-bytes_around(fasta_t *fasta, char *current, int length)
+long
+match_multi(char *pattern_file, fasta_t *fasta)
 {
-  const int padding_bytes = 8;
-  const char *fasta_last = fasta->sequence + fasta->cur_length;
-
-  const char *first = clamp(current - padding_bytes, fasta->sequence, fasta_last);
-  const char *last = clamp(current + length + padding_bytes, fasta->sequence, fasta_last);
+  int num_patterns;
+  char **patterns = ac_read_patterns(pattern_file, &num_patterns);
+  ac_automaton_t ac;
+  ac_build(&ac, patterns, num_patterns);
+  long *counts = calloc(num_patterns + 1, sizeof(long));
+  ac_matches_t matches = { NULL, 0, 0 };
+
+  printf("MATCHING %d patterns ...\n", num_patterns);
+  double start_time = now();
 
-  print_padding(padding_bytes - (current - first));
+  long match_count = ac_search(&ac, fasta, 0, fasta->cur_length, counts,
+							   verbose ? ac_collect : NULL, &matches);
 
-  for (const char *p = first;  p < last;  p++) {
-	if (p == current) {
-	  printf("[");
-	}
-	printf("%c", *p);
-	if (p == current + length - 1) {
-	  printf("]");
-	}
-  }
+  printf("    TOOK %5.3f seconds\n", now() - start_time);
+  ac_print_results(&ac, fasta, counts, verbose ? &matches : NULL);
 
-  print_padding(padding_bytes - (last - (current + length)));
-  printf("%15ld\n", current - fasta->sequence);
+  free(matches.matches);
+  free(counts);
+  ac_free(&ac);
+  ac_free_patterns(patterns, num_patterns);
+  return match_count;
 }
 
-/* Search for all occurrences of 'pattern' in the FASTA structure. Returns the
- * number of times the pattern occurs. Occurrences can overlap (e.g., "ACTACT"
- * matches twice in "ACTACTACT". Returns the number of occurrences. Also tracks
- * the time taken by the matching and reports the results to stdout.
+/* Search for 'pattern' allowing up to 'max_edits' differences (mismatches
+ * only if 'mismatches_only') in a scan of the FASTA structure, and report
+ * how many positions end a match at each distance (and where, when
+ * verbose). Returns the total number of matches, or -1 if the pattern
+ * can't be searched for this way.
  */
-int 
-match(char *pattern, fasta_t *fasta)
+long
+match_approx(char *pattern, int max_edits, int mismatches_only, fasta_t *fasta)
 {
-  int pattern_length = strlen(pattern);
-  char *seq_ptr = fasta->sequence;
-  char *last_match_location = fasta->sequence + fasta->cur_length - pattern_length;
-  long match_count = 0;
-  long trial_count = 0;
+  approx_pattern_t approx;
+  if (approx_init(&approx, pattern, max_edits, mismatches_only)) {
+	return -1;
+  }
+  long *counts = calloc(max_edits + 1, sizeof(long));
+  approx_matches_t matches = { NULL, 0, 0 };
 
   double start_time = now();
 
-  while (seq_ptr <= last_match_location) {
-	trial_count++;
-	if (strncmp(seq_ptr, pattern, pattern_length) == 0) {
-	  if (verbose) {
-		bytes_around(fasta, seq_ptr, pattern_length);
-	  }
-	  match_count++;
-	}
-	seq_ptr++;
-  }
+  long match_count = approx_search(&approx, fasta, 0, fasta->cur_length, counts,
+								   verbose ? approx_collect : NULL, &matches);
 
   printf("    TOOK %5.3f seconds\n", now() - start_time);
-  printf("   TRIED %e matches\n", (double)trial_count);
+  printf(" PATTERN %s\n", pattern);
+  approx_print_results(&approx, fasta, counts, verbose ? &matches : NULL);
 
+  free(matches.matches);
+  free(counts);
   return match_count;
 }
 
@@ -210,15 +132,31 @@ match(char *pattern, fasta_t *fasta)
 void
 usage(char *prog_name)
 {
-  fprintf(stderr, "%s: [-v] -b <B>|-m <MB>|-g <GB> -p <pattern> <fastafile>...\n", prog_name);
+  fprintf(stderr, "%s: [-v] [-b <B>|-m <MB>|-g <GB>] -p <pattern> <fastafile>...\n", prog_name);
+  fprintf(stderr, "%s: [-v] [-b <B>|-m <MB>|-g <GB>] -I <file> [-p <pattern>] <fastafile>...\n",
+		  prog_name);
+  fprintf(stderr, "%s: [-v] [-b <B>|-m <MB>|-g <GB>] -k <K> [-s] -p <pattern> <fastafile>...\n",
+		  prog_name);
+  fprintf(stderr, "%s: [-v] [-b <B>|-m <MB>|-g <GB>] -P <file> <fastafile>...\n", prog_name);
+  fprintf(stderr, "%s: [-v] [-b <B>|-m <MB>|-g <GB>] -c <file> <fastafile>...\n", prog_name);
+  fprintf(stderr, "%s: [-v] [-b <B>|-m <MB>|-g <GB>] -i <file> -p <pattern> <fastafile>...\n",
+		  prog_name);
   fprintf(stderr, "  -v           enable verbose output\n");
-  fprintf(stderr, "  -b <B>       allocate <B> bytes for FASTA data\n");
-  fprintf(stderr, "  -m <MB>      allocate <MB> megabytes for FASTA data\n");
-  fprintf(stderr, "  -g <GB>      allocate <GB> gigabytes for FASTA data\n");
-  fprintf(stderr, "  -p <pattern> pattern for search [required]\n");
+  fprintf(stderr, "  -b <B>       reserve room for <B> bases of FASTA data at first\n");
+  fprintf(stderr, "  -m <MB>      reserve room for <MB> megabases (2^20) at first\n");
+  fprintf(stderr, "  -g <GB>      reserve room for <GB> gigabases (2^30) at first\n");
+  fprintf(stderr, "  -p <pattern> pattern for search [required unless -I or -P]\n");
+  fprintf(stderr, "  -k <K>       match <pattern> with up to <K> edits (up to %d bases)\n",
+		  APPROX_MAX_LENGTH);
+  fprintf(stderr, "  -s           with -k, allow mismatches only, not insertions or deletions\n");
+  fprintf(stderr, "  -P <file>    search for every pattern in <file>, one per line\n");
+  fprintf(stderr, "  -c <file>    pack the FASTA data into the genome image <file>\n");
+  fprintf(stderr, "  -I <file>    build an FM-index of the FASTA data into <file>\n");
+  fprintf(stderr, "  -i <file>    search with the FM-index in <file> of the same FASTA data\n");
   fprintf(stderr, "  -h, -?       print this help and exit\n");
-  fprintf(stderr, "One of -b, -m, or -g must be provided");
+  fprintf(stderr, "Without -b, -m, or -g, room is reserved from the <fastafile> sizes\n");
   fprintf(stderr, "One or more <fastafile> must appear; can be text or .gz file\n");
+  fprintf(stderr, "A genome image from -c can be given instead, as the only <fastafile>\n");
   fprintf(stderr, "If multiple <fastafile>s, will be concatenated and searched\n");
   exit(1);
 }
@@ -229,23 +167,47 @@ main(int argc, char **argv)
   char *prog_name = argv[0];
   long fasta_max_length = 0;
   char *pattern = NULL;
+  char *index_name = NULL;
+  char *save_index_name = NULL;
+  char *pattern_file = NULL;
+  char *image_name = NULL;
+  int max_edits = -1;
+  int mismatches_only = 0;
 
   /* Process command-line arguments; see 'man 3 getopt'. */
   int ch;
-  while ((ch = getopt(argc, argv, "b:hm:g:p:v")) != -1) {
+  while ((ch = getopt(argc, argv, "b:c:hi:I:k:m:g:p:P:sv")) != -1) {
 	switch (ch) {
 	case 'b':
 	  fasta_max_length = atol(optarg);
 	  break;
+	case 'c':
+	  image_name = optarg;
+	  break;
 	case 'g':
 	  fasta_max_length = atol(optarg) * ONE_GIGA;
 	  break;
 	case 'm':
 	  fasta_max_length = atol(optarg) * ONE_MEGA;
 	  break;
+	case 'i':
+	  index_name = optarg;
+	  break;
+	case 'I':
+	  save_index_name = optarg;
+	  break;
+	case 'k':
+	  max_edits = atoi(optarg);
+	  break;
 	case 'p':
 	  pattern = optarg;
 	  break;
+	case 'P':
+	  pattern_file = optarg;
+	  break;
+	case 's':
+	  mismatches_only = 1;
+	  break;
 	case 'v':
 	  verbose = 1;
 	  break;
@@ -258,25 +220,88 @@ main(int argc, char **argv)
   argc -= optind;
   argv += optind;
 
-  if (fasta_max_length == 0 || pattern == NULL) {
+  if (argc == 0 ||
+	  (pattern == NULL && !save_index_name && !pattern_file && !image_name) ||
+	  (pattern && pattern_file) ||
+	  (index_name && (save_index_name || pattern_file)) ||
+	  (max_edits >= 0 && (!pattern || index_name || save_index_name)) ||
+	  (mismatches_only && max_edits < 0)) {
 	usage(prog_name);
   }
 
-  /* Create FASTA structure with the given length. */
-  fasta_t *fasta = fasta_create(fasta_max_length);
+  fasta_t *fasta;
+  if (argc == 1 && fasta_is_image(argv[0])) {
+	/* Map the genome image; there's nothing to read. */
+	fasta = fasta_map(argv[0]);
+	if (!fasta) {
+	  exit(1);
+	}
+  } else {
+	/* Create FASTA structure with the given length, or one to fit the files. */
+	if (fasta_max_length == 0) {
+	  fasta_max_length = fasta_size_hint(argv, argc);
+	}
+	fasta = fasta_create(fasta_max_length);
+
+	/* For each <fastafile> argument, read its data into the FASTA structure. */
+	for (int idx = 0;  idx < argc;  idx++) {
+	  fasta_read_file(argv[idx], fasta);
+	}
+  }
+
+  /* Save the FASTA data as a genome image for later runs to map. */
+  if (image_name) {
+	double start_time = now();
+	if (fasta_save(fasta, image_name)) {
+	  exit(1);
+	}
+	printf("  PACKED %ld bytes in %5.3f seconds\n", fasta->cur_length, now() - start_time);
+  }
 
-  /* For each <fastafile> argument, read its data into the FASTA structure. */
-  for (int idx = 0;  idx < argc;  idx++) {
-	fasta_read_file(argv[idx], fasta);
+  /* Build and save an index of the FASTA data, or load one built before. */
+  fm_index_t index;
+  int have_index = 0;
+  if (save_index_name) {
+	double start_time = now();
+	if (fm_build(&index, fasta, 1) || fm_save(&index, save_index_name)) {
+	  exit(1);
+	}
+	printf(" INDEXED %ld bytes in %5.3f seconds\n", fasta->cur_length, now() - start_time);
+	have_index = 1;
+  } else if (index_name) {
+	if (fm_load(&index, index_name)) {
+	  exit(1);
+	}
+	if (index.length != fasta->cur_length + 1 ||
+		index.fingerprint != fasta_fingerprint(fasta)) {
+	  fprintf(stderr, "Index '%s' doesn't match the FASTA data\n", index_name);
+	  exit(1);
+	}
+	have_index = 1;
   }
 
   /* Match the pattern; report result. */
-  printf("MATCHING ...\n");
-  int count = match(pattern, fasta);
-  printf(" PATTERN %s\n", pattern);
-  printf("   MATCH %d time%s\n", count, count == 1 ? "" : "s");
+  if (pattern && max_edits >= 0) {
+	printf("MATCHING ...\n");
+	long count = match_approx(pattern, max_edits, mismatches_only, fasta);
+	if (count < 0) {
+	  exit(1);
+	}
+	printf("   TOTAL %ld match%s\n", count, count == 1 ? "" : "es");
+  } else if (pattern) {
+	printf("MATCHING ...\n");
+	int count = have_index ? match_index(pattern, &index, fasta) : match(pattern, fasta);
+	printf(" PATTERN %s\n", pattern);
+	printf("   MATCH %d time%s\n", count, count == 1 ? "" : "s");
+  } else if (pattern_file) {
+	long count = match_multi(pattern_file, fasta);
+	printf("   TOTAL %ld match%s\n", count, count == 1 ? "" : "es");
+  }
 
   /* Clean up and be done. */
+  if (have_index) {
+	fm_free(&index);
+  }
   fasta_destroy(fasta);
   exit(0);
 }